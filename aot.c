@@ -0,0 +1,394 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "compiler.h"
+
+#ifdef NATIVE_CODE
+
+// outside the Lox heap, like the assembler's buffer
+typedef struct {
+    ObjFunction** functions;
+    uint32_t count;
+    uint32_t capacity;
+} FunctionList;
+
+// the script, then every function declared in it, depth first in the order of the constants: the generated program
+// numbers the functions the same way when it matches them up with their code
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+    if (list->count == list->capacity) {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->functions = realloc(list->functions, sizeof(ObjFunction*) * list->capacity);
+        assert(list->functions);
+    }
+    list->functions[list->count++] = function;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (uint32_t i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+}
+
+static const char* functionName(ObjFunction* function) {
+    return function->name ? STRING_CHARS(FROM_HEAP_REF(ObjString, function->name)) : "<script>";
+}
+
+// the instructions the generated code runs itself: anything else is left to the interpreter
+static bool isCompiled(OpCode op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_INT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_MOVE:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_PRINT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            return true;
+        default:
+            return isRegisterOp(op);
+    }
+}
+
+// the extra words of a longer instruction
+static bool isExtraWord(Chunk* chunk, uint32_t index) {
+    return index > 0 && chunk->wordOffsets[index] == chunk->wordOffsets[index - 1];
+}
+
+// where the code can start running
+static bool isEntry(Chunk* chunk, uint32_t index) {
+    return !isExtraWord(chunk, index) && isCompiled(WORD_OP(chunk->words[index]));
+}
+
+static uint32_t jumpTarget(uint32_t index, uint32_t word) {
+    return WORD_OP(word) == OP_LOOP ? index + 1 - WORD_OPERAND(word) : index + 1 + WORD_OPERAND(word);
+}
+
+static const char* operatorName(OpCode op) {
+    switch (op) {
+        case OP_EQUAL: return "OP_EQUAL";
+        case OP_GREATER: return "OP_GREATER";
+        case OP_LESS: return "OP_LESS";
+        case OP_ADD: return "OP_ADD";
+        case OP_SUBTRACT: return "OP_SUBTRACT";
+        case OP_MULTIPLY: return "OP_MULTIPLY";
+        case OP_DIVIDE: return "OP_DIVIDE";
+        default:
+            assert(!"Not a binary operator");
+            return NULL;
+    }
+}
+
+// a register instruction's operand, from its slot or the constants
+static void emitRegister(FILE* out, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        fprintf(out, "AOT_CONSTANT(%u)", operand & ~RK_CONSTANT);
+    } else {
+        fprintf(out, "slots[%u]", operand);
+    }
+}
+
+// `loop` counts the OP_LOOPs before this one
+static void emitInstruction(FILE* out, uint32_t index, uint32_t word, uint32_t loop) {
+    OpCode op = WORD_OP(word);
+    switch (op) {
+        case OP_CONSTANT:
+            fprintf(out, "    *top++ = AOT_CONSTANT(%u);\n", WORD_OPERAND(word));
+            break;
+        case OP_INT:
+            fprintf(out, "    *top++ = INT_VAL(%d);\n", WORD_SIGNED_OPERAND(word));
+            break;
+        case OP_NIL:
+            fprintf(out, "    *top++ = NIL_VAL;\n");
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            fprintf(out, "    *top++ = BOOL_VAL(%s);\n", op == OP_TRUE ? "true" : "false");
+            break;
+        case OP_POP:
+            fprintf(out, "    top--;\n");
+            break;
+        case OP_GET_LOCAL:
+            fprintf(out, "    *top++ = slots[%u];\n", WORD_OPERAND(word));
+            break;
+        case OP_SET_LOCAL:
+            fprintf(out, "    slots[%u] = top[-1];\n", WORD_OPERAND(word));
+            break;
+        case OP_SET_LOCAL_POP:
+            fprintf(out, "    slots[%u] = *--top;\n", WORD_OPERAND(word));
+            break;
+        case OP_MOVE:
+            fprintf(out, "    slots[%u] = ", WORD_B(word));
+            emitRegister(out, WORD_A(word));
+            fprintf(out, ";\n");
+            break;
+        case OP_GET_UPVALUE:
+            fprintf(out, "    *top++ = *AOT_UPVALUE(%u)->location;\n", WORD_OPERAND(word));
+            break;
+        case OP_SET_UPVALUE:
+            fprintf(out, "    *AOT_UPVALUE(%u)->location = top[-1];\n", WORD_OPERAND(word));
+            break;
+        case OP_DEFINE_GLOBAL:
+            fprintf(out, "    AOT_SYNC_STACK();\n");
+            fprintf(out, "    tableSet(vm, NULL, &vm->globals, AS_STRING(AOT_CONSTANT(%u)), top[-1]);\n",
+                    WORD_OPERAND(word));
+            fprintf(out, "    top--;\n");
+            break;
+        case OP_GET_GLOBAL:
+            fprintf(out, "    if (!tableGet(&vm->globals, AS_STRING(AOT_CONSTANT(%u)), top)) AOT_EXIT(%u);\n",
+                    WORD_OPERAND(word), index);
+            fprintf(out, "    top++;\n");
+            break;
+        case OP_SET_GLOBAL:
+            // undefined globals are left for the interpreter to report, as it would have
+            fprintf(out, "    AOT_SYNC_STACK();\n");
+            fprintf(out, "    if (tableSet(vm, NULL, &vm->globals, AS_STRING(AOT_CONSTANT(%u)), top[-1])) {\n",
+                    WORD_OPERAND(word));
+            fprintf(out, "        tableDelete(&vm->globals, AS_STRING(AOT_CONSTANT(%u)));\n", WORD_OPERAND(word));
+            fprintf(out, "        AOT_EXIT(%u);\n", index);
+            fprintf(out, "    }\n");
+            break;
+        case OP_GET_PROPERTY:
+            fprintf(out, "    if (!aotGetField(top - 1, AS_STRING(AOT_CONSTANT(%u)))) AOT_EXIT(%u);\n",
+                    WORD_OPERAND(word), index);
+            break;
+        case OP_SET_PROPERTY:
+            fprintf(out, "    if (!IS_INSTANCE(top[-2])) AOT_EXIT(%u);\n", index);
+            fprintf(out, "    AOT_SYNC_STACK();\n");
+            fprintf(out, "    tableSet(vm, NULL, &AS_INSTANCE(top[-2])->fields, AS_STRING(AOT_CONSTANT(%u)), "
+                         "top[-1]);\n", WORD_OPERAND(word));
+            fprintf(out, "    top[-2] = top[-1];\n");
+            fprintf(out, "    top--;\n");
+            break;
+        case OP_PRINT:
+            fprintf(out, "    printValue(vm->print, *--top);\n");
+            fprintf(out, "    vm->print(\"\\n\");\n");
+            break;
+        case OP_LOOP:
+            fprintf(out, "    AOT_LOOP(%u, %u);\n", loop, index);
+            fprintf(out, "    goto w%u;\n", jumpTarget(index, word));
+            break;
+        case OP_JUMP:
+            fprintf(out, "    goto w%u;\n", jumpTarget(index, word));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            fprintf(out, "    if (%saotFalsey(top[-1])) goto w%u;\n", op == OP_JUMP_IF_FALSE ? "" : "!",
+                    jumpTarget(index, word));
+            break;
+        case OP_NOT:
+            fprintf(out, "    top[-1] = BOOL_VAL(aotFalsey(top[-1]));\n");
+            break;
+        case OP_NEGATE:
+            fprintf(out, "    if (!aotNegate(top[-1], top - 1)) AOT_EXIT(%u);\n", index);
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            fprintf(out, "    if (!aotBinary(%s, top[-2], top[-1], top - 2)) AOT_EXIT(%u);\n", operatorName(op), index);
+            fprintf(out, "    top--;\n");
+            break;
+        default: {
+            assert(isRegisterOp(op));
+            fprintf(out, "    if (!aotBinary(%s, ", operatorName(stackOp(op)));
+            emitRegister(out, WORD_A(word));
+            fprintf(out, ", ");
+            emitRegister(out, WORD_B(word));
+            if (isRegisterStore(op)) {
+                fprintf(out, ", &slots[%u])) AOT_EXIT(%u);\n", WORD_C(word), index);
+            } else {
+                fprintf(out, ", top)) AOT_EXIT(%u);\n", index);
+                fprintf(out, "    top++;\n");
+            }
+            break;
+        }
+    }
+}
+
+static void emitFunction(FILE* out, ObjFunction* function, uint32_t number) {
+    Chunk* chunk = &function->chunk;
+    // instructions with labels: those the code can start from, and jump targets
+    bool* labelled = calloc(chunk->wordCount, sizeof(bool));
+    assert(labelled);
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (!isEntry(chunk, i)) continue;
+        labelled[i] = true;
+        OpCode op = WORD_OP(chunk->words[i]);
+        if (op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE) {
+            labelled[jumpTarget(i, chunk->words[i])] = true;
+        }
+    }
+
+    fprintf(out, "// %s\n", functionName(function));
+    fprintf(out, "static const uint32_t words%u[] = {", number);
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        fprintf(out, "%s0x%08x,", i % 8 ? " " : "\n    ", chunk->words[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static uint32_t entries%u[] = {", number);
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        fprintf(out, "%s%d,", i % 16 ? " " : "\n    ", isEntry(chunk, i));
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static void function%u(VM* vm, CallFrame* frame, UNUSED uint32_t entry) {\n", number);
+    fprintf(out, "    uint32_t* words = frame->function->chunk.words;\n");
+    fprintf(out, "    UNUSED Value* slots = vm->stack.values + frame->base;\n");
+    fprintf(out, "    Value* top = vm->stack.values + vm->stack.count;\n");
+    fprintf(out, "    switch (frame->ip - words) {\n");
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (isEntry(chunk, i)) fprintf(out, "        case %u: goto w%u;\n", i, i);
+    }
+    fprintf(out, "        default: return;\n");
+    fprintf(out, "    }\n");
+    uint32_t loops = 0;
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (isExtraWord(chunk, i)) continue;
+        if (labelled[i]) fprintf(out, "w%u:\n", i);
+        if (isCompiled(WORD_OP(chunk->words[i]))) {
+            emitInstruction(out, i, chunk->words[i], loops);
+            if (WORD_OP(chunk->words[i]) == OP_LOOP) loops++;
+        } else {
+            fprintf(out, "    AOT_EXIT(%u);\n", i);
+        }
+    }
+    fprintf(out, "leave:\n");
+    fprintf(out, "    AOT_SYNC_STACK();\n");
+    fprintf(out, "}\n\n");
+
+    // every instruction pushes at most one value, as for the JIT
+    fprintf(out, "static NativeCode native%u = {.entries = entries%u, .stackNeeded = %u, .enter = function%u};\n\n",
+            number, number, chunk->wordCount + 1, number);
+    free(labelled);
+}
+
+static void emitSource(FILE* out, const char* source) {
+    fprintf(out, "static const char source[] =\n    \"");
+    for (const char* c = source; *c; c++) {
+        switch (*c) {
+            case '\n':
+                fprintf(out, c[1] ? "\\n\"\n    \"" : "\\n");
+                break;
+            case '"':
+            case '\\':
+            // no trigraphs
+            case '?':
+                fprintf(out, "\\%c", *c);
+                break;
+            default:
+                if (*c >= ' ' && *c <= '~') {
+                    fputc(*c, out);
+                } else {
+                    fprintf(out, "\\%03o", (unsigned char) *c);
+                }
+        }
+    }
+    fprintf(out, "\";\n\n");
+}
+
+bool emitC(VM* vm, const char* source, const char* path, FILE* out) {
+    ObjFunction* script = compile(vm, source);
+    if (!script) return false;
+
+    // nothing else is allocated from here on, so the functions don't need to be kept anywhere the GC can see them
+    FunctionList list = {0};
+    collectFunctions(&list, script);
+
+    fprintf(out, "// generated by clox --emit-c from %s: see aot.h\n", path);
+    fprintf(out, "#include \"aot.h\"\n\n");
+    emitSource(out, source);
+    for (uint32_t i = 0; i < list.count; i++) {
+        emitFunction(out, list.functions[i], i);
+    }
+
+    fprintf(out, "static CompiledFunction functions[] = {\n");
+    for (uint32_t i = 0; i < list.count; i++) {
+        fprintf(out, "    {words%u, %u, &native%u},\n", i, list.functions[i]->chunk.wordCount, i);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    return runCompiled(source, functions, sizeof(functions) / sizeof(functions[0]));\n");
+    fprintf(out, "}\n");
+
+    free(list.functions);
+    return true;
+}
+
+static void attachCompiledCode(ObjFunction* script, CompiledFunction* functions, uint32_t count) {
+    FunctionList list = {0};
+    collectFunctions(&list, script);
+
+    uint32_t mismatched = 0;
+    for (uint32_t i = 0; i < list.count; i++) {
+        Chunk* chunk = &list.functions[i]->chunk;
+        CompiledFunction* compiled = i < count ? functions + i : NULL;
+        if (!compiled || compiled->wordCount != chunk->wordCount ||
+            memcmp(compiled->words, chunk->words, sizeof(uint32_t) * chunk->wordCount) != 0) {
+            mismatched++;
+            continue;
+        }
+        chunk->native = compiled->native;
+#ifndef BASELINE_JIT
+        // rebuilding the words would throw the code away, with nothing to compile the new ones
+        list.functions[i]->optimised = true;
+#endif
+    }
+    if (mismatched || count != list.count) {
+        fprintf(stderr, "Interpreting %u of %u functions, as clox_lib doesn't compile them the way it did when the "
+                        "C was generated.\n", mismatched, list.count);
+    }
+
+    free(list.functions);
+}
+
+int runCompiled(const char* source, CompiledFunction* functions, uint32_t count) {
+    FreeList freeList;
+    initMemory(&freeList, 256 * 1024 * 1024);
+
+    VM vm;
+    initVM(&freeList, &vm);
+
+    // the exit statuses of `clox script.lox`
+    int status = 0;
+    ObjFunction* script = compile(&vm, source);
+    if (!script) {
+        status = 65;
+    } else {
+        attachCompiledCode(script, functions, count);
+        if (interpretFunction(&vm, script) == INTERPRET_RUNTIME_ERROR) status = 70;
+    }
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return status;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+#include "jit.h"
+#include "object.h"
+#include "table.h"
+#include "trace.h"
+#include "vm.h"
+
+#ifdef NATIVE_CODE
+
+// `clox --emit-c script.lox` writes a C program which runs the script with each of its functions translated to C ahead
+// of time, to be built with the system's C compiler against clox_lib (with clox's sources on the include path), e.g.
+//   clox --emit-c script.lox script.c && cc -O2 -I clox script.c build/libclox_lib.a -lm
+// The program embeds the script's source, which it compiles as usual when it starts; each function's C is then used as
+// its native code (see jit.h), and does what the baseline JIT's machine code would: straight-line code, jumps, loops,
+// arithmetic and comparisons on ints and doubles, locals, upvalues, globals, fields and printing run without any
+// dispatch, and everything else (calls, returns, closures, classes, string concatenation and runtime errors) is left
+// to the interpreter. Where there's a JIT, hot functions are still rebuilt by the optimiser (and compiled again at
+// runtime), and hot loops still traced, as if they'd been interpreted. The C is only used for functions whose
+// instruction words are exactly the ones it was generated from, so a program built against a different clox_lib (or
+// options) still runs, interpreted
+
+// a function's generated code
+typedef struct {
+    // the instruction words it was generated from
+    const uint32_t* words;
+    uint32_t wordCount;
+    NativeCode* native;
+} CompiledFunction;
+
+// writes the program for a script to `out`, or returns false (having reported the errors) if it doesn't compile
+bool emitC(VM* vm, const char* source, const char* path, FILE* out);
+
+// the generated program's main(): runs the script with its functions' generated code, returning the exit status
+int runCompiled(const char* source, CompiledFunction* functions, uint32_t count);
+
+// everything below is for the generated code, which has `vm`, `frame`, `words`, `slots` (the frame's) and `top` (one
+// past the top of the stack) in scope, and a `leave` label which hands back to the interpreter
+
+#define AOT_CONSTANT(index) (frame->function->chunk.constants.values[index])
+#define AOT_UPVALUE(slot) \
+    FROM_HEAP_REF(ObjUpvalue, FROM_HEAP_REF(HEAP_REF(ObjUpvalue), frame->closure->upvalues)[slot])
+// leaves the instruction to the interpreter
+#define AOT_EXIT(index) do { frame->ip = words + (index); goto leave; } while (false)
+// anything which can allocate (and so collect garbage) needs the GC to see everything on the stack
+#define AOT_SYNC_STACK() (vm->stack.count = (uint32_t) (top - vm->stack.values))
+
+#ifdef TRACING_JIT
+// the back edge of the function's `number`th loop: hot loops are left to the interpreter to record (or run the trace
+// of), as the baseline JIT leaves them
+#define AOT_LOOP(number, index) do { \
+    TraceLoop* loop_ = frame->function->chunk.loops + (number); \
+    if (loop_->hotness >= TRACE_THRESHOLD) AOT_EXIT(index); \
+    loop_->hotness++; \
+} while (false)
+#else
+#define AOT_LOOP(number, index) do {} while (false)
+#endif
+
+static inline bool aotFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// the binary operators, as run() does them: false for anything it would report as an error, or concatenate
+static inline bool aotBinary(OpCode op, Value a, Value b, Value* result) {
+    if (op == OP_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (IS_INT(a) && IS_INT(b)) {
+        int32_t x = AS_INT(a);
+        int32_t y = AS_INT(b);
+        int32_t z;
+        switch (op) {
+            case OP_ADD:
+                if (__builtin_add_overflow(x, y, &z)) break;
+                *result = INT_VAL(z);
+                return true;
+            case OP_SUBTRACT:
+                if (__builtin_sub_overflow(x, y, &z)) break;
+                *result = INT_VAL(z);
+                return true;
+            case OP_MULTIPLY:
+                if (intMultiplyOverflows(x, y, &z)) break;
+                *result = INT_VAL(z);
+                return true;
+            case OP_LESS:
+                *result = BOOL_VAL(x < y);
+                return true;
+            case OP_GREATER:
+                *result = BOOL_VAL(x > y);
+                return true;
+            default:
+                break;
+        }
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool aotNegate(Value value, Value* result) {
+    if (IS_INT(value) && !intNegateOverflows(AS_INT(value))) {
+        *result = INT_VAL(-AS_INT(value));
+        return true;
+    }
+    if (!IS_NUMBER(value)) return false;
+    *result = NUMBER_VAL(-AS_NUMBER(value));
+    return true;
+}
+
+// the slow paths of property access (methods, and errors) are left to the interpreter
+static inline bool aotGetField(Value* receiver, ObjString* name) {
+    return IS_INSTANCE(*receiver) && tableGet(&AS_INSTANCE(*receiver)->fields, name, receiver);
+}
+
+#endif
+
+#endif //CLOX_AOT_H
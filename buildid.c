@@ -0,0 +1,60 @@
+// for dl_iterate_phdr()
+#define _GNU_SOURCE
+#include <string.h>
+#include "buildid.h"
+
+#ifdef __ELF__
+#include <link.h>
+
+typedef struct {
+    uintptr_t code;
+    uint8_t* id;
+    uint32_t length;
+} BuildIdSearch;
+
+static const ElfW(Phdr)* segmentContaining(struct dl_phdr_info* info, uintptr_t address) {
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* segment = info->dlpi_phdr + i;
+        uintptr_t start = info->dlpi_addr + segment->p_vaddr;
+        if (segment->p_type == PT_LOAD && address >= start && address - start < segment->p_memsz) return segment;
+    }
+    return NULL;
+}
+
+// stops at the object the code was loaded from, whether or not it has a build ID
+static int findBuildId(struct dl_phdr_info* info, UNUSED size_t size, void* data) {
+    BuildIdSearch* search = data;
+    if (!segmentContaining(info, search->code)) return 0;
+
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* segment = info->dlpi_phdr + i;
+        if (segment->p_type != PT_NOTE) continue;
+        uint64_t align = segment->p_align == 8 ? 8 : 4;
+        const uint8_t* note = (const uint8_t*) (info->dlpi_addr + segment->p_vaddr);
+        const uint8_t* end = note + segment->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)* header = (const ElfW(Nhdr)*) note;
+            const uint8_t* name = note + sizeof(ElfW(Nhdr));
+            const uint8_t* descriptor = name + ((header->n_namesz + align - 1) & ~(align - 1));
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                search->length = header->n_descsz < BUILD_ID_MAX ? header->n_descsz : BUILD_ID_MAX;
+                memcpy(search->id, descriptor, search->length);
+                return 1;
+            }
+            note = descriptor + ((header->n_descsz + align - 1) & ~(align - 1));
+        }
+    }
+    return 1;
+}
+#endif
+
+uint32_t buildId(uint8_t id[BUILD_ID_MAX]) {
+    memset(id, 0, BUILD_ID_MAX);
+#ifdef __ELF__
+    BuildIdSearch search = {.code = (uintptr_t) &buildId, .id = id, .length = 0};
+    dl_iterate_phdr(findBuildId, &search);
+    return search.length;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_BUILDID_H
+#define CLOX_BUILDID_H
+
+#include "common.h"
+
+// SHA-1 build IDs are 20 bytes; anything longer is compared by its prefix
+#define BUILD_ID_MAX 32
+
+// the linker's build ID for whichever binary this code's in (clox, or the program embedding it), which files only the
+// build that wrote them can use (heap snapshots, bytecode caches) are tagged with. Returns its length, with the rest of
+// `id` zeroed, or 0 if there isn't one (the binary wasn't linked with one, or isn't ELF)
+uint32_t buildId(uint8_t id[BUILD_ID_MAX]);
+
+#endif //CLOX_BUILDID_H
@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "memory.h"
+#include "trace.h"
+
+#ifdef BYTECODE_CACHE
+
+#define CACHE_ALIGNMENT 8
+
+// FNV-1a, 64 bit
+static uint64_t hashSource(const char* source, uint32_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// the file's built in memory outside the Lox heap (like the assembler's buffer), then written in one go
+typedef struct {
+    uint8_t* bytes;
+    uint32_t count;
+    uint32_t capacity;
+} Buffer;
+
+// `size` zeroed bytes at the next aligned offset, which is returned
+static uint32_t reserve(Buffer* buffer, size_t size) {
+    uint32_t offset = (buffer->count + CACHE_ALIGNMENT - 1) & ~(uint32_t) (CACHE_ALIGNMENT - 1);
+    while (buffer->capacity < offset + size) {
+        buffer->capacity = GROW_CAPACITY(buffer->capacity);
+    }
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    assert(buffer->bytes);
+    memset(buffer->bytes + buffer->count, 0, offset + size - buffer->count);
+    buffer->count = offset + (uint32_t) size;
+    return offset;
+}
+
+static uint32_t append(Buffer* buffer, const void* data, size_t size) {
+    uint32_t offset = reserve(buffer, size);
+    if (size) memcpy(buffer->bytes + offset, data, size);
+    return offset;
+}
+
+// every function in the script (numbered as in cache.h), and every ObjString they use, numbered in the order they're
+// first seen. Strings are interned, so are told apart by address, in an open addressed set of indexes plus one
+typedef struct {
+    ObjFunction** functions;
+    uint32_t functionCount;
+    uint32_t functionCapacity;
+    ObjString** strings;
+    uint32_t stringCount;
+    uint32_t stringCapacity;
+    uint32_t* slots;
+    uint32_t slotCapacity;
+} Contents;
+
+static void addFunction(Contents* contents, ObjFunction* function) {
+    if (contents->functionCount == contents->functionCapacity) {
+        contents->functionCapacity = GROW_CAPACITY(contents->functionCapacity);
+        contents->functions = realloc(contents->functions, sizeof(ObjFunction*) * contents->functionCapacity);
+        assert(contents->functions);
+    }
+    contents->functions[contents->functionCount++] = function;
+}
+
+static uint32_t* findSlot(Contents* contents, ObjString* string) {
+    uint32_t mask = contents->slotCapacity - 1;
+    for (uint32_t slot = string->hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t index = contents->slots[slot];
+        if (!index || contents->strings[index - 1] == string) return contents->slots + slot;
+    }
+}
+
+static uint32_t stringIndex(Contents* contents, ObjString* string) {
+    // kept at most half full
+    if (contents->slotCapacity < 2 * (contents->stringCount + 1)) {
+        uint32_t* oldSlots = contents->slots;
+        uint32_t oldCapacity = contents->slotCapacity;
+        contents->slotCapacity = oldCapacity ? oldCapacity * 2 : 64;
+        contents->slots = calloc(contents->slotCapacity, sizeof(uint32_t));
+        assert(contents->slots);
+        for (uint32_t i = 0; i < oldCapacity; i++) {
+            if (oldSlots[i]) *findSlot(contents, contents->strings[oldSlots[i] - 1]) = oldSlots[i];
+        }
+        free(oldSlots);
+    }
+
+    uint32_t* slot = findSlot(contents, string);
+    if (*slot) return *slot - 1;
+
+    if (contents->stringCount == contents->stringCapacity) {
+        contents->stringCapacity = GROW_CAPACITY(contents->stringCapacity);
+        contents->strings = realloc(contents->strings, sizeof(ObjString*) * contents->stringCapacity);
+        assert(contents->strings);
+    }
+    contents->strings[contents->stringCount] = string;
+    *slot = ++contents->stringCount;
+    return contents->stringCount - 1;
+}
+
+static void freeContents(Contents* contents) {
+    free(contents->functions);
+    free(contents->strings);
+    free(contents->slots);
+}
+
+// false for anything the compiler doesn't leave in the constants
+static bool writeConstant(Contents* contents, Value value, uint32_t* nextFunction, CacheConstant* constant) {
+    if (IS_NIL(value)) {
+        constant->kind = CACHE_NIL;
+    } else if (IS_BOOL(value)) {
+        constant->kind = AS_BOOL(value) ? CACHE_TRUE : CACHE_FALSE;
+    } else if (IS_INT(value)) {
+        constant->kind = CACHE_INT;
+        constant->index = (uint32_t) AS_INT(value);
+    } else if (IS_DOUBLE(value)) {
+        constant->kind = CACHE_NUMBER;
+        constant->as.number = AS_DOUBLE(value);
+    } else if (IS_SMALL_STRING(value)) {
+        constant->kind = CACHE_SMALL_STRING;
+        constant->index = stringValueLength(value);
+        copyStringValueChars(value, constant->as.chars);
+    } else if (IS_STRING(value)) {
+        constant->kind = CACHE_STRING;
+        constant->index = stringIndex(contents, AS_STRING(value));
+    } else if (IS_FUNCTION(value)) {
+        constant->kind = CACHE_FUNCTION;
+        constant->index = (*nextFunction)++;
+        addFunction(contents, AS_FUNCTION(value));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool writeFile(Buffer* buffer, const char* path) {
+    // written alongside and renamed over the old cache, so nothing ever maps half a file
+    size_t length = strlen(path) + 32;
+    char* tempPath = malloc(length);
+    assert(tempPath);
+    snprintf(tempPath, length, "%s.%ld.tmp", path, (long) getpid());
+
+    FILE* file = fopen(tempPath, "wb");
+    bool written = file && fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+    if (file && fclose(file)) written = false;
+    if (written && rename(tempPath, path)) written = false;
+    if (!written) remove(tempPath);
+
+    free(tempPath);
+    return written;
+}
+
+bool writeCache(ObjFunction* script, const char* source, const char* path) {
+    CacheHeader header = {0};
+    header.buildIdLength = buildId(header.buildId);
+    if (!header.buildIdLength) return false;
+
+    Contents contents = {0};
+    Buffer buffer = {0};
+    addFunction(&contents, script);
+
+    memcpy(header.magic, "clox", 4);
+    header.version = CACHE_VERSION;
+    header.opcodeCount = OP_INT + 1;
+    header.sourceLength = (uint32_t) strlen(source);
+    header.sourceHash = hashSource(source, header.sourceLength);
+    reserve(&buffer, sizeof(CacheHeader));
+
+    // functions are found as their parents' constants are written, so the tables (which need every function and
+    // string) go after them, and the header's filled in last
+    CacheFunction* records = NULL;
+    bool supported = true;
+    uint32_t nextFunction = 1;
+    for (uint32_t i = 0; supported && i < contents.functionCount; i++) {
+        ObjFunction* function = contents.functions[i];
+        Chunk* chunk = &function->chunk;
+        // only compile()'s output is cached, which the optimiser hasn't touched
+        supported = !chunk->inlinedCount;
+
+        records = realloc(records, sizeof(CacheFunction) * contents.functionCapacity);
+        assert(records);
+        CacheFunction* record = records + i;
+        record->arity = function->arity;
+        record->upvalueCount = function->upvalueCount;
+        ObjString* name = FROM_HEAP_REF(ObjString, function->name);
+        record->name = name ? stringIndex(&contents, name) : UINT32_MAX;
+
+        record->constantCount = chunk->constants.count;
+        record->constants = reserve(&buffer, sizeof(CacheConstant) * chunk->constants.count);
+        for (uint32_t c = 0; supported && c < chunk->constants.count; c++) {
+            CacheConstant constant = {0};
+            supported = writeConstant(&contents, chunk->constants.values[c], &nextFunction, &constant);
+            memcpy(buffer.bytes + record->constants + sizeof(CacheConstant) * c, &constant, sizeof(CacheConstant));
+        }
+
+        record->codeCount = chunk->count;
+        record->code = append(&buffer, chunk->code, chunk->count);
+        record->lineCount = chunk->lineCount;
+        record->lines = append(&buffer, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+        record->wordCount = chunk->wordCount;
+        record->words = append(&buffer, chunk->words, sizeof(uint32_t) * chunk->wordCount);
+        record->wordOffsets = append(&buffer, chunk->wordOffsets, sizeof(uint32_t) * chunk->wordCount);
+    }
+
+    bool written = false;
+    if (supported) {
+        header.functionCount = contents.functionCount;
+        header.functions = append(&buffer, records, sizeof(CacheFunction) * contents.functionCount);
+        header.stringCount = contents.stringCount;
+        header.strings = reserve(&buffer, sizeof(CacheString) * contents.stringCount);
+        for (uint32_t i = 0; i < contents.stringCount; i++) {
+            ObjString* string = contents.strings[i];
+            CacheString record = {string->length, append(&buffer, STRING_CHARS(string), string->length + 1)};
+            memcpy(buffer.bytes + header.strings + sizeof(CacheString) * i, &record, sizeof(CacheString));
+        }
+        header.size = buffer.count;
+        memcpy(buffer.bytes, &header, sizeof(CacheHeader));
+        written = writeFile(&buffer, path);
+    }
+
+    free(records);
+    free(buffer.bytes);
+    freeContents(&contents);
+    return written;
+}
+
+// a range of `count` things of `size` bytes which is entirely inside the file
+static bool inFile(const CacheHeader* header, uint32_t offset, uint32_t count, size_t size) {
+    return offset % CACHE_ALIGNMENT == 0 && (uint64_t) offset + (uint64_t) count * size <= header->size;
+}
+
+// everything's checked before anything's allocated, so a bad cache is just ignored. The key ensures the contents were
+// written by this build of clox for this source, so that's as far as they're checked: the bytecode's trusted as if
+// it had just been compiled
+static bool validCache(const uint8_t* base, size_t size, const char* source) {
+    const CacheHeader* header = (const CacheHeader*) base;
+    uint32_t sourceLength = (uint32_t) strlen(source);
+    uint8_t id[BUILD_ID_MAX];
+    uint32_t idLength = buildId(id);
+    if (size < sizeof(CacheHeader) || memcmp(header->magic, "clox", 4) != 0 || header->version != CACHE_VERSION
+        || !idLength || header->buildIdLength != idLength || memcmp(header->buildId, id, BUILD_ID_MAX) != 0
+        || header->opcodeCount != OP_INT + 1 || header->size != size || header->sourceLength != sourceLength
+        || header->sourceHash != hashSource(source, sourceLength) || !header->functionCount
+        || !inFile(header, header->functions, header->functionCount, sizeof(CacheFunction))
+        || !inFile(header, header->strings, header->stringCount, sizeof(CacheString))) {
+        return false;
+    }
+
+    const CacheString* strings = (const CacheString*) (base + header->strings);
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        if (!inFile(header, strings[i].chars, strings[i].length + 1, 1)) return false;
+        if (base[strings[i].chars + strings[i].length] != '\0') return false;
+    }
+
+    const CacheFunction* functions = (const CacheFunction*) (base + header->functions);
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        const CacheFunction* function = functions + i;
+        if (function->arity > UINT8_MAX || (function->name >= header->stringCount && function->name != UINT32_MAX)
+            || !inFile(header, function->constants, function->constantCount, sizeof(CacheConstant))
+            || !inFile(header, function->code, function->codeCount, 1)
+            || !inFile(header, function->lines, function->lineCount, sizeof(LineRun))
+            || !inFile(header, function->words, function->wordCount, sizeof(uint32_t))
+            || !inFile(header, function->wordOffsets, function->wordCount, sizeof(uint32_t))
+            || (function->codeCount && !function->lineCount)) {
+            return false;
+        }
+
+        const CacheConstant* constants = (const CacheConstant*) (base + function->constants);
+        for (uint32_t c = 0; c < function->constantCount; c++) {
+            switch ((CacheConstantKind) constants[c].kind) {
+                case CACHE_NIL:
+                case CACHE_FALSE:
+                case CACHE_TRUE:
+                case CACHE_NUMBER:
+                case CACHE_INT:
+                    break;
+                case CACHE_STRING:
+                    if (constants[c].index >= header->stringCount) return false;
+                    break;
+                case CACHE_SMALL_STRING:
+                    if (constants[c].index > SMALL_STRING_MAX) return false;
+                    break;
+                case CACHE_FUNCTION:
+                    // the function's declared by this one, so comes later: nothing can contain itself
+                    if (constants[c].index <= i || constants[c].index >= header->functionCount) return false;
+                    break;
+                default:
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static ObjString* cachedString(VM* vm, const uint8_t* base, uint32_t index) {
+    const CacheHeader* header = (const CacheHeader*) base;
+    const CacheString* string = (const CacheString*) (base + header->strings) + index;
+    return copyString(vm, NULL, (const char*) base + string->chars, string->length);
+}
+
+// functions are on the stack from `stackBase`
+static Value cachedConstant(VM* vm, const uint8_t* base, const CacheConstant* constant, uint32_t stackBase) {
+    switch ((CacheConstantKind) constant->kind) {
+        case CACHE_NIL:
+            return NIL_VAL;
+        case CACHE_FALSE:
+            return BOOL_VAL(false);
+        case CACHE_TRUE:
+            return BOOL_VAL(true);
+        case CACHE_NUMBER:
+            return NUMBER_VAL(constant->as.number);
+        case CACHE_INT:
+            return INT_VAL((int32_t) constant->index);
+        case CACHE_STRING:
+            return OBJ_VAL(cachedString(vm, base, constant->index));
+        case CACHE_SMALL_STRING:
+            return stringValue(vm, NULL, constant->as.chars, constant->index);
+        case CACHE_FUNCTION:
+            return vm->stack.values[stackBase + constant->index];
+    }
+    assert(!"Unknown constant kind");
+    return NIL_VAL;
+}
+
+static ObjFunction* loadFunctions(VM* vm, const uint8_t* base) {
+    const CacheHeader* header = (const CacheHeader*) base;
+    const CacheFunction* records = (const CacheFunction*) (base + header->functions);
+
+    // every function's on the stack until they're all in the script's constants
+    uint32_t stackBase = vm->stack.count;
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        push(vm, OBJ_VAL(newFunction(vm, NULL)));
+    }
+
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        const CacheFunction* record = records + i;
+        ObjFunction* function = AS_FUNCTION(vm->stack.values[stackBase + i]);
+        function->arity = (uint8_t) record->arity;
+        function->upvalueCount = record->upvalueCount;
+        if (record->name != UINT32_MAX) function->name = TO_HEAP_REF(cachedString(vm, base, record->name));
+
+        // straight from the mapping, with no capacity so there's nothing to free
+        Chunk* chunk = &function->chunk;
+        chunk->count = record->codeCount;
+        chunk->code = (uint8_t*) base + record->code;
+        chunk->lineCount = record->lineCount;
+        chunk->lines = (LineRun*) (base + record->lines);
+        chunk->wordCount = record->wordCount;
+        chunk->words = (uint32_t*) (base + record->words);
+        chunk->wordOffsets = (uint32_t*) (base + record->wordOffsets);
+        chunk->mapped = true;
+#ifdef TRACING_JIT
+        initTraceLoops(chunk);
+#endif
+
+        // grown up front (leaving the spare slot writeValue expects) so the constants never move while they're filled in
+        ValueArray* constants = &chunk->constants;
+        uint32_t capacity = record->constantCount + 1;
+        if (constants->capacity < capacity) {
+            constants->values = VM_GROW_ARRAY(Value, constants->values, constants->capacity, capacity);
+            constants->capacity = capacity;
+        }
+        const CacheConstant* cached = (const CacheConstant*) (base + record->constants);
+        for (uint32_t c = 0; c < record->constantCount; c++) {
+            Value constant = cachedConstant(vm, base, cached + c, stackBase);
+            constants->values[constants->count++] = constant;
+        }
+    }
+
+    ObjFunction* script = AS_FUNCTION(vm->stack.values[stackBase]);
+    vm->stack.count = stackBase;
+    return script;
+}
+
+ObjFunction* loadCache(VM* vm, const char* source, const char* path) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    struct stat info;
+    if (fstat(file, &info) || info.st_size < (off_t) sizeof(CacheHeader) || info.st_size > UINT32_MAX) {
+        close(file);
+        return NULL;
+    }
+    size_t size = (size_t) info.st_size;
+    // private, so the functions don't change under us if the file's rewritten in place
+    uint8_t* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (base == MAP_FAILED) return NULL;
+
+    if (!validCache(base, size, source)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    CacheMapping* mapping = malloc(sizeof(CacheMapping));
+    assert(mapping);
+    mapping->base = base;
+    mapping->size = size;
+    mapping->next = vm->cacheMappings;
+    vm->cacheMappings = mapping;
+    return loadFunctions(vm, base);
+}
+
+void freeCacheMappings(VM* vm) {
+    while (vm->cacheMappings) {
+        CacheMapping* next = vm->cacheMappings->next;
+        munmap(vm->cacheMappings->base, vm->cacheMappings->size);
+        free(vm->cacheMappings);
+        vm->cacheMappings = next;
+    }
+}
+
+#endif
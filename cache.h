@@ -0,0 +1,106 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "buildid.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef BYTECODE_CACHE
+
+// a compiled script on disk, which `clox script.lox` keeps in script.loxc and loads instead of compiling the script
+// again. The file is mapped read only, and the functions' bytecode, line runs and instruction words are used straight
+// from the mapping; only the functions and their constants are allocated, as they have to be objects on the heap
+// (strings are interned as they're loaded). A chunk's mapped arrays are never written or freed (see Chunk::mapped), and
+// the optimiser replaces them rather than rewriting them, so the mapping stays until freeVM().
+//
+// Everything's in the machine's byte order, at 8 byte aligned offsets from the start of the file:
+//   CacheHeader
+//   for each function: its CacheConstants, code, LineRuns, words and word offsets
+//   CacheFunction[functionCount]: the script, then the functions in its constants, then the functions in theirs etc, so
+//     the functions each function declares are numbered in the order they appear in its constants
+//   CacheString[stringCount], followed by their characters (each nul terminated)
+
+// bumped whenever the format changes. Anything else which would make an old cache compile differently today (the
+// compiler, the optimisations it folds in, the opcodes) comes with a new binary, so the header also records the build
+// ID of the one which wrote it (see buildid.h), and a binary without one doesn't write caches
+#define CACHE_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodeCount;
+    // the cache's key, along with the version and build ID: FNV-1a of the source
+    uint32_t sourceLength;
+    uint64_t sourceHash;
+    uint32_t buildIdLength;
+    uint8_t buildId[BUILD_ID_MAX];
+    uint32_t size;
+    uint32_t functionCount;
+    uint32_t functions;
+    uint32_t stringCount;
+    uint32_t strings;
+} CacheHeader;
+
+typedef struct {
+    uint32_t arity;
+    uint32_t upvalueCount;
+    // a string's index, or UINT32_MAX for the script
+    uint32_t name;
+    // counts, and offsets into the file
+    uint32_t constantCount;
+    uint32_t constants;
+    uint32_t codeCount;
+    uint32_t code;
+    uint32_t lineCount;
+    uint32_t lines;
+    uint32_t wordCount;
+    uint32_t words;
+    uint32_t wordOffsets;
+} CacheFunction;
+
+typedef enum {
+    CACHE_NIL,
+    CACHE_FALSE,
+    CACHE_TRUE,
+    CACHE_NUMBER,
+    CACHE_INT,
+    // an interned ObjString, or a string value short enough to be stored in the constant itself (see value.h)
+    CACHE_STRING,
+    CACHE_SMALL_STRING,
+    CACHE_FUNCTION,
+} CacheConstantKind;
+
+typedef struct {
+    uint32_t kind;
+    // a string or function's index, an int, or a small string's length
+    uint32_t index;
+    union {
+        double number;
+        char chars[8];
+    } as;
+} CacheConstant;
+
+typedef struct {
+    uint32_t length;
+    uint32_t chars;
+} CacheString;
+
+// a cache the VM's functions have been loaded from
+typedef struct CacheMapping {
+    uint8_t* base;
+    size_t size;
+    struct CacheMapping* next;
+} CacheMapping;
+
+// writes the script compile() returned to `path` (before anything's run, so before the optimiser's changed anything).
+// Returns false if it couldn't be written, in which case there's no file left at `path`
+bool writeCache(ObjFunction* script, const char* source, const char* path);
+
+// the script cached at `path`, or NULL if there's no cache there for exactly this source and build of clox
+ObjFunction* loadCache(VM* vm, const char* source, const char* path);
+
+void freeCacheMappings(VM* vm);
+
+#endif
+
+#endif //CLOX_CACHE_H
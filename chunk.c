@@ -1,61 +1,77 @@
 #include <assert.h>
 #include "chunk.h"
+#include "object.h"
+#include "jit.h"
+#include "trace.h"
 
 void initChunk(VM* vm, Compiler* compiler, Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->firstLine = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
+    chunk->inlined = NULL;
+#ifdef TRACING_JIT
+    // before anything's allocated, as the GC marks the functions the traces inlined
+    chunk->loopCount = 0;
+    chunk->loops = NULL;
+#endif
     initValueArray(vm, compiler, &chunk->constants);
+    chunk->wordCount = 0;
+    chunk->words = NULL;
+    chunk->wordOffsets = NULL;
+    chunk->mapped = false;
+#ifdef NATIVE_CODE
+    chunk->native = NULL;
+#endif
 }
 
 void freeChunk(VM* vm, Chunk* chunk) {
-    VM_FREE_ARRAY(uint8_t, chunk->code, chunk->count);
-    for (Line* line = chunk->firstLine; line;) {
-        Line* next = line->next;
-        VM_FREE(Line, line);
-        line = next;
+    VM_FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    VM_FREE_ARRAY(LineRun, chunk->lines, chunk->lineCapacity);
+    VM_FREE_ARRAY(InlinedRun, chunk->inlined, chunk->inlinedCapacity);
+    if (!chunk->mapped) {
+        VM_FREE_ARRAY(uint32_t, chunk->words, chunk->wordCount);
+        VM_FREE_ARRAY(uint32_t, chunk->wordOffsets, chunk->wordCount);
     }
     freeValueArray(vm, &chunk->constants);
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
-    chunk->firstLine = NULL;
-}
-
-static Line* newLine(VM* vm, Compiler* compiler, uint32_t lineNumber) {
-    Line* line = NULL;
-    line = COMPILER_ALLOCATE(Line, 1);
-    assert(line);
-    line->lineNumber = lineNumber;
-    line->instructions = 0;
-    line->next = NULL;
-
-    return line;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
+    chunk->inlined = NULL;
+    chunk->wordCount = 0;
+    chunk->words = NULL;
+    chunk->wordOffsets = NULL;
+    chunk->mapped = false;
+#ifdef NATIVE_CODE
+    freeNativeCode(chunk->native);
+    chunk->native = NULL;
+#endif
+#ifdef TRACING_JIT
+    freeTraceLoops(chunk);
+#endif
 }
 
 static void writeLine(VM* vm, Compiler* compiler, Chunk* chunk, uint32_t line) {
-    if (!chunk->firstLine) {
-        chunk->firstLine = newLine(vm, compiler, line);
-    }
+    // only the last run can be extended, so this is O(1) regardless of how many lines came before
+    if (chunk->lineCount && chunk->lines[chunk->lineCount - 1].line == line) return;
 
-    Line* closest = chunk->firstLine;
-    while (closest && closest->next) {
-        if (closest->lineNumber == line) break;
-        closest = closest->next;
-    }
-    assert(closest);
-
-    if (closest->lineNumber == line) {
-        closest->instructions += 1;
-    } else {
-        Line* nextLine = newLine(vm, compiler, line);
-        nextLine->instructions += 1;
-
-        // assuming that line numbers never decrease, otherwise this will overwrite existing links
-        assert(!closest->next);
-        closest->next = nextLine;
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        uint32_t oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = COMPILER_GROW_ARRAY(LineRun, chunk->lines, oldCapacity, chunk->lineCapacity);
     }
+    chunk->lines[chunk->lineCount].start = chunk->count;
+    chunk->lines[chunk->lineCount].line = line;
+    chunk->lineCount++;
 }
 
 void writeChunk(VM* vm, Compiler* compiler, Chunk* chunk, uint8_t byte, uint32_t line) {
@@ -71,18 +87,271 @@ void writeChunk(VM* vm, Compiler* compiler, Chunk* chunk, uint8_t byte, uint32_t
 }
 
 uint32_t getLine(Chunk* chunk, uint32_t instructionIndex) {
-    uint32_t line = UINT32_MAX;
-    for (Line* nextLine = chunk->firstLine; nextLine; nextLine = nextLine->next) {
-        if (instructionIndex <= nextLine->instructions) {
-            line = nextLine->lineNumber;
+    assert(chunk->lineCount && instructionIndex < chunk->count);
+
+    // find the last run starting at or before the instruction
+    uint32_t low = 0;
+    uint32_t high = chunk->lineCount;
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (chunk->lines[middle].start <= instructionIndex) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
+void truncateChunk(Chunk* chunk, uint32_t count) {
+    assert(count <= chunk->count);
+    chunk->count = count;
+    while (chunk->lineCount && chunk->lines[chunk->lineCount - 1].start >= count) {
+        chunk->lineCount--;
+    }
+}
+
+uint32_t instructionLength(Chunk* chunk, uint32_t offset) {
+    switch ((OpCode) chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+            return 1;
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLASS:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_EQUAL_RK:
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_MOVE:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_LOCAL_POP_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_JUMP_IF_CALLEE:
+        case OP_EQUAL_RK_STORE:
+        case OP_GREATER_RK_STORE:
+        case OP_LESS_RK_STORE:
+        case OP_ADD_RK_STORE:
+        case OP_SUBTRACT_RK_STORE:
+        case OP_MULTIPLY_RK_STORE:
+        case OP_DIVIDE_RK_STORE:
+            return 4;
+        case OP_JUMP_IF_INVOKES:
+            return 5;
+        case OP_CLOSURE: {
+            // followed by an (isLocal, index) pair per upvalue
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        case OP_INT:
+            // never in bytecode
             break;
+    }
+    assert(!"Unknown opcode");
+    return 1;
+}
+
+static uint32_t wordLength(Chunk* chunk, uint32_t offset) {
+    switch (chunk->code[offset]) {
+        case OP_JUMP_IF_INVOKES:
+            return 2;
+        case OP_CLOSURE:
+            return 1 + AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])->upvalueCount;
+        default:
+            return 1;
+    }
+}
+
+// the 1 byte form of each _LONG opcode
+static OpCode narrowOp(OpCode op) {
+    switch (op) {
+        case OP_CONSTANT_LONG:
+            return OP_CONSTANT;
+        case OP_DEFINE_GLOBAL_LONG:
+            return OP_DEFINE_GLOBAL;
+        case OP_GET_GLOBAL_LONG:
+            return OP_GET_GLOBAL;
+        case OP_SET_GLOBAL_LONG:
+            return OP_SET_GLOBAL;
+        case OP_GET_LOCAL_LONG:
+            return OP_GET_LOCAL;
+        case OP_SET_LOCAL_LONG:
+            return OP_SET_LOCAL;
+        case OP_SET_LOCAL_POP_LONG:
+            return OP_SET_LOCAL_POP;
+        case OP_GET_UPVALUE_LONG:
+            return OP_GET_UPVALUE;
+        case OP_SET_UPVALUE_LONG:
+            return OP_SET_UPVALUE;
+        default:
+            return op;
+    }
+}
+
+void encodeChunk(VM* vm, Compiler* compiler, Chunk* chunk) {
+    // the code's always been replaced by now, so nothing's left in the mapping
+    if (!chunk->mapped) {
+        VM_FREE_ARRAY(uint32_t, chunk->words, chunk->wordCount);
+        VM_FREE_ARRAY(uint32_t, chunk->wordOffsets, chunk->wordCount);
+    }
+    chunk->mapped = false;
+    chunk->wordCount = 0;
+    chunk->words = NULL;
+    chunk->wordOffsets = NULL;
+#ifdef NATIVE_CODE
+    // compiled from the old words
+    freeNativeCode(chunk->native);
+    chunk->native = NULL;
+#endif
+#ifdef TRACING_JIT
+    freeTraceLoops(chunk);
+#endif
+
+    // the index of the first word of each instruction, by offset, to resolve jumps
+    uint32_t* indexes = COMPILER_ALLOCATE(uint32_t, chunk->count + 1);
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        indexes[offset] = count;
+        count += wordLength(chunk, offset);
+    }
+    indexes[chunk->count] = count;
+
+    uint32_t* words = COMPILER_ALLOCATE(uint32_t, count);
+    uint32_t* wordOffsets = COMPILER_ALLOCATE(uint32_t, count);
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t* code = chunk->code + offset;
+        uint32_t length = instructionLength(chunk, offset);
+        uint32_t index = indexes[offset];
+        uint32_t next = index + wordLength(chunk, offset);
+        for (uint32_t i = index; i < next; i++) {
+            wordOffsets[i] = offset;
+        }
+
+        OpCode op = (OpCode) code[0];
+        switch (op) {
+            case OP_CONSTANT: {
+                Value value = chunk->constants.values[code[1]];
+                if (IS_INT(value) && AS_INT(value) >= WORD_INT_MIN && AS_INT(value) <= WORD_INT_MAX) {
+                    words[index] = OP_INT | (uint32_t) AS_INT(value) << 8;
+                } else {
+                    words[index] = OP_CONSTANT | code[1] << 8;
+                }
+                break;
+            }
+            case OP_CONSTANT_LONG:
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL_LONG:
+            case OP_SET_LOCAL_POP_LONG:
+            case OP_GET_UPVALUE_LONG:
+            case OP_SET_UPVALUE_LONG:
+                words[index] = narrowOp(op) | (uint32_t) (code[1] << 16 | code[2] << 8 | code[3]) << 8;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE: {
+                uint32_t target = offset + length + (code[1] << 8 | code[2]);
+                words[index] = op | (indexes[target] - next) << 8;
+                break;
+            }
+            case OP_LOOP: {
+                uint32_t target = offset + length - (code[1] << 8 | code[2]);
+                words[index] = op | (next - indexes[target]) << 8;
+                break;
+            }
+            case OP_JUMP_IF_CALLEE: {
+                uint32_t target = offset + length + (code[2] << 8 | code[3]);
+                words[index] = op | code[1] << 8 | (indexes[target] - next) << 16;
+                break;
+            }
+            case OP_JUMP_IF_INVOKES: {
+                uint32_t target = offset + length + (code[3] << 8 | code[4]);
+                words[index] = op | code[1] << 8 | code[2] << 16;
+                words[index + 1] = indexes[target] - next;
+                break;
+            }
+            case OP_CLOSURE:
+                words[index] = op | code[1] << 8;
+                for (uint32_t i = index + 1; i < next; i++) {
+                    uint32_t pair = 2 + 2 * (i - index - 1);
+                    words[i] = code[pair] | code[pair + 1] << 8;
+                }
+                break;
+            default: {
+                // the operands are bytes, in order
+                uint32_t word = op;
+                for (uint32_t i = 1; i < length; i++) {
+                    word |= (uint32_t) code[i] << (8 * i);
+                }
+                words[index] = word;
+                break;
+            }
         }
-        instructionIndex -= nextLine->instructions;
     }
 
-    // hopefully nobody's writing 4 billion lines of lox code
-    if (line == UINT32_MAX) {
-        assert(!"Oh no");
+    VM_FREE_ARRAY(uint32_t, indexes, chunk->count + 1);
+    chunk->wordCount = count;
+    chunk->words = words;
+    chunk->wordOffsets = wordOffsets;
+#ifdef TRACING_JIT
+    initTraceLoops(chunk);
+#endif
+}
+
+InlinedRun* findInlinedRun(Chunk* chunk, uint32_t offset) {
+    // only needed for stack traces, so not worth keeping sorted
+    for (uint32_t i = 0; i < chunk->inlinedCount; i++) {
+        InlinedRun* run = chunk->inlined + i;
+        if (offset >= run->start && offset < run->end) return run;
     }
-    return line;
+    return NULL;
 }
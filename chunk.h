@@ -18,6 +18,9 @@ typedef enum {
     OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
     OP_SET_LOCAL_LONG,
+    // SET_LOCAL; POP, as left by assignment expression statements
+    OP_SET_LOCAL_POP,
+    OP_SET_LOCAL_POP_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -35,6 +38,7 @@ typedef enum {
     OP_RETURN,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_CALL,
     OP_CLOSURE,
@@ -51,20 +55,125 @@ typedef enum {
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    // calls in tail position, which replace the calling frame rather than returning to it: the OP_RETURN that follows
+    // one is only reached by code jumping over the call
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
+    // guards for code inlined by the optimiser: pop a callee/receiver, and jump to the inlined code if calling it (or
+    // invoking a method on it) would run the given closure
+    OP_JUMP_IF_CALLEE,
+    OP_JUMP_IF_INVOKES,
+    // register instructions: the binary operators from OP_EQUAL to OP_DIVIDE (in the same order), reading both operands
+    // straight from frame slots or constants (see RK_CONSTANT) rather than the stack. The _RK forms push the result;
+    // the three-address _STORE forms write it to the slot given by a third operand
+    OP_EQUAL_RK,
+    OP_GREATER_RK,
+    OP_LESS_RK,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_EQUAL_RK_STORE,
+    OP_GREATER_RK_STORE,
+    OP_LESS_RK_STORE,
+    OP_ADD_RK_STORE,
+    OP_SUBTRACT_RK_STORE,
+    OP_MULTIPLY_RK_STORE,
+    OP_DIVIDE_RK_STORE,
+    // copies a slot or constant (the first operand) into the slot given by the second
+    OP_MOVE,
+    // only in instruction words: pushes the signed integer in the operand field
+    OP_INT,
 } OpCode;
 
-typedef struct Line {
-    uint32_t lineNumber;
-    uint32_t instructions;
-    struct Line* next;
-} Line;
+// a register instruction's operand is a frame slot, or (with this bit set) one of the first 128 constants
+#define RK_CONSTANT 0x80
+
+static inline bool isRegisterOp(uint8_t op) {
+    return op >= OP_EQUAL_RK && op <= OP_DIVIDE_RK_STORE;
+}
+
+static inline bool isRegisterStore(uint8_t op) {
+    return op >= OP_EQUAL_RK_STORE && op <= OP_DIVIDE_RK_STORE;
+}
+
+// the stack operator a register instruction does the work of
+static inline OpCode stackOp(uint8_t op) {
+    return (OpCode) (OP_EQUAL + (isRegisterStore(op) ? op - OP_EQUAL_RK_STORE : op - OP_EQUAL_RK));
+}
+
+static inline OpCode registerOp(OpCode op) {
+    return (OpCode) (OP_EQUAL_RK + (op - OP_EQUAL));
+}
+
+static inline OpCode registerStoreOp(OpCode op) {
+    return (OpCode) (OP_EQUAL_RK_STORE + (op - OP_EQUAL));
+}
+
+// the VM runs a chunk's code as 32 bit instruction words: the opcode in the low byte, then either up to three byte
+// operands (a, b, c) or a single 24 bit operand. Wide operands fit in the same word, so the _LONG opcodes are never
+// used; jump distances count words from the end of the instruction; small integer constants are OP_INT immediates.
+// Instructions with more operands are followed by extra words: a distance for OP_JUMP_IF_INVOKES, and an
+// (isLocal | index << 8) word per upvalue for OP_CLOSURE
+#define WORD_OP(word) ((OpCode) ((word) & 0xff))
+#define WORD_A(word) (((word) >> 8) & 0xff)
+#define WORD_B(word) (((word) >> 16) & 0xff)
+#define WORD_C(word) ((word) >> 24)
+#define WORD_OPERAND(word) ((word) >> 8)
+#define WORD_SIGNED_OPERAND(word) ((int32_t) (word) >> 8)
+#define WORD_INT_MIN (-(1 << 23))
+#define WORD_INT_MAX ((1 << 23) - 1)
+
+// a run of bytecode from the same source line, covering everything from `start` up to the next run's start (or the end
+// of the chunk); runs are only ever appended, in code order, so can be binary searched by offset
+typedef struct {
+    uint32_t start;
+    uint32_t line;
+} LineRun;
+
+// code the optimiser inlined from another function: runtime errors inside it report the callee's frame (at the code's
+// own lines) as well as the caller's at the line of the call
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t line;
+    // the callee's closure, as an index into the constants
+    uint32_t callee;
+} InlinedRun;
+
+// see jit.h
+typedef struct NativeCode NativeCode;
+// see trace.h
+typedef struct TraceLoop TraceLoop;
 
 typedef struct {
     uint32_t count;
     uint32_t capacity;
     uint8_t* code;
-    Line* firstLine;
+    uint32_t lineCount;
+    uint32_t lineCapacity;
+    LineRun* lines;
+    uint32_t inlinedCount;
+    uint32_t inlinedCapacity;
+    InlinedRun* inlined;
     ValueArray constants;
+    // the code as instruction words, and the offset in `code` of the instruction each word belongs to
+    uint32_t wordCount;
+    uint32_t* words;
+    uint32_t* wordOffsets;
+    // the code, lines and words are in a bytecode cache's mapping (see cache.h) rather than the heap, so are never
+    // written or freed (the optimiser replaces them), and capacity and lineCapacity are 0
+    bool mapped;
+#ifdef NATIVE_CODE
+    // the words compiled to native code: ahead of time, or once the function's hot
+    NativeCode* native;
+#endif
+#ifdef TRACING_JIT
+    // one for each OP_LOOP, in order
+    uint32_t loopCount;
+    TraceLoop* loops;
+#endif
 } Chunk;
 
 void initChunk(VM* vm, Compiler* compiler, Chunk* chunk);
@@ -75,4 +184,16 @@ void writeChunk(VM* vm, Compiler* compiler, Chunk* chunk, uint8_t byte, uint32_t
 
 uint32_t getLine(Chunk* chunk, uint32_t instructionIndex);
 
+// the size of the instruction at `offset`, including its operands
+uint32_t instructionLength(Chunk* chunk, uint32_t offset);
+
+// drops everything from `count` onwards, e.g. to replace code that's been evaluated at compile time
+void truncateChunk(Chunk* chunk, uint32_t count);
+
+// the inlined code covering `offset`, if any
+InlinedRun* findInlinedRun(Chunk* chunk, uint32_t offset);
+
+// (re)builds the instruction words from the finished bytecode
+void encodeChunk(VM* vm, Compiler* compiler, Chunk* chunk);
+
 #endif //CLOX_CHUNK_H
@@ -9,10 +9,95 @@
 //#define DEBUG_TRACE_EXECUTION
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//#define DEBUG_PRINT_TRACES
 #define NAN_BOXING
+//#define COMPRESSED_HEAP_REFS
+#define PEEPHOLE_OPTIMISATION
+#define SSA_OPTIMISATION
+// the GC's mark bits are kept in a bitmap beside the heap rather than in each object, so collecting only writes to
+// objects it frees (which leaves the pages of a forked child's inherited objects shared; see serve.h)
+#define MARK_BITMAP
+#ifndef COMPRESSED_HEAP_REFS
+// code compiled once can be frozen and run by any number of VMs, which each refer to it rather than having their own
+// copy (see shared.h); needs full pointers, as it's outside every VM's heap
+#define SHARED_CODE
+#endif
+#ifndef HOT_FUNCTION_THRESHOLD
+// calls (plus loop iterations) before a function's bytecode is rebuilt by the optimiser
+#define HOT_FUNCTION_THRESHOLD 1000
+#endif
+#ifndef REGISTER_BYTECODE
+// arithmetic and comparisons on locals and constants read their operands straight from the frame instead of the stack
+#define REGISTER_BYTECODE true
+#endif
+// functions can run as native code, with the interpreter checking for it before each instruction: compiled ahead of
+// time by `clox --emit-c` (see aot.h), or by the baseline JIT. Without it, everything's interpreted
+#define NATIVE_CODE
+#if defined(NATIVE_CODE) && defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__)
+// hot functions are compiled to machine code (see jit.h); only for NaN boxed values on x86-64 Linux
+#define BASELINE_JIT
+#endif
+#ifndef JIT_THRESHOLD
+// calls (plus loop iterations) before a function is compiled to machine code: half way to being rebuilt by the
+// optimiser, after which it's compiled again. 1 compiles every function as soon as it runs
+#define JIT_THRESHOLD ((HOT_FUNCTION_THRESHOLD + 1) / 2)
+#endif
+#ifdef BASELINE_JIT
+// hot loops are recorded as they run and compiled to machine code specialised to the types they saw (see trace.h)
+#define TRACING_JIT
+#endif
+#ifndef TRACE_THRESHOLD
+// iterations of a loop before it's recorded
+#define TRACE_THRESHOLD 50
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+// `clox script.lox` keeps the compiled script in script.loxc, and maps it straight into memory the next time the
+// script's run rather than compiling it again (see cache.h)
+#define BYTECODE_CACHE
+// `clox --snapshot prelude.lox image` saves the VM's heap once the prelude's run, and `clox --image image script.lox`
+// starts from it rather than running the prelude again (see snapshot.h)
+#define HEAP_SNAPSHOT
+// `clox --serve prelude.lox` runs the prelude once, then each job in a forked copy of the VM (see serve.h)
+#define FORK_SERVER
+// a pool of threads, each with its own VM, to run scripts and calls on (see pool.h)
+#define WORKER_POOL
+// `spawn(fn, argument)` runs a function on a thread of its own, in a VM of its own, which it talks to over channels
+// (see isolate.h)
+#define ISOLATES
+#endif
+// `coroutine(fn)` makes a function which runs on a stack of its own, resumed with `resume(coroutine, value)` and
+// handing values back with `yield(value)` (see ObjCoroutine)
+#define COROUTINES
 #define UINT8_COUNT (UINT8_MAX + 1)
 #define UNUSED __attribute__((__unused__))
 
+#ifdef COMPRESSED_HEAP_REFS
+// references from one heap object to another are stored as 32 bit offsets from the start of the heap, in units of
+// 1 << HEAP_REF_SHIFT bytes: a shift of 3 allows heaps of up to 32GB, but every allocation is rounded up to 8 bytes; a
+// shift of 0 allows 4GB without rounding. The base is one unit before the start of the heap, so NULL can be 0
+#define HEAP_REF_SHIFT 3
+typedef uint32_t HeapRef;
+// the base of the heap this thread's VM code is running against: each heap has its own (see FreeList), which
+// initMemory makes current, and every entry point into a VM switches to for as long as it runs (see ENTER_HEAP)
+extern _Thread_local uint8_t* heapBase;
+
+static inline HeapRef toHeapRef(const void* pointer) {
+    return pointer ? (HeapRef) (((const uint8_t*) pointer - heapBase) >> HEAP_REF_SHIFT) : 0;
+}
+
+static inline void* fromHeapRef(HeapRef ref) {
+    return ref ? heapBase + ((size_t) ref << HEAP_REF_SHIFT) : NULL;
+}
+
+#define HEAP_REF(type) HeapRef
+#define TO_HEAP_REF(pointer) toHeapRef(pointer)
+#define FROM_HEAP_REF(type, ref) ((type*) fromHeapRef(ref))
+#else
+#define HEAP_REF(type) type*
+#define TO_HEAP_REF(pointer) (pointer)
+#define FROM_HEAP_REF(type, ref) (ref)
+#endif
+
 typedef int (Printer)(const char* format, ...);
 typedef struct VM VM;
 typedef struct Compiler Compiler;
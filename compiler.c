@@ -5,6 +5,7 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "debug.h"
+#include "peephole.h"
 #include "object.h"
 
 typedef enum {
@@ -74,6 +75,10 @@ static void freeLocalArray(VM* vm, LocalArray* array) {
     initLocalArray(array);
 }
 
+// probed linearly for a few slots then overwritten, so a miss only ever means a duplicate constant
+#define CONSTANT_CACHE_SIZE 256
+#define CONSTANT_CACHE_PROBES 8
+
 struct Compiler {
     Compiler* enclosing;
     ObjFunction* function;
@@ -82,6 +87,19 @@ struct Compiler {
     LocalArray localArray;
     Upvalue upvalues[UINT8_COUNT];
     uint32_t scopeDepth;
+
+    // indexes of constants already in the function's pool, so repeated literals and names share a slot; folding can
+    // pop constants from the pool, so entries are checked against the pool before being used rather than invalidated
+    uint32_t constantCache[CONSTANT_CACHE_SIZE];
+    // where the code and constants for the left operand of the current infix expression start, for constant folding
+    uint32_t operandStart;
+    uint32_t operandConstants;
+    // where the most recent call instruction starts, so a return can tell if its value comes straight from a call
+    uint32_t lastCall;
+    // where the most recent assignment to a local, and the value assigned, start; so an assignment whose value is
+    // discarded can write the value straight to the local
+    uint32_t lastAssignment;
+    uint32_t assignedValue;
 };
 
 static void errorAt(Parser* parser, Token* token, const char* message) {
@@ -152,10 +170,51 @@ static void emitVariableWidth(Parser* parser, uint8_t byteOp, uint8_t longOp, ui
     }
 }
 
+// constants are only merged if they're bitwise identical, so e.g. 0 & -0, or 1 & 1.0 stay distinct
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+    if (a.type == VAL_NUMBER) return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    return valuesEqual(a, b);
+#endif
+}
+
+static uint32_t constantCacheSlot(Value value) {
+    uint64_t bits = 0;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    if (IS_NUMBER(value)) {
+        memcpy(&bits, &value.as.number, sizeof(bits));
+    } else if (IS_OBJ(value)) {
+        bits = (uintptr_t) AS_OBJ(value);
+    } else {
+        bits = IS_BOOL(value) ? AS_BOOL(value) + 1u : 0u;
+    }
+#endif
+    return (uint32_t) ((bits * 0x9E3779B97F4A7C15ull) >> 56) & (CONSTANT_CACHE_SIZE - 1);
+}
+
 static uint32_t makeConstant(Parser* parser, Value value) {
-    writeValue(parser->vm, parser->compiler, &currentChunk(parser)->constants, value);
-    uint32_t index = currentChunk(parser)->constants.count - 1;
+    ValueArray* constants = &currentChunk(parser)->constants;
+    uint32_t* cache = parser->compiler->constantCache;
+    uint32_t home = constantCacheSlot(value);
+    uint32_t* unused = NULL;
+    for (uint32_t i = 0; i < CONSTANT_CACHE_PROBES; i++) {
+        uint32_t* cached = cache + ((home + i) & (CONSTANT_CACHE_SIZE - 1));
+        if (*cached >= constants->count) {
+            if (!unused) unused = cached;
+        } else if (sameConstant(constants->values[*cached], value)) {
+            return *cached;
+        }
+    }
+
+    writeValue(parser->vm, parser->compiler, constants, value);
+    uint32_t index = constants->count - 1;
     assert(index < 1 << 24 || !"Way too many constants");
+    *(unused ? unused : cache + home) = index;
     return index;
 }
 
@@ -164,7 +223,7 @@ static void emitConstant(Parser* parser, Value value) {
     emitVariableWidth(parser, OP_CONSTANT, OP_CONSTANT_LONG, index);
 }
 
-static ParseRule* getRule(TokenType type);
+static const ParseRule* getRule(TokenType type);
 
 static void statement(Parser* parser);
 
@@ -195,12 +254,17 @@ static void parsePrecedence(Parser* parser, Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    uint32_t start = currentChunk(parser)->count;
+    uint32_t constantsStart = currentChunk(parser)->constants.count;
     prefixRule(parser, canAssign);
 
     while (precedence <= getRule(parser->current.type)->precedence) {
         advance(parser);
         ParseFn infixRule = getRule(parser->previous.type)->infix;
         assert(infixRule || !"Attempting to parse non-infix operator as infix");
+        // the left operand is everything emitted so far by this call, including any earlier infix expressions
+        parser->compiler->operandStart = start;
+        parser->compiler->operandConstants = constantsStart;
         infixRule(parser, canAssign);
     }
 
@@ -538,10 +602,55 @@ static void whileStatement(Parser* parser) {
     emitByte(parser, OP_POP);
 }
 
+// the operand of a register instruction reading what [start, end) pushes, if that's a single local or constant
+static bool registerOperand(Parser* parser, uint32_t start, uint32_t end, uint8_t* operand) {
+    Chunk* chunk = currentChunk(parser);
+    if (!parser->vm->registerBytecode || end - start != 2 || chunk->code[start + 1] & RK_CONSTANT) return false;
+
+    switch (chunk->code[start]) {
+        case OP_GET_LOCAL:
+            *operand = chunk->code[start + 1];
+            return true;
+        case OP_CONSTANT:
+            *operand = chunk->code[start + 1] | RK_CONSTANT;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// discards the value of an expression statement; if the expression is an assignment to a local of a register
+// instruction or operand, the value can be written straight to the local instead of going via the stack
+static void popExpression(Parser* parser) {
+    Chunk* chunk = currentChunk(parser);
+    uint32_t set = parser->compiler->lastAssignment;
+    if (!parser->vm->registerBytecode || set >= chunk->count || set + 2 != chunk->count) {
+        emitByte(parser, OP_POP);
+        return;
+    }
+
+    uint32_t value = parser->compiler->assignedValue;
+    uint32_t line = getLine(chunk, value);
+    uint8_t slot = chunk->code[set + 1];
+    uint8_t operand;
+    if (isRegisterOp(chunk->code[value]) && !isRegisterStore(chunk->code[value]) && value + 3 == set) {
+        truncateChunk(chunk, set);
+        chunk->code[value] = registerStoreOp(stackOp(chunk->code[value]));
+        writeChunk(parser->vm, parser->compiler, chunk, slot, line);
+    } else if (registerOperand(parser, value, set, &operand)) {
+        truncateChunk(chunk, value);
+        writeChunk(parser->vm, parser->compiler, chunk, OP_MOVE, line);
+        writeChunk(parser->vm, parser->compiler, chunk, operand, line);
+        writeChunk(parser->vm, parser->compiler, chunk, slot, line);
+    } else {
+        emitByte(parser, OP_POP);
+    }
+}
+
 static void expressionStatement(Parser* parser) {
     expression(parser);
     consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(parser, OP_POP);
+    popExpression(parser);
 }
 
 static void forStatement(Parser* parser) {
@@ -569,7 +678,7 @@ static void forStatement(Parser* parser) {
         int32_t bodyJump = emitJump(parser, OP_JUMP);
         uint32_t incrementStart = currentChunk(parser)->count;
         expression(parser);
-        emitByte(parser, OP_POP);
+        popExpression(parser);
         consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emitLoop(parser, loopStart);
@@ -586,6 +695,28 @@ static void forStatement(Parser* parser) {
     endScope(parser);
 }
 
+// if the last thing emitted is a call, nothing happens between it returning and the function returning, so the call can
+// reuse the function's frame. The OP_RETURN is still emitted after it, for anything jumping past the call
+static void tailCall(Parser* parser) {
+    Chunk* chunk = currentChunk(parser);
+    uint32_t offset = parser->compiler->lastCall;
+    if (offset >= chunk->count || offset + instructionLength(chunk, offset) != chunk->count) return;
+
+    switch (chunk->code[offset]) {
+        case OP_CALL:
+            chunk->code[offset] = OP_TAIL_CALL;
+            break;
+        case OP_INVOKE:
+            chunk->code[offset] = OP_TAIL_INVOKE;
+            break;
+        case OP_SUPER_INVOKE:
+            chunk->code[offset] = OP_TAIL_SUPER_INVOKE;
+            break;
+        default:
+            break;
+    }
+}
+
 static void returnStatement(Parser* parser) {
     if (parser->compiler->type == TYPE_SCRIPT) {
         error(parser, "Can't return from top level code.");
@@ -599,6 +730,7 @@ static void returnStatement(Parser* parser) {
         }
         expression(parser);
         consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        tailCall(parser);
         emitByte(parser, OP_RETURN);
     }
 }
@@ -624,13 +756,15 @@ static void statement(Parser* parser) {
 }
 
 static void number(Parser* parser, UNUSED bool canAssign) {
-    Value value = NUMBER_VAL(strtod(parser->previous.start, NULL));
+    double number = strtod(parser->previous.start, NULL);
+    // literals without a fractional part are ints, if they fit
+    bool isIntegral = !memchr(parser->previous.start, '.', parser->previous.length) && number <= INT32_MAX;
+    Value value = isIntegral ? INT_VAL((int32_t) number) : NUMBER_VAL(number);
     emitConstant(parser, value);
 }
 
 static void string(Parser* parser, UNUSED bool canAssign) {
-    Value value = OBJ_VAL(
-            copyString(parser->vm, parser->compiler, parser->previous.start + 1, parser->previous.length - 2));
+    Value value = stringValue(parser->vm, parser->compiler, parser->previous.start + 1, parser->previous.length - 2);
     emitConstant(parser, value);
 }
 
@@ -657,13 +791,160 @@ static uint8_t argumentList(Parser* parser) {
 
 static void call(Parser* parser, UNUSED bool canAssign) {
     uint8_t argumentCount = argumentList(parser);
+    parser->compiler->lastCall = currentChunk(parser)->count;
     emitBytes(parser, OP_CALL, argumentCount);
 }
 
+// if `code[start, end)` is a single instruction which pushes a constant, gets that constant
+static bool constantAt(Parser* parser, uint32_t start, uint32_t end, Value* value) {
+    Chunk* chunk = currentChunk(parser);
+    if (start >= end) return false;
+
+    switch (chunk->code[start]) {
+        case OP_CONSTANT:
+            if (end - start != 2) return false;
+            *value = chunk->constants.values[chunk->code[start + 1]];
+            return true;
+        case OP_CONSTANT_LONG:
+            if (end - start != 4) return false;
+            *value = chunk->constants.values[
+                    (chunk->code[start + 1] << 16) | (chunk->code[start + 2] << 8) | chunk->code[start + 3]];
+            return true;
+        case OP_NIL:
+            *value = NIL_VAL;
+            return end - start == 1;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return end - start == 1;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return end - start == 1;
+        default:
+            return false;
+    }
+}
+
+// replaces everything emitted since `start` (which must only have added the constants since `constantsStart`) with
+// a single instruction pushing `value`
+static void replaceWithConstant(Parser* parser, uint32_t start, uint32_t constantsStart, Value value) {
+    Chunk* chunk = currentChunk(parser);
+    truncateChunk(chunk, start);
+    chunk->constants.count = constantsStart;
+
+    if (IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    } else {
+        emitConstant(parser, value);
+    }
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// mirrors the VM's arithmetic exactly, including int overflow promoting to double; returns false if the operation
+// would be a runtime error, so the error still happens at runtime
+static bool foldArithmetic(Parser* parser, OpCode op, Value a, Value b, Value* result) {
+    if (op == OP_ADD && IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+        // operands are still in the constant pool, so stay reachable while the result is allocated
+        VM* vm = parser->vm;
+        Compiler* compiler = parser->compiler;
+        uint32_t aLength = stringValueLength(a);
+        uint32_t length = aLength + stringValueLength(b);
+        if (length <= SMALL_STRING_MAX) {
+            char chars[8];
+            copyStringValueChars(a, chars);
+            copyStringValueChars(b, chars + aLength);
+            *result = stringValue(vm, compiler, chars, length);
+        } else {
+            char* chars = COMPILER_ALLOCATE(char, length + 1);
+            copyStringValueChars(a, chars);
+            copyStringValueChars(b, chars + aLength);
+            chars[length] = '\0';
+            *result = OBJ_VAL(takeString(vm, compiler, chars, length));
+        }
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    int32_t intResult;
+    if (IS_INT(a) && IS_INT(b)) {
+        bool overflowed = true;
+        switch (op) {
+            case OP_ADD:
+                overflowed = __builtin_add_overflow(AS_INT(a), AS_INT(b), &intResult);
+                break;
+            case OP_SUBTRACT:
+                overflowed = __builtin_sub_overflow(AS_INT(a), AS_INT(b), &intResult);
+                break;
+            case OP_MULTIPLY:
+                overflowed = intMultiplyOverflows(AS_INT(a), AS_INT(b), &intResult);
+                break;
+            case OP_LESS:
+                *result = BOOL_VAL(AS_INT(a) < AS_INT(b));
+                return true;
+            case OP_GREATER:
+                *result = BOOL_VAL(AS_INT(a) > AS_INT(b));
+                return true;
+            default:
+                break;
+        }
+        if (!overflowed) {
+            *result = INT_VAL(intResult);
+            return true;
+        }
+    }
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        default:
+            return false;
+    }
+}
+
 static void unary(Parser* parser, UNUSED bool canAssign) {
     TokenType operator = parser->previous.type;
+    uint32_t start = currentChunk(parser)->count;
+    uint32_t constantsStart = currentChunk(parser)->constants.count;
     parsePrecedence(parser, PREC_UNARY);
 
+    Value operand;
+    if (constantAt(parser, start, currentChunk(parser)->count, &operand)) {
+        if (operator == TOKEN_NOT) {
+            replaceWithConstant(parser, start, constantsStart, BOOL_VAL(isFalsey(operand)));
+            return;
+        }
+        if (operator == TOKEN_MINUS && IS_NUMBER(operand)) {
+            Value negated = IS_INT(operand) && !intNegateOverflows(AS_INT(operand))
+                            ? INT_VAL(-AS_INT(operand))
+                            : NUMBER_VAL(-AS_NUMBER(operand));
+            replaceWithConstant(parser, start, constantsStart, negated);
+            return;
+        }
+    }
+
     switch (operator) {
         case TOKEN_MINUS:
             emitByte(parser, OP_NEGATE);
@@ -676,47 +957,85 @@ static void unary(Parser* parser, UNUSED bool canAssign) {
     }
 }
 
-static void binary(Parser* parser, UNUSED bool canAssign) {
-    TokenType operator = parser->previous.type;
-    ParseRule* rule = getRule(operator);
-    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
-
+// the equivalent instruction(s) for each binary operator, with an optional trailing OP_NOT
+static OpCode binaryOp(TokenType operator, bool* negate) {
+    *negate = false;
     switch (operator) {
         case TOKEN_PLUS:
-            emitByte(parser, OP_ADD);
-            break;
+            return OP_ADD;
         case TOKEN_MINUS:
-            emitByte(parser, OP_SUBTRACT);
-            break;
+            return OP_SUBTRACT;
         case TOKEN_ASTERISK:
-            emitByte(parser, OP_MULTIPLY);
-            break;
+            return OP_MULTIPLY;
         case TOKEN_SLASH:
-            emitByte(parser, OP_DIVIDE);
-            break;
+            return OP_DIVIDE;
         case TOKEN_NOT_EQUAL:
-            emitBytes(parser, OP_EQUAL, OP_NOT);
-            break;
+            *negate = true;
+            return OP_EQUAL;
         case TOKEN_DOUBLE_EQUAL:
-            emitByte(parser, OP_EQUAL);
-            break;
+            return OP_EQUAL;
         case TOKEN_GREATER_THAN:
-            emitByte(parser, OP_GREATER);
-            break;
+            return OP_GREATER;
         case TOKEN_GREATER_THAN_EQUAL:
-            emitBytes(parser, OP_LESS, OP_NOT);
-            break;
+            *negate = true;
+            return OP_LESS;
         case TOKEN_LESS_THAN:
-            emitByte(parser, OP_LESS);
-            break;
+            return OP_LESS;
         case TOKEN_LESS_THAN_EQUAL:
-            emitBytes(parser, OP_GREATER, OP_NOT);
-            break;
+            *negate = true;
+            return OP_GREATER;
         default:
-            return;
+            assert(!"Not a binary operator");
+            return OP_RETURN;
     }
 }
 
+static bool foldBinary(Parser* parser, TokenType operator, uint32_t start, uint32_t rightStart,
+                       uint32_t constantsStart) {
+    Value a, b;
+    if (!constantAt(parser, start, rightStart, &a) || !constantAt(parser, rightStart, currentChunk(parser)->count, &b)) {
+        return false;
+    }
+
+    bool negate;
+    OpCode op = binaryOp(operator, &negate);
+    Value result;
+    if (op == OP_EQUAL) {
+        result = BOOL_VAL(valuesEqual(a, b));
+    } else if (!foldArithmetic(parser, op, a, b, &result)) {
+        return false;
+    }
+    if (negate) result = BOOL_VAL(isFalsey(result));
+
+    replaceWithConstant(parser, start, constantsStart, result);
+    return true;
+}
+
+static void binary(Parser* parser, UNUSED bool canAssign) {
+    TokenType operator = parser->previous.type;
+    uint32_t start = parser->compiler->operandStart;
+    uint32_t constantsStart = parser->compiler->operandConstants;
+    uint32_t rightStart = currentChunk(parser)->count;
+    const ParseRule* rule = getRule(operator);
+    parsePrecedence(parser, (Precedence) (rule->precedence + 1));
+
+    if (foldBinary(parser, operator, start, rightStart, constantsStart)) return;
+
+    bool negate;
+    OpCode op = binaryOp(operator, &negate);
+    uint8_t a, b;
+    if (registerOperand(parser, start, rightStart, &a) &&
+        registerOperand(parser, rightStart, currentChunk(parser)->count, &b)) {
+        // both operands are read straight from the frame or the constants instead of being pushed first
+        truncateChunk(currentChunk(parser), start);
+        emitBytes(parser, registerOp(op), a);
+        emitByte(parser, b);
+    } else {
+        emitByte(parser, op);
+    }
+    if (negate) emitByte(parser, OP_NOT);
+}
+
 static void literal(Parser* parser, UNUSED bool canAssign) {
     switch (parser->previous.type) {
         case TOKEN_NIL:
@@ -806,7 +1125,12 @@ static void namedVariable(Parser* parser, Token name, UNUSED bool canAssign) {
         setOpLong = OP_SET_GLOBAL_LONG;
     }
     if (canAssign && match(parser, TOKEN_EQUAL)) {
+        uint32_t value = currentChunk(parser)->count;
         expression(parser);
+        if (setOp == OP_SET_LOCAL) {
+            parser->compiler->lastAssignment = currentChunk(parser)->count;
+            parser->compiler->assignedValue = value;
+        }
         emitVariableWidth(parser, setOp, setOpLong, argument);
     } else {
         emitVariableWidth(parser, getOp, getOpLong, argument);
@@ -845,6 +1169,7 @@ static void dot(Parser* parser, bool canAssign) {
     } else if (match(parser, TOKEN_LEFT_PAREN)) {
         // optimise for immediate method calls i.e. bytecode can be substantially simplified for accessing a method property and invoking it immediately, rather than assigning the property to a variable then invoking that
         uint8_t argumentCount = argumentList(parser);
+        parser->compiler->lastCall = currentChunk(parser)->count;
         emitBytes(parser, OP_INVOKE, name);
         emitByte(parser, argumentCount);
     } else {
@@ -875,6 +1200,7 @@ static void super(Parser* parser, UNUSED bool canAssign) {
     if (match(parser, TOKEN_LEFT_PAREN)) {
         uint8_t argumentCount = argumentList(parser);
         namedVariable(parser, syntheticToken("super"), false);
+        parser->compiler->lastCall = currentChunk(parser)->count;
         emitBytes(parser, OP_SUPER_INVOKE, name);
         emitByte(parser, argumentCount);
     } else {
@@ -883,7 +1209,7 @@ static void super(Parser* parser, UNUSED bool canAssign) {
     }
 }
 
-ParseRule rules[] = {
+static const ParseRule rules[] = {
         [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
         [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
@@ -926,18 +1252,26 @@ ParseRule rules[] = {
         [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-static ParseRule* getRule(TokenType type) {
+static const ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
 static ObjFunction* endCompiler(Parser* parser) {
     emitReturn(parser);
     ObjFunction* function = parser->compiler->function;
+#ifdef PEEPHOLE_OPTIMISATION
+    if (!parser->hadError) {
+        optimiseChunk(parser->vm, parser->compiler, currentChunk(parser));
+    }
+#endif
+    if (!parser->hadError) {
+        encodeChunk(parser->vm, parser->compiler, currentChunk(parser));
+    }
 
     freeLocalArray(parser->vm, &parser->compiler->localArray);
 #ifdef DEBUG_PRINT_CODE
     if (!parser->hadError) {
-        disassembleChunk(currentChunk(parser), function->name ? function->name->chars : "<script>");
+        disassembleChunk(currentChunk(parser), function->name ? STRING_CHARS(FROM_HEAP_REF(ObjString, function->name)) : "<script>");
     }
 #endif
 
@@ -950,13 +1284,18 @@ static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type)
     initLocalArray(&compiler->localArray);
     compiler->scopeDepth = 0;
     compiler->type = type;
+    for (uint32_t i = 0; i < CONSTANT_CACHE_SIZE; i++) {
+        compiler->constantCache[i] = UINT32_MAX;
+    }
+    compiler->lastCall = UINT32_MAX;
+    compiler->lastAssignment = UINT32_MAX;
     compiler->function = NULL;
     compiler->function = newFunction(parser->vm, parser->compiler);
 
     parser->compiler = compiler;
     if (type != TYPE_SCRIPT) {
-        compiler->function->name = copyString(parser->vm, parser->compiler, parser->previous.start,
-                                              parser->previous.length);
+        compiler->function->name = TO_HEAP_REF(copyString(parser->vm, parser->compiler, parser->previous.start,
+                                                          parser->previous.length));
     }
 
     Local local = {
@@ -975,6 +1314,7 @@ static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type)
 }
 
 ObjFunction* compile(VM* vm, const char* source) {
+    ENTER_HEAP(vm);
     Scanner scanner;
     initScanner(&scanner, source);
 
@@ -994,6 +1334,7 @@ ObjFunction* compile(VM* vm, const char* source) {
     while (!match(&parser, TOKEN_EOF)) declaration(&parser);
     ObjFunction* function = endCompiler(&parser);
 
+    LEAVE_HEAP();
     return parser.hadError ? NULL : function;
 }
 
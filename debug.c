@@ -6,176 +6,260 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
     for (uint32_t offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(printf, chunk, offset);
     }
 }
 
-static uint32_t simpleInstruction(const char* name, uint32_t offset) {
-    printf("%s\n", name);
+static uint32_t simpleInstruction(Printer* print, const char* name, uint32_t offset) {
+    print("%s\n", name);
     return offset + 1;
 }
 
-static uint32_t constantInstruction(const char* name, Chunk* chunk, uint32_t offset) {
+static uint32_t constantInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    printValue(printf, chunk->constants.values[constant]);
-    printf("'\n");
+    print("%-16s %4d '", name, constant);
+    printValue(print, chunk->constants.values[constant]);
+    print("'\n");
 
     return offset + 2;
 }
 
-static uint32_t longConstantInstruction(const char* name, Chunk* chunk, uint32_t offset) {
+static uint32_t longConstantInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
     uint32_t constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
-    printf("%-16s %4d '", name, constant);
-    printValue(printf, chunk->constants.values[constant]);
-    printf("'\n");
+    print("%-16s %4d '", name, constant);
+    printValue(print, chunk->constants.values[constant]);
+    print("'\n");
 
     return offset + 4;
 }
 
-static uint32_t byteInstruction(const char* name, Chunk* chunk, uint32_t offset) {
+static uint32_t byteInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
     uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    print("%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
-static uint32_t longInstruction(const char* name, Chunk* chunk, uint32_t offset) {
+static uint32_t longInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
     uint32_t slot = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
-    printf("%-16s %4d\n", name, slot);
+    print("%-16s %4d\n", name, slot);
     return offset + 4;
 }
 
-static uint32_t jumpInstruction(const char* name, Chunk* chunk, int32_t sign, uint32_t offset) {
+static uint32_t jumpInstruction(Printer* print, const char* name, Chunk* chunk, int32_t sign, uint32_t offset) {
     uint16_t jump = (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2]);
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    print("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
-static uint32_t invokeInstruction(const char* name, Chunk* chunk, uint32_t offset) {
+static uint32_t invokeInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argumentCount = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argumentCount, constant);
-    printValue(printf, chunk->constants.values[constant]);
-    printf("'\n");
+    print("%-16s (%d args) %4d '", name, argumentCount, constant);
+    printValue(print, chunk->constants.values[constant]);
+    print("'\n");
     return offset + 3;
 }
 
-uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset) {
-    printf("%04d ", offset);
+static void registerOperand(Printer* print, Chunk* chunk, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        print(" k%d '", operand & ~RK_CONSTANT);
+        printValue(print, chunk->constants.values[operand & ~RK_CONSTANT]);
+        print("'");
+    } else {
+        print(" r%d", operand);
+    }
+}
+
+// the operands read, then the slot written (if any)
+static uint32_t registerInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t offset) {
+    uint8_t op = chunk->code[offset];
+    uint32_t length = instructionLength(chunk, offset);
+    print("%-16s", name);
+    registerOperand(print, chunk, chunk->code[offset + 1]);
+    if (op != OP_MOVE) registerOperand(print, chunk, chunk->code[offset + 2]);
+    if (op == OP_MOVE || isRegisterStore(op)) print(" -> r%d", chunk->code[offset + length - 1]);
+    print("\n");
+    return offset + length;
+}
+
+// the constants (a closure, optionally preceded by a method name) come before the jump
+static uint32_t guardInstruction(Printer* print, const char* name, Chunk* chunk, uint32_t constantCount,
+                                 uint32_t offset) {
+    print("%-16s", name);
+    for (uint32_t i = 0; i < constantCount; i++) {
+        uint8_t constant = chunk->code[offset + 1 + i];
+        print(" %4d '", constant);
+        printValue(print, chunk->constants.values[constant]);
+        print("'");
+    }
+    uint32_t next = offset + 3 + constantCount;
+    uint16_t jump = (chunk->code[next - 2] << 8) | (chunk->code[next - 1]);
+    print(" -> %d\n", next + jump);
+    return next;
+}
+
+uint32_t disassembleInstruction(Printer* print, Chunk* chunk, uint32_t offset) {
+    print("%04d ", offset);
     if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
-        printf("   | ");
+        print("   | ");
     } else {
-        printf("%4d ", getLine(chunk, offset));
+        print("%4d ", getLine(chunk, offset));
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction(print, "OP_CONSTANT", chunk, offset);
         case OP_CONSTANT_LONG:
-            return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+            return longConstantInstruction(print, "OP_CONSTANT_LONG", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return constantInstruction(print, "OP_DEFINE_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL_LONG:
-            return longConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+            return longConstantInstruction(print, "OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return constantInstruction(print, "OP_GET_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL_LONG:
-            return longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+            return longConstantInstruction(print, "OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return constantInstruction(print, "OP_SET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL_LONG:
-            return longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+            return longConstantInstruction(print, "OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_GET_LOCAL:
-            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+            return byteInstruction(print, "OP_GET_LOCAL", chunk, offset);
         case OP_GET_LOCAL_LONG:
-            return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+            return longInstruction(print, "OP_GET_LOCAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
-            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+            return byteInstruction(print, "OP_SET_LOCAL", chunk, offset);
         case OP_SET_LOCAL_LONG:
-            return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+            return longInstruction(print, "OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction(print, "OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_LOCAL_POP_LONG:
+            return longInstruction(print, "OP_SET_LOCAL_POP_LONG", chunk, offset);
         case OP_ADD:
-            return simpleInstruction("OP_ADD", offset);
+            return simpleInstruction(print, "OP_ADD", offset);
         case OP_SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
+            return simpleInstruction(print, "OP_SUBTRACT", offset);
         case OP_MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
+            return simpleInstruction(print, "OP_MULTIPLY", offset);
         case OP_DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
+            return simpleInstruction(print, "OP_DIVIDE", offset);
         case OP_RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction(print, "OP_RETURN", offset);
         case OP_NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
+            return simpleInstruction(print, "OP_NEGATE", offset);
         case OP_NIL:
-            return simpleInstruction("OP_NIL", offset);
+            return simpleInstruction(print, "OP_NIL", offset);
         case OP_TRUE:
-            return simpleInstruction("OP_TRUE", offset);
+            return simpleInstruction(print, "OP_TRUE", offset);
         case OP_FALSE:
-            return simpleInstruction("OP_FALSE", offset);
+            return simpleInstruction(print, "OP_FALSE", offset);
         case OP_EQUAL:
-            return simpleInstruction("OP_EQUAL", offset);
+            return simpleInstruction(print, "OP_EQUAL", offset);
         case OP_GREATER:
-            return simpleInstruction("OP_GREATER", offset);
+            return simpleInstruction(print, "OP_GREATER", offset);
         case OP_LESS:
-            return simpleInstruction("OP_LESS", offset);
+            return simpleInstruction(print, "OP_LESS", offset);
         case OP_NOT:
-            return simpleInstruction("OP_NOT", offset);
+            return simpleInstruction(print, "OP_NOT", offset);
         case OP_PRINT:
-            return simpleInstruction("OP_PRINT", offset);
+            return simpleInstruction(print, "OP_PRINT", offset);
         case OP_POP:
-            return simpleInstruction("OP_POP", offset);
+            return simpleInstruction(print, "OP_POP", offset);
         case OP_JUMP_IF_FALSE:
-            return jumpInstruction("OP_JUMP_IF_FALSE", chunk, 1, offset);
+            return jumpInstruction(print, "OP_JUMP_IF_FALSE", chunk, 1, offset);
+        case OP_JUMP_IF_TRUE:
+            return jumpInstruction(print, "OP_JUMP_IF_TRUE", chunk, 1, offset);
         case OP_JUMP:
-            return jumpInstruction("OP_JUMP", chunk, 1, offset);
+            return jumpInstruction(print, "OP_JUMP", chunk, 1, offset);
         case OP_LOOP:
-            return jumpInstruction("OP_LOOP", chunk, -1, offset);
+            return jumpInstruction(print, "OP_LOOP", chunk, -1, offset);
         case OP_CALL:
-            return byteInstruction("OP_CALL", chunk, offset);
+            return byteInstruction(print, "OP_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(printf, chunk->constants.values[constant]);
-            printf("\n");
+            print("%-16s %4d ", "OP_CLOSURE", constant);
+            printValue(print, chunk->constants.values[constant]);
+            print("\n");
 
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
             for (uint32_t i = 0; i < function->upvalueCount; i++) {
                 uint32_t isLocal = chunk->code[offset++];
                 uint32_t index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                print("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
             }
 
             return offset;
         }
         case OP_GET_UPVALUE:
-            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+            return byteInstruction(print, "OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
-            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+            return byteInstruction(print, "OP_SET_UPVALUE", chunk, offset);
         case OP_GET_UPVALUE_LONG:
-            return longInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+            return longInstruction(print, "OP_GET_UPVALUE_LONG", chunk, offset);
         case OP_SET_UPVALUE_LONG:
-            return longInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+            return longInstruction(print, "OP_SET_UPVALUE_LONG", chunk, offset);
         case OP_CLOSE_UPVALUE:
-            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+            return simpleInstruction(print, "OP_CLOSE_UPVALUE", offset);
         case OP_CLASS:
-            return constantInstruction("OP_CLASS", chunk, offset);
+            return constantInstruction(print, "OP_CLASS", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return constantInstruction(print, "OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return constantInstruction(print, "OP_SET_PROPERTY", chunk, offset);
         case OP_METHOD:
-            return constantInstruction("OP_METHOD", chunk, offset);
+            return constantInstruction(print, "OP_METHOD", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeInstruction(print, "OP_INVOKE", chunk, offset);
         case OP_INHERIT:
-            return simpleInstruction("OP_INHERIT", offset);
+            return simpleInstruction(print, "OP_INHERIT", offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return constantInstruction(print, "OP_GET_SUPER", chunk, offset);
         case OP_SUPER_INVOKE:
-            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+            return invokeInstruction(print, "OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction(print, "OP_TAIL_CALL", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction(print, "OP_TAIL_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE:
+            return invokeInstruction(print, "OP_TAIL_SUPER_INVOKE", chunk, offset);
+        case OP_JUMP_IF_CALLEE:
+            return guardInstruction(print, "OP_JUMP_IF_CALLEE", chunk, 1, offset);
+        case OP_JUMP_IF_INVOKES:
+            return guardInstruction(print, "OP_JUMP_IF_INVOKES", chunk, 2, offset);
+        case OP_EQUAL_RK:
+            return registerInstruction(print, "OP_EQUAL_RK", chunk, offset);
+        case OP_GREATER_RK:
+            return registerInstruction(print, "OP_GREATER_RK", chunk, offset);
+        case OP_LESS_RK:
+            return registerInstruction(print, "OP_LESS_RK", chunk, offset);
+        case OP_ADD_RK:
+            return registerInstruction(print, "OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerInstruction(print, "OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerInstruction(print, "OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerInstruction(print, "OP_DIVIDE_RK", chunk, offset);
+        case OP_EQUAL_RK_STORE:
+            return registerInstruction(print, "OP_EQUAL_RK_STORE", chunk, offset);
+        case OP_GREATER_RK_STORE:
+            return registerInstruction(print, "OP_GREATER_RK_STORE", chunk, offset);
+        case OP_LESS_RK_STORE:
+            return registerInstruction(print, "OP_LESS_RK_STORE", chunk, offset);
+        case OP_ADD_RK_STORE:
+            return registerInstruction(print, "OP_ADD_RK_STORE", chunk, offset);
+        case OP_SUBTRACT_RK_STORE:
+            return registerInstruction(print, "OP_SUBTRACT_RK_STORE", chunk, offset);
+        case OP_MULTIPLY_RK_STORE:
+            return registerInstruction(print, "OP_MULTIPLY_RK_STORE", chunk, offset);
+        case OP_DIVIDE_RK_STORE:
+            return registerInstruction(print, "OP_DIVIDE_RK_STORE", chunk, offset);
+        case OP_MOVE:
+            return registerInstruction(print, "OP_MOVE", chunk, offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            print("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
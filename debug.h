@@ -4,6 +4,6 @@
 #include "chunk.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
-uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset);
+uint32_t disassembleInstruction(Printer* print, Chunk* chunk, uint32_t offset);
 
 #endif //CLOX_DEBUG_H
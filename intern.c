@@ -0,0 +1,103 @@
+#include <string.h>
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+void initInternTable(InternTable* table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+void freeInternTable(VM* vm, InternTable* table) {
+    VM_FREE_ARRAY(InternEntry, table->entries, table->capacity);
+    initInternTable(table);
+}
+
+static InternEntry* findEmpty(InternEntry* entries, uint32_t capacity, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    while (entries[index].string) {
+        index = (index + 1) & (capacity - 1);
+    }
+    return entries + index;
+}
+
+static void adjustCapacity(VM* vm, Compiler* compiler, InternTable* table, uint32_t newCapacity) {
+    InternEntry* entries = COMPILER_ALLOCATE(InternEntry, newCapacity);
+    memset(entries, 0, sizeof(InternEntry) * newCapacity);
+
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        InternEntry* entry = table->entries + i;
+        if (!entry->string) continue;
+        *findEmpty(entries, newCapacity, entry->hash) = *entry;
+    }
+
+    VM_FREE_ARRAY(InternEntry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = newCapacity;
+}
+
+ObjString* internTableFind(InternTable* table, const char* chars, uint32_t length, uint32_t hash) {
+    if (!table->count) return NULL;
+
+    uint32_t index = hash & (table->capacity - 1);
+    for (;;) {
+        InternEntry* entry = table->entries + index;
+        if (!entry->string) return NULL;
+        if (entry->hash == hash && entry->length == length && memcmp(STRING_CHARS(entry->string), chars, length) == 0) {
+            return entry->string;
+        }
+
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+void internTableAdd(VM* vm, Compiler* compiler, InternTable* table, ObjString* string) {
+    if (table->count + 1 > table->capacity * INTERN_TABLE_MAX_LOAD) {
+        adjustCapacity(vm, compiler, table, GROW_CAPACITY(table->capacity));
+    }
+
+    InternEntry* entry = findEmpty(table->entries, table->capacity, string->hash);
+    entry->string = string;
+    entry->hash = string->hash;
+    entry->length = string->length;
+    table->count++;
+}
+
+void internTableRemoveWhite(VM* vm, InternTable* table) {
+    if (!table->count) return;
+
+    // removing entries can break probe sequences, so survivors are re-settled as the dead are cleared. Walking forwards
+    // from a slot which was already empty means no probe sequence wraps past the start, so everything between a
+    // survivor's home slot and its current slot has already been settled: it can only move backwards into a gap (or
+    // stay put) - no allocation, and no tombstones left behind. Starting from a slot emptied by this pass instead
+    // would let a survivor whose chain wraps past it settle ahead of entries which are yet to move
+    uint32_t mask = table->capacity - 1;
+    uint32_t start = 0;
+    while (table->entries[start].string) {
+        start = (start + 1) & mask;
+    }
+
+    uint32_t removed = 0;
+    for (uint32_t step = 1; step <= table->capacity; step++) {
+        uint32_t index = (start + step) & mask;
+        InternEntry* entry = table->entries + index;
+        if (!entry->string) continue;
+
+        if (!IS_MARKED(vm->freeList, &entry->string->obj)) {
+            entry->string = NULL;
+            removed++;
+            continue;
+        }
+        // entries which stay put aren't written, so collecting without removing anything leaves the table untouched
+        uint32_t target = entry->hash & mask;
+        while (target != index && table->entries[target].string) {
+            target = (target + 1) & mask;
+        }
+        if (target != index) {
+            table->entries[target] = *entry;
+            entry->string = NULL;
+        }
+    }
+    table->count -= removed;
+}
@@ -0,0 +1,30 @@
+#ifndef CLOX_INTERN_H
+#define CLOX_INTERN_H
+
+#include "value.h"
+
+#define INTERN_TABLE_MAX_LOAD 0.75
+
+// the hash & length are duplicated from the string so probing only touches the entry array; the string itself is only
+// dereferenced for the final memcmp
+typedef struct {
+    ObjString* string;
+    uint32_t hash;
+    uint32_t length;
+} InternEntry;
+
+// strings are only ever removed in bulk by the GC, which compacts the table in place, so (unlike `Table`) there are no
+// tombstones and an empty slot always terminates a probe
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    InternEntry* entries;
+} InternTable;
+
+void initInternTable(InternTable* table);
+void freeInternTable(VM* vm, InternTable* table);
+ObjString* internTableFind(InternTable* table, const char* chars, uint32_t length, uint32_t hash);
+void internTableAdd(VM* vm, Compiler* compiler, InternTable* table, ObjString* string);
+void internTableRemoveWhite(VM* vm, InternTable* table);
+
+#endif //CLOX_INTERN_H
@@ -0,0 +1,759 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "isolate.h"
+#include "memory.h"
+
+#ifdef ISOLATES
+
+// values copied out of the sender's heap, to be rebuilt in the receiver's; like everything else here, it's outside
+// every heap, from the system allocator
+typedef struct Message {
+    struct Message* next;
+    uint8_t* bytes;
+    size_t size;
+    // how many objects the receiver will make, all kept on its stack (so reachable) until they're finished
+    uint32_t objectCount;
+    // a reference to each channel in the message, which the receiver's channel objects take over
+    Channel** channels;
+    uint32_t channelCount;
+} Message;
+
+struct Channel {
+    pthread_mutex_t lock;
+    // signalled when a message is sent (or the channel's closed), and when one's received
+    pthread_cond_t sent;
+    pthread_cond_t received;
+    Message* first;
+    Message* last;
+    uint32_t count;
+    uint32_t capacity;
+    bool closed;
+    // from channel objects in any VM, messages, and isolates still to send their result
+    uint32_t references;
+};
+
+// each object's written as its type followed by its contents, or as one of these
+typedef enum {
+    // anything that isn't an object, as the bits of the value itself
+    MESSAGE_IMMEDIATE = 0xfd,
+    // an object that's already been written, by the order they were first reached in
+    MESSAGE_REFERENCE = 0xfe,
+    // a missing reference, e.g. the script's name
+    MESSAGE_NULL = 0xff,
+} MessageTag;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    // an open addressed set of the objects written so far, with their numbers
+    Obj** seen;
+    uint32_t* seenIndices;
+    uint32_t seenCapacity;
+    uint32_t objectCount;
+    Channel** channels;
+    uint32_t channelCount;
+    uint32_t channelCapacity;
+} Writer;
+
+typedef struct {
+    VM* vm;
+    const uint8_t* bytes;
+    size_t position;
+    // by number, as they're made
+    Obj** objects;
+    uint32_t objectCount;
+} Reader;
+
+typedef struct {
+    Message* message;
+    Channel* result;
+    size_t heapSize;
+    Printer* print;
+} Isolate;
+
+static Channel* createChannel(uint32_t capacity) {
+    Channel* channel = malloc(sizeof(Channel));
+    assert(channel);
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->sent, NULL);
+    pthread_cond_init(&channel->received, NULL);
+    channel->first = NULL;
+    channel->last = NULL;
+    channel->count = 0;
+    channel->capacity = capacity;
+    channel->closed = false;
+    channel->references = 1;
+    return channel;
+}
+
+static void retainChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->references++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+// a message that's delivered has handed its references over to the receiver's channel objects
+static void freeMessage(Message* message, bool delivered) {
+    if (!delivered) {
+        for (uint32_t i = 0; i < message->channelCount; i++) {
+            releaseChannel(message->channels[i]);
+        }
+    }
+    free(message->channels);
+    free(message->bytes);
+    free(message);
+}
+
+void releaseChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    bool last = --channel->references == 0;
+    pthread_mutex_unlock(&channel->lock);
+    if (!last) return;
+
+    // a message can refer to the channel it's queued on, which keeps the channel alive even once nothing else can
+    // reach it
+    for (Message* message = channel->first; message;) {
+        Message* next = message->next;
+        freeMessage(message, false);
+        message = next;
+    }
+    pthread_cond_destroy(&channel->received);
+    pthread_cond_destroy(&channel->sent);
+    pthread_mutex_destroy(&channel->lock);
+    free(channel);
+}
+
+// waits while the channel's full; false (leaving the message with the caller) if it's closed
+static bool sendMessage(Channel* channel, Message* message) {
+    pthread_mutex_lock(&channel->lock);
+    while (!channel->closed && channel->count >= channel->capacity) {
+        pthread_cond_wait(&channel->received, &channel->lock);
+    }
+    if (channel->closed) {
+        pthread_mutex_unlock(&channel->lock);
+        return false;
+    }
+
+    message->next = NULL;
+    if (channel->last) {
+        channel->last->next = message;
+    } else {
+        channel->first = message;
+    }
+    channel->last = message;
+    channel->count++;
+    pthread_cond_signal(&channel->sent);
+    pthread_mutex_unlock(&channel->lock);
+    return true;
+}
+
+// NULL if there's nothing to receive (once it's closed, if waiting)
+static Message* receiveMessage(Channel* channel, bool wait) {
+    pthread_mutex_lock(&channel->lock);
+    while (wait && !channel->first && !channel->closed) {
+        pthread_cond_wait(&channel->sent, &channel->lock);
+    }
+    Message* message = channel->first;
+    if (message) {
+        channel->first = message->next;
+        if (!channel->first) channel->last = NULL;
+        channel->count--;
+        pthread_cond_signal(&channel->received);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    return message;
+}
+
+static void closeChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->sent);
+    pthread_cond_broadcast(&channel->received);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+static void initWriter(Writer* writer) {
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->seen = NULL;
+    writer->seenIndices = NULL;
+    writer->seenCapacity = 0;
+    writer->objectCount = 0;
+    writer->channels = NULL;
+    writer->channelCount = 0;
+    writer->channelCapacity = 0;
+}
+
+static void writeBytes(Writer* writer, const void* bytes, size_t size) {
+    if (!size) return;
+    if (writer->capacity < writer->count + size) {
+        size_t capacity = writer->capacity ? writer->capacity : 256;
+        while (capacity < writer->count + size) {
+            capacity *= 2;
+        }
+        writer->bytes = realloc(writer->bytes, capacity);
+        assert(writer->bytes);
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->count, bytes, size);
+    writer->count += size;
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeUint(Writer* writer, uint32_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static uint32_t seenSlot(Obj** seen, uint32_t capacity, Obj* object) {
+    uint32_t slot = (uint32_t) (((uint64_t) (uintptr_t) object * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+    while (seen[slot] && seen[slot] != object) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+// numbers the object if it's new, returning false; otherwise sets its number
+static bool findSeen(Writer* writer, Obj* object, uint32_t* index) {
+    // kept at most half full
+    if (writer->seenCapacity < (writer->objectCount + 1) * 2) {
+        uint32_t capacity = writer->seenCapacity ? writer->seenCapacity * 2 : 64;
+        Obj** seen = calloc(capacity, sizeof(Obj*));
+        uint32_t* indices = malloc(sizeof(uint32_t) * capacity);
+        assert(seen && indices);
+        for (uint32_t i = 0; i < writer->seenCapacity; i++) {
+            if (!writer->seen[i]) continue;
+            uint32_t slot = seenSlot(seen, capacity, writer->seen[i]);
+            seen[slot] = writer->seen[i];
+            indices[slot] = writer->seenIndices[i];
+        }
+        free(writer->seen);
+        free(writer->seenIndices);
+        writer->seen = seen;
+        writer->seenIndices = indices;
+        writer->seenCapacity = capacity;
+    }
+
+    uint32_t slot = seenSlot(writer->seen, writer->seenCapacity, object);
+    if (writer->seen[slot]) {
+        *index = writer->seenIndices[slot];
+        return true;
+    }
+    writer->seen[slot] = object;
+    writer->seenIndices[slot] = writer->objectCount++;
+    return false;
+}
+
+static void writeObject(Writer* writer, Obj* object);
+
+static void writeValueTo(Writer* writer, Value value) {
+#ifdef COROUTINES
+    // a coroutine's stack and frames can't be rebuilt in another heap, so it's received as nil
+    if (IS_COROUTINE(value)) value = NIL_VAL;
+#endif
+    if (IS_OBJ(value)) {
+        writeObject(writer, AS_OBJ(value));
+    } else {
+        writeByte(writer, MESSAGE_IMMEDIATE);
+        writeBytes(writer, &value, sizeof(Value));
+    }
+}
+
+static void writeTable(Writer* writer, Table* table) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (!(table->control[i] & 0x80)) count++;
+    }
+    writeUint(writer, count);
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+
+        Entry* entry = table->entries + i;
+        writeObject(writer, (Obj*) FROM_HEAP_REF(ObjString, entry->key));
+        writeValueTo(writer, entry->value);
+    }
+}
+
+static void writeChunkTo(Writer* writer, Chunk* chunk) {
+    writeUint(writer, chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    writeUint(writer, chunk->lineCount);
+    writeBytes(writer, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+    writeUint(writer, chunk->inlinedCount);
+    writeBytes(writer, chunk->inlined, sizeof(InlinedRun) * chunk->inlinedCount);
+    writeUint(writer, chunk->wordCount);
+    writeBytes(writer, chunk->words, sizeof(uint32_t) * chunk->wordCount);
+    writeBytes(writer, chunk->wordOffsets, sizeof(uint32_t) * chunk->wordCount);
+    writeUint(writer, chunk->constants.count);
+    for (uint32_t i = 0; i < chunk->constants.count; i++) {
+        writeValueTo(writer, chunk->constants.values[i]);
+    }
+}
+
+// objects are numbered before anything they refer to is written, so the reader can make each one (empty) before
+// reading what it refers to, which might include the object itself
+static void writeObject(Writer* writer, Obj* object) {
+    if (!object) {
+        writeByte(writer, MESSAGE_NULL);
+        return;
+    }
+    uint32_t index;
+    if (findSeen(writer, object, &index)) {
+        writeByte(writer, MESSAGE_REFERENCE);
+        writeUint(writer, index);
+        return;
+    }
+
+    writeByte(writer, (uint8_t) object->type);
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* boundMethod = (ObjBoundMethod*) object;
+            writeValueTo(writer, boundMethod->receiver);
+            writeObject(writer, (Obj*) FROM_HEAP_REF(ObjClosure, boundMethod->method));
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* class = (ObjClass*) object;
+            writeObject(writer, (Obj*) FROM_HEAP_REF(ObjString, class->name));
+            writeTable(writer, &class->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            writeUint(writer, closure->upvalueCount);
+            writeObject(writer, (Obj*) FROM_HEAP_REF(ObjFunction, closure->function));
+            HEAP_REF(ObjUpvalue)* upvalues = FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues);
+            for (uint32_t i = 0; i < closure->upvalueCount; i++) {
+                writeObject(writer, (Obj*) FROM_HEAP_REF(ObjUpvalue, upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            // just the bytecode: machine code and traces are made again once it's hot in the receiver
+            ObjFunction* function = (ObjFunction*) object;
+            writeUint(writer, function->arity);
+            writeUint(writer, function->upvalueCount);
+            writeByte(writer, function->optimised);
+            writeChunkTo(writer, &function->chunk);
+            writeObject(writer, (Obj*) FROM_HEAP_REF(ObjString, function->name));
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            writeObject(writer, (Obj*) FROM_HEAP_REF(ObjClass, instance->class));
+            writeTable(writer, &instance->fields);
+            break;
+        }
+        case OBJ_NATIVE: {
+            ObjNative* native = (ObjNative*) object;
+            writeBytes(writer, &native->function, sizeof(NativeFn));
+            writeByte(writer, native->arity);
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            writeUint(writer, string->length);
+            writeBytes(writer, STRING_CHARS(string), string->length);
+            break;
+        }
+        case OBJ_UPVALUE:
+            // whatever the variable holds now; the receiver's copy is closed
+            writeValueTo(writer, *((ObjUpvalue*) object)->location);
+            break;
+        case OBJ_CHANNEL: {
+            Channel* channel = ((ObjChannel*) object)->channel;
+            writeBytes(writer, &channel, sizeof(Channel*));
+            retainChannel(channel);
+            if (writer->channelCapacity < writer->channelCount + 1) {
+                writer->channelCapacity = writer->channelCapacity ? writer->channelCapacity * 2 : 4;
+                writer->channels = realloc(writer->channels, sizeof(Channel*) * writer->channelCapacity);
+                assert(writer->channels);
+            }
+            writer->channels[writer->channelCount++] = channel;
+            break;
+        }
+#ifdef COROUTINES
+        case OBJ_COROUTINE:
+            assert(!"Coroutines are sent as nil");
+            break;
+#endif
+        case OBJ_NONE:
+            assert(!"Use after free");
+    }
+}
+
+static Message* finishWriting(Writer* writer) {
+    free(writer->seen);
+    free(writer->seenIndices);
+    Message* message = malloc(sizeof(Message));
+    assert(message);
+    message->next = NULL;
+    message->bytes = writer->bytes;
+    message->size = writer->count;
+    message->objectCount = writer->objectCount;
+    message->channels = writer->channels;
+    message->channelCount = writer->channelCount;
+    return message;
+}
+
+// only reads the VM's heap, so can run while other threads use theirs
+static Message* writeMessage(Value value) {
+    Writer writer;
+    initWriter(&writer);
+    writeValueTo(&writer, value);
+    return finishWriting(&writer);
+}
+
+static void startReading(Reader* reader, VM* vm, Message* message) {
+    // every object read is pushed, and the stack mustn't grow (so collect) in between
+    reserveStack(vm, vm->stack.count + message->objectCount);
+    reader->vm = vm;
+    reader->bytes = message->bytes;
+    reader->position = 0;
+    reader->objects = malloc(sizeof(Obj*) * (message->objectCount ? message->objectCount : 1));
+    assert(reader->objects);
+    reader->objectCount = 0;
+}
+
+// the objects read are still on the stack, for the caller to pop once they're reachable some other way
+static void finishReading(Reader* reader, Message* message) {
+    assert(reader->objectCount == message->objectCount && reader->position == message->size);
+    free(reader->objects);
+    freeMessage(message, true);
+}
+
+static void readBytes(Reader* reader, void* bytes, size_t size) {
+    memcpy(bytes, reader->bytes + reader->position, size);
+    reader->position += size;
+}
+
+static uint8_t readByte(Reader* reader) {
+    return reader->bytes[reader->position++];
+}
+
+static uint32_t readUint(Reader* reader) {
+    uint32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+static void remember(Reader* reader, Obj* object) {
+    reader->objects[reader->objectCount++] = object;
+    push(reader->vm, OBJ_VAL(object));
+}
+
+static Obj* readObject(Reader* reader);
+
+static Value readValueFrom(Reader* reader) {
+    if (reader->bytes[reader->position] != MESSAGE_IMMEDIATE) return OBJ_VAL(readObject(reader));
+
+    reader->position++;
+    Value value;
+    readBytes(reader, &value, sizeof(Value));
+    return value;
+}
+
+static void readTable(Reader* reader, Table* table) {
+    uint32_t count = readUint(reader);
+    for (uint32_t i = 0; i < count; i++) {
+        ObjString* key = (ObjString*) readObject(reader);
+        Value value = readValueFrom(reader);
+        tableSet(reader->vm, NULL, table, key, value);
+    }
+}
+
+// arrays the chunk owns, which are left empty rather than allocated when there's nothing in them
+#define READ_ARRAY(type, count) readArray(reader, sizeof(type), count)
+
+static void* readArray(Reader* reader, size_t size, uint32_t count) {
+    if (!count) return NULL;
+    VM* vm = reader->vm;
+    uint8_t* array = VM_ALLOCATE(uint8_t, size * count);
+    readBytes(reader, array, size * count);
+    return array;
+}
+
+static void readChunk(Reader* reader, Chunk* chunk) {
+    // each array's only attached once it's filled, as reading the next one can collect
+    uint32_t count = readUint(reader);
+    uint8_t* code = READ_ARRAY(uint8_t, count);
+    chunk->code = code;
+    chunk->count = chunk->capacity = count;
+    count = readUint(reader);
+    LineRun* lines = READ_ARRAY(LineRun, count);
+    chunk->lines = lines;
+    chunk->lineCount = chunk->lineCapacity = count;
+    count = readUint(reader);
+    InlinedRun* inlined = READ_ARRAY(InlinedRun, count);
+    chunk->inlined = inlined;
+    chunk->inlinedCount = chunk->inlinedCapacity = count;
+    count = readUint(reader);
+    uint32_t* words = READ_ARRAY(uint32_t, count);
+    uint32_t* wordOffsets = READ_ARRAY(uint32_t, count);
+    chunk->words = words;
+    chunk->wordOffsets = wordOffsets;
+    chunk->wordCount = count;
+    count = readUint(reader);
+    for (uint32_t i = 0; i < count; i++) {
+        writeValue(reader->vm, NULL, &chunk->constants, readValueFrom(reader));
+    }
+}
+
+#undef READ_ARRAY
+
+static Obj* readObject(Reader* reader) {
+    VM* vm = reader->vm;
+    uint8_t tag = readByte(reader);
+    switch (tag) {
+        case MESSAGE_NULL:
+            return NULL;
+        case MESSAGE_REFERENCE:
+            return reader->objects[readUint(reader)];
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* boundMethod = newBoundMethod(vm, NULL, NIL_VAL, NULL);
+            remember(reader, (Obj*) boundMethod);
+            boundMethod->receiver = readValueFrom(reader);
+            boundMethod->method = TO_HEAP_REF((ObjClosure*) readObject(reader));
+            return (Obj*) boundMethod;
+        }
+        case OBJ_CLASS: {
+            ObjClass* class = newClass(vm, NULL, NULL);
+            remember(reader, (Obj*) class);
+            class->name = TO_HEAP_REF((ObjString*) readObject(reader));
+            readTable(reader, &class->methods);
+            return (Obj*) class;
+        }
+        case OBJ_CLOSURE: {
+            // made before its function, which only has to say how many upvalues there are
+            ObjFunction shape = {.upvalueCount = readUint(reader)};
+            ObjClosure* closure = newClosure(vm, NULL, &shape);
+            closure->function = TO_HEAP_REF(NULL);
+            remember(reader, (Obj*) closure);
+            closure->function = TO_HEAP_REF((ObjFunction*) readObject(reader));
+            HEAP_REF(ObjUpvalue)* upvalues = FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues);
+            for (uint32_t i = 0; i < closure->upvalueCount; i++) {
+                upvalues[i] = TO_HEAP_REF((ObjUpvalue*) readObject(reader));
+            }
+            return (Obj*) closure;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = newFunction(vm, NULL);
+            remember(reader, (Obj*) function);
+            function->arity = (uint8_t) readUint(reader);
+            function->upvalueCount = readUint(reader);
+            function->optimised = readByte(reader);
+            readChunk(reader, &function->chunk);
+            function->name = TO_HEAP_REF((ObjString*) readObject(reader));
+            return (Obj*) function;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = newInstance(vm, NULL, NULL);
+            remember(reader, (Obj*) instance);
+            instance->class = TO_HEAP_REF((ObjClass*) readObject(reader));
+            readTable(reader, &instance->fields);
+            return (Obj*) instance;
+        }
+        case OBJ_NATIVE: {
+            NativeFn function;
+            readBytes(reader, &function, sizeof(NativeFn));
+            ObjNative* native = newNative(vm, NULL, function, readByte(reader));
+            remember(reader, (Obj*) native);
+            return (Obj*) native;
+        }
+        case OBJ_STRING: {
+            uint32_t length = readUint(reader);
+            ObjString* string = copyString(vm, NULL, (const char*) reader->bytes + reader->position, length);
+            reader->position += length;
+            remember(reader, (Obj*) string);
+            return (Obj*) string;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = newUpvalue(vm, NULL, NULL);
+            upvalue->location = &upvalue->closed;
+            remember(reader, (Obj*) upvalue);
+            upvalue->closed = readValueFrom(reader);
+            return (Obj*) upvalue;
+        }
+        case OBJ_CHANNEL: {
+            Channel* channel;
+            readBytes(reader, &channel, sizeof(Channel*));
+            ObjChannel* object = newChannel(vm, NULL, channel);
+            remember(reader, (Obj*) object);
+            return (Obj*) object;
+        }
+        default:
+            assert(!"Unknown message tag");
+            return NULL;
+    }
+}
+
+// the message's value, rebuilt in the VM's heap; frees the message
+static Value readMessage(VM* vm, Message* message) {
+    uint32_t base = vm->stack.count;
+    Reader reader;
+    startReading(&reader, vm, message);
+    Value value = readValueFrom(&reader);
+    finishReading(&reader, message);
+    // nothing's allocated between here and the native returning it
+    vm->stack.count = base;
+    return value;
+}
+
+static void* runIsolate(void* argument) {
+    Isolate* isolate = argument;
+    // on the isolate's own thread, which compressed references need
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, isolate->heapSize);
+    initVM(&freeList, &vm);
+    vm.print = isolate->print;
+
+    Reader reader;
+    startReading(&reader, &vm, isolate->message);
+    uint32_t globalCount = readUint(&reader);
+    for (uint32_t i = 0; i < globalCount; i++) {
+        ObjString* name = (ObjString*) readObject(&reader);
+        Value value = readValueFrom(&reader);
+        tableSet(&vm, NULL, &vm.globals, name, value);
+    }
+    Value function = readValueFrom(&reader);
+    Value parameter = readValueFrom(&reader);
+    finishReading(&reader, isolate->message);
+
+    // the objects read stay on the stack (under the call) until it returns
+    Value result;
+    if (callFunction(&vm, function, &parameter, 1, &result) == INTERPRET_OK) {
+        Message* message = writeMessage(result);
+        if (!sendMessage(isolate->result, message)) freeMessage(message, false);
+    }
+    closeChannel(isolate->result);
+    releaseChannel(isolate->result);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    free(isolate);
+    return NULL;
+}
+
+static Channel* channelArgument(VM* vm, Value value) {
+    if (!IS_CHANNEL(value)) {
+        runtimeError(vm, "Expected a channel.");
+        return NULL;
+    }
+    return AS_CHANNEL(value)->channel;
+}
+
+static bool spawnNative(VM* vm, Value* out, Value* args) {
+    Writer writer;
+    initWriter(&writer);
+    // the new VM has natives of its own
+    uint32_t globalCount = 0;
+    Table* globals = &vm->globals;
+    for (uint32_t i = 0; i < globals->capacity; i++) {
+        if (!(globals->control[i] & 0x80) && !IS_NATIVE(globals->entries[i].value)) globalCount++;
+    }
+    writeUint(&writer, globalCount);
+    for (uint32_t i = 0; i < globals->capacity; i++) {
+        if ((globals->control[i] & 0x80) || IS_NATIVE(globals->entries[i].value)) continue;
+
+        Entry* entry = globals->entries + i;
+        writeObject(&writer, (Obj*) FROM_HEAP_REF(ObjString, entry->key));
+        writeValueTo(&writer, entry->value);
+    }
+    writeValueTo(&writer, args[0]);
+    writeValueTo(&writer, args[1]);
+
+    // one reference for the isolate, and one for the channel object returned
+    Channel* result = createChannel(1);
+    retainChannel(result);
+    Isolate* isolate = malloc(sizeof(Isolate));
+    assert(isolate);
+    isolate->message = finishWriting(&writer);
+    isolate->result = result;
+    isolate->heapSize = vm->freeList->size_;
+    isolate->print = vm->print;
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    bool started = pthread_create(&thread, &attributes, runIsolate, isolate) == 0;
+    pthread_attr_destroy(&attributes);
+    if (!started) {
+        freeMessage(isolate->message, false);
+        free(isolate);
+        releaseChannel(result);
+        releaseChannel(result);
+        runtimeError(vm, "Couldn't start an isolate.");
+        return false;
+    }
+
+    // the isolate may already have finished (and freed `isolate`)
+    *out = OBJ_VAL(newChannel(vm, NULL, result));
+    return true;
+}
+
+static bool channelNative(VM* vm, Value* out, Value* args) {
+    double capacity = IS_NUMBER(*args) ? AS_NUMBER(*args) : 0;
+    if (!(capacity >= 1 && capacity <= UINT32_MAX) || capacity != (double) (uint32_t) capacity) {
+        runtimeError(vm, "Channel capacity must be a positive integer.");
+        return false;
+    }
+    *out = OBJ_VAL(newChannel(vm, NULL, createChannel((uint32_t) capacity)));
+    return true;
+}
+
+static bool sendNative(VM* vm, Value* out, Value* args) {
+    Channel* channel = channelArgument(vm, args[0]);
+    if (!channel) return false;
+
+    Message* message = writeMessage(args[1]);
+    bool sent = sendMessage(channel, message);
+    if (!sent) freeMessage(message, false);
+    *out = BOOL_VAL(sent);
+    return true;
+}
+
+static bool receiveNative(VM* vm, Value* out, Value* args) {
+    Channel* channel = channelArgument(vm, *args);
+    if (!channel) return false;
+
+    Message* message = receiveMessage(channel, true);
+    *out = message ? readMessage(vm, message) : NIL_VAL;
+    return true;
+}
+
+static bool pollNative(VM* vm, Value* out, Value* args) {
+    Channel* channel = channelArgument(vm, *args);
+    if (!channel) return false;
+
+    Message* message = receiveMessage(channel, false);
+    *out = message ? readMessage(vm, message) : NIL_VAL;
+    return true;
+}
+
+static bool closeNative(VM* vm, Value* out, Value* args) {
+    Channel* channel = channelArgument(vm, *args);
+    if (!channel) return false;
+
+    closeChannel(channel);
+    *out = NIL_VAL;
+    return true;
+}
+
+void defineIsolateNatives(VM* vm) {
+    defineNative(vm, "spawn", spawnNative, 2);
+    defineNative(vm, "channel", channelNative, 1);
+    defineNative(vm, "send", sendNative, 2);
+    defineNative(vm, "receive", receiveNative, 1);
+    defineNative(vm, "poll", pollNative, 1);
+    defineNative(vm, "close", closeNative, 1);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CLOX_ISOLATE_H
+#define CLOX_ISOLATE_H
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef ISOLATES
+
+// isolates are VMs (each with its own heap, on a thread of its own) started by a Lox program, which only ever talk to
+// each other by sending values over channels, so nothing is shared and nothing needs locking apart from the channels
+// themselves. Natives:
+//   spawn(fn, argument)  calls fn(argument) in a new isolate, returning a channel which receives what it returns (and
+//                        is closed without anything in it if the call fails)
+//   channel(capacity)    a new channel, holding up to `capacity` values that haven't been received
+//   send(channel, value) waits while the channel's full; returns false (without sending) once it's closed
+//   receive(channel)     waits for the next value; nil once the channel's closed and empty
+//   poll(channel)        the next value if there is one, without waiting, otherwise nil
+//   close(channel)       wakes everything waiting on the channel; values already sent can still be received
+//
+// Sending copies the value, structured clone style: numbers, booleans, nil and short strings are copied as they are;
+// anything else is copied along with everything it refers to (an instance's fields and class, a closure's function and
+// captured variables etc), keeping cycles and any object reached twice as one copy, and rebuilt in the receiver's
+// heap. Each message is its own copy, so instances sent separately have separate copies of their class. Channels are
+// the exception, being references to the same channel, and coroutines can't be copied at all, so arrive as nil.
+//
+// spawn() copies the calling VM's globals into the new isolate with the function and its argument (which would
+// usually be a channel), so the function sees everything that had been defined when it was spawned, as of then.
+
+void defineIsolateNatives(VM* vm);
+// drops one reference, freeing the channel (and anything still queued on it) once every VM's finished with it
+void releaseChannel(Channel* channel);
+
+#endif
+
+#endif //CLOX_ISOLATE_H
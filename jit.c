@@ -0,0 +1,530 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "trace.h"
+#include "x64.h"
+
+#ifdef BASELINE_JIT
+
+// what the machine code keeps in the callee saved registers
+#define VM_REG RBX
+#define FRAME_REG R12
+// the frame's first slot, and one past the top of the stack
+#define SLOTS_REG R13
+#define TOP_REG R14
+// QNAN | TAG_INT, to re-tag the results of 32 bit arithmetic
+#define INT_TAG_REG R15
+
+// the upper half of every int value
+#define INT_TAG_HIGH ((uint32_t) ((QNAN | TAG_INT) >> 32))
+
+typedef enum {
+    // to the code for an instruction
+    PATCH_INSTRUCTION,
+    // to the stub which leaves an instruction to the interpreter
+    PATCH_EXIT,
+    // to the shared epilogue
+    PATCH_RETURN,
+} PatchKind;
+
+// a rel32 to fill in once everything's been emitted
+typedef struct {
+    uint32_t at;
+    uint32_t index;
+    PatchKind kind;
+} Patch;
+
+typedef struct {
+    Assembler as;
+    ObjFunction* function;
+    Chunk* chunk;
+    Patch* patches;
+    uint32_t patchCount;
+    uint32_t patchCapacity;
+    // per word: the code offset of its instruction, and whether it needs an exit stub
+    uint32_t* offsets;
+    bool* exits;
+    uint32_t returnOffset;
+    // the instruction being compiled
+    uint32_t index;
+} NativeCompiler;
+
+static void addPatch(NativeCompiler* nc, uint32_t at, PatchKind kind, uint32_t index) {
+    if (nc->patchCount == nc->patchCapacity) {
+        nc->patchCapacity = GROW_CAPACITY(nc->patchCapacity);
+        nc->patches = realloc(nc->patches, sizeof(Patch) * nc->patchCapacity);
+        assert(nc->patches);
+    }
+    nc->patches[nc->patchCount++] = (Patch) {.at = at, .index = index, .kind = kind};
+    if (kind == PATCH_EXIT) nc->exits[index] = true;
+}
+
+static void emitJumpTo(NativeCompiler* nc, PatchKind kind, uint32_t index) {
+    addPatch(nc, emitJump(&nc->as), kind, index);
+}
+
+static void emitJumpToIf(NativeCompiler* nc, Condition condition, PatchKind kind, uint32_t index) {
+    addPatch(nc, emitJumpIf(&nc->as, condition), kind, index);
+}
+
+// leaves the current instruction to the interpreter
+static void emitExitIf(NativeCompiler* nc, Condition condition) {
+    emitJumpToIf(nc, condition, PATCH_EXIT, nc->index);
+}
+
+static void emitPushValue(NativeCompiler* nc, Register reg) {
+    emitStore(&nc->as, TOP_REG, 0, reg);
+    emitAluImmediate(&nc->as, IMM_ADD, true, TOP_REG, sizeof(Value));
+}
+
+static void emitPopValue(NativeCompiler* nc, Register reg) {
+    emitAluImmediate(&nc->as, IMM_SUB, true, TOP_REG, sizeof(Value));
+    emitLoad(&nc->as, reg, TOP_REG, 0);
+}
+
+static void emitPeek(NativeCompiler* nc, Register reg, uint32_t distance) {
+    emitLoad(&nc->as, reg, TOP_REG, -(int32_t) (sizeof(Value) * (distance + 1)));
+}
+
+static int32_t slotOffset(uint32_t slot) {
+    return (int32_t) (sizeof(Value) * slot);
+}
+
+// vm->stack.count, from the top of stack register, so the GC sees everything on the stack
+static void emitSyncStackCount(NativeCompiler* nc) {
+    emitAlu(&nc->as, ALU_MOV, true, RAX, TOP_REG);
+    emitRex(&nc->as, true, RAX, VM_REG);
+    emitByte(&nc->as, 0x2b);
+    emitMemory(&nc->as, RAX, VM_REG, offsetof(VM, stack.values));
+    emitShift(&nc->as, SHIFT_RIGHT, RAX, 3);
+    emitStore32(&nc->as, VM_REG, offsetof(VM, stack.count), RAX);
+}
+
+static Value constant(NativeCompiler* nc, uint32_t index) {
+    return nc->chunk->constants.values[index];
+}
+
+// a register instruction's operand, from its slot or as an immediate
+static void emitLoadRegister(NativeCompiler* nc, Register reg, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        emitMoveImmediate(&nc->as, reg, constant(nc, operand & ~RK_CONSTANT));
+    } else {
+        emitLoad(&nc->as, reg, SLOTS_REG, slotOffset(operand));
+    }
+}
+
+static void emitIntCheck(NativeCompiler* nc, Register reg) {
+    emitAlu(&nc->as, ALU_MOV, true, RCX, reg);
+    emitShift(&nc->as, SHIFT_RIGHT, RCX, 32);
+    emitAluImmediate(&nc->as, IMM_CMP, false, RCX, (int32_t) INT_TAG_HIGH);
+    emitExitIf(nc, CC_NOT_EQUAL);
+}
+
+// constants are known at compile time, so either always pass or always leave the instruction to the interpreter
+static void emitRegisterIntCheck(NativeCompiler* nc, Register reg, uint8_t operand) {
+    if (!(operand & RK_CONSTANT)) {
+        emitIntCheck(nc, reg);
+    } else if (!IS_INT(constant(nc, operand & ~RK_CONSTANT))) {
+        emitJumpTo(nc, PATCH_EXIT, nc->index);
+    }
+}
+
+// anything but a double compares bitwise, like valuesEqual()
+static void emitNotDoubleCheck(NativeCompiler* nc, Register reg) {
+    emitMoveImmediate(&nc->as, RCX, QNAN);
+    emitAlu(&nc->as, ALU_AND, true, RCX, reg);
+    emitMoveImmediate(&nc->as, RSI, QNAN);
+    emitAlu(&nc->as, ALU_CMP, true, RCX, RSI);
+    emitExitIf(nc, CC_NOT_EQUAL);
+}
+
+// a in rax and b in rdx, both known to be ints: the result is left in rax
+static void emitIntOp(NativeCompiler* nc, OpCode op) {
+    switch (op) {
+        case OP_ADD:
+            emitAlu(&nc->as, ALU_ADD, false, RAX, RDX);
+            emitExitIf(nc, CC_OVERFLOW);
+            emitAlu(&nc->as, ALU_OR, true, RAX, INT_TAG_REG);
+            break;
+        case OP_SUBTRACT:
+            emitAlu(&nc->as, ALU_SUB, false, RAX, RDX);
+            emitExitIf(nc, CC_OVERFLOW);
+            emitAlu(&nc->as, ALU_OR, true, RAX, INT_TAG_REG);
+            break;
+        case OP_MULTIPLY:
+            // imul eax, edx
+            emitByte(&nc->as, 0x0f);
+            emitByte(&nc->as, 0xaf);
+            emitByte(&nc->as, 0xc2);
+            emitExitIf(nc, CC_OVERFLOW);
+            // a zero product might be -0.0, which only the interpreter can tell
+            emitAluImmediate(&nc->as, IMM_CMP, false, RAX, 0);
+            emitExitIf(nc, CC_EQUAL);
+            emitAlu(&nc->as, ALU_OR, true, RAX, INT_TAG_REG);
+            break;
+        case OP_LESS:
+        case OP_GREATER:
+            emitAlu(&nc->as, ALU_CMP, false, RAX, RDX);
+            emitSetCondition(&nc->as, op == OP_LESS ? CC_LESS : CC_GREATER, RCX);
+            emitMoveImmediate(&nc->as, RAX, FALSE_VAL);
+            emitAlu(&nc->as, ALU_OR, true, RAX, RCX);
+            break;
+        case OP_EQUAL:
+            emitAlu(&nc->as, ALU_CMP, true, RAX, RDX);
+            emitSetCondition(&nc->as, CC_EQUAL, RCX);
+            emitMoveImmediate(&nc->as, RAX, FALSE_VAL);
+            emitAlu(&nc->as, ALU_OR, true, RAX, RCX);
+            break;
+        default:
+            assert(!"Not an int operator");
+    }
+}
+
+// whether a value in rax is falsey, as the flags for an unsigned compare: nil and false are next to each other
+static void emitFalseyCompare(NativeCompiler* nc) {
+    emitMoveImmediate(&nc->as, RCX, NIL_VAL);
+    emitAlu(&nc->as, ALU_SUB, true, RAX, RCX);
+    emitAluImmediate(&nc->as, IMM_CMP, true, RAX, 1);
+}
+
+// the slow paths of property access are left to the interpreter, so these only need to handle fields
+static bool getField(Value* top, ObjString* name) {
+    Value value;
+    if (!IS_INSTANCE(top[-1]) || !tableGet(&AS_INSTANCE(top[-1])->fields, name, &value)) return false;
+    top[-1] = value;
+    return true;
+}
+
+static bool setField(VM* vm, Value* top, ObjString* name) {
+    if (!IS_INSTANCE(top[-2])) return false;
+    tableSet(vm, NULL, &AS_INSTANCE(top[-2])->fields, name, top[-1]);
+    top[-2] = top[-1];
+    return true;
+}
+
+static uint32_t jumpTarget(NativeCompiler* nc, int32_t distance) {
+    uint32_t target = (uint32_t) ((int32_t) nc->index + 1 + distance);
+    assert(target < nc->chunk->wordCount);
+    return target;
+}
+
+// returns false if the instruction is always left to the interpreter
+static bool compileInstruction(NativeCompiler* nc, uint32_t word) {
+    OpCode op = WORD_OP(word);
+    switch (op) {
+        case OP_CONSTANT:
+            emitMoveImmediate(&nc->as, RAX, constant(nc, WORD_OPERAND(word)));
+            emitPushValue(nc, RAX);
+            return true;
+        case OP_INT:
+            emitMoveImmediate(&nc->as, RAX, INT_VAL(WORD_SIGNED_OPERAND(word)));
+            emitPushValue(nc, RAX);
+            return true;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitMoveImmediate(&nc->as, RAX, op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE));
+            emitPushValue(nc, RAX);
+            return true;
+        case OP_POP:
+            emitAluImmediate(&nc->as, IMM_SUB, true, TOP_REG, sizeof(Value));
+            return true;
+        case OP_GET_LOCAL:
+            emitLoad(&nc->as, RAX, SLOTS_REG, slotOffset(WORD_OPERAND(word)));
+            emitPushValue(nc, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            emitPeek(nc, RAX, 0);
+            emitStore(&nc->as, SLOTS_REG, slotOffset(WORD_OPERAND(word)), RAX);
+            return true;
+        case OP_SET_LOCAL_POP:
+            emitPopValue(nc, RAX);
+            emitStore(&nc->as, SLOTS_REG, slotOffset(WORD_OPERAND(word)), RAX);
+            return true;
+        case OP_MOVE:
+            emitLoadRegister(nc, RAX, WORD_A(word));
+            emitStore(&nc->as, SLOTS_REG, slotOffset(WORD_B(word)), RAX);
+            return true;
+#ifndef COMPRESSED_HEAP_REFS
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            emitLoad(&nc->as, RAX, FRAME_REG, offsetof(CallFrame, closure));
+            emitLoad(&nc->as, RAX, RAX, offsetof(ObjClosure, upvalues));
+            emitLoad(&nc->as, RAX, RAX, (int32_t) (sizeof(ObjUpvalue*) * WORD_OPERAND(word)));
+            emitLoad(&nc->as, RAX, RAX, offsetof(ObjUpvalue, location));
+            if (op == OP_GET_UPVALUE) {
+                emitLoad(&nc->as, RAX, RAX, 0);
+                emitPushValue(nc, RAX);
+            } else {
+                emitPeek(nc, RCX, 0);
+                emitStore(&nc->as, RAX, 0, RCX);
+            }
+            return true;
+#endif
+        case OP_GET_GLOBAL:
+            // tableGet() writes straight into the next stack slot
+            emitAlu(&nc->as, ALU_MOV, true, RDI, VM_REG);
+            emitAluImmediate(&nc->as, IMM_ADD, true, RDI, offsetof(VM, globals));
+            emitMoveImmediate(&nc->as, RSI, pointer(AS_STRING(constant(nc, WORD_OPERAND(word)))));
+            emitAlu(&nc->as, ALU_MOV, true, RDX, TOP_REG);
+            emitCall(&nc->as, (uintptr_t) tableGet);
+            emitByte(&nc->as, 0x84);
+            emitByte(&nc->as, 0xc0);
+            emitExitIf(nc, CC_EQUAL);
+            emitAluImmediate(&nc->as, IMM_ADD, true, TOP_REG, sizeof(Value));
+            return true;
+        case OP_GET_PROPERTY:
+            emitAlu(&nc->as, ALU_MOV, true, RDI, TOP_REG);
+            emitMoveImmediate(&nc->as, RSI, pointer(AS_STRING(constant(nc, WORD_OPERAND(word)))));
+            emitCall(&nc->as, (uintptr_t) getField);
+            emitByte(&nc->as, 0x84);
+            emitByte(&nc->as, 0xc0);
+            emitExitIf(nc, CC_EQUAL);
+            return true;
+        case OP_SET_PROPERTY:
+            // setting a new field can allocate
+            emitSyncStackCount(nc);
+            emitAlu(&nc->as, ALU_MOV, true, RDI, VM_REG);
+            emitAlu(&nc->as, ALU_MOV, true, RSI, TOP_REG);
+            emitMoveImmediate(&nc->as, RDX, pointer(AS_STRING(constant(nc, WORD_OPERAND(word)))));
+            emitCall(&nc->as, (uintptr_t) setField);
+            emitByte(&nc->as, 0x84);
+            emitByte(&nc->as, 0xc0);
+            emitExitIf(nc, CC_EQUAL);
+            emitAluImmediate(&nc->as, IMM_SUB, true, TOP_REG, sizeof(Value));
+            return true;
+        case OP_JUMP:
+            emitJumpTo(nc, PATCH_INSTRUCTION, jumpTarget(nc, (int32_t) WORD_OPERAND(word)));
+            return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            emitPeek(nc, RAX, 0);
+            emitFalseyCompare(nc);
+            emitJumpToIf(nc, op == OP_JUMP_IF_FALSE ? CC_BELOW_EQUAL : CC_ABOVE, PATCH_INSTRUCTION,
+                       jumpTarget(nc, (int32_t) WORD_OPERAND(word)));
+            return true;
+        case OP_LOOP:
+#ifdef TRACING_JIT
+            // hot loops are left to the interpreter to record (or run the trace of)
+            emitMoveImmediate(&nc->as, RAX, pointer(&findTraceLoop(nc->chunk, nc->index)->hotness));
+            // cmp dword [rax], TRACE_THRESHOLD
+            emitByte(&nc->as, 0x81);
+            emitByte(&nc->as, 0x38);
+            emit32(&nc->as, TRACE_THRESHOLD);
+            emitExitIf(nc, CC_GREATER_EQUAL);
+            // add dword [rax], 1
+            emitByte(&nc->as, 0x83);
+            emitByte(&nc->as, 0x00);
+            emitByte(&nc->as, 0x01);
+#endif
+            // still counts towards the optimiser's threshold
+            emitMoveImmediate(&nc->as, RAX, pointer(&nc->function->hotness));
+            // add dword [rax], 1
+            emitByte(&nc->as, 0x83);
+            emitByte(&nc->as, 0x00);
+            emitByte(&nc->as, 0x01);
+            emitJumpTo(nc, PATCH_INSTRUCTION, jumpTarget(nc, -(int32_t) WORD_OPERAND(word)));
+            return true;
+        case OP_JUMP_IF_CALLEE:
+            emitPopValue(nc, RAX);
+            emitMoveImmediate(&nc->as, RCX, constant(nc, WORD_A(word)));
+            emitAlu(&nc->as, ALU_CMP, true, RAX, RCX);
+            emitJumpToIf(nc, CC_EQUAL, PATCH_INSTRUCTION, jumpTarget(nc, (int32_t) (word >> 16)));
+            return true;
+        case OP_NOT:
+            emitPeek(nc, RAX, 0);
+            emitFalseyCompare(nc);
+            emitSetCondition(&nc->as, CC_BELOW_EQUAL, RCX);
+            emitMoveImmediate(&nc->as, RAX, FALSE_VAL);
+            emitAlu(&nc->as, ALU_OR, true, RAX, RCX);
+            emitStore(&nc->as, TOP_REG, -(int32_t) sizeof(Value), RAX);
+            return true;
+        case OP_NEGATE:
+            emitPeek(nc, RAX, 0);
+            emitIntCheck(nc, RAX);
+            // neg eax: overflows on INT32_MIN, and negating 0 gives -0.0
+            emitByte(&nc->as, 0xf7);
+            emitByte(&nc->as, 0xd8);
+            emitExitIf(nc, CC_OVERFLOW);
+            emitExitIf(nc, CC_EQUAL);
+            emitAlu(&nc->as, ALU_OR, true, RAX, INT_TAG_REG);
+            emitStore(&nc->as, TOP_REG, -(int32_t) sizeof(Value), RAX);
+            return true;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_EQUAL:
+            emitPeek(nc, RAX, 1);
+            emitPeek(nc, RDX, 0);
+            if (op == OP_EQUAL) {
+                emitNotDoubleCheck(nc, RAX);
+                emitNotDoubleCheck(nc, RDX);
+            } else {
+                emitIntCheck(nc, RAX);
+                emitIntCheck(nc, RDX);
+            }
+            emitIntOp(nc, op);
+            emitStore(&nc->as, TOP_REG, -2 * (int32_t) sizeof(Value), RAX);
+            emitAluImmediate(&nc->as, IMM_SUB, true, TOP_REG, sizeof(Value));
+            return true;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_LESS_RK:
+        case OP_GREATER_RK:
+        case OP_EQUAL_RK:
+        case OP_ADD_RK_STORE:
+        case OP_SUBTRACT_RK_STORE:
+        case OP_MULTIPLY_RK_STORE:
+        case OP_LESS_RK_STORE:
+        case OP_GREATER_RK_STORE:
+        case OP_EQUAL_RK_STORE:
+            emitLoadRegister(nc, RAX, WORD_A(word));
+            emitLoadRegister(nc, RDX, WORD_B(word));
+            if (stackOp(op) == OP_EQUAL) {
+                emitNotDoubleCheck(nc, RAX);
+                emitNotDoubleCheck(nc, RDX);
+            } else {
+                emitRegisterIntCheck(nc, RAX, WORD_A(word));
+                emitRegisterIntCheck(nc, RDX, WORD_B(word));
+            }
+            emitIntOp(nc, stackOp(op));
+            if (isRegisterStore(op)) {
+                emitStore(&nc->as, SLOTS_REG, slotOffset(WORD_C(word)), RAX);
+            } else {
+                emitPushValue(nc, RAX);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void emitPrologue(NativeCompiler* nc) {
+    // the entry is an offset from the start of the code, which is where this is: lea rax, [rip - 7]; add rdx, rax
+    assert(nc->as.count == 0);
+    emitByte(&nc->as, 0x48);
+    emitByte(&nc->as, 0x8d);
+    emitByte(&nc->as, 0x05);
+    emit32(&nc->as, (uint32_t) -7);
+    emitAlu(&nc->as, ALU_ADD, true, RDX, RAX);
+    // callee saved registers, which also leaves the stack aligned for calls
+    emitPush(&nc->as, RBX);
+    emitPush(&nc->as, R12);
+    emitPush(&nc->as, R13);
+    emitPush(&nc->as, R14);
+    emitPush(&nc->as, R15);
+    emitAlu(&nc->as, ALU_MOV, true, VM_REG, RDI);
+    emitAlu(&nc->as, ALU_MOV, true, FRAME_REG, RSI);
+    emitLoad(&nc->as, RAX, VM_REG, offsetof(VM, stack.values));
+    emitLoad32(&nc->as, RCX, FRAME_REG, offsetof(CallFrame, base));
+    emitShift(&nc->as, SHIFT_LEFT, RCX, 3);
+    emitAlu(&nc->as, ALU_MOV, true, SLOTS_REG, RAX);
+    emitAlu(&nc->as, ALU_ADD, true, SLOTS_REG, RCX);
+    emitLoad32(&nc->as, RCX, VM_REG, offsetof(VM, stack.count));
+    emitShift(&nc->as, SHIFT_LEFT, RCX, 3);
+    emitAlu(&nc->as, ALU_MOV, true, TOP_REG, RAX);
+    emitAlu(&nc->as, ALU_ADD, true, TOP_REG, RCX);
+    emitMoveImmediate(&nc->as, INT_TAG_REG, QNAN | TAG_INT);
+    // jmp rdx
+    emitByte(&nc->as, 0xff);
+    emitByte(&nc->as, 0xe2);
+}
+
+// hands the instruction in rax back to the interpreter
+static void emitEpilogue(NativeCompiler* nc) {
+    emitStore(&nc->as, FRAME_REG, offsetof(CallFrame, ip), RAX);
+    emitSyncStackCount(nc);
+    emitPop(&nc->as, R15);
+    emitPop(&nc->as, R14);
+    emitPop(&nc->as, R13);
+    emitPop(&nc->as, R12);
+    emitPop(&nc->as, RBX);
+    emitByte(&nc->as, 0xc3);
+}
+
+static void emitExit(NativeCompiler* nc, uint32_t index) {
+    emitMoveImmediate(&nc->as, RAX, pointer(nc->chunk->words + index));
+    emitJumpTo(nc, PATCH_RETURN, 0);
+}
+
+void compileNative(UNUSED VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    assert(!chunk->native);
+
+    NativeCompiler nc = {.function = function, .chunk = chunk};
+    nc.offsets = calloc(chunk->wordCount, sizeof(uint32_t));
+    nc.exits = calloc(chunk->wordCount, sizeof(bool));
+    uint32_t* entries = calloc(chunk->wordCount, sizeof(uint32_t));
+    assert(nc.offsets && nc.exits && entries);
+
+    emitPrologue(&nc);
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        // the extra words of a longer instruction
+        if (i > 0 && chunk->wordOffsets[i] == chunk->wordOffsets[i - 1]) continue;
+
+        nc.index = i;
+        nc.offsets[i] = nc.as.count;
+        if (compileInstruction(&nc, chunk->words[i])) {
+            entries[i] = nc.offsets[i];
+        } else {
+            emitExit(&nc, i);
+        }
+    }
+    // out of line, as the fast paths shouldn't have to jump over them
+    uint32_t* exitOffsets = calloc(chunk->wordCount, sizeof(uint32_t));
+    assert(exitOffsets);
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (!nc.exits[i]) continue;
+        exitOffsets[i] = nc.as.count;
+        emitExit(&nc, i);
+    }
+    nc.returnOffset = nc.as.count;
+    emitEpilogue(&nc);
+
+    for (uint32_t i = 0; i < nc.patchCount; i++) {
+        Patch* patch = nc.patches + i;
+        uint32_t target = patch->kind == PATCH_INSTRUCTION ? nc.offsets[patch->index]
+                                                           : patch->kind == PATCH_EXIT ? exitOffsets[patch->index]
+                                                                                       : nc.returnOffset;
+        patchJump(&nc.as, patch->at, target);
+    }
+
+    size_t entriesSize = sizeof(uint32_t) * chunk->wordCount;
+    size_t size;
+    uint8_t* mapping = mapCode(&nc.as, sizeof(NativeCode) + entriesSize, &size);
+    if (mapping) {
+        NativeCode* native = (NativeCode*) mapping;
+        native->size = size;
+        native->entries = (uint32_t*) (mapping + sizeof(NativeCode));
+        memcpy(native->entries, entries, entriesSize);
+        // every instruction pushes at most one value, and no more than the longest path through the function can be
+        // on the stack at once
+        native->stackNeeded = chunk->wordCount + 1;
+        native->code = mapping + codeOffset(sizeof(NativeCode) + entriesSize);
+        // ISO C has no conversion from an object pointer to a function pointer
+        memcpy(&native->enter, &native->code, sizeof(native->enter));
+        if (protectCode(mapping, size)) chunk->native = native;
+    }
+
+    free(exitOffsets);
+    free(entries);
+    free(nc.exits);
+    free(nc.offsets);
+    free(nc.patches);
+    free(nc.as.code);
+}
+
+#endif
+
+#ifdef NATIVE_CODE
+void freeNativeCode(UNUSED NativeCode* native) {
+#ifdef BASELINE_JIT
+    // code compiled ahead of time is static
+    if (native && native->size) unmapCode((uint8_t*) native, native->size);
+#endif
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "object.h"
+
+#ifdef NATIVE_CODE
+
+// a function's instruction words as native code, which handles the common cases itself and stops with the frame's ip
+// at the first instruction it leaves to the interpreter. Either compiled ahead of time as C (see aot.h), or by the
+// baseline JIT (below)
+struct NativeCode {
+    // of the whole mapping, or 0 for code compiled ahead of time, which isn't mapped
+    size_t size;
+    // per word: non-zero where the code can start running (for the JIT, the offset into `code` of its instruction), or
+    // 0 for instructions which are always left to the interpreter (and the extra words of longer instructions)
+    uint32_t* entries;
+    // pushes and pops are unchecked, so the stack needs room for this many more values on entry
+    uint32_t stackNeeded;
+    void (*enter)(VM* vm, CallFrame* frame, uint32_t entry);
+    uint8_t* code;
+};
+
+// runs `frame` in native code from the instruction at `entry` until the next instruction for the interpreter,
+// which the frame's ip is left pointing at
+static inline void runNative(VM* vm, CallFrame* frame, NativeCode* native, uint32_t entry) {
+    native->enter(vm, frame, entry);
+}
+
+void freeNativeCode(NativeCode* native);
+
+#endif
+
+#ifdef BASELINE_JIT
+
+// the JIT compiles to x86-64, one template per instruction. The machine code handles locals, constants, jumps, int
+// arithmetic and comparisons, globals, fields and upvalues; anything else, including every call and return, every type
+// the fast paths don't cover, and every runtime error, is left to the interpreter to run exactly as it would have
+// anyway. The header, entry table and code share one mapping.
+
+// compiles the function's current instruction words into function->chunk.native; the code stays valid until the words
+// are re-encoded. Leaves the function interpreted if there's no executable memory to be had
+void compileNative(VM* vm, ObjFunction* function);
+
+#endif
+
+#endif //CLOX_JIT_H
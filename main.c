@@ -1,7 +1,14 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "serve.h"
+#include "snapshot.h"
 #include "vm.h"
 
 static void repl(VM* vm) {
@@ -18,7 +25,7 @@ static void repl(VM* vm) {
     }
 }
 
-static void runFile(VM* vm, const char* path) {
+static char* readFile(VM* vm, const char* path, size_t* size) {
     FILE* file = fopen(path, "rb");
     fseek(file, 0L, SEEK_END);
     size_t fileSize = ftell(file);
@@ -29,27 +36,144 @@ static void runFile(VM* vm, const char* path) {
     source[bytesRead] = '\0';
 
     fclose(file);
+    *size = fileSize + 1;
+    return source;
+}
 
+#ifdef BYTECODE_CACHE
+// runs the script from the cache at `cachePath` if it's there and up to date, otherwise compiles it and (if possible)
+// replaces the cache
+static InterpretResult interpretCached(VM* vm, const char* source, const char* cachePath) {
+    ObjFunction* function = loadCache(vm, source, cachePath);
+    if (!function) {
+        function = compile(vm, source);
+        if (!function) return INTERPRET_COMPILE_ERROR;
+        // scripts in directories we can't write to are just compiled every time
+        writeCache(function, source, cachePath);
+    }
+    return interpretFunction(vm, function);
+}
+#endif
+
+static void runFile(VM* vm, const char* path) {
+    size_t size;
+    char* source = readFile(vm, path, &size);
+#ifdef BYTECODE_CACHE
+    // script.lox is cached in script.loxc
+    size_t cachePathSize = strlen(path) + 2;
+    char* cachePath = reallocate(vm, NULL, NULL, 0, cachePathSize);
+    snprintf(cachePath, cachePathSize, "%sc", path);
+    InterpretResult result = interpretCached(vm, source, cachePath);
+    reallocate(vm, NULL, cachePath, cachePathSize, 0);
+#else
     InterpretResult result = interpret(vm, source);
-    reallocate(vm, NULL, source, fileSize + 1, 0);
+#endif
+    reallocate(vm, NULL, source, size, 0);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+#ifdef NATIVE_CODE
+// to stdout, without an output path
+static void emitFile(VM* vm, const char* path, const char* outputPath) {
+    FILE* out = outputPath ? fopen(outputPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Could not open \"%s\".\n", outputPath);
+        exit(74);
+    }
+
+    size_t size;
+    char* source = readFile(vm, path, &size);
+    bool compiled = emitC(vm, source, path, out);
+    reallocate(vm, NULL, source, size, 0);
+    if (outputPath) fclose(out);
+
+    if (!compiled) {
+        if (outputPath) remove(outputPath);
+        exit(65);
+    }
+}
+#endif
+
+#ifdef HEAP_SNAPSHOT
+// runs the prelude at `path`, then saves the VM as it's left
+static void snapshotFile(VM* vm, const char* path, const char* imagePath) {
+    runFile(vm, path);
+    if (!writeSnapshot(vm, imagePath)) {
+        fprintf(stderr, "Could not write \"%s\".\n", imagePath);
+        exit(74);
+    }
+}
+#endif
+
+#ifdef FORK_SERVER
+// jobs are read from stdin without a socket to listen on
+static void serveFile(VM* vm, const char* socketPath, const char* preludePath) {
+    if (preludePath) runFile(vm, preludePath);
+    bool served = socketPath ? serveSocket(vm, socketPath, runFile) : serveStdin(vm, runFile);
+    if (!served) {
+        fprintf(stderr, "Could not serve jobs: %s.\n", strerror(errno));
+        exit(74);
+    }
+}
+#endif
+
 int main(int argc, const char** argv) {
     FreeList freeList;
-    initMemory(&freeList, 256 * 1024 * 1024);
-
     VM vm;
+
+#ifdef HEAP_SNAPSHOT
+    // in place of a fresh VM, with whatever the image's prelude defined
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--image") == 0) {
+        if (!restoreSnapshot(&freeList, &vm, argv[2])) {
+            fprintf(stderr, "Could not restore \"%s\".\n", argv[2]);
+            exit(74);
+        }
+        if (argc == 4) {
+            runFile(&vm, argv[3]);
+        } else {
+            repl(&vm);
+        }
+        freeVM(&vm);
+        freeMemory(&freeList);
+        return 0;
+    }
+#endif
+
+    initMemory(&freeList, 256 * 1024 * 1024);
     initVM(&freeList, &vm);
 
     if (argc == 1) {
         repl(&vm);
+#ifdef FORK_SERVER
+    } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "--serve") == 0) {
+        serveFile(&vm, NULL, argc == 3 ? argv[2] : NULL);
+    } else if ((argc == 4 || argc == 5) && strcmp(argv[1], "--serve") == 0 && strcmp(argv[2], "--socket") == 0) {
+        serveFile(&vm, argv[3], argc == 5 ? argv[4] : NULL);
+#endif
     } else if (argc == 2) {
         runFile(&vm, argv[1]);
+#ifdef NATIVE_CODE
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "--emit-c") == 0) {
+        emitFile(&vm, argv[2], argc == 4 ? argv[3] : NULL);
+#endif
+#ifdef HEAP_SNAPSHOT
+    } else if (argc == 4 && strcmp(argv[1], "--snapshot") == 0) {
+        snapshotFile(&vm, argv[2], argv[3]);
+#endif
     } else {
         fprintf(stderr, "Usage: clox [path]\n");
+#ifdef NATIVE_CODE
+        fprintf(stderr, "       clox --emit-c path [output.c]\n");
+#endif
+#ifdef HEAP_SNAPSHOT
+        fprintf(stderr, "       clox --snapshot prelude image\n");
+        fprintf(stderr, "       clox --image image [path]\n");
+#endif
+#ifdef FORK_SERVER
+        fprintf(stderr, "       clox --serve [--socket path] [prelude]\n");
+#endif
         exit(64);
     }
 
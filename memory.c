@@ -8,10 +8,23 @@
 
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
+
+#ifdef HEAP_SNAPSHOT
+#include <sys/mman.h>
+#endif
+
+#ifdef COMPRESSED_HEAP_REFS
+_Thread_local uint8_t* heapBase = NULL;
+#endif
 
 void initMemory(FreeList* freeList, size_t size) {
     void* allocation = malloc(size);
     assert(allocation && size >= sizeof(Block));
+#ifdef NAN_BOXING
+    // object values only have room for 47 bit pointers
+    assert(((uintptr_t) allocation + size) <= OBJ_POINTER_MASK || !"Heap outside of the NaN boxable address range");
+#endif
 
     Block* block = (Block*) allocation;
     block->blockSize = size;
@@ -19,16 +32,41 @@ void initMemory(FreeList* freeList, size_t size) {
 
     freeList->first = block;
     freeList->base_ = allocation;
+    freeList->size_ = size;
+    freeList->mapped_ = false;
+#ifdef MARK_BITMAP
+    // untouched (so never really allocated) apart from where objects are
+    freeList->marks_ = calloc((size + 7) / 8, 1);
+    assert(freeList->marks_);
+#endif
+#ifdef COMPRESSED_HEAP_REFS
+    assert(size <= ((size_t) UINT32_MAX << HEAP_REF_SHIFT) || !"Heap too large for 32 bit references");
+    freeList->heapBase_ = (uint8_t*) allocation - (1 << HEAP_REF_SHIFT);
+    heapBase = freeList->heapBase_;
+#endif
 }
 
 void freeMemory(FreeList* freeList) {
+#ifdef HEAP_SNAPSHOT
+    if (freeList->mapped_) {
+        munmap(freeList->base_, freeList->size_);
+    } else {
+        free(freeList->base_);
+    }
+#else
     free(freeList->base_);
+#endif
+#ifdef MARK_BITMAP
+    free(freeList->marks_);
+    freeList->marks_ = NULL;
+#endif
     freeList->base_ = NULL;
     freeList->first = NULL;
 }
 
 // TODO potential improvements: keep list sorted in memory order; merge adjacent free blocks to reduce fragmentation
 void* reallocate(VM* vm, Compiler* compiler, void* pointer, size_t oldSize, size_t newSize) {
+    ASSERT_HEAP(vm);
     vm->bytesAllocated += newSize - oldSize;
     uint8_t* result = NULL;
 
@@ -37,11 +75,18 @@ void* reallocate(VM* vm, Compiler* compiler, void* pointer, size_t oldSize, size
         collectGarbage(vm, compiler);
     }
 #else
-    if (vm->bytesAllocated > vm->nextGC) {
+    // only growing can start a collection: otherwise the frees from a sweep could start another one part way through
+    if (newSize > oldSize && vm->bytesAllocated > vm->nextGC) {
         collectGarbage(vm, compiler);
     }
 #endif
 
+#if defined(COMPRESSED_HEAP_REFS) && HEAP_REF_SHIFT
+    // keeps every block aligned, so every allocation can be referenced with a shifted offset
+    newSize = (newSize + (1 << HEAP_REF_SHIFT) - 1) & ~(size_t) ((1 << HEAP_REF_SHIFT) - 1);
+    oldSize = (oldSize + (1 << HEAP_REF_SHIFT) - 1) & ~(size_t) ((1 << HEAP_REF_SHIFT) - 1);
+#endif
+
     if (newSize) {
         // need to always allocate enough space to be able to reuse the space to store block metadata once it's freed
         if (newSize < sizeof(Block)) newSize = sizeof(Block);
@@ -101,40 +146,67 @@ static void blackenObject(VM* vm, Obj* object) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* boundMethod = (ObjBoundMethod*) object;
             markValue(vm, boundMethod->receiver);
-            markObject(vm, (Obj*) boundMethod->method);
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjClosure, boundMethod->method));
             break;
         }
         case OBJ_CLASS: {
             ObjClass* class = (ObjClass*) object;
-            markObject(vm, (Obj*) class->name);
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjString, class->name));
             markTable(vm, &class->methods);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
-            markObject(vm, (Obj*) function->name);
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjString, function->name));
             markValueArray(vm, &function->chunk.constants);
+#ifdef TRACING_JIT
+            markTraces(vm, &function->chunk);
+#endif
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            markObject(vm, (Obj*) closure->function);
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjFunction, closure->function));
+            HEAP_REF(ObjUpvalue)* upvalues = FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues);
             for (uint32_t i = 0; i < closure->upvalueCount; i++) {
-                markObject(vm, (Obj*) closure->upvalues[i]);
+                markObject(vm, (Obj*) FROM_HEAP_REF(ObjUpvalue, upvalues[i]));
             }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*) object;
-            markObject(vm, (Obj*) instance->class);
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjClass, instance->class));
             markTable(vm, &instance->fields);
             break;
         }
         case OBJ_UPVALUE:
             markValue(vm, ((ObjUpvalue*) object)->closed);
+#ifdef COROUTINES
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjCoroutine, ((ObjUpvalue*) object)->owner));
+#endif
+            break;
+#ifdef COROUTINES
+        case OBJ_COROUTINE: {
+            // including the stack it was resumed from, if it's running
+            ObjCoroutine* coroutine = (ObjCoroutine*) object;
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjClosure, coroutine->closure));
+            markValueArray(vm, &coroutine->stack);
+            for (uint32_t i = 0; i < coroutine->frameCount; i++) {
+                markObject(vm, (Obj*) coroutine->frames[i].closure);
+            }
+            for (ObjUpvalue* upvalue = coroutine->openUpvalues; upvalue;
+                 upvalue = FROM_HEAP_REF(ObjUpvalue, upvalue->next)) {
+                markObject(vm, (Obj*) upvalue);
+            }
+            markObject(vm, (Obj*) FROM_HEAP_REF(ObjCoroutine, coroutine->resumer));
             break;
+        }
+#endif
         case OBJ_NATIVE:
         case OBJ_STRING:
+#ifdef ISOLATES
+        case OBJ_CHANNEL:
+#endif
             break;
         case OBJ_NONE:
             assert(!"Use after free");
@@ -153,16 +225,16 @@ static void sweep(VM* vm) {
     Obj* object = vm->objects;
 
     while (object) {
-        if (object->isMarked) {
-            object->isMarked = false;
+        if (IS_MARKED(vm->freeList, object)) {
+            CLEAR_MARKED(vm->freeList, object);
             previous = object;
-            object = object->next;
+            object = FROM_HEAP_REF(Obj, object->next);
         } else {
             Obj* unreached = object;
-            object = object->next;
+            object = FROM_HEAP_REF(Obj, object->next);
 
             if (previous) {
-                previous->next = object;
+                previous->next = TO_HEAP_REF(object);
             } else {
                 vm->objects = object;
             }
@@ -177,6 +249,7 @@ void collectGarbage(VM* vm, Compiler* compiler) {
     printf("-- gc begin\n");
     size_t before = vm->bytesAllocated;
 #endif
+    ENTER_HEAP(vm);
 
     markRoots(vm);
 
@@ -185,10 +258,11 @@ void collectGarbage(VM* vm, Compiler* compiler) {
     }
 
     traceReferences(vm);
-    tableRemoveWhite(&vm->strings);
+    internTableRemoveWhite(vm, &vm->strings);
     sweep(vm);
 
     vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    LEAVE_HEAP();
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
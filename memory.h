@@ -13,13 +13,13 @@
 #define VM_FREE_ARRAY(type, pointer, oldCount) \
     (type*) reallocate(vm, NULL, pointer, sizeof(type) * (oldCount), 0)
 #define VM_ALLOCATE(type, count) \
-    (type*) reallocate(vm, NULL, NULL, 0, sizeof(type) * count)
+    (type*) reallocate(vm, NULL, NULL, 0, sizeof(type) * (count))
 #define VM_FREE(type, pointer) reallocate(vm, NULL, pointer, sizeof(type), 0)
 
 // need to be able to mark compiler objects if GC is triggered while compiling, but don't want to pass NULLs everywhere in the VM code
 // note that the compiler(s) are unreachable once compilation is done, so it's fine to implicitly GC any leftover objects from the compilation phase
 #define COMPILER_ALLOCATE(type, count) \
-    (type*) reallocate(vm, compiler, NULL, 0, sizeof(type) * count)
+    (type*) reallocate(vm, compiler, NULL, 0, sizeof(type) * (count))
 #define COMPILER_GROW_ARRAY(type, pointer, oldCount, newCount) \
     (type*) reallocate(vm, compiler, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
@@ -32,8 +32,45 @@ typedef struct Block {
 struct FreeList {
     Block* first;
     void* base_;
+    size_t size_;
+    // the region was mapped from a heap snapshot (see snapshot.h), rather than allocated
+    bool mapped_;
+#ifdef MARK_BITMAP
+    // outside the heap, from the system allocator
+    uint8_t* marks_;
+#endif
+#ifdef COMPRESSED_HEAP_REFS
+    // what references into this heap are relative to
+    uint8_t* heapBase_;
+#endif
 };
 
+#ifdef COMPRESSED_HEAP_REFS
+// a thread can run any number of VMs, one at a time: the public entry points into one make its heap the current one,
+// and put back whichever was (another VM's, if that's what called it) before they return
+#define ENTER_HEAP(vm) uint8_t* enclosingHeapBase = heapBase; heapBase = (vm)->freeList->heapBase_
+#define LEAVE_HEAP() heapBase = enclosingHeapBase
+#define ASSERT_HEAP(vm) assert(heapBase == (vm)->freeList->heapBase_ || !"Running against another VM's heap")
+#else
+#define ENTER_HEAP(vm) (void) (vm)
+#define LEAVE_HEAP() (void) 0
+#define ASSERT_HEAP(vm) (void) (vm)
+#endif
+
+#ifdef MARK_BITMAP
+// a bit for each byte of the heap, as objects can start anywhere in it
+#define MARK_OFFSET(freeList, object) ((size_t) ((uint8_t*) (object) - (uint8_t*) (freeList)->base_))
+#define MARK_BYTE(freeList, object) ((freeList)->marks_[MARK_OFFSET(freeList, object) >> 3])
+#define MARK_MASK(freeList, object) ((uint8_t) (1 << (MARK_OFFSET(freeList, object) & 7)))
+#define IS_MARKED(freeList, object) ((MARK_BYTE(freeList, object) & MARK_MASK(freeList, object)) != 0)
+#define SET_MARKED(freeList, object) (MARK_BYTE(freeList, object) |= MARK_MASK(freeList, object))
+#define CLEAR_MARKED(freeList, object) (MARK_BYTE(freeList, object) &= (uint8_t) ~MARK_MASK(freeList, object))
+#else
+#define IS_MARKED(freeList, object) ((void) (freeList), (object)->isMarked)
+#define SET_MARKED(freeList, object) ((void) (freeList), (object)->isMarked = true)
+#define CLEAR_MARKED(freeList, object) ((void) (freeList), (object)->isMarked = false)
+#endif
+
 void initMemory(FreeList* freeList, size_t size);
 void freeMemory(FreeList* freeList);
 void* reallocate(VM* vm, Compiler* compiler, void* pointer, size_t oldSize, size_t newSize);
@@ -3,12 +3,16 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "object.h"
+#include "shared.h"
+#include "isolate.h"
 
 static Obj* allocateObject(VM* vm, Compiler* compiler, size_t size, ObjType type) {
     Obj* object = (Obj*) reallocate(vm, compiler, NULL, 0, size);
     object->type = type;
+#ifndef MARK_BITMAP
     object->isMarked = false;
-    object->next = vm->objects;
+#endif
+    object->next = TO_HEAP_REF(vm->objects);
     vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
@@ -22,28 +26,105 @@ static Obj* allocateObject(VM* vm, Compiler* compiler, size_t size, ObjType type
 static ObjString* allocateString(VM* vm, Compiler* compiler, char* chars, uint32_t length, uint32_t hash) {
     ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->chars = TO_HEAP_REF(chars);
     string->hash = hash;
     // make new string visible to GC
     writeValue(vm, compiler, &vm->stack, OBJ_VAL(string));
-    tableSet(vm, compiler, &vm->strings, string, NIL_VAL);
+    internTableAdd(vm, compiler, &vm->strings, string);
     pop(vm);
     return string;
 }
 
+// wyhash-style: consumes 8 bytes per step and folds with a 64x64->128 bit multiply, which avalanches far better than FNV
+// and runs at close to memory bandwidth on long strings (concatenation results, file contents)
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6dbull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+    __extension__ unsigned __int128 product = (unsigned __int128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
 static uint32_t hashString(const char* key, uint32_t length) {
-    // FNV-1a
-    uint32_t hash = 2166136261u;
-    for (uint32_t i = 0; i < length; ++i) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+    const uint8_t* p = (const uint8_t*) key;
+    uint64_t seed = hashMix(HASH_P0, HASH_P1);
+    uint64_t a, b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            // two overlapping reads cover every byte of 4-16 byte strings without a loop
+            uint32_t shift = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - shift);
+        } else if (length > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint32_t remaining = length;
+        if (remaining > 48) {
+            // three independent lanes so the multiplies can overlap
+            uint64_t lane1 = seed, lane2 = seed;
+            do {
+                seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+                lane1 = hashMix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ lane1);
+                lane2 = hashMix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ lane2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while (remaining > 16) {
+            seed = hashMix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // final (possibly overlapping) 16 bytes
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return hash;
+
+    a ^= HASH_P1;
+    b ^= seed;
+    __extension__ unsigned __int128 product = (unsigned __int128) a * b;
+    a = (uint64_t) product;
+    b = (uint64_t) (product >> 64);
+    return (uint32_t) hashMix(a ^ HASH_P0 ^ length, b ^ HASH_P1);
+}
+
+#undef HASH_P0
+#undef HASH_P1
+#undef HASH_P2
+#undef HASH_P3
+
+// strings the VM's shared code already has are used rather than copied, so every string is still unique
+static ObjString* findInterned(VM* vm, const char* chars, uint32_t length, uint32_t hash) {
+    ObjString* interned = internTableFind(&vm->strings, chars, length, hash);
+#ifdef SHARED_CODE
+    if (!interned && vm->shared) interned = internTableFind(&vm->shared->vm.strings, chars, length, hash);
+#endif
+    return interned;
 }
 
 ObjString* copyString(VM* vm, Compiler* compiler, const char* chars, uint32_t length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
     if (interned) return interned;
 
     char* heapChars = COMPILER_ALLOCATE(char, length + 1);
@@ -52,11 +133,26 @@ ObjString* copyString(VM* vm, Compiler* compiler, const char* chars, uint32_t le
     return allocateString(vm, compiler, heapChars, length, hash);
 }
 
+Value stringValue(VM* vm, Compiler* compiler, const char* chars, uint32_t length) {
+#ifdef NAN_BOXING
+    if (length <= SMALL_STRING_MAX) return smallStringToValue(chars, length);
+#endif
+    return OBJ_VAL(copyString(vm, compiler, chars, length));
+}
+
 ObjFunction* newFunction(VM* vm, Compiler* compiler) {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
-    function->name = NULL;
+    function->name = TO_HEAP_REF(NULL);
+    function->hotness = 0;
+    function->optimised = false;
+#ifdef SHARED_CODE
+    function->frozen = false;
+#endif
+#ifdef COROUTINES
+    function->suspendedFrames = 0;
+#endif
     // GC shenanigans
     writeValue(vm, compiler, &vm->stack, OBJ_VAL(function));
     initChunk(vm, compiler, &function->chunk);
@@ -68,34 +164,34 @@ ObjFunction* newFunction(VM* vm, Compiler* compiler) {
 ObjBoundMethod* newBoundMethod(VM* vm, Compiler* compiler, Value receiver, ObjClosure* method) {
     ObjBoundMethod* boundMethod = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     boundMethod->receiver = receiver;
-    boundMethod->method = method;
+    boundMethod->method = TO_HEAP_REF(method);
     return boundMethod;
 }
 
 ObjClass* newClass(VM* vm, Compiler* compiler, ObjString* name) {
     ObjClass* class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    class->name = name;
+    class->name = TO_HEAP_REF(name);
     initTable(&class->methods);
     return class;
 }
 
 ObjInstance* newInstance(VM* vm, Compiler* compiler, ObjClass* class) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->class = class;
+    instance->class = TO_HEAP_REF(class);
     initTable(&instance->fields);
     return instance;
 }
 
 ObjClosure* newClosure(VM* vm, Compiler* compiler, ObjFunction* function) {
-    ObjUpvalue** upvalues = COMPILER_ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    HEAP_REF(ObjUpvalue)* upvalues = COMPILER_ALLOCATE(HEAP_REF(ObjUpvalue), function->upvalueCount);
 
     for (uint32_t i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        upvalues[i] = TO_HEAP_REF(NULL);
     }
 
     ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
+    closure->function = TO_HEAP_REF(function);
+    closure->upvalues = TO_HEAP_REF(upvalues);
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
@@ -107,9 +203,33 @@ ObjNative* newNative(VM* vm, Compiler* compiler, NativeFn function, uint8_t arit
     return native;
 }
 
+#ifdef COROUTINES
+ObjCoroutine* newCoroutine(VM* vm, Compiler* compiler, ObjClosure* closure) {
+    ObjCoroutine* coroutine = ALLOCATE_OBJ(ObjCoroutine, OBJ_COROUTINE);
+    coroutine->state = COROUTINE_NEW;
+    coroutine->closure = TO_HEAP_REF(closure);
+    // allocated once it's resumed, as nothing's keeping the coroutine alive yet
+    coroutine->stack = (ValueArray) {.capacity = 0, .count = 0, .values = NULL};
+    coroutine->frames = NULL;
+    coroutine->frameCount = 0;
+    coroutine->frameCapacity = 0;
+    coroutine->openUpvalues = NULL;
+    coroutine->resumer = TO_HEAP_REF(NULL);
+    return coroutine;
+}
+#endif
+
+#ifdef ISOLATES
+ObjChannel* newChannel(VM* vm, Compiler* compiler, Channel* channel) {
+    ObjChannel* object = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+#endif
+
 static void printFunction(Printer* print, ObjFunction* function) {
     if (function->name) {
-        print("<fn %s>", function->name->chars);
+        print("<fn %s>", STRING_CHARS(FROM_HEAP_REF(ObjString, function->name)));
     } else {
         print("<script>");
     }
@@ -118,22 +238,24 @@ static void printFunction(Printer* print, ObjFunction* function) {
 void printObject(Printer* print, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD: {
-            printFunction(print, AS_BOUND_METHOD(value)->method->function);
+            ObjClosure* method = FROM_HEAP_REF(ObjClosure, AS_BOUND_METHOD(value)->method);
+            printFunction(print, FROM_HEAP_REF(ObjFunction, method->function));
             break;
         }
         case OBJ_CLASS: {
-            print("%s", AS_CLASS(value)->name->chars);
+            print("%s", STRING_CHARS(FROM_HEAP_REF(ObjString, AS_CLASS(value)->name)));
             break;
         }
         case OBJ_CLOSURE: {
-            printFunction(print, AS_CLOSURE(value)->function);
+            printFunction(print, FROM_HEAP_REF(ObjFunction, AS_CLOSURE(value)->function));
             break;
         }
         case OBJ_FUNCTION:
             printFunction(print, AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE: {
-            print("%s instance", AS_INSTANCE(value)->class->name->chars);
+            ObjClass* class = FROM_HEAP_REF(ObjClass, AS_INSTANCE(value)->class);
+            print("%s instance", STRING_CHARS(FROM_HEAP_REF(ObjString, class->name)));
             break;
         }
         case OBJ_NATIVE:
@@ -145,6 +267,16 @@ void printObject(Printer* print, Value value) {
         case OBJ_UPVALUE:
             print("upvalue");
             break;
+#ifdef COROUTINES
+        case OBJ_COROUTINE:
+            print("<coroutine>");
+            break;
+#endif
+#ifdef ISOLATES
+        case OBJ_CHANNEL:
+            print("<channel>");
+            break;
+#endif
         case OBJ_NONE:
             assert(!"Use after free");
     }
@@ -152,7 +284,7 @@ void printObject(Printer* print, Value value) {
 
 ObjString* takeString(VM* vm, Compiler* compiler, char* chars, uint32_t length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
     if (interned) {
         VM_FREE_ARRAY(char, chars, length + 1);
         return interned;
@@ -163,8 +295,11 @@ ObjString* takeString(VM* vm, Compiler* compiler, char* chars, uint32_t length)
 ObjUpvalue* newUpvalue(VM* vm, Compiler* compiler, Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
+    upvalue->next = TO_HEAP_REF(NULL);
     upvalue->closed = NIL_VAL;
+#ifdef COROUTINES
+    upvalue->owner = TO_HEAP_REF(NULL);
+#endif
     return upvalue;
 }
 
@@ -189,7 +324,8 @@ void freeObject(VM* vm, Obj* object) {
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            VM_FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            VM_FREE_ARRAY(HEAP_REF(ObjUpvalue), FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues),
+                          closure->upvalueCount);
             VM_FREE(ObjClosure, object);
             break;
         }
@@ -211,7 +347,7 @@ void freeObject(VM* vm, Obj* object) {
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*) object;
-            VM_FREE_ARRAY(char, string->chars, string->length + 1);
+            VM_FREE_ARRAY(char, STRING_CHARS(string), string->length + 1);
             VM_FREE(ObjString, object);
             break;
         }
@@ -219,6 +355,22 @@ void freeObject(VM* vm, Obj* object) {
             VM_FREE(ObjUpvalue, object);
             break;
         }
+#ifdef COROUTINES
+        case OBJ_COROUTINE: {
+            ObjCoroutine* coroutine = (ObjCoroutine*) object;
+            freeValueArray(vm, &coroutine->stack);
+            VM_FREE_ARRAY(CallFrame, coroutine->frames, coroutine->frameCapacity);
+            VM_FREE(ObjCoroutine, object);
+            break;
+        }
+#endif
+#ifdef ISOLATES
+        case OBJ_CHANNEL: {
+            releaseChannel(((ObjChannel*) object)->channel);
+            VM_FREE(ObjChannel, object);
+            break;
+        }
+#endif
         case OBJ_NONE: {
             assert(!"Double free");
         }
@@ -228,7 +380,7 @@ void freeObject(VM* vm, Obj* object) {
 void freeObjects(VM* vm) {
     Obj* object = vm->objects;
     while (object) {
-        Obj* next = object->next;
+        Obj* next = FROM_HEAP_REF(Obj, object->next);
         freeObject(vm, object);
         object = next;
     }
@@ -236,14 +388,18 @@ void freeObjects(VM* vm) {
 
 void markObject(VM* vm, Obj* object) {
     if (!object) return;
-    if (object->isMarked) return;
+#ifdef SHARED_CODE
+    // frozen, so always live, and only refers to other shared objects
+    if (vm->shared && isSharedObject(vm->shared, object)) return;
+#endif
+    if (IS_MARKED(vm->freeList, object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*) object);
     printValue(printf, OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    SET_MARKED(vm->freeList, object);
 
     if (vm->greyCapacity < vm->greyCount + 1) {
         vm->greyCapacity = GROW_CAPACITY(vm->greyCapacity);
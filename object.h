@@ -6,6 +6,9 @@
 #include "value.h"
 #include "vm.h"
 
+// the types before OBJ_UPVALUE fit in the NaN boxed object type tag (see value.h), so any new types which values can
+// commonly hold should be added before it; types from OBJ_UPVALUE onwards are tagged as 0 and have to be read from the
+// object header instead
 typedef enum {
     OBJ_NONE,
     OBJ_BOUND_METHOD,
@@ -16,19 +19,27 @@ typedef enum {
     OBJ_NATIVE,
     OBJ_STRING,
     OBJ_UPVALUE,
+#ifdef COROUTINES
+    OBJ_COROUTINE,
+#endif
+#ifdef ISOLATES
+    OBJ_CHANNEL,
+#endif
 } ObjType;
 
 struct Obj {
     ObjType type;
+#ifndef MARK_BITMAP
     bool isMarked;
-    struct Obj* next;
+#endif
+    HEAP_REF(struct Obj) next;
 };
 
 struct ObjString {
     Obj obj;
     uint32_t length;
     uint32_t hash;
-    char* chars;
+    HEAP_REF(char) chars;
 };
 
 struct ObjUpvalue {
@@ -37,7 +48,11 @@ struct ObjUpvalue {
     Value* location;
     // for closed upvalues (i.e. the closed variable can't be reached elsewhere and will probably get GC'd when the closure is unreachable)
     Value closed;
-    ObjUpvalue* next;
+    HEAP_REF(ObjUpvalue) next;
+#ifdef COROUTINES
+    // the coroutine whose stack an open upvalue points into, which has to live as long as the upvalue does
+    HEAP_REF(ObjCoroutine) owner;
+#endif
 };
 
 struct ObjFunction {
@@ -45,18 +60,27 @@ struct ObjFunction {
     uint8_t arity;
     uint32_t upvalueCount;
     Chunk chunk;
-    ObjString* name;
+    HEAP_REF(ObjString) name;
+    // calls plus loop iterations, towards HOT_FUNCTION_THRESHOLD and JIT_THRESHOLD
+    uint32_t hotness;
+    bool optimised;
+#ifdef SHARED_CODE
+    // shared between VMs (see shared.h), so never counted, optimised or compiled again
+    bool frozen;
+#endif
+#ifdef COROUTINES
+    // frames running it in suspended coroutines, which would be left pointing into the old code if it was rebuilt
+    uint32_t suspendedFrames;
+#endif
 };
 
 struct ObjClosure {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues;
+    HEAP_REF(ObjFunction) function;
+    HEAP_REF(HEAP_REF(ObjUpvalue)) upvalues;
     uint32_t upvalueCount;
 };
 
-typedef bool (*NativeFn)(VM* vm, Value* out, Value* args);
-
 struct ObjNative {
     Obj obj;
     NativeFn function;
@@ -65,25 +89,67 @@ struct ObjNative {
 
 struct ObjClass {
     Obj obj;
-    ObjString* name;
+    HEAP_REF(ObjString) name;
     // TODO could probably make constructors faster by directly storing init method here
     Table methods;
 };
 
 struct ObjInstance {
     Obj obj;
-    ObjClass* class;
+    HEAP_REF(ObjClass) class;
     Table fields;
 };
 
 struct ObjBoundMethod {
     Obj obj;
     Value receiver;
-    ObjClosure* method;
+    HEAP_REF(ObjClosure) method;
+};
+
+#ifdef COROUTINES
+typedef enum {
+    COROUTINE_NEW,
+    COROUTINE_SUSPENDED,
+    COROUTINE_RUNNING,
+    COROUTINE_DONE,
+} CoroutineState;
+
+// a closure running on a stack of its own, which is swapped with the VM's as it's resumed and yields. Natives:
+//   coroutine(fn)            a new coroutine, which calls fn (taking at most one argument) when it's first resumed
+//   resume(coroutine, value) runs the coroutine until it yields or returns, giving back what it yielded or returned;
+//                            `value` is fn's argument the first time, and what yield() returns after that
+//   yield(value)             suspends the running coroutine, giving `value` to whatever resumed it
+//   done(coroutine)          whether the coroutine has returned (or failed), so can't be resumed again
+struct ObjCoroutine {
+    Obj obj;
+    CoroutineState state;
+    HEAP_REF(ObjClosure) closure;
+    // the coroutine's own stack, frames and open upvalues while it's not running; while it is, they're the stack it
+    // was resumed from
+    ValueArray stack;
+    CallFrame* frames;
+    uint8_t frameCount;
+    uint8_t frameCapacity;
+    ObjUpvalue* openUpvalues;
+    // the coroutine that resumed it (NULL for the VM's own stack) while it's running
+    HEAP_REF(ObjCoroutine) resumer;
 };
+#endif
+
+#ifdef ISOLATES
+// see isolate.h
+typedef struct Channel Channel;
+
+// one of the VM's references to a channel, which is outside every heap
+struct ObjChannel {
+    Obj obj;
+    Channel* channel;
+};
+#endif
 
 ObjString* copyString(VM* vm, Compiler* compiler, const char* chars, uint32_t length);
 ObjString* takeString(VM* vm, Compiler* compiler, char* chars, uint32_t length);
+Value stringValue(VM* vm, Compiler* compiler, const char* chars, uint32_t length);
 ObjUpvalue* newUpvalue(VM* vm, Compiler* compiler, Value* slot);
 ObjFunction* newFunction(VM* vm, Compiler* compiler);
 ObjBoundMethod* newBoundMethod(VM* vm, Compiler* compiler, Value receiver, ObjClosure* method);
@@ -91,20 +157,72 @@ ObjClass* newClass(VM* vm, Compiler* compiler, ObjString* name);
 ObjClosure* newClosure(VM* vm, Compiler* compiler, ObjFunction* objFunction);
 ObjInstance* newInstance(VM* vm, Compiler* compiler, ObjClass* class);
 ObjNative* newNative(VM* vm, Compiler* compiler, NativeFn function, uint8_t arity);
+#ifdef COROUTINES
+ObjCoroutine* newCoroutine(VM* vm, Compiler* compiler, ObjClosure* closure);
+#endif
+#ifdef ISOLATES
+// takes over a reference to `channel`, which is released when the object's freed
+ObjChannel* newChannel(VM* vm, Compiler* compiler, Channel* channel);
+#endif
 void printObject(Printer* print, Value value);
 void freeObjects(VM* vm);
 void freeObject(VM* vm, Obj* object);
 void markObject(VM* vm, Obj* object);
 
+#ifdef NAN_BOXING
+#define IS_TAGGED_OBJ_TYPE(type) ((type) < OBJ_UPVALUE)
+
+static inline Value objToValue(Obj* object) {
+    uint64_t tag = IS_TAGGED_OBJ_TYPE(object->type) ? object->type : 0;
+    return (Value) (SIGN_BIT | QNAN | (tag << OBJ_TAG_SHIFT) | (uint64_t) (uintptr_t) object);
+}
+
+static inline bool isObjType(Value value, ObjType type) {
+    // `type` is a constant in all the IS_* macros, so only one of these branches survives
+    if (IS_TAGGED_OBJ_TYPE(type)) {
+        return (value & (SIGN_BIT | QNAN | OBJ_TAG_MASK)) == (SIGN_BIT | QNAN | ((uint64_t) type << OBJ_TAG_SHIFT));
+    }
+    return IS_OBJ(value) && !OBJ_TAG(value) && AS_OBJ(value)->type == type;
+}
+
+static inline ObjType objType(Value value) {
+    uint32_t tag = OBJ_TAG(value);
+    return tag ? (ObjType) tag : AS_OBJ(value)->type;
+}
+
+#define OBJ_TYPE(value) objType(value)
+#else
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#endif
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define AS_STRING(value) ((ObjString*) AS_OBJ(value))
-#define AS_CSTRING(value) (AS_STRING(value)->chars)
+#define STRING_CHARS(string) FROM_HEAP_REF(char, (string)->chars)
+#define AS_CSTRING(value) STRING_CHARS(AS_STRING(value))
+// string values may be either an ObjString or a small string (see value.h)
+#define IS_ANY_STRING(value) (IS_SMALL_STRING(value) || IS_STRING(value))
+
+static inline uint32_t stringValueLength(Value value) {
+#ifdef NAN_BOXING
+    if (IS_SMALL_STRING(value)) return SMALL_STRING_LENGTH(value);
+#endif
+    return AS_STRING(value)->length;
+}
+
+// doesn't null terminate
+static inline void copyStringValueChars(Value value, char* dest) {
+#ifdef NAN_BOXING
+    if (IS_SMALL_STRING(value)) {
+        smallStringChars(value, dest);
+        return;
+    }
+#endif
+    memcpy(dest, AS_CSTRING(value), AS_STRING(value)->length);
+}
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
@@ -118,5 +236,19 @@ static inline bool isObjType(Value value, ObjType type) {
 #define AS_FUNCTION(value) ((ObjFunction*) AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*) AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*) AS_OBJ(value)))
+#ifdef COROUTINES
+#define IS_COROUTINE(value) isObjType(value, OBJ_COROUTINE)
+#define AS_COROUTINE(value) ((ObjCoroutine*) AS_OBJ(value))
+#endif
+#ifdef ISOLATES
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define AS_CHANNEL(value) ((ObjChannel*) AS_OBJ(value))
+#endif
+
+#ifdef SHARED_CODE
+#define IS_FROZEN(function) ((function)->frozen)
+#else
+#define IS_FROZEN(function) false
+#endif
 
 #endif //CLOX_OBJECT_H
@@ -0,0 +1,2204 @@
+#include <assert.h>
+#include <string.h>
+#include "optimiser.h"
+#include "memory.h"
+#include "peephole.h"
+
+// anything bigger is left as it is
+#define MAX_INSTRUCTIONS 4096
+#define MAX_VALUES 16384
+// callees no bigger than this (in bytes of bytecode) are inlined
+#define INLINE_MAX_BYTES 64
+#define INLINE_MAX_SITES 16
+
+#define NONE UINT32_MAX
+// values which don't correspond to an instruction
+#define IR_PHI 0x100
+#define IR_PARAM 0x101
+
+// what an SSA value is known to hold: NONE is "not yet known" while types are being inferred
+typedef enum {
+    IR_TYPE_NONE,
+    IR_TYPE_NUMBER,
+    IR_TYPE_BOOL,
+    IR_TYPE_NIL,
+    IR_TYPE_ANY,
+} IrType;
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* items;
+} IndexArray;
+
+typedef struct {
+    uint16_t op;
+    uint8_t type;
+    // can't fail or have side effects, so can be moved, merged with an identical value, or removed
+    bool pure;
+    bool live;
+    // part of a block's instruction list (constants and parameters never are)
+    bool scheduled;
+    // evaluated straight onto the stack by its only user, rather than being kept in a slot
+    bool inlined;
+    uint32_t block;
+    uint32_t line;
+    uint32_t immediate;
+    uint32_t immediate2;
+    uint32_t operands;
+    uint32_t operandCount;
+    // set once the value has been found to be the same as another one
+    uint32_t replacement;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t position;
+    uint32_t useCount;
+    // the only user if there's exactly one, or NONE if that's the block's exit
+    uint32_t user;
+    uint32_t userBlock;
+    // the phi it's copied into, to try and share a slot
+    uint32_t phi;
+    uint32_t reg;
+    uint32_t firstRange;
+    // the inlined call it came from, if any
+    uint32_t site;
+} IrValue;
+
+typedef enum {
+    EXIT_JUMP,
+    EXIT_BRANCH,
+    EXIT_RETURN,
+} ExitKind;
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    ExitKind exit;
+    uint8_t branchOp;
+    // a branch's successors are the jump target, then the fall through
+    uint32_t successors[2];
+    uint32_t exitValue;
+    uint32_t line;
+    IndexArray preds;
+    uint32_t first;
+    uint32_t last;
+    uint32_t firstPhi;
+    uint32_t phiCount;
+    uint32_t exitState;
+    uint32_t exitHeight;
+    bool reachable;
+    // position in reverse postorder
+    uint32_t rpo;
+    // only entered from a branch, so can pop the condition itself rather than needing a stub to do it
+    bool popOnEntry;
+    uint32_t preheader;
+    uint32_t startPos;
+    uint32_t endPos;
+    uint32_t codeOffset;
+    uint32_t site;
+    // a guard's constants: the method name (if a method call) and the closure expected to be called
+    uint32_t guardName;
+    uint32_t guardClosure;
+} IrBlock;
+
+// a range of emission positions over which a value's slot mustn't be reused
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    uint32_t next;
+} LiveRange;
+
+typedef struct {
+    VM* vm;
+    ObjFunction* function;
+    Chunk* chunk;
+    uint32_t arity;
+    bool failed;
+
+    IrValue* values;
+    uint32_t valueCount;
+    uint32_t valueCapacity;
+    IrBlock* blocks;
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+    LiveRange* ranges;
+    uint32_t rangeCount;
+    uint32_t rangeCapacity;
+
+    IndexArray operands;
+    IndexArray states;
+    IndexArray constants;
+    // blocks in emission order
+    IndexArray order;
+    IndexArray loops;
+    // slot (minus the parameters) -> values sharing it
+    IndexArray* registers;
+    uint32_t registerCount;
+    IndexArray patches;
+    // (callee constant, line of the call) for each inlined call
+    IndexArray sites;
+    uint32_t currentSite;
+
+    uint32_t bitsetWords;
+    uint32_t dominatorWords;
+    uint64_t* dominators;
+    uint64_t* loopBodies;
+
+    uint8_t* code;
+    uint32_t* codeLines;
+    uint32_t* codeSites;
+    uint32_t codeCount;
+    uint32_t codeCapacity;
+} Optimiser;
+
+static void appendIndex(Optimiser* opt, IndexArray* array, uint32_t index) {
+    VM* vm = opt->vm;
+    if (array->count == array->capacity) {
+        uint32_t oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->items = VM_GROW_ARRAY(uint32_t, array->items, oldCapacity, array->capacity);
+    }
+    array->items[array->count++] = index;
+}
+
+static void freeIndexArray(Optimiser* opt, IndexArray* array) {
+    VM* vm = opt->vm;
+    VM_FREE_ARRAY(uint32_t, array->items, array->capacity);
+    *array = (IndexArray) {0};
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP;
+}
+
+static bool isSupported(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_LOCAL_POP_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_POP:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+        case OP_EQUAL_RK:
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_EQUAL_RK_STORE:
+        case OP_GREATER_RK_STORE:
+        case OP_LESS_RK_STORE:
+        case OP_ADD_RK_STORE:
+        case OP_SUBTRACT_RK_STORE:
+        case OP_MULTIPLY_RK_STORE:
+        case OP_DIVIDE_RK_STORE:
+        case OP_MOVE:
+            return true;
+        default:
+            // closures & upvalue capture, classes, and the rarer long forms
+            return false;
+    }
+}
+
+static bool isConstant(uint16_t op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+// stores leave the stored value on the stack, but don't count as producing a new one
+static bool hasResult(uint16_t op) {
+    return op != OP_PRINT && op != OP_SET_GLOBAL && op != OP_SET_PROPERTY && op != OP_SET_UPVALUE;
+}
+
+static bool isCommutative(uint16_t op) {
+    return op == OP_ADD || op == OP_MULTIPLY || op == OP_EQUAL;
+}
+
+static uint32_t readOperand(Chunk* chunk, uint32_t offset, bool wide) {
+    if (wide) {
+        return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    }
+    return chunk->code[offset + 1];
+}
+
+static uint32_t jumpTarget(Chunk* chunk, uint32_t offset) {
+    uint32_t distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+}
+
+static uint32_t resolve(Optimiser* opt, uint32_t value) {
+    while (opt->values[value].replacement != NONE) value = opt->values[value].replacement;
+    return value;
+}
+
+static uint32_t operand(Optimiser* opt, uint32_t value, uint32_t index) {
+    return resolve(opt, opt->operands.items[opt->values[value].operands + index]);
+}
+
+static uint32_t newValue(Optimiser* opt, uint16_t op, uint32_t block, uint32_t line, uint32_t operandCount) {
+    VM* vm = opt->vm;
+    if (opt->valueCount == MAX_VALUES) {
+        opt->failed = true;
+        return 0;
+    }
+    if (opt->valueCount == opt->valueCapacity) {
+        uint32_t oldCapacity = opt->valueCapacity;
+        opt->valueCapacity = GROW_CAPACITY(oldCapacity);
+        opt->values = VM_GROW_ARRAY(IrValue, opt->values, oldCapacity, opt->valueCapacity);
+    }
+
+    uint32_t index = opt->valueCount++;
+    opt->values[index] = (IrValue) {
+            .op = op,
+            .type = IR_TYPE_NONE,
+            .block = block,
+            .line = line,
+            .operands = opt->operands.count,
+            .operandCount = operandCount,
+            .replacement = NONE,
+            .prev = NONE,
+            .next = NONE,
+            .user = NONE,
+            .phi = NONE,
+            .reg = NONE,
+            .firstRange = NONE,
+            .site = NONE,
+    };
+    for (uint32_t i = 0; i < operandCount; i++) {
+        appendIndex(opt, &opt->operands, NONE);
+    }
+    return index;
+}
+
+static uint32_t newBlock(Optimiser* opt) {
+    VM* vm = opt->vm;
+    if (opt->blockCount == opt->blockCapacity) {
+        uint32_t oldCapacity = opt->blockCapacity;
+        opt->blockCapacity = GROW_CAPACITY(oldCapacity);
+        opt->blocks = VM_GROW_ARRAY(IrBlock, opt->blocks, oldCapacity, opt->blockCapacity);
+    }
+
+    uint32_t index = opt->blockCount++;
+    opt->blocks[index] = (IrBlock) {
+            .exit = EXIT_JUMP,
+            .successors = {NONE, NONE},
+            .exitValue = NONE,
+            .first = NONE,
+            .last = NONE,
+            .firstPhi = NONE,
+            .preheader = NONE,
+            .site = NONE,
+    };
+    return index;
+}
+
+static void schedule(Optimiser* opt, uint32_t block, uint32_t value) {
+    IrBlock* irBlock = opt->blocks + block;
+    IrValue* irValue = opt->values + value;
+    irValue->block = block;
+    irValue->scheduled = true;
+    irValue->prev = irBlock->last;
+    irValue->next = NONE;
+    if (irBlock->last == NONE) {
+        irBlock->first = value;
+    } else {
+        opt->values[irBlock->last].next = value;
+    }
+    irBlock->last = value;
+}
+
+static void unschedule(Optimiser* opt, uint32_t value) {
+    IrValue* irValue = opt->values + value;
+    if (!irValue->scheduled) return;
+    IrBlock* irBlock = opt->blocks + irValue->block;
+    if (irValue->prev == NONE) {
+        irBlock->first = irValue->next;
+    } else {
+        opt->values[irValue->prev].next = irValue->next;
+    }
+    if (irValue->next == NONE) {
+        irBlock->last = irValue->prev;
+    } else {
+        opt->values[irValue->next].prev = irValue->prev;
+    }
+    irValue->scheduled = false;
+    irValue->prev = NONE;
+    irValue->next = NONE;
+}
+
+// constants (including nil, true & false) are shared, so identical expressions have identical operands
+static uint32_t constant(Optimiser* opt, uint16_t op, uint32_t index) {
+    for (uint32_t i = 0; i < opt->constants.count; i++) {
+        IrValue* value = opt->values + opt->constants.items[i];
+        if (value->op == op && value->immediate == index) return opt->constants.items[i];
+    }
+
+    uint32_t value = newValue(opt, op, 0, 0, 0);
+    opt->values[value].immediate = index;
+    opt->values[value].pure = true;
+    appendIndex(opt, &opt->constants, value);
+    return value;
+}
+
+static bool hasBit(uint64_t* bits, uint32_t index) {
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static void setBit(uint64_t* bits, uint32_t index) {
+    bits[index / 64] |= 1ull << (index % 64);
+}
+
+// blocks are built and emitted in reverse postorder, so each one comes after all of its predecessors other than those
+// reaching it via a loop's back edge (a for loop's increment comes before its body in the bytecode)
+static void orderBlocks(Optimiser* opt, bool collectPreds) {
+    VM* vm = opt->vm;
+    uint32_t* nextSuccessor = VM_ALLOCATE(uint32_t, opt->blockCount);
+    memset(nextSuccessor, 0, sizeof(uint32_t) * opt->blockCount);
+    for (uint32_t block = 0; block < opt->blockCount; block++) {
+        opt->blocks[block].reachable = block == 0;
+    }
+    opt->order.count = 0;
+
+    IndexArray stack = {0};
+    IndexArray postorder = {0};
+    appendIndex(opt, &stack, 0);
+    while (stack.count > 0) {
+        uint32_t block = stack.items[stack.count - 1];
+        if (nextSuccessor[block] == 2) {
+            stack.count--;
+            appendIndex(opt, &postorder, block);
+            continue;
+        }
+        uint32_t successor = opt->blocks[block].successors[nextSuccessor[block]++];
+        if (successor == NONE) continue;
+        // predecessors only count reachable blocks
+        if (collectPreds) appendIndex(opt, &opt->blocks[successor].preds, block);
+        if (!opt->blocks[successor].reachable) {
+            opt->blocks[successor].reachable = true;
+            appendIndex(opt, &stack, successor);
+        }
+    }
+    for (uint32_t i = postorder.count; i-- > 0;) {
+        opt->blocks[postorder.items[i]].rpo = opt->order.count;
+        appendIndex(opt, &opt->order, postorder.items[i]);
+    }
+    freeIndexArray(opt, &postorder);
+    freeIndexArray(opt, &stack);
+    VM_FREE_ARRAY(uint32_t, nextSuccessor, opt->blockCount);
+}
+
+// splits the bytecode into basic blocks; block 0 is an empty entry block, so even the first real block can be a loop
+// header with a single forward predecessor
+static void buildBlocks(Optimiser* opt) {
+    VM* vm = opt->vm;
+    Chunk* chunk = opt->chunk;
+    uint32_t count = chunk->count;
+    bool* leaders = VM_ALLOCATE(bool, count + 1);
+    uint32_t* blockAt = VM_ALLOCATE(uint32_t, count + 1);
+    memset(leaders, 0, sizeof(bool) * (count + 1));
+
+    leaders[0] = true;
+    uint32_t instructions = 0;
+    for (uint32_t offset = 0; offset < count && !opt->failed; offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (!isSupported(op) || ++instructions > MAX_INSTRUCTIONS) {
+            opt->failed = true;
+            break;
+        }
+        uint32_t next = offset + instructionLength(chunk, offset);
+        if (isJump(op)) leaders[jumpTarget(chunk, offset)] = true;
+        if (isJump(op) || op == OP_RETURN) leaders[next] = true;
+    }
+
+    if (!opt->failed) {
+        uint32_t entry = newBlock(opt);
+        opt->blocks[entry].reachable = true;
+        for (uint32_t offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+            if (leaders[offset]) {
+                blockAt[offset] = newBlock(opt);
+                opt->blocks[blockAt[offset]].start = offset;
+            }
+        }
+        opt->blocks[entry].successors[0] = 1;
+
+        for (uint32_t block = 1; block < opt->blockCount; block++) {
+            IrBlock* irBlock = opt->blocks + block;
+            irBlock->end = block + 1 < opt->blockCount ? opt->blocks[block + 1].start : count;
+            uint32_t last = irBlock->start;
+            for (uint32_t offset = irBlock->start; offset < irBlock->end; offset += instructionLength(chunk, offset)) {
+                last = offset;
+            }
+
+            uint8_t op = chunk->code[last];
+            irBlock->line = getLine(chunk, last);
+            if (op == OP_RETURN) {
+                irBlock->exit = EXIT_RETURN;
+            } else if (irBlock->end >= count) {
+                // falls off the end of the chunk, which the compiler never does
+                opt->failed = true;
+            } else if (op == OP_JUMP || op == OP_LOOP) {
+                irBlock->successors[0] = blockAt[jumpTarget(chunk, last)];
+            } else if (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE) {
+                irBlock->exit = EXIT_BRANCH;
+                irBlock->branchOp = op;
+                irBlock->successors[0] = blockAt[jumpTarget(chunk, last)];
+                irBlock->successors[1] = blockAt[irBlock->end];
+            } else {
+                irBlock->successors[0] = blockAt[irBlock->end];
+            }
+        }
+    }
+
+    if (!opt->failed) {
+        orderBlocks(opt, true);
+
+        // keep predecessors in a stable order, for phi operands
+        for (uint32_t block = 0; block < opt->blockCount; block++) {
+            IndexArray* preds = &opt->blocks[block].preds;
+            for (uint32_t i = 1; i < preds->count; i++) {
+                uint32_t pred = preds->items[i];
+                uint32_t j = i;
+                for (; j > 0 && preds->items[j - 1] > pred; j--) preds->items[j] = preds->items[j - 1];
+                preds->items[j] = pred;
+            }
+        }
+    }
+
+    VM_FREE_ARRAY(uint32_t, blockAt, count + 1);
+    VM_FREE_ARRAY(bool, leaders, count + 1);
+}
+
+static uint32_t popState(Optimiser* opt, IndexArray* stack) {
+    if (stack->count == 0) {
+        opt->failed = true;
+        return 0;
+    }
+    return stack->items[--stack->count];
+}
+
+static uint32_t emitIr(Optimiser* opt, IndexArray* stack, uint16_t op, uint32_t block, uint32_t line,
+                       uint32_t operandCount) {
+    if (stack->count < operandCount) {
+        opt->failed = true;
+        return 0;
+    }
+    uint32_t value = newValue(opt, op, block, line, operandCount);
+    if (opt->failed) return 0;
+    stack->count -= operandCount;
+    for (uint32_t i = 0; i < operandCount; i++) {
+        opt->operands.items[opt->values[value].operands + i] = stack->items[stack->count + i];
+    }
+    schedule(opt, block, value);
+    return value;
+}
+
+// the value a register instruction's operand reads, given the stack before the instruction
+static uint32_t registerValue(Optimiser* opt, IndexArray* stack, uint8_t operand) {
+    if (operand & RK_CONSTANT) return constant(opt, OP_CONSTANT, operand & ~RK_CONSTANT);
+    if (operand >= stack->count) {
+        opt->failed = true;
+        return 0;
+    }
+    return stack->items[operand];
+}
+
+// abstractly interprets a block's instructions, turning stack slots (locals and temporaries alike) into SSA values
+static void buildBlock(Optimiser* opt, uint32_t block, IndexArray* stack) {
+    Chunk* chunk = opt->chunk;
+    IrBlock* irBlock = opt->blocks + block;
+    stack->count = 0;
+
+    if (block == 0) {
+        for (uint32_t slot = 0; slot <= opt->arity; slot++) {
+            uint32_t param = newValue(opt, IR_PARAM, 0, 0, 0);
+            opt->values[param].immediate = slot;
+            appendIndex(opt, stack, param);
+        }
+    } else {
+        uint32_t forward = NONE;
+        bool merge = irBlock->preds.count > 1;
+        for (uint32_t i = 0; i < irBlock->preds.count; i++) {
+            uint32_t pred = irBlock->preds.items[i];
+            if (opt->blocks[pred].rpo >= irBlock->rpo) {
+                merge = true;
+            } else if (forward == NONE) {
+                forward = pred;
+            } else if (opt->blocks[pred].exitHeight != opt->blocks[forward].exitHeight) {
+                opt->failed = true;
+            }
+        }
+        if (forward == NONE || opt->failed) {
+            opt->failed = true;
+            return;
+        }
+
+        IrBlock* pred = opt->blocks + forward;
+        if (merge) irBlock->firstPhi = opt->valueCount;
+        for (uint32_t slot = 0; slot < pred->exitHeight; slot++) {
+            uint32_t value = opt->states.items[pred->exitState + slot];
+            if (merge) {
+                // filled in once every predecessor has been built
+                value = newValue(opt, IR_PHI, block, irBlock->line, irBlock->preds.count);
+                if (opt->failed) return;
+                schedule(opt, block, value);
+                irBlock->phiCount++;
+            }
+            appendIndex(opt, stack, value);
+        }
+    }
+
+    for (uint32_t offset = irBlock->start; offset < irBlock->end && !opt->failed;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        uint32_t line = getLine(chunk, offset);
+        bool wide = instructionLength(chunk, offset) == 4;
+        uint32_t value = NONE;
+
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                appendIndex(opt, stack, constant(opt, OP_CONSTANT, readOperand(chunk, offset, wide)));
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                appendIndex(opt, stack, constant(opt, op, 0));
+                break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG: {
+                uint32_t slot = readOperand(chunk, offset, wide);
+                if (slot >= stack->count) {
+                    opt->failed = true;
+                    break;
+                }
+                appendIndex(opt, stack, stack->items[slot]);
+                break;
+            }
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_LONG:
+            case OP_SET_LOCAL_POP:
+            case OP_SET_LOCAL_POP_LONG: {
+                uint32_t slot = readOperand(chunk, offset, wide);
+                uint32_t top = op == OP_SET_LOCAL || op == OP_SET_LOCAL_LONG
+                               ? (stack->count ? stack->items[stack->count - 1] : NONE)
+                               : popState(opt, stack);
+                if (slot >= stack->count || top == NONE) {
+                    opt->failed = true;
+                    break;
+                }
+                stack->items[slot] = top;
+                break;
+            }
+            case OP_POP:
+                popState(opt, stack);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                value = emitIr(opt, stack, OP_GET_GLOBAL, block, line, 0);
+                opt->values[value].immediate = readOperand(chunk, offset, wide);
+                appendIndex(opt, stack, value);
+                break;
+            case OP_GET_UPVALUE:
+                value = emitIr(opt, stack, op, block, line, 0);
+                opt->values[value].immediate = readOperand(chunk, offset, false);
+                appendIndex(opt, stack, value);
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+            case OP_SET_UPVALUE: {
+                if (stack->count == 0) {
+                    opt->failed = true;
+                    break;
+                }
+                uint32_t stored = stack->items[stack->count - 1];
+                value = emitIr(opt, stack, op == OP_SET_UPVALUE ? OP_SET_UPVALUE : OP_SET_GLOBAL, block, line, 1);
+                opt->values[value].immediate = readOperand(chunk, offset, wide);
+                appendIndex(opt, stack, stored);
+                break;
+            }
+            case OP_GET_PROPERTY:
+                value = emitIr(opt, stack, op, block, line, 1);
+                opt->values[value].immediate = readOperand(chunk, offset, false);
+                appendIndex(opt, stack, value);
+                break;
+            case OP_SET_PROPERTY: {
+                if (stack->count < 2) {
+                    opt->failed = true;
+                    break;
+                }
+                uint32_t stored = stack->items[stack->count - 1];
+                value = emitIr(opt, stack, op, block, line, 2);
+                opt->values[value].immediate = readOperand(chunk, offset, false);
+                appendIndex(opt, stack, stored);
+                break;
+            }
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                appendIndex(opt, stack, emitIr(opt, stack, op, block, line, 2));
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                appendIndex(opt, stack, emitIr(opt, stack, op, block, line, 1));
+                break;
+            case OP_EQUAL_RK:
+            case OP_GREATER_RK:
+            case OP_LESS_RK:
+            case OP_ADD_RK:
+            case OP_SUBTRACT_RK:
+            case OP_MULTIPLY_RK:
+            case OP_DIVIDE_RK:
+            case OP_EQUAL_RK_STORE:
+            case OP_GREATER_RK_STORE:
+            case OP_LESS_RK_STORE:
+            case OP_ADD_RK_STORE:
+            case OP_SUBTRACT_RK_STORE:
+            case OP_MULTIPLY_RK_STORE:
+            case OP_DIVIDE_RK_STORE:
+            case OP_MOVE: {
+                // the same as pushing the operands, then doing the stack instruction's work
+                uint32_t length = instructionLength(chunk, offset);
+                uint32_t height = stack->count;
+                uint32_t a = registerValue(opt, stack, chunk->code[offset + 1]);
+                if (op == OP_MOVE) {
+                    value = a;
+                } else {
+                    uint32_t b = registerValue(opt, stack, chunk->code[offset + 2]);
+                    appendIndex(opt, stack, a);
+                    appendIndex(opt, stack, b);
+                    value = emitIr(opt, stack, stackOp(op), block, line, 2);
+                }
+                if (op != OP_MOVE && !isRegisterStore(op)) {
+                    appendIndex(opt, stack, value);
+                } else if (chunk->code[offset + length - 1] >= height) {
+                    opt->failed = true;
+                } else {
+                    stack->items[chunk->code[offset + length - 1]] = value;
+                }
+                break;
+            }
+            case OP_PRINT:
+                emitIr(opt, stack, op, block, line, 1);
+                break;
+            // tail calls are modelled as plain calls, and put back when the return is emitted
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                uint32_t argumentCount = chunk->code[offset + 1];
+                value = emitIr(opt, stack, OP_CALL, block, line, argumentCount + 1);
+                opt->values[value].immediate = argumentCount;
+                appendIndex(opt, stack, value);
+                break;
+            }
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE: {
+                uint32_t argumentCount = chunk->code[offset + 2];
+                value = emitIr(opt, stack, OP_INVOKE, block, line, argumentCount + 1);
+                opt->values[value].immediate = chunk->code[offset + 1];
+                opt->values[value].immediate2 = argumentCount;
+                appendIndex(opt, stack, value);
+                break;
+            }
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+                // the condition stays on the stack for both successors
+                if (stack->count == 0) {
+                    opt->failed = true;
+                    break;
+                }
+                irBlock->exitValue = stack->items[stack->count - 1];
+                break;
+            case OP_RETURN:
+                irBlock->exitValue = popState(opt, stack);
+                break;
+            default:
+                break;
+        }
+    }
+
+    irBlock->exitState = opt->states.count;
+    irBlock->exitHeight = stack->count;
+    for (uint32_t i = 0; i < stack->count; i++) {
+        appendIndex(opt, &opt->states, stack->items[i]);
+    }
+}
+
+static void buildSsa(Optimiser* opt) {
+    IndexArray stack = {0};
+    for (uint32_t i = 0; i < opt->order.count && !opt->failed; i++) {
+        buildBlock(opt, opt->order.items[i], &stack);
+    }
+    freeIndexArray(opt, &stack);
+
+    for (uint32_t i = 0; i < opt->order.count && !opt->failed; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        for (uint32_t phi = 0; phi < block->phiCount; phi++) {
+            IrValue* value = opt->values + block->firstPhi + phi;
+            for (uint32_t p = 0; p < block->preds.count; p++) {
+                IrBlock* pred = opt->blocks + block->preds.items[p];
+                if (pred->exitHeight != block->phiCount) {
+                    opt->failed = true;
+                    return;
+                }
+                opt->operands.items[value->operands + p] = opt->states.items[pred->exitState + phi];
+            }
+        }
+    }
+}
+
+// a phi whose operands are all the same value (or itself) is just a copy of that value; removing these is what turns
+// the locals' GET/SET traffic into direct references, i.e. copy propagation
+static void removeTrivialPhis(Optimiser* opt) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t v = 0; v < opt->valueCount; v++) {
+            IrValue* value = opt->values + v;
+            if (value->op != IR_PHI || value->replacement != NONE) continue;
+
+            uint32_t same = NONE;
+            bool trivial = true;
+            for (uint32_t i = 0; i < value->operandCount; i++) {
+                uint32_t input = operand(opt, v, i);
+                if (input == v || input == same) continue;
+                if (same != NONE) {
+                    trivial = false;
+                    break;
+                }
+                same = input;
+            }
+            if (trivial && same != NONE) {
+                value->replacement = same;
+                unschedule(opt, v);
+                changed = true;
+            }
+        }
+    }
+}
+
+static void freeOptimiser(Optimiser* opt);
+
+// finds (or adds) `value` in the function's own constants
+static uint32_t chunkConstant(Optimiser* opt, Value value) {
+    ValueArray* constants = &opt->chunk->constants;
+    for (uint32_t i = 0; i < constants->count; i++) {
+        // bitwise, as 1 and 1.0 print differently
+        if (memcmp(constants->values + i, &value, sizeof(Value)) == 0) return i;
+    }
+    writeValue(opt->vm, NULL, constants, value);
+    return constants->count - 1;
+}
+
+// the closure a call is expected to reach: whatever the global being called currently holds, or the only method of
+// that name in any class held by a global
+static ObjClosure* expectedCallee(Optimiser* opt, uint32_t call) {
+    IrValue* value = opt->values + call;
+    Value callee = NIL_VAL;
+    if (value->op == OP_CALL) {
+        IrValue* target = opt->values + operand(opt, call, 0);
+        if (target->op != OP_GET_GLOBAL) return NULL;
+        ObjString* name = AS_STRING(opt->chunk->constants.values[target->immediate]);
+        if (!tableGet(&opt->vm->globals, name, &callee)) return NULL;
+    } else {
+        ObjString* name = AS_STRING(opt->chunk->constants.values[value->immediate]);
+        Table* globals = &opt->vm->globals;
+        for (uint32_t i = 0; i < globals->capacity; i++) {
+            if (globals->control[i] & 0x80) continue;
+            Value method;
+            if (!IS_CLASS(globals->entries[i].value) ||
+                !tableGet(&AS_CLASS(globals->entries[i].value)->methods, name, &method)) {
+                continue;
+            }
+            if (!IS_NIL(callee) && !valuesEqual(callee, method)) return NULL;
+            callee = method;
+        }
+    }
+    if (!IS_CLOSURE(callee)) return NULL;
+
+    ObjClosure* closure = AS_CLOSURE(callee);
+    ObjFunction* function = FROM_HEAP_REF(ObjFunction, closure->function);
+    uint32_t argumentCount = value->op == OP_CALL ? value->immediate : value->immediate2;
+    // upvalues would be the callee's, not the caller's
+    if (closure->upvalueCount != 0 || function == opt->function || function->arity != argumentCount ||
+        function->chunk.count > INLINE_MAX_BYTES) {
+        return NULL;
+    }
+    return closure;
+}
+
+// operands which refer to constants by index, and how many bytes they're encoded in
+static uint32_t constantOperandWidth(uint16_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// splices the callee's IR in place of `call`, behind a check that the callee (or the method the receiver would invoke)
+// really is the expected closure, falling back to the call itself if not:
+//
+//     before; guard ? inlined body : call; after
+static void spliceCall(Optimiser* opt, Optimiser* callee, uint32_t call, uint32_t closureConstant) {
+    VM* vm = opt->vm;
+    uint32_t* valueMap = VM_ALLOCATE(uint32_t, callee->valueCount);
+    uint32_t* constantMap = VM_ALLOCATE(uint32_t, callee->chunk->constants.count);
+    uint32_t* blockMap = VM_ALLOCATE(uint32_t, callee->blockCount);
+    uint32_t calleeConstants = callee->chunk->constants.count;
+    for (uint32_t i = 0; i < calleeConstants; i++) constantMap[i] = NONE;
+
+    // check every constant the callee refers to fits in the caller before changing anything
+    bool fits = true;
+    for (uint32_t v = 0; v < callee->valueCount && fits; v++) {
+        IrValue* value = callee->values + v;
+        uint32_t width = constantOperandWidth(value->op);
+        if (width == 0 || value->replacement != NONE) continue;
+        if (constantMap[value->immediate] == NONE) {
+            constantMap[value->immediate] = chunkConstant(opt, callee->chunk->constants.values[value->immediate]);
+        }
+        fits = constantMap[value->immediate] < (width == 1 ? UINT8_COUNT : 1u << 24);
+    }
+
+    if (fits) {
+        IrValue* callValue = opt->values + call;
+        uint32_t line = callValue->line;
+        uint32_t site = opt->sites.count / 2;
+        appendIndex(opt, &opt->sites, closureConstant);
+        appendIndex(opt, &opt->sites, line);
+
+        for (uint32_t b = 0; b < callee->blockCount; b++) blockMap[b] = NONE;
+        for (uint32_t i = 0; i < callee->order.count; i++) {
+            uint32_t newIndex = newBlock(opt);
+            blockMap[callee->order.items[i]] = newIndex;
+            opt->blocks[newIndex].site = site;
+        }
+
+        for (uint32_t v = 0; v < callee->valueCount && !opt->failed; v++) {
+            IrValue* value = callee->values + v;
+            valueMap[v] = NONE;
+            if (value->replacement != NONE) continue;
+            if (value->op == IR_PARAM) {
+                // slot zero is the callee itself, or the receiver of a method
+                valueMap[v] = operand(opt, call, value->immediate);
+            } else if (isConstant(value->op)) {
+                valueMap[v] = constant(opt, value->op, value->op == OP_CONSTANT ? constantMap[value->immediate] : 0);
+            } else {
+                uint32_t copy = newValue(opt, value->op, blockMap[value->block], value->line, value->operandCount);
+                if (opt->failed) break;
+                opt->values[copy].immediate = constantOperandWidth(value->op) ? constantMap[value->immediate]
+                                                                               : value->immediate;
+                opt->values[copy].immediate2 = value->immediate2;
+                opt->values[copy].site = site;
+                valueMap[v] = copy;
+            }
+        }
+    }
+
+    if (fits && !opt->failed) {
+        for (uint32_t v = 0; v < callee->valueCount; v++) {
+            IrValue* value = callee->values + v;
+            if (value->replacement != NONE || value->op == IR_PARAM || isConstant(value->op)) continue;
+            for (uint32_t i = 0; i < value->operandCount; i++) {
+                opt->operands.items[opt->values[valueMap[v]].operands + i] = valueMap[operand(callee, v, i)];
+            }
+        }
+
+        uint32_t block = opt->values[call].block;
+        uint32_t line = opt->values[call].line;
+        // a call whose result is returned straight away is returned from each path instead, so the fallback call, and
+        // any the callee makes in tail position, are still tail calls
+        bool tail = opt->blocks[block].exit == EXIT_RETURN && opt->values[call].next == NONE &&
+                    resolve(opt, opt->blocks[block].exitValue) == call;
+        uint32_t after = tail ? NONE : newBlock(opt);
+        uint32_t fallback = newBlock(opt);
+        uint32_t result = tail ? NONE : newValue(opt, IR_PHI, after, line, 0);
+
+        // the rest of the block (and its exit) moves after the call
+        IrBlock* before = opt->blocks + block;
+        if (!tail) {
+            IrBlock* rest = opt->blocks + after;
+            rest->exit = before->exit;
+            rest->branchOp = before->branchOp;
+            rest->successors[0] = before->successors[0];
+            rest->successors[1] = before->successors[1];
+            rest->exitValue = before->exitValue;
+            rest->line = before->line;
+            for (uint32_t s = 0; s < 2; s++) {
+                if (rest->successors[s] == NONE) continue;
+                IndexArray* preds = &opt->blocks[rest->successors[s]].preds;
+                for (uint32_t p = 0; p < preds->count; p++) {
+                    if (preds->items[p] == block) preds->items[p] = after;
+                }
+            }
+            schedule(opt, after, result);
+            for (uint32_t v = opt->values[call].next; v != NONE;) {
+                uint32_t next = opt->values[v].next;
+                unschedule(opt, v);
+                schedule(opt, after, v);
+                v = next;
+            }
+        }
+
+        unschedule(opt, call);
+        // a global callee is read again rather than kept in a slot, so the guard can test it straight off the stack
+        uint32_t target = operand(opt, call, 0);
+        if (opt->values[call].op == OP_CALL && opt->values[target].op == OP_GET_GLOBAL) {
+            uint32_t reload = newValue(opt, OP_GET_GLOBAL, fallback, line, 0);
+            if (!opt->failed) {
+                opt->values[reload].immediate = opt->values[target].immediate;
+                opt->operands.items[opt->values[call].operands] = reload;
+                schedule(opt, fallback, reload);
+            }
+        }
+        schedule(opt, fallback, call);
+        IrBlock* slowPath = opt->blocks + fallback;
+        slowPath->line = line;
+        appendIndex(opt, &slowPath->preds, block);
+        if (tail) {
+            slowPath->exit = EXIT_RETURN;
+            slowPath->exitValue = call;
+        } else {
+            slowPath->successors[0] = after;
+            // every other use of the call's result now uses the phi
+            for (uint32_t i = 0; i < opt->operands.count; i++) {
+                if (opt->operands.items[i] != NONE && resolve(opt, opt->operands.items[i]) == call) {
+                    opt->operands.items[i] = result;
+                }
+            }
+            for (uint32_t b = 0; b < opt->blockCount; b++) {
+                if (opt->blocks[b].exitValue != NONE && resolve(opt, opt->blocks[b].exitValue) == call) {
+                    opt->blocks[b].exitValue = result;
+                }
+            }
+        }
+
+        // jumps to the inlined code, so it's laid out to fall through to the code after the call
+        before = opt->blocks + block;
+        before->exit = EXIT_BRANCH;
+        before->branchOp = opt->values[call].op == OP_CALL ? OP_JUMP_IF_CALLEE : OP_JUMP_IF_INVOKES;
+        before->guardName = opt->values[call].immediate;
+        before->guardClosure = closureConstant;
+        before->successors[0] = blockMap[0];
+        before->successors[1] = fallback;
+        before->exitValue = target;
+        before->line = line;
+
+        IndexArray returns = {0};
+        if (!tail) appendIndex(opt, &opt->blocks[after].preds, fallback);
+        appendIndex(opt, &returns, call);
+        for (uint32_t i = 0; i < callee->order.count; i++) {
+            uint32_t original = callee->order.items[i];
+            IrBlock* from = callee->blocks + original;
+            IrBlock* to = opt->blocks + blockMap[original];
+            to->line = from->line;
+            to->branchOp = from->branchOp;
+            for (uint32_t p = 0; p < from->preds.count; p++) {
+                appendIndex(opt, &to->preds, blockMap[from->preds.items[p]]);
+            }
+            if (from->exit == EXIT_RETURN && tail) {
+                to->exit = EXIT_RETURN;
+                to->exitValue = valueMap[resolve(callee, from->exitValue)];
+            } else if (from->exit == EXIT_RETURN) {
+                to->exit = EXIT_JUMP;
+                to->successors[0] = after;
+                appendIndex(opt, &opt->blocks[after].preds, blockMap[original]);
+                appendIndex(opt, &returns, valueMap[resolve(callee, from->exitValue)]);
+            } else {
+                to->exit = from->exit;
+                for (uint32_t s = 0; s < 2; s++) {
+                    if (from->successors[s] != NONE) to->successors[s] = blockMap[from->successors[s]];
+                }
+                if (from->exit == EXIT_BRANCH) to->exitValue = valueMap[resolve(callee, from->exitValue)];
+            }
+            for (uint32_t v = from->first; v != NONE; v = callee->values[v].next) {
+                schedule(opt, blockMap[original], valueMap[v]);
+            }
+        }
+        appendIndex(opt, &opt->blocks[blockMap[0]].preds, block);
+
+        // a phi's operands have to be allocated along with it
+        if (!tail) {
+            IrValue* phi = opt->values + result;
+            phi->operands = opt->operands.count;
+            phi->operandCount = returns.count;
+            for (uint32_t i = 0; i < returns.count; i++) appendIndex(opt, &opt->operands, returns.items[i]);
+        }
+        freeIndexArray(opt, &returns);
+    }
+
+    VM_FREE_ARRAY(uint32_t, blockMap, callee->blockCount);
+    VM_FREE_ARRAY(uint32_t, constantMap, calleeConstants);
+    VM_FREE_ARRAY(uint32_t, valueMap, callee->valueCount);
+}
+
+// small functions and methods are inlined into their callers (but not into themselves, or each other)
+static void inlineCalls(Optimiser* opt) {
+    IndexArray calls = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        for (uint32_t v = opt->blocks[opt->order.items[i]].first; v != NONE; v = opt->values[v].next) {
+            uint16_t op = opt->values[v].op;
+            if ((op == OP_CALL || op == OP_INVOKE) && calls.count < INLINE_MAX_SITES) appendIndex(opt, &calls, v);
+        }
+    }
+
+    bool inlined = false;
+    for (uint32_t i = 0; i < calls.count && !opt->failed; i++) {
+        ObjClosure* closure = expectedCallee(opt, calls.items[i]);
+        if (!closure) continue;
+        // the guard refers to it with a single byte
+        uint32_t closureConstant = chunkConstant(opt, OBJ_VAL(closure));
+        if (closureConstant > UINT8_MAX) continue;
+
+        ObjFunction* function = FROM_HEAP_REF(ObjFunction, closure->function);
+        Optimiser callee = {
+                .vm = opt->vm,
+                .function = function,
+                .chunk = &function->chunk,
+                .arity = function->arity,
+                .currentSite = NONE,
+        };
+        buildBlocks(&callee);
+        if (!callee.failed) buildSsa(&callee);
+        if (!callee.failed) {
+            removeTrivialPhis(&callee);
+            spliceCall(opt, &callee, calls.items[i], closureConstant);
+            inlined = true;
+        }
+        freeOptimiser(&callee);
+    }
+    freeIndexArray(opt, &calls);
+
+    if (inlined) orderBlocks(opt, false);
+}
+
+static IrType joinTypes(IrType a, IrType b) {
+    if (a == IR_TYPE_NONE) return b;
+    if (b == IR_TYPE_NONE || a == b) return a;
+    return IR_TYPE_ANY;
+}
+
+static IrType valueType(Optimiser* opt, uint32_t v) {
+    IrValue* value = opt->values + v;
+    switch (value->op) {
+        case OP_CONSTANT: {
+            Value constant = opt->chunk->constants.values[value->immediate];
+            return IS_NUMBER(constant) ? IR_TYPE_NUMBER : IR_TYPE_ANY;
+        }
+        case OP_NIL:
+            return IR_TYPE_NIL;
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT:
+            return IR_TYPE_BOOL;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+            // either a number, or a runtime error
+            return IR_TYPE_NUMBER;
+        case OP_ADD: {
+            IrType a = opt->values[operand(opt, v, 0)].type;
+            IrType b = opt->values[operand(opt, v, 1)].type;
+            if (a == IR_TYPE_NONE || b == IR_TYPE_NONE) return IR_TYPE_NONE;
+            return a == IR_TYPE_NUMBER && b == IR_TYPE_NUMBER ? IR_TYPE_NUMBER : IR_TYPE_ANY;
+        }
+        case IR_PHI: {
+            IrType type = IR_TYPE_NONE;
+            for (uint32_t i = 0; i < value->operandCount; i++) {
+                type = joinTypes(type, opt->values[operand(opt, v, i)].type);
+            }
+            return type;
+        }
+        default:
+            return IR_TYPE_ANY;
+    }
+}
+
+static bool isNumber(Optimiser* opt, uint32_t v, uint32_t index) {
+    return opt->values[operand(opt, v, index)].type == IR_TYPE_NUMBER;
+}
+
+// optimistic, so a loop counter starting at a number and only ever incremented by numbers is a number
+static void inferTypes(Optimiser* opt) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t v = 0; v < opt->valueCount; v++) {
+            if (opt->values[v].replacement != NONE) continue;
+            IrType type = valueType(opt, v);
+            if (type != opt->values[v].type) {
+                opt->values[v].type = type;
+                changed = true;
+            }
+        }
+    }
+
+    for (uint32_t v = 0; v < opt->valueCount; v++) {
+        IrValue* value = opt->values + v;
+        switch (value->op) {
+            case OP_EQUAL:
+            case OP_NOT:
+                value->pure = true;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_LESS:
+            case OP_GREATER:
+                value->pure = isNumber(opt, v, 0) && isNumber(opt, v, 1);
+                break;
+            case OP_NEGATE:
+                value->pure = isNumber(opt, v, 0);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void computeDominators(Optimiser* opt) {
+    VM* vm = opt->vm;
+    uint32_t words = opt->bitsetWords = (opt->blockCount + 63) / 64;
+    opt->dominatorWords = words * opt->blockCount;
+    opt->dominators = VM_ALLOCATE(uint64_t, opt->dominatorWords);
+    for (uint32_t block = 0; block < opt->blockCount; block++) {
+        memset(opt->dominators + block * words, block == 0 ? 0 : 0xff, sizeof(uint64_t) * words);
+    }
+    setBit(opt->dominators, 0);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = 1; i < opt->order.count; i++) {
+            uint32_t block = opt->order.items[i];
+            uint64_t* dominators = opt->dominators + block * words;
+            IndexArray* preds = &opt->blocks[block].preds;
+            for (uint32_t w = 0; w < words; w++) {
+                uint64_t word = ~0ull;
+                for (uint32_t p = 0; p < preds->count; p++) {
+                    word &= opt->dominators[preds->items[p] * words + w];
+                }
+                if (w == block / 64) word |= 1ull << (block % 64);
+                if (word != dominators[w]) {
+                    dominators[w] = word;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static bool dominates(Optimiser* opt, uint32_t dominator, uint32_t block) {
+    return hasBit(opt->dominators + block * opt->bitsetWords, dominator);
+}
+
+static bool sameExpression(Optimiser* opt, uint32_t a, uint32_t b) {
+    IrValue* x = opt->values + a;
+    IrValue* y = opt->values + b;
+    if (x->op != y->op || x->immediate != y->immediate || x->operandCount != y->operandCount) {
+        return false;
+    }
+
+    bool same = true;
+    for (uint32_t i = 0; i < x->operandCount && same; i++) {
+        same = operand(opt, a, i) == operand(opt, b, i);
+    }
+    if (!same && isCommutative(x->op)) {
+        same = operand(opt, a, 0) == operand(opt, b, 1) && operand(opt, a, 1) == operand(opt, b, 0);
+    }
+    return same;
+}
+
+// replaces a pure value with an identical one which dominates it
+static void eliminateCommonSubexpressions(Optimiser* opt) {
+    IndexArray available = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        for (uint32_t v = opt->blocks[block].first; v != NONE;) {
+            uint32_t next = opt->values[v].next;
+            if (opt->values[v].pure) {
+                bool replaced = false;
+                for (uint32_t a = 0; a < available.count && !replaced; a++) {
+                    uint32_t candidate = available.items[a];
+                    if (dominates(opt, opt->values[candidate].block, block) && sameExpression(opt, candidate, v)) {
+                        opt->values[v].replacement = candidate;
+                        unschedule(opt, v);
+                        replaced = true;
+                    }
+                }
+                if (!replaced) appendIndex(opt, &available, v);
+            }
+            v = next;
+        }
+    }
+    freeIndexArray(opt, &available);
+}
+
+static bool inLoop(Optimiser* opt, uint32_t loop, uint32_t block) {
+    return hasBit(opt->loopBodies + loop * opt->bitsetWords, block);
+}
+
+// gives every loop (entered from a single block) a preheader, which invariant values are moved into
+static void findLoops(Optimiser* opt) {
+    VM* vm = opt->vm;
+    uint32_t originalCount = opt->order.count;
+    for (uint32_t i = 0; i < originalCount; i++) {
+        uint32_t header = opt->order.items[i];
+        IndexArray* preds = &opt->blocks[header].preds;
+        uint32_t forward = NONE;
+        uint32_t forwardCount = 0;
+        bool isLoop = false;
+        bool reducible = true;
+        for (uint32_t p = 0; p < preds->count; p++) {
+            uint32_t pred = preds->items[p];
+            if (opt->blocks[pred].rpo >= opt->blocks[header].rpo) {
+                isLoop = true;
+                reducible = reducible && dominates(opt, header, pred);
+            } else if (pred != forward) {
+                forward = pred;
+                forwardCount++;
+            }
+        }
+        if (!isLoop || !reducible || forwardCount != 1) continue;
+
+        uint32_t preheader = newBlock(opt);
+        IrBlock* block = opt->blocks + preheader;
+        IrBlock* pred = opt->blocks + forward;
+        block->reachable = true;
+        block->rpo = opt->blocks[header].rpo;
+        block->successors[0] = header;
+        block->line = pred->line;
+        block->exitState = pred->exitState;
+        block->exitHeight = pred->exitHeight;
+        appendIndex(opt, &block->preds, forward);
+        for (uint32_t s = 0; s < 2; s++) {
+            if (pred->successors[s] == header) pred->successors[s] = preheader;
+        }
+        preds = &opt->blocks[header].preds;
+        for (uint32_t p = 0; p < preds->count; p++) {
+            if (preds->items[p] == forward) preds->items[p] = preheader;
+        }
+        opt->blocks[header].preheader = preheader;
+        appendIndex(opt, &opt->loops, header);
+    }
+
+    // preheaders go directly before their loop
+    IndexArray order = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        if (opt->blocks[block].preheader != NONE) appendIndex(opt, &order, opt->blocks[block].preheader);
+        appendIndex(opt, &order, block);
+    }
+    freeIndexArray(opt, &opt->order);
+    opt->order = order;
+
+    // the dominator sets don't include preheaders, but aren't needed after this
+    VM_FREE_ARRAY(uint64_t, opt->dominators, opt->dominatorWords);
+    opt->dominators = NULL;
+    opt->dominatorWords = 0;
+    uint32_t words = opt->bitsetWords = (opt->blockCount + 63) / 64;
+    opt->loopBodies = VM_ALLOCATE(uint64_t, words * opt->loops.count);
+    // NULL without any loops, which memset() mustn't be given even to clear nothing
+    if (opt->loops.count) memset(opt->loopBodies, 0, sizeof(uint64_t) * words * opt->loops.count);
+
+    IndexArray worklist = {0};
+    for (uint32_t loop = 0; loop < opt->loops.count; loop++) {
+        uint32_t header = opt->loops.items[loop];
+        uint64_t* body = opt->loopBodies + loop * words;
+        setBit(body, header);
+        IndexArray* preds = &opt->blocks[header].preds;
+        for (uint32_t p = 0; p < preds->count; p++) {
+            if (preds->items[p] != opt->blocks[header].preheader) appendIndex(opt, &worklist, preds->items[p]);
+        }
+        while (worklist.count > 0) {
+            uint32_t block = worklist.items[--worklist.count];
+            if (hasBit(body, block)) continue;
+            setBit(body, block);
+            IndexArray* blockPreds = &opt->blocks[block].preds;
+            for (uint32_t p = 0; p < blockPreds->count; p++) appendIndex(opt, &worklist, blockPreds->items[p]);
+        }
+    }
+    freeIndexArray(opt, &worklist);
+}
+
+static bool isInvariant(Optimiser* opt, uint32_t loop, uint32_t v) {
+    for (uint32_t i = 0; i < opt->values[v].operandCount; i++) {
+        IrValue* input = opt->values + operand(opt, v, i);
+        if (input->scheduled && inLoop(opt, loop, input->block)) return false;
+    }
+    return true;
+}
+
+// pure values can't fail, so can be computed before the loop even if the loop body never runs
+static void hoistLoopInvariants(Optimiser* opt) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t loop = 0; loop < opt->loops.count; loop++) {
+            uint32_t preheader = opt->blocks[opt->loops.items[loop]].preheader;
+            for (uint32_t i = 0; i < opt->order.count; i++) {
+                uint32_t block = opt->order.items[i];
+                if (!inLoop(opt, loop, block)) continue;
+
+                for (uint32_t v = opt->blocks[block].first; v != NONE;) {
+                    uint32_t next = opt->values[v].next;
+                    if (opt->values[v].pure && isInvariant(opt, loop, v)) {
+                        unschedule(opt, v);
+                        schedule(opt, preheader, v);
+                        changed = true;
+                    }
+                    v = next;
+                }
+            }
+        }
+    }
+}
+
+static void markLive(Optimiser* opt, IndexArray* worklist, uint32_t v) {
+    v = resolve(opt, v);
+    if (opt->values[v].live) return;
+    opt->values[v].live = true;
+    appendIndex(opt, worklist, v);
+}
+
+// anything which can fail or has side effects is kept, along with whatever it (transitively) uses
+static void eliminateDeadCode(Optimiser* opt) {
+    IndexArray worklist = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        for (uint32_t v = block->first; v != NONE; v = opt->values[v].next) {
+            if (!opt->values[v].pure && opt->values[v].op != IR_PHI) markLive(opt, &worklist, v);
+        }
+        if (block->exit != EXIT_JUMP) markLive(opt, &worklist, block->exitValue);
+    }
+    while (worklist.count > 0) {
+        uint32_t v = worklist.items[--worklist.count];
+        for (uint32_t i = 0; i < opt->values[v].operandCount; i++) {
+            markLive(opt, &worklist, operand(opt, v, i));
+        }
+    }
+    freeIndexArray(opt, &worklist);
+
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        for (uint32_t v = block->first; v != NONE;) {
+            uint32_t next = opt->values[v].next;
+            if (!opt->values[v].live) unschedule(opt, v);
+            v = next;
+        }
+    }
+}
+
+// the predecessor index of `pred` in `block`, for picking phi operands
+static uint32_t predIndex(Optimiser* opt, uint32_t block, uint32_t pred) {
+    IndexArray* preds = &opt->blocks[block].preds;
+    for (uint32_t i = 0; i < preds->count; i++) {
+        if (preds->items[i] == pred) return i;
+    }
+    assert(!"Not a predecessor");
+    return 0;
+}
+
+static void noteUse(Optimiser* opt, uint32_t v, uint32_t user, uint32_t block) {
+    IrValue* value = opt->values + v;
+    value->useCount++;
+    value->user = user;
+    value->userBlock = block;
+}
+
+// whether a value lives in a slot of its own (as opposed to being a constant, a parameter, or inlined into its user)
+static bool needsSlot(IrValue* value) {
+    return value->live && !value->inlined && value->useCount > 0 && hasResult(value->op) &&
+           !isConstant(value->op) && value->op != IR_PARAM;
+}
+
+static bool isOrdered(IrValue* value) {
+    return !value->pure && value->op != IR_PHI;
+}
+
+static uint32_t previousOrdered(Optimiser* opt, uint32_t v) {
+    while (v != NONE && !isOrdered(opt->values + v)) v = opt->values[v].prev;
+    return v;
+}
+
+static bool canInline(Optimiser* opt, uint32_t v, uint32_t block) {
+    IrValue* value = opt->values + v;
+    if (!value->scheduled || value->block != block || value->op == IR_PHI || !hasResult(value->op)) return false;
+    if (value->useCount != 1 || value->userBlock != block) return false;
+    return value->user == NONE || opt->values[value->user].op != IR_PHI;
+}
+
+// operands are evaluated first to last when their user is emitted, so working backwards from the user, a value which
+// can fail (or has side effects) can only be inlined if it's the last such value not already accounted for
+static void inlineOperands(Optimiser* opt, uint32_t block, uint32_t v, uint32_t* cursor) {
+    for (uint32_t i = opt->values[v].operandCount; i-- > 0;) {
+        uint32_t input = operand(opt, v, i);
+        if (!canInline(opt, input, block)) continue;
+        if (opt->values[input].pure) {
+            opt->values[input].inlined = true;
+            inlineOperands(opt, block, input, cursor);
+        } else if (input == *cursor) {
+            opt->values[input].inlined = true;
+            *cursor = previousOrdered(opt, opt->values[input].prev);
+            inlineOperands(opt, block, input, cursor);
+        }
+    }
+}
+
+// values with one user in the same block are evaluated directly onto the stack by that user, as long as that doesn't
+// reorder anything which can fail or has side effects
+static void chooseInlining(Optimiser* opt) {
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        IrBlock* irBlock = opt->blocks + block;
+        for (uint32_t v = irBlock->first; v != NONE; v = opt->values[v].next) {
+            for (uint32_t o = 0; o < opt->values[v].operandCount; o++) {
+                noteUse(opt, operand(opt, v, o), v, block);
+            }
+        }
+        if (irBlock->exit != EXIT_JUMP) noteUse(opt, resolve(opt, irBlock->exitValue), NONE, block);
+    }
+
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        IrBlock* irBlock = opt->blocks + block;
+        uint32_t cursor = previousOrdered(opt, irBlock->last);
+        if (irBlock->exit != EXIT_JUMP) {
+            uint32_t exit = resolve(opt, irBlock->exitValue);
+            if (canInline(opt, exit, block) && (opt->values[exit].pure || exit == cursor)) {
+                if (exit == cursor) cursor = previousOrdered(opt, opt->values[exit].prev);
+                opt->values[exit].inlined = true;
+                inlineOperands(opt, block, exit, &cursor);
+            }
+        }
+
+        for (uint32_t v = irBlock->last; v != NONE; v = opt->values[v].prev) {
+            if (opt->values[v].inlined || opt->values[v].op == IR_PHI) continue;
+            cursor = previousOrdered(opt, opt->values[v].prev);
+            inlineOperands(opt, block, v, &cursor);
+        }
+    }
+}
+
+static void addRange(Optimiser* opt, uint32_t v, uint32_t start, uint32_t end) {
+    VM* vm = opt->vm;
+    if (opt->rangeCount == opt->rangeCapacity) {
+        uint32_t oldCapacity = opt->rangeCapacity;
+        opt->rangeCapacity = GROW_CAPACITY(oldCapacity);
+        opt->ranges = VM_GROW_ARRAY(LiveRange, opt->ranges, oldCapacity, opt->rangeCapacity);
+    }
+    opt->ranges[opt->rangeCount] = (LiveRange) {.start = start, .end = end, .next = opt->values[v].firstRange};
+    opt->values[v].firstRange = opt->rangeCount++;
+}
+
+// the values with slots which are read when `v` is evaluated, looking through anything inlined into it
+static void collectReads(Optimiser* opt, uint32_t v, IndexArray* reads) {
+    for (uint32_t i = 0; i < opt->values[v].operandCount; i++) {
+        uint32_t input = operand(opt, v, i);
+        if (opt->values[input].inlined) {
+            collectReads(opt, input, reads);
+        } else if (needsSlot(opt->values + input)) {
+            appendIndex(opt, reads, input);
+        }
+    }
+}
+
+// everything read at the end of a block: its exit value, and the operands of its successors' phis
+static void collectExitReads(Optimiser* opt, uint32_t block, IndexArray* reads) {
+    IrBlock* irBlock = opt->blocks + block;
+    if (irBlock->exit != EXIT_JUMP) {
+        uint32_t exit = resolve(opt, irBlock->exitValue);
+        if (opt->values[exit].inlined) {
+            collectReads(opt, exit, reads);
+        } else if (needsSlot(opt->values + exit)) {
+            appendIndex(opt, reads, exit);
+        }
+    }
+    for (uint32_t s = 0; s < 2; s++) {
+        uint32_t successor = irBlock->successors[s];
+        if (successor == NONE) continue;
+        uint32_t index = predIndex(opt, successor, block);
+        for (uint32_t phi = opt->blocks[successor].first; phi != NONE && opt->values[phi].op == IR_PHI;
+             phi = opt->values[phi].next) {
+            uint32_t input = operand(opt, phi, index);
+            if (needsSlot(opt->values + phi) && input != phi && needsSlot(opt->values + input)) {
+                appendIndex(opt, reads, input);
+            }
+        }
+    }
+}
+
+static bool rangesConflict(Optimiser* opt, uint32_t a, uint32_t b) {
+    for (uint32_t x = opt->values[a].firstRange; x != NONE; x = opt->ranges[x].next) {
+        for (uint32_t y = opt->values[b].firstRange; y != NONE; y = opt->ranges[y].next) {
+            LiveRange* r = opt->ranges + x;
+            LiveRange* s = opt->ranges + y;
+            // a slot can be written at the same point its last value is read, as reads come first
+            if ((r->start < s->end && s->start < r->end) || r->start == s->start) return true;
+        }
+    }
+    return false;
+}
+
+static bool registerFree(Optimiser* opt, uint32_t reg, uint32_t v) {
+    IndexArray* occupants = opt->registers + reg;
+    for (uint32_t i = 0; i < occupants->count; i++) {
+        if (rangesConflict(opt, occupants->items[i], v)) return false;
+    }
+    return true;
+}
+
+static void assignRegister(Optimiser* opt, uint32_t v, uint32_t reg) {
+    VM* vm = opt->vm;
+    if (reg == opt->registerCount) {
+        opt->registers = VM_GROW_ARRAY(IndexArray, opt->registers, opt->registerCount, opt->registerCount + 1);
+        opt->registers[opt->registerCount++] = (IndexArray) {0};
+    }
+    opt->values[v].reg = reg;
+    appendIndex(opt, opt->registers + reg, v);
+}
+
+// numbers emission points in block order, works out exactly where each value with a slot is live, then packs values
+// into as few slots as possible, preferring to give a phi's operands the phi's own slot so the copy disappears
+static void allocateRegisters(Optimiser* opt) {
+    VM* vm = opt->vm;
+    uint32_t position = 0;
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        block->startPos = position++;
+        for (uint32_t v = block->first; v != NONE; v = opt->values[v].next) {
+            IrValue* value = opt->values + v;
+            if (value->op == IR_PHI) {
+                value->position = block->startPos;
+            } else if (!value->inlined) {
+                value->position = position++;
+            }
+        }
+        block->endPos = position++;
+    }
+
+    uint32_t words = (opt->valueCount + 63) / 64;
+    uint64_t* liveIn = VM_ALLOCATE(uint64_t, words * opt->blockCount);
+    uint64_t* liveOut = VM_ALLOCATE(uint64_t, words * opt->blockCount);
+    uint64_t* uses = VM_ALLOCATE(uint64_t, words * opt->blockCount);
+    memset(liveIn, 0, sizeof(uint64_t) * words * opt->blockCount);
+    memset(liveOut, 0, sizeof(uint64_t) * words * opt->blockCount);
+    memset(uses, 0, sizeof(uint64_t) * words * opt->blockCount);
+
+    IndexArray reads = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        reads.count = 0;
+        for (uint32_t v = opt->blocks[block].first; v != NONE; v = opt->values[v].next) {
+            if (opt->values[v].op != IR_PHI && !opt->values[v].inlined) collectReads(opt, v, &reads);
+        }
+        collectExitReads(opt, block, &reads);
+        for (uint32_t r = 0; r < reads.count; r++) {
+            if (opt->values[reads.items[r]].block != block) setBit(uses + block * words, reads.items[r]);
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint32_t i = opt->order.count; i-- > 0;) {
+            uint32_t block = opt->order.items[i];
+            IrBlock* irBlock = opt->blocks + block;
+            uint64_t* out = liveOut + block * words;
+            uint64_t* in = liveIn + block * words;
+            for (uint32_t s = 0; s < 2; s++) {
+                if (irBlock->successors[s] == NONE) continue;
+                uint64_t* successorIn = liveIn + irBlock->successors[s] * words;
+                for (uint32_t w = 0; w < words; w++) out[w] |= successorIn[w];
+            }
+            for (uint32_t w = 0; w < words; w++) {
+                uint64_t word = uses[block * words + w] | out[w];
+                // minus everything defined here
+                for (uint32_t bit = 0; bit < 64 && word; bit++) {
+                    uint32_t v = w * 64 + bit;
+                    if (((word >> bit) & 1) && opt->values[v].block == block && opt->values[v].scheduled) {
+                        word &= ~(1ull << bit);
+                    }
+                }
+                if ((in[w] | word) != in[w]) {
+                    in[w] |= word;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // walk each block backwards, opening a range at the last read of a value and closing it at its definition
+    uint32_t* openUntil = VM_ALLOCATE(uint32_t, opt->valueCount);
+    for (uint32_t v = 0; v < opt->valueCount; v++) openUntil[v] = NONE;
+    IndexArray open = {0};
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        IrBlock* irBlock = opt->blocks + block;
+        open.count = 0;
+        for (uint32_t v = 0; v < opt->valueCount; v++) {
+            if (hasBit(liveOut + block * words, v)) {
+                openUntil[v] = irBlock->endPos;
+                appendIndex(opt, &open, v);
+            }
+        }
+        reads.count = 0;
+        collectExitReads(opt, block, &reads);
+        for (uint32_t r = 0; r < reads.count; r++) {
+            uint32_t v = reads.items[r];
+            if (openUntil[v] == NONE) {
+                openUntil[v] = irBlock->endPos;
+                appendIndex(opt, &open, v);
+            }
+        }
+
+        for (uint32_t v = irBlock->last; v != NONE; v = opt->values[v].prev) {
+            IrValue* value = opt->values + v;
+            uint32_t defined = value->op == IR_PHI ? irBlock->startPos : value->position;
+            if (value->inlined) continue;
+            if (needsSlot(value)) {
+                addRange(opt, v, defined, openUntil[v] == NONE ? defined : openUntil[v]);
+                openUntil[v] = NONE;
+            }
+            if (value->op == IR_PHI) continue;
+
+            reads.count = 0;
+            collectReads(opt, v, &reads);
+            for (uint32_t r = 0; r < reads.count; r++) {
+                uint32_t input = reads.items[r];
+                if (openUntil[input] == NONE) {
+                    openUntil[input] = value->position;
+                    appendIndex(opt, &open, input);
+                }
+            }
+        }
+        for (uint32_t o = 0; o < open.count; o++) {
+            uint32_t v = open.items[o];
+            if (openUntil[v] != NONE) {
+                addRange(opt, v, irBlock->startPos, openUntil[v]);
+                openUntil[v] = NONE;
+            }
+        }
+    }
+
+    // phis are written at the end of each predecessor
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        for (uint32_t phi = block->first; phi != NONE && opt->values[phi].op == IR_PHI; phi = opt->values[phi].next) {
+            if (!needsSlot(opt->values + phi)) continue;
+            for (uint32_t p = 0; p < block->preds.count; p++) {
+                uint32_t end = opt->blocks[block->preds.items[p]].endPos;
+                addRange(opt, phi, end, end);
+                uint32_t input = operand(opt, phi, p);
+                if (input != phi) opt->values[input].phi = phi;
+            }
+        }
+    }
+
+    // in order of first use, so each slot is filled roughly front to back
+    IndexArray byStart = {0};
+    for (uint32_t v = 0; v < opt->valueCount; v++) {
+        if (!needsSlot(opt->values + v) || opt->values[v].firstRange == NONE) continue;
+        uint32_t start = NONE;
+        for (uint32_t r = opt->values[v].firstRange; r != NONE; r = opt->ranges[r].next) {
+            if (opt->ranges[r].start < start) start = opt->ranges[r].start;
+        }
+        opt->values[v].position = start;
+        appendIndex(opt, &byStart, v);
+    }
+    for (uint32_t i = 1; i < byStart.count; i++) {
+        uint32_t v = byStart.items[i];
+        uint32_t j = i;
+        for (; j > 0 && opt->values[byStart.items[j - 1]].position > opt->values[v].position; j--) {
+            byStart.items[j] = byStart.items[j - 1];
+        }
+        byStart.items[j] = v;
+    }
+
+    for (uint32_t i = 0; i < byStart.count && !opt->failed; i++) {
+        uint32_t v = byStart.items[i];
+        IrValue* value = opt->values + v;
+        uint32_t preferred = NONE;
+        if (value->phi != NONE && opt->values[value->phi].reg != NONE) {
+            preferred = opt->values[value->phi].reg;
+        } else if (value->op == IR_PHI) {
+            for (uint32_t o = 0; o < value->operandCount && preferred == NONE; o++) {
+                preferred = opt->values[operand(opt, v, o)].reg;
+            }
+        }
+
+        if (preferred != NONE && registerFree(opt, preferred, v)) {
+            assignRegister(opt, v, preferred);
+            continue;
+        }
+        uint32_t reg = 0;
+        while (reg < opt->registerCount && !registerFree(opt, reg, v)) reg++;
+        assignRegister(opt, v, reg);
+        // every slot has to be reachable with a single byte operand
+        if (opt->arity + 1 + opt->registerCount > UINT8_COUNT) opt->failed = true;
+    }
+
+    freeIndexArray(opt, &byStart);
+    freeIndexArray(opt, &open);
+    freeIndexArray(opt, &reads);
+    VM_FREE_ARRAY(uint32_t, openUntil, opt->valueCount);
+    VM_FREE_ARRAY(uint64_t, uses, words * opt->blockCount);
+    VM_FREE_ARRAY(uint64_t, liveOut, words * opt->blockCount);
+    VM_FREE_ARRAY(uint64_t, liveIn, words * opt->blockCount);
+}
+
+static void emitByte(Optimiser* opt, uint8_t byte, uint32_t line) {
+    VM* vm = opt->vm;
+    if (opt->codeCount == opt->codeCapacity) {
+        uint32_t oldCapacity = opt->codeCapacity;
+        opt->codeCapacity = GROW_CAPACITY(oldCapacity);
+        opt->code = VM_GROW_ARRAY(uint8_t, opt->code, oldCapacity, opt->codeCapacity);
+        opt->codeLines = VM_GROW_ARRAY(uint32_t, opt->codeLines, oldCapacity, opt->codeCapacity);
+        opt->codeSites = VM_GROW_ARRAY(uint32_t, opt->codeSites, oldCapacity, opt->codeCapacity);
+    }
+    opt->codeLines[opt->codeCount] = line;
+    opt->codeSites[opt->codeCount] = opt->currentSite;
+    opt->code[opt->codeCount++] = byte;
+}
+
+static void emitVariableWidth(Optimiser* opt, uint8_t op, uint8_t longOp, uint32_t operand, uint32_t line) {
+    if (operand <= UINT8_MAX) {
+        emitByte(opt, op, line);
+        emitByte(opt, (uint8_t) operand, line);
+    } else {
+        emitByte(opt, longOp, line);
+        emitByte(opt, (uint8_t) (operand >> 16), line);
+        emitByte(opt, (uint8_t) (operand >> 8), line);
+        emitByte(opt, (uint8_t) operand, line);
+    }
+}
+
+static uint32_t slotOf(Optimiser* opt, uint32_t v) {
+    IrValue* value = opt->values + v;
+    return value->op == IR_PARAM ? value->immediate : opt->arity + 1 + value->reg;
+}
+
+static void emitValue(Optimiser* opt, uint32_t v);
+
+static void emitOperand(Optimiser* opt, uint32_t v, uint32_t line) {
+    IrValue* value = opt->values + v;
+    if (isConstant(value->op) || value->inlined) {
+        emitValue(opt, v);
+        // constants don't have lines of their own
+        if (isConstant(value->op)) {
+            for (uint32_t i = opt->codeCount; i-- > 0 && opt->codeLines[i] == 0;) opt->codeLines[i] = line;
+        }
+    } else {
+        emitByte(opt, OP_GET_LOCAL, line);
+        emitByte(opt, (uint8_t) slotOf(opt, v), line);
+    }
+}
+
+// the operand of a register instruction reading a value, if it's a constant or already in one of the first 128 slots
+static bool registerOperand(Optimiser* opt, uint32_t v, uint8_t* operand) {
+    IrValue* value = opt->values + v;
+    if (value->op == OP_CONSTANT) {
+        if (value->immediate >= RK_CONSTANT) return false;
+        *operand = (uint8_t) (value->immediate | RK_CONSTANT);
+        return true;
+    }
+    if (isConstant(value->op) || value->inlined || slotOf(opt, v) >= RK_CONSTANT) return false;
+    *operand = (uint8_t) slotOf(opt, v);
+    return true;
+}
+
+// pushes a value's result (if it has one), evaluating any inlined operands first
+static void emitValue(Optimiser* opt, uint32_t v) {
+    IrValue* value = opt->values + v;
+    uint32_t line = value->line;
+    // constants are shared, so belong to whatever uses them
+    uint32_t outerSite = opt->currentSite;
+    if (!isConstant(value->op)) opt->currentSite = value->site;
+
+    uint8_t a, b;
+    if (opt->vm->registerBytecode && value->op >= OP_EQUAL && value->op <= OP_DIVIDE &&
+        registerOperand(opt, operand(opt, v, 0), &a) && registerOperand(opt, operand(opt, v, 1), &b)) {
+        emitByte(opt, registerOp((OpCode) value->op), line);
+        emitByte(opt, a, line);
+        emitByte(opt, b, line);
+        opt->currentSite = outerSite;
+        return;
+    }
+
+    for (uint32_t i = 0; i < value->operandCount; i++) {
+        emitOperand(opt, operand(opt, v, i), line);
+        value = opt->values + v;
+    }
+
+    switch (value->op) {
+        case OP_CONSTANT:
+            emitVariableWidth(opt, OP_CONSTANT, OP_CONSTANT_LONG, value->immediate, line);
+            break;
+        case OP_GET_GLOBAL:
+            emitVariableWidth(opt, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, value->immediate, line);
+            break;
+        case OP_SET_GLOBAL:
+            emitVariableWidth(opt, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, value->immediate, line);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CALL:
+            emitByte(opt, (uint8_t) value->op, line);
+            emitByte(opt, (uint8_t) value->immediate, line);
+            break;
+        case OP_INVOKE:
+            emitByte(opt, (uint8_t) value->op, line);
+            emitByte(opt, (uint8_t) value->immediate, line);
+            emitByte(opt, (uint8_t) value->immediate2, line);
+            break;
+        default:
+            emitByte(opt, (uint8_t) value->op, line);
+            break;
+    }
+    opt->currentSite = outerSite;
+}
+
+// the distance is filled in once every block has been emitted
+static void emitBranch(Optimiser* opt, uint8_t op, uint32_t target, uint32_t line) {
+    appendIndex(opt, &opt->patches, opt->codeCount);
+    appendIndex(opt, &opt->patches, target);
+    emitByte(opt, op, line);
+    emitByte(opt, 0xff, line);
+    emitByte(opt, 0xff, line);
+}
+
+// guards are branches with constants between the opcode and the distance
+static uint32_t branchLength(uint8_t op) {
+    switch (op) {
+        case OP_JUMP_IF_CALLEE:
+            return 4;
+        case OP_JUMP_IF_INVOKES:
+            return 5;
+        default:
+            return 3;
+    }
+}
+
+static void emitGuard(Optimiser* opt, IrBlock* block, uint32_t target) {
+    appendIndex(opt, &opt->patches, opt->codeCount);
+    appendIndex(opt, &opt->patches, target);
+    emitByte(opt, block->branchOp, block->line);
+    if (block->branchOp == OP_JUMP_IF_INVOKES) emitByte(opt, (uint8_t) block->guardName, block->line);
+    emitByte(opt, (uint8_t) block->guardClosure, block->line);
+    emitByte(opt, 0xff, block->line);
+    emitByte(opt, 0xff, block->line);
+}
+
+static void emitJump(Optimiser* opt, uint32_t target, uint32_t line) {
+    emitBranch(opt, OP_JUMP, target, line);
+}
+
+// copies into the successor's phis, via the stack so they all happen at once, then jumps to it
+static void emitEdge(Optimiser* opt, uint32_t block, uint32_t successor) {
+    uint32_t line = opt->blocks[block].line;
+    uint32_t index = predIndex(opt, successor, block);
+    IndexArray copies = {0};
+    for (uint32_t phi = opt->blocks[successor].first; phi != NONE && opt->values[phi].op == IR_PHI;
+         phi = opt->values[phi].next) {
+        if (!needsSlot(opt->values + phi)) continue;
+        uint32_t input = operand(opt, phi, index);
+        if (input == phi || (needsSlot(opt->values + input) && opt->values[input].reg == opt->values[phi].reg)) {
+            continue;
+        }
+        appendIndex(opt, &copies, phi);
+    }
+    uint8_t source;
+    if (copies.count == 1 && opt->vm->registerBytecode &&
+        registerOperand(opt, operand(opt, copies.items[0], index), &source)) {
+        // a single copy can't overwrite anything another copy reads, so doesn't need the stack
+        emitByte(opt, OP_MOVE, line);
+        emitByte(opt, source, line);
+        emitByte(opt, (uint8_t) slotOf(opt, copies.items[0]), line);
+        copies.count = 0;
+    }
+    for (uint32_t i = 0; i < copies.count; i++) {
+        emitOperand(opt, operand(opt, copies.items[i], index), line);
+    }
+    for (uint32_t i = copies.count; i-- > 0;) {
+        emitByte(opt, OP_SET_LOCAL_POP, line);
+        emitByte(opt, (uint8_t) slotOf(opt, copies.items[i]), line);
+    }
+    freeIndexArray(opt, &copies);
+    emitJump(opt, successor, line);
+}
+
+static void emitCode(Optimiser* opt) {
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        IrBlock* block = opt->blocks + opt->order.items[i];
+        if (block->preds.count != 1) continue;
+        IrBlock* pred = opt->blocks + block->preds.items[0];
+        block->popOnEntry = pred->exit == EXIT_BRANCH && pred->successors[0] != pred->successors[1] &&
+                            branchLength(pred->branchOp) == 3;
+    }
+
+    uint32_t firstLine = getLine(opt->chunk, 0);
+    for (uint32_t reg = 0; reg < opt->registerCount; reg++) {
+        emitByte(opt, OP_NIL, firstLine);
+    }
+
+    for (uint32_t i = 0; i < opt->order.count; i++) {
+        uint32_t block = opt->order.items[i];
+        IrBlock* irBlock = opt->blocks + block;
+        irBlock->codeOffset = opt->codeCount;
+        opt->currentSite = irBlock->site;
+        if (irBlock->popOnEntry) emitByte(opt, OP_POP, opt->blocks[irBlock->preds.items[0]].line);
+
+        for (uint32_t v = irBlock->first; v != NONE; v = opt->values[v].next) {
+            IrValue* value = opt->values + v;
+            if (value->op == IR_PHI || value->inlined) continue;
+            uint32_t start = opt->codeCount;
+            emitValue(opt, v);
+            value = opt->values + v;
+            if (needsSlot(value) && isRegisterOp(opt->code[start]) && start + 3 == opt->codeCount) {
+                // the result goes straight to its slot
+                opt->code[start] = registerStoreOp(stackOp(opt->code[start]));
+                emitByte(opt, (uint8_t) slotOf(opt, v), value->line);
+            } else if (needsSlot(value)) {
+                emitByte(opt, OP_SET_LOCAL_POP, value->line);
+                emitByte(opt, (uint8_t) slotOf(opt, v), value->line);
+            } else if (value->op != OP_PRINT) {
+                emitByte(opt, OP_POP, value->line);
+            }
+        }
+
+        irBlock = opt->blocks + block;
+        switch (irBlock->exit) {
+            case EXIT_RETURN: {
+                uint32_t result = resolve(opt, irBlock->exitValue);
+                emitOperand(opt, result, irBlock->line);
+                // a call evaluated straight onto the stack is the last thing before the return, so is a tail call
+                if (opt->values[result].inlined && opt->values[result].op == OP_CALL) {
+                    opt->code[opt->codeCount - 2] = OP_TAIL_CALL;
+                } else if (opt->values[result].inlined && opt->values[result].op == OP_INVOKE) {
+                    opt->code[opt->codeCount - 3] = OP_TAIL_INVOKE;
+                }
+                emitByte(opt, OP_RETURN, irBlock->line);
+                break;
+            }
+            case EXIT_JUMP:
+                emitEdge(opt, block, irBlock->successors[0]);
+                break;
+            case EXIT_BRANCH: {
+                emitOperand(opt, resolve(opt, irBlock->exitValue), irBlock->line);
+                if (branchLength(irBlock->branchOp) != 3) {
+                    // the guard pops what it tests, and the inlined code is only reachable from here, so has no phis
+                    emitGuard(opt, irBlock, irBlock->successors[0]);
+                    emitEdge(opt, block, irBlock->successors[1]);
+                    break;
+                }
+                uint32_t taken = irBlock->successors[0];
+                uint32_t fallthrough = irBlock->successors[1];
+                uint32_t branch = opt->codeCount;
+                uint32_t patch = opt->patches.count;
+                emitBranch(opt, irBlock->branchOp, taken, irBlock->line);
+                if (opt->blocks[fallthrough].popOnEntry) {
+                    emitJump(opt, fallthrough, irBlock->line);
+                } else {
+                    emitByte(opt, OP_POP, irBlock->line);
+                    emitEdge(opt, block, fallthrough);
+                }
+                if (opt->blocks[taken].popOnEntry) break;
+
+                // otherwise the branch goes to a stub which pops the condition and copies into the target's phis
+                opt->patches.items[patch + 1] = NONE;
+                uint32_t distance = opt->codeCount - branch - 3;
+                if (distance > UINT16_MAX) opt->failed = true;
+                opt->code[branch + 1] = (uint8_t) (distance >> 8);
+                opt->code[branch + 2] = (uint8_t) distance;
+                emitByte(opt, OP_POP, irBlock->line);
+                emitEdge(opt, block, taken);
+                break;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < opt->patches.count; i += 2) {
+        if (opt->patches.items[i + 1] == NONE) continue;
+        uint32_t offset = opt->patches.items[i];
+        uint32_t target = opt->blocks[opt->patches.items[i + 1]].codeOffset;
+        uint32_t length = branchLength(opt->code[offset]);
+        uint32_t from = offset + length;
+        uint32_t distance = target >= from ? target - from : from - target;
+        if (distance > UINT16_MAX) opt->failed = true;
+        if (opt->code[offset] == OP_JUMP) {
+            opt->code[offset] = target >= from ? OP_JUMP : OP_LOOP;
+        } else if (target < from) {
+            // conditional jumps only go forwards
+            opt->failed = true;
+        }
+        opt->code[from - 2] = (uint8_t) (distance >> 8);
+        opt->code[from - 1] = (uint8_t) distance;
+    }
+}
+
+static void installCode(Optimiser* opt) {
+    VM* vm = opt->vm;
+    Chunk* chunk = opt->chunk;
+
+    uint32_t runCount = 0;
+    for (uint32_t i = 0; i < opt->codeCount; i++) {
+        if (i == 0 || opt->codeLines[i] != opt->codeLines[i - 1]) runCount++;
+    }
+    LineRun* lines = VM_ALLOCATE(LineRun, runCount);
+    runCount = 0;
+    for (uint32_t i = 0; i < opt->codeCount; i++) {
+        if (i == 0 || opt->codeLines[i] != opt->codeLines[i - 1]) {
+            lines[runCount++] = (LineRun) {.start = i, .line = opt->codeLines[i]};
+        }
+    }
+
+    uint32_t inlinedCount = 0;
+    for (uint32_t i = 0; i < opt->codeCount; i++) {
+        if (opt->codeSites[i] != NONE && (i == 0 || opt->codeSites[i] != opt->codeSites[i - 1])) inlinedCount++;
+    }
+    InlinedRun* inlined = VM_ALLOCATE(InlinedRun, inlinedCount);
+    inlinedCount = 0;
+    for (uint32_t i = 0; i < opt->codeCount; i++) {
+        uint32_t site = opt->codeSites[i];
+        if (site == NONE) continue;
+        if (i == 0 || site != opt->codeSites[i - 1]) {
+            inlined[inlinedCount++] = (InlinedRun) {
+                    .start = i,
+                    .line = opt->sites.items[site * 2 + 1],
+                    .callee = opt->sites.items[site * 2],
+            };
+        }
+        inlined[inlinedCount - 1].end = i + 1;
+    }
+
+    VM_FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    VM_FREE_ARRAY(LineRun, chunk->lines, chunk->lineCapacity);
+    VM_FREE_ARRAY(InlinedRun, chunk->inlined, chunk->inlinedCapacity);
+    chunk->inlined = inlined;
+    chunk->inlinedCount = inlinedCount;
+    chunk->inlinedCapacity = inlinedCount;
+    chunk->code = opt->code;
+    chunk->count = opt->codeCount;
+    chunk->capacity = opt->codeCapacity;
+    chunk->lines = lines;
+    chunk->lineCount = runCount;
+    chunk->lineCapacity = runCount;
+    VM_FREE_ARRAY(uint32_t, opt->codeLines, opt->codeCapacity);
+    VM_FREE_ARRAY(uint32_t, opt->codeSites, opt->codeCapacity);
+    opt->code = NULL;
+    opt->codeLines = NULL;
+    opt->codeSites = NULL;
+    opt->codeCapacity = 0;
+
+    optimiseChunk(vm, NULL, chunk);
+}
+
+static void freeOptimiser(Optimiser* opt) {
+    VM* vm = opt->vm;
+    for (uint32_t block = 0; block < opt->blockCount; block++) {
+        freeIndexArray(opt, &opt->blocks[block].preds);
+    }
+    for (uint32_t reg = 0; reg < opt->registerCount; reg++) {
+        freeIndexArray(opt, opt->registers + reg);
+    }
+    VM_FREE_ARRAY(IndexArray, opt->registers, opt->registerCount);
+    VM_FREE_ARRAY(IrValue, opt->values, opt->valueCapacity);
+    VM_FREE_ARRAY(IrBlock, opt->blocks, opt->blockCapacity);
+    VM_FREE_ARRAY(LiveRange, opt->ranges, opt->rangeCapacity);
+    VM_FREE_ARRAY(uint64_t, opt->dominators, opt->dominatorWords);
+    VM_FREE_ARRAY(uint64_t, opt->loopBodies, opt->bitsetWords * opt->loops.count);
+    VM_FREE_ARRAY(uint8_t, opt->code, opt->codeCapacity);
+    VM_FREE_ARRAY(uint32_t, opt->codeLines, opt->codeCapacity);
+    VM_FREE_ARRAY(uint32_t, opt->codeSites, opt->codeCapacity);
+    freeIndexArray(opt, &opt->operands);
+    freeIndexArray(opt, &opt->states);
+    freeIndexArray(opt, &opt->constants);
+    freeIndexArray(opt, &opt->order);
+    freeIndexArray(opt, &opt->loops);
+    freeIndexArray(opt, &opt->patches);
+    freeIndexArray(opt, &opt->sites);
+}
+
+bool optimiseFunction(VM* vm, ObjFunction* function) {
+    Optimiser opt = {
+            .vm = vm,
+            .function = function,
+            .chunk = &function->chunk,
+            .arity = function->arity,
+            .currentSite = NONE,
+    };
+
+    buildBlocks(&opt);
+    if (!opt.failed) buildSsa(&opt);
+    if (!opt.failed) {
+        removeTrivialPhis(&opt);
+        inlineCalls(&opt);
+        removeTrivialPhis(&opt);
+        inferTypes(&opt);
+        computeDominators(&opt);
+        eliminateCommonSubexpressions(&opt);
+        findLoops(&opt);
+        hoistLoopInvariants(&opt);
+        eliminateDeadCode(&opt);
+        chooseInlining(&opt);
+        allocateRegisters(&opt);
+    }
+    if (!opt.failed) emitCode(&opt);
+    if (!opt.failed) {
+        installCode(&opt);
+        encodeChunk(vm, NULL, opt.chunk);
+    }
+
+    bool optimised = !opt.failed;
+    freeOptimiser(&opt);
+    return optimised;
+}
@@ -0,0 +1,14 @@
+#ifndef CLOX_OPTIMISER_H
+#define CLOX_OPTIMISER_H
+
+#include "object.h"
+
+// rebuilds a function's bytecode via an SSA IR: inlining of small functions and methods (behind a check that the call
+// still reaches the same closure, falling back to a real call if not), copy propagation, common subexpression
+// elimination, loop invariant code motion and dead code elimination of operations which can't fail or have side
+// effects, then re-emits it with every value kept in a local slot. Returns false (leaving the function untouched) if
+// the bytecode uses something the IR doesn't model, e.g. closures or classes. The function mustn't be executing when
+// this is called.
+bool optimiseFunction(VM* vm, ObjFunction* function);
+
+#endif //CLOX_OPTIMISER_H
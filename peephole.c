@@ -0,0 +1,226 @@
+#include <assert.h>
+#include <string.h>
+#include "peephole.h"
+#include "memory.h"
+
+typedef struct {
+    uint32_t offset;
+    uint32_t newOffset;
+    uint32_t length;
+    uint32_t line;
+    // index (not offset) of the instruction jumped to
+    uint32_t target;
+    uint8_t op;
+    bool removed;
+    bool isTarget;
+} Instruction;
+
+// the optimiser's guards pop what they test, unlike the other conditional jumps
+static bool isGuard(uint8_t op) {
+    return op == OP_JUMP_IF_CALLEE || op == OP_JUMP_IF_INVOKES;
+}
+
+// every jump's distance is in its last two bytes, and is relative to the end of the instruction
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP || isGuard(op);
+}
+
+static bool isUnconditionalJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+static bool endsBlock(uint8_t op) {
+    return op == OP_RETURN || isUnconditionalJump(op);
+}
+
+static uint32_t readShort(Chunk* chunk, uint32_t offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+// jumping to an unconditional jump can go straight to its destination; conditional jumps can only be encoded forwards,
+// and new targets must stay within 16 bit range (in the original layout, so also after removing code)
+static void threadJump(Instruction* instructions, uint32_t count, uint32_t index) {
+    Instruction* jump = instructions + index;
+    uint32_t from = jump->offset + jump->length;
+    for (uint32_t hops = 0; hops < count && isUnconditionalJump(instructions[jump->target].op); hops++) {
+        uint32_t next = instructions[jump->target].target;
+        if (next == jump->target) break; // infinite loop
+        if (!isUnconditionalJump(jump->op) && next <= index) break;
+
+        uint32_t offset = instructions[next].offset;
+        uint32_t distance = offset >= from ? offset - from : from - offset;
+        if (distance > UINT16_MAX) break;
+        jump->target = next;
+    }
+}
+
+static void markReachable(VM* vm, Compiler* compiler, Instruction* instructions, uint32_t count) {
+    bool* reachable = COMPILER_ALLOCATE(bool, count);
+    uint32_t* worklist = COMPILER_ALLOCATE(uint32_t, count);
+    memset(reachable, 0, sizeof(bool) * count);
+
+    uint32_t pending = 0;
+    reachable[0] = true;
+    worklist[pending++] = 0;
+    while (pending > 0) {
+        uint32_t index = worklist[--pending];
+        uint8_t op = instructions[index].op;
+        // every chunk ends with a return, so execution never falls off the end
+        uint32_t successors[2];
+        uint32_t successorCount = 0;
+        if (!endsBlock(op)) successors[successorCount++] = index + 1;
+        if (isJump(op)) successors[successorCount++] = instructions[index].target;
+
+        for (uint32_t i = 0; i < successorCount; i++) {
+            assert(successors[i] < count);
+            if (!reachable[successors[i]]) {
+                reachable[successors[i]] = true;
+                worklist[pending++] = successors[i];
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        instructions[i].removed = !reachable[i];
+    }
+    VM_FREE_ARRAY(uint32_t, worklist, count);
+    VM_FREE_ARRAY(bool, reachable, count);
+}
+
+static void fuseInstructions(Instruction* instructions, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!instructions[i].removed && isJump(instructions[i].op)) {
+            instructions[instructions[i].target].isTarget = true;
+        }
+    }
+
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        Instruction* first = instructions + i;
+        Instruction* second = instructions + i + 1;
+        if (first->removed || second->removed || second->isTarget) continue;
+
+        // the negated condition is only ever popped on both paths, so the original can be left in its place
+        if (first->op == OP_NOT && second->op == OP_JUMP_IF_FALSE && i + 2 < count &&
+            instructions[i + 2].op == OP_POP && instructions[second->target].op == OP_POP) {
+            first->removed = true;
+            second->op = OP_JUMP_IF_TRUE;
+        } else if ((first->op == OP_SET_LOCAL || first->op == OP_SET_LOCAL_LONG) && second->op == OP_POP) {
+            first->op = first->op == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_LOCAL_POP_LONG;
+            second->removed = true;
+        }
+    }
+}
+
+static uint32_t nextKept(Instruction* instructions, uint32_t count, uint32_t index) {
+    while (index < count && instructions[index].removed) index++;
+    return index;
+}
+
+// done back to front, so a jump over nothing but other removed jumps is removed too
+static void removeJumpsToNext(Instruction* instructions, uint32_t count) {
+    for (uint32_t i = count; i-- > 0;) {
+        if (instructions[i].removed || !isJump(instructions[i].op) || isGuard(instructions[i].op)) continue;
+        if (nextKept(instructions, count, instructions[i].target) == nextKept(instructions, count, i + 1)) {
+            instructions[i].removed = true;
+        }
+    }
+}
+
+// instructions only ever shrink or disappear, so every instruction's new offset is at most its old one and the chunk
+// can be rewritten front to back without overwriting anything still to be read
+static void rewriteChunk(Chunk* chunk, Instruction* instructions, uint32_t count, uint32_t* indexes) {
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        instructions[i].newOffset = offset;
+        if (!instructions[i].removed) offset += instructions[i].length;
+    }
+
+    // inlined runs cover whole instructions, so just move with them
+    for (uint32_t i = 0; i < chunk->inlinedCount; i++) {
+        InlinedRun* run = chunk->inlined + i;
+        run->start = run->start < chunk->count ? instructions[indexes[run->start]].newOffset : offset;
+        run->end = run->end < chunk->count ? instructions[indexes[run->end]].newOffset : offset;
+    }
+
+    chunk->lineCount = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        Instruction* instruction = instructions + i;
+        if (instruction->removed) continue;
+        uint8_t* code = chunk->code + instruction->newOffset;
+
+        if (isJump(instruction->op)) {
+            uint32_t from = instruction->newOffset + instruction->length;
+            uint32_t to = instructions[instruction->target].newOffset;
+            uint8_t op = instruction->op;
+            uint32_t distance;
+            if (isUnconditionalJump(op)) {
+                op = to >= from ? OP_JUMP : OP_LOOP;
+                distance = to >= from ? to - from : from - to;
+            } else {
+                assert(to >= from);
+                distance = to - from;
+            }
+            assert(distance <= UINT16_MAX);
+            memmove(code, chunk->code + instruction->offset, instruction->length);
+            code[0] = op;
+            code[instruction->length - 2] = (uint8_t) (distance >> 8);
+            code[instruction->length - 1] = (uint8_t) distance;
+        } else {
+            memmove(code, chunk->code + instruction->offset, instruction->length);
+            code[0] = instruction->op;
+        }
+
+        // the new runs are never more than the old ones, as merging instructions can't introduce a line change
+        if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != instruction->line) {
+            chunk->lines[chunk->lineCount++] = (LineRun) {.start = instruction->newOffset, .line = instruction->line};
+        }
+    }
+    chunk->count = offset;
+}
+
+void optimiseChunk(VM* vm, Compiler* compiler, Chunk* chunk) {
+    uint32_t codeCount = chunk->count;
+    if (codeCount == 0) return;
+
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < codeCount; offset += instructionLength(chunk, offset)) {
+        count++;
+    }
+
+    Instruction* instructions = COMPILER_ALLOCATE(Instruction, count);
+    // maps offsets of instruction starts to instruction indexes, to resolve jumps
+    uint32_t* indexes = COMPILER_ALLOCATE(uint32_t, codeCount);
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        indexes[offset] = i;
+        instructions[i] = (Instruction) {
+                .offset = offset,
+                .length = instructionLength(chunk, offset),
+                .line = getLine(chunk, offset),
+                .op = chunk->code[offset],
+        };
+        offset += instructions[i].length;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        Instruction* instruction = instructions + i;
+        if (!isJump(instruction->op)) continue;
+
+        uint32_t end = instruction->offset + instruction->length;
+        uint32_t distance = readShort(chunk, end - 2);
+        uint32_t target = instruction->op == OP_LOOP ? end - distance : end + distance;
+        assert(target < codeCount);
+        instruction->target = indexes[target];
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (isJump(instructions[i].op)) threadJump(instructions, count, i);
+    }
+    markReachable(vm, compiler, instructions, count);
+    fuseInstructions(instructions, count);
+    removeJumpsToNext(instructions, count);
+    rewriteChunk(chunk, instructions, count, indexes);
+
+    VM_FREE_ARRAY(uint32_t, indexes, codeCount);
+    VM_FREE_ARRAY(Instruction, instructions, count);
+}
@@ -0,0 +1,10 @@
+#ifndef CLOX_PEEPHOLE_H
+#define CLOX_PEEPHOLE_H
+
+#include "chunk.h"
+
+// rewrites a finished chunk in place: threads jumps to jumps, fuses common instruction pairs, and drops unreachable
+// code and jumps to the next instruction, then re-encodes jump offsets and line runs to match
+void optimiseChunk(VM* vm, Compiler* compiler, Chunk* chunk);
+
+#endif //CLOX_PEEPHOLE_H
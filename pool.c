@@ -0,0 +1,240 @@
+// for CPU affinity
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+#include "memory.h"
+#include "object.h"
+#include "shared.h"
+
+#ifdef WORKER_POOL
+
+typedef enum {
+    JOB_SCRIPT,
+    JOB_CALL,
+} JobType;
+
+// everything here is outside every VM's heap, from the system allocator
+typedef struct Job {
+    struct Job* next;
+    JobType type;
+    // the script's source, or the global to call
+    char* text;
+    PoolResult* result;
+    uint8_t argumentCount;
+    Value arguments[];
+} Job;
+
+typedef struct {
+    WorkerPool* pool;
+    uint32_t index;
+    pthread_t thread;
+} Worker;
+
+struct WorkerPool {
+    PoolOptions options;
+    Worker* workers;
+    uint32_t workerCount;
+    pthread_mutex_t lock;
+    // signalled when a job's queued (or the pool's stopping), and when the last job running finishes
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    Job* first;
+    Job* last;
+    // queued or running, including preludes
+    uint32_t pending;
+    uint32_t failed;
+    bool stopping;
+};
+
+// before the worker's heap is touched, so it's allocated close to the CPU that uses it
+static void pinWorker(Worker* worker) {
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->index % (uint32_t) cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) worker;
+#endif
+}
+
+static InterpretResult runJob(VM* vm, Job* job) {
+    if (job->type == JOB_SCRIPT) return interpret(vm, job->text);
+
+    Value value = NIL_VAL;
+    InterpretResult status = callGlobal(vm, job->text, job->arguments, job->argumentCount, &value);
+    if (job->result) job->result->value = IS_OBJ(value) ? NIL_VAL : value;
+    return status;
+}
+
+// marks one job done, having run it
+static void finishJob(WorkerPool* pool, bool failed) {
+    pthread_mutex_lock(&pool->lock);
+    if (failed) pool->failed++;
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* runWorker(void* argument) {
+    Worker* worker = argument;
+    WorkerPool* pool = worker->pool;
+    if (pool->options.pinned) pinWorker(worker);
+
+    // on the worker's own thread, which compressed references need
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, pool->options.heapSize);
+#ifdef SHARED_CODE
+    initSharedVM(&freeList, &vm, pool->options.shared);
+#else
+    initVM(&freeList, &vm);
+#endif
+    if (pool->options.print) vm.print = pool->options.print;
+
+    // setting up the VM counts as a job, so waitForPool() waits for it
+    InterpretResult status = INTERPRET_OK;
+#ifdef SHARED_CODE
+    if (pool->options.shared) status = interpretFunction(&vm, pool->options.shared->script);
+#endif
+    if (pool->options.prelude && status == INTERPRET_OK) status = interpret(&vm, pool->options.prelude);
+    finishJob(pool, status != INTERPRET_OK);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->first && !pool->stopping) {
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        }
+        Job* job = pool->first;
+        if (job) {
+            pool->first = job->next;
+            if (!pool->first) pool->last = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        // the queue's only empty when stopping
+        if (!job) break;
+
+        InterpretResult status = runJob(&vm, job);
+        if (job->result) job->result->status = status;
+        free(job->text);
+        free(job);
+        finishJob(pool, status != INTERPRET_OK);
+    }
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return NULL;
+}
+
+WorkerPool* newWorkerPool(const PoolOptions* options) {
+    assert(options->workers > 0);
+    WorkerPool* pool = malloc(sizeof(WorkerPool));
+    assert(pool);
+    pool->options = *options;
+    pool->workers = calloc(options->workers, sizeof(Worker));
+    assert(pool->workers);
+    pool->workerCount = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->first = NULL;
+    pool->last = NULL;
+    pool->pending = options->workers;
+    pool->failed = 0;
+    pool->stopping = false;
+
+    for (uint32_t i = 0; i < options->workers; i++) {
+        Worker* worker = pool->workers + i;
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, runWorker, worker)) {
+            // the workers which won't be set up
+            pool->pending -= options->workers - i;
+            freeWorkerPool(pool);
+            return NULL;
+        }
+        pool->workerCount++;
+    }
+    return pool;
+}
+
+void freeWorkerPool(WorkerPool* pool) {
+    waitForPool(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static void queueJob(WorkerPool* pool, Job* job) {
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->last) {
+        pool->last->next = job;
+    } else {
+        pool->first = job;
+    }
+    pool->last = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static Job* newJob(JobType type, const char* text, uint8_t argumentCount, PoolResult* result) {
+    Job* job = malloc(sizeof(Job) + sizeof(Value) * argumentCount);
+    assert(job);
+    job->type = type;
+    size_t length = strlen(text) + 1;
+    job->text = malloc(length);
+    assert(job->text);
+    memcpy(job->text, text, length);
+    job->argumentCount = argumentCount;
+    job->result = result;
+    if (result) {
+        result->status = INTERPRET_OK;
+        result->value = NIL_VAL;
+    }
+    return job;
+}
+
+void submitScript(WorkerPool* pool, const char* source, PoolResult* result) {
+    queueJob(pool, newJob(JOB_SCRIPT, source, 0, result));
+}
+
+void submitCall(WorkerPool* pool, const char* name, const Value* arguments, uint8_t argumentCount,
+                PoolResult* result) {
+    Job* job = newJob(JOB_CALL, name, argumentCount, result);
+    for (uint8_t i = 0; i < argumentCount; i++) {
+        assert(!IS_OBJ(arguments[i]) || !"Objects can't be passed to another VM");
+        job->arguments[i] = arguments[i];
+    }
+    queueJob(pool, job);
+}
+
+uint32_t waitForPool(WorkerPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    uint32_t failed = pool->failed;
+    pool->failed = 0;
+    pthread_mutex_unlock(&pool->lock);
+    return failed;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include "vm.h"
+
+#ifdef WORKER_POOL
+
+// worker threads, each with a VM (and heap) of its own that only it ever touches, taking scripts and calls from a
+// shared queue. VMs have no state outside themselves (apart from code they share; see shared.h), so any number can run
+// at once on different threads, as long as each is only used by one thread at a time: the thread that initialised its
+// heap, when references are compressed.
+//
+// Each worker's VM lives as long as the pool, so jobs see the prelude's globals and anything earlier jobs on the same
+// worker defined; jobs which need to see each other's state can't rely on which worker they get.
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+    uint32_t workers;
+    size_t heapSize;
+#ifdef SHARED_CODE
+    // the code each worker's VM shares, if any (see shared.h), whose script each worker runs first; has to outlive
+    // the pool
+    SharedCode* shared;
+#endif
+    // run by each worker before taking any jobs, if set
+    const char* prelude;
+    // printf if NULL; called from every worker, so has to be thread safe
+    Printer* print;
+    // each worker to its own CPU (worker i to CPU i, wrapping round), where supported
+    bool pinned;
+} PoolOptions;
+
+// how a job went, once waitForPool() returns
+typedef struct {
+    InterpretResult status;
+    // what a call returned, unless it was an object (which belongs to the worker's heap), in which case nil
+    Value value;
+} PoolResult;
+
+// NULL if the workers couldn't be started
+WorkerPool* newWorkerPool(const PoolOptions* options);
+// waits for every job queued, then stops the workers
+void freeWorkerPool(WorkerPool* pool);
+// copies `source`; `result` (if not NULL) is set once the script's run
+void submitScript(WorkerPool* pool, const char* source, PoolResult* result);
+// calls the global `name` with `argumentCount` arguments, which can't be objects (as they'd belong to another heap)
+void submitCall(WorkerPool* pool, const char* name, const Value* arguments, uint8_t argumentCount,
+                PoolResult* result);
+// waits for every job queued so far, returning how many of them failed (including workers' preludes)
+uint32_t waitForPool(WorkerPool* pool);
+
+#endif
+
+#endif //CLOX_POOL_H
@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "serve.h"
+#include "memory.h"
+
+#ifdef FORK_SERVER
+
+#define JOB_PATH_MAX 4096
+
+// read straight from the file descriptor rather than through stdio: a child exiting with lines still in stdin's buffer
+// could otherwise move the server's (shared) position in it back to the end of the last line it used
+typedef struct {
+    char chars[4096];
+    size_t start;
+    size_t end;
+} LineReader;
+
+// without the newline; overlong lines are cut short. Returns false at the end of the input
+static bool readLine(LineReader* reader, int file, char* line, size_t size) {
+    size_t length = 0;
+    for (;;) {
+        if (reader->start == reader->end) {
+            ssize_t count = read(file, reader->chars, sizeof(reader->chars));
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) {
+                line[length] = '\0';
+                return length > 0;
+            }
+            reader->start = 0;
+            reader->end = (size_t) count;
+        }
+
+        char c = reader->chars[reader->start++];
+        if (c == '\n') break;
+        if (length < size - 1) line[length++] = c;
+    }
+    line[length] = '\0';
+    return true;
+}
+
+// anything still buffered would otherwise be written by the child as well
+static pid_t forkJob(void) {
+    fflush(stdout);
+    fflush(stderr);
+    return fork();
+}
+
+static void runJob(VM* vm, const char* path, JobRunner* run) {
+    run(vm, path);
+    // without freeing anything, as that would write to every page the child shares
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+bool serveStdin(VM* vm, JobRunner* run) {
+    // garbage left by the prelude would otherwise be collected again in every child
+    collectGarbage(vm, NULL);
+
+    LineReader reader = {.start = 0, .end = 0};
+    char path[JOB_PATH_MAX];
+    while (readLine(&reader, STDIN_FILENO, path, sizeof(path))) {
+        if (!path[0]) continue;
+
+        pid_t child = forkJob();
+        if (child < 0) return false;
+        if (child == 0) runJob(vm, path, run);
+        while (waitpid(child, NULL, 0) < 0 && errno == EINTR) {}
+    }
+    return true;
+}
+
+bool serveSocket(VM* vm, const char* socketPath, JobRunner* run) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // a socket could have been left behind by a server that's stopped, but anything else there isn't ours to delete
+    struct stat existing;
+    if (!lstat(socketPath, &existing)) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            errno = EEXIST;
+            return false;
+        }
+        unlink(socketPath);
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) return false;
+    if (bind(server, (struct sockaddr*) &address, sizeof(address)) || listen(server, SOMAXCONN)) {
+        close(server);
+        return false;
+    }
+    // children are never waited for
+    signal(SIGCHLD, SIG_IGN);
+    collectGarbage(vm, NULL);
+
+    for (;;) {
+        int connection = accept(server, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        // a connection is dropped (rather than the server stopping) if it can't be forked for
+        pid_t child = forkJob();
+        if (child == 0) {
+            close(server);
+            // read by the child, so a slow client only holds up its own job
+            LineReader reader = {.start = 0, .end = 0};
+            char path[JOB_PATH_MAX];
+            if (!readLine(&reader, connection, path, sizeof(path))) _exit(0);
+            dup2(connection, STDOUT_FILENO);
+            dup2(connection, STDERR_FILENO);
+            close(connection);
+            runJob(vm, path, run);
+        }
+        close(connection);
+    }
+
+    close(server);
+    return false;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef CLOX_SERVE_H
+#define CLOX_SERVE_H
+
+#include "vm.h"
+
+#ifdef FORK_SERVER
+
+// a VM that's already warmed up (e.g. by a prelude) runs each job in a forked copy of itself, so jobs start in about
+// the time fork() takes, and see the prelude's globals without running it again. Nothing a job does reaches the server
+// or any other job.
+//
+// Forked children share the server's pages until they write to them, which would be every live object's page on each
+// collection if mark bits were kept in the objects; see MARK_BITMAP.
+
+// runs the job's script, in the child
+typedef void (JobRunner)(VM* vm, const char* path);
+
+// forks a child for each line of stdin (the path of a script), until stdin ends. Each job finishes before the next
+// starts, so their output isn't interleaved; returns false if a child couldn't be forked
+bool serveStdin(VM* vm, JobRunner* run);
+
+// listens on a Unix domain socket at `socketPath`, forking a child for each connection that runs the script whose path
+// is sent as its first line, with output (and errors) sent back over the connection. Jobs run concurrently; only
+// returns (false, with errno set) if the socket can't be listened on or accepting connections fails. A stale socket
+// at `socketPath` is replaced, but any other kind of file is left alone and fails with EEXIST
+bool serveSocket(VM* vm, const char* socketPath, JobRunner* run);
+
+#endif
+
+#endif //CLOX_SERVE_H
@@ -0,0 +1,46 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "shared.h"
+#include "compiler.h"
+#include "object.h"
+#include "optimiser.h"
+
+#ifdef SHARED_CODE
+
+SharedCode* compileSharedCode(const char* source, size_t heapSize) {
+    // outside the heap it owns
+    SharedCode* shared = malloc(sizeof(SharedCode));
+    assert(shared);
+    initMemory(&shared->heap, heapSize);
+    VM* vm = &shared->vm;
+    initVM(&shared->heap, vm);
+
+    shared->script = compile(vm, source);
+    if (!shared->script) {
+        freeSharedCode(shared);
+        return NULL;
+    }
+
+    push(vm, OBJ_VAL(shared->script));
+    collectGarbage(vm, NULL);
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*) object;
+#ifdef SSA_OPTIMISATION
+        // now, as it'd be too late by the time it's hot
+        function->optimised = true;
+        optimiseFunction(vm, function);
+#endif
+        function->frozen = true;
+    }
+    pop(vm);
+    return shared;
+}
+
+void freeSharedCode(SharedCode* shared) {
+    freeVM(&shared->vm);
+    freeMemory(&shared->heap);
+    free(shared);
+}
+
+#endif
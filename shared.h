@@ -0,0 +1,37 @@
+#ifndef CLOX_SHARED_H
+#define CLOX_SHARED_H
+
+#include "memory.h"
+#include "vm.h"
+
+#ifdef SHARED_CODE
+
+// a script compiled once (e.g. library code every sandbox loads), frozen in a heap of its own so any number of VMs in
+// the process can run it without compiling or copying it: its functions, their chunks and constants, and its interned
+// strings. VMs set up with initSharedVM() look strings up in the shared code before making their own, so a name the
+// shared code uses is the same string everywhere, and their GC treats shared objects as always live, never marking
+// (or writing to) them. Each VM still has its own closures, classes, instances and globals, so running the shared
+// script defines its globals in that VM only.
+//
+// Shared functions are optimised once when they're frozen rather than when they're hot, and are never compiled to
+// machine code or traced, as those change the function; only a VM's own functions are.
+struct SharedCode {
+    FreeList heap;
+    // compiled the code, and owns everything in the heap; never runs anything
+    VM vm;
+    ObjFunction* script;
+};
+
+// NULL if `source` doesn't compile
+SharedCode* compileSharedCode(const char* source, size_t heapSize);
+// once every VM sharing the code has been freed
+void freeSharedCode(SharedCode* shared);
+
+static inline bool isSharedObject(const SharedCode* shared, const void* object) {
+    const uint8_t* base = shared->heap.base_;
+    return (const uint8_t*) object >= base && (const uint8_t*) object < base + shared->heap.size_;
+}
+
+#endif
+
+#endif //CLOX_SHARED_H
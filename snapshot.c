@@ -0,0 +1,451 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "jit.h"
+#include "object.h"
+#include "trace.h"
+
+#ifdef HEAP_SNAPSHOT
+
+#define SNAPSHOT_NAN_BOXING 1
+#define SNAPSHOT_COMPRESSED_HEAP_REFS 2
+
+static uint32_t buildOptions(void) {
+    uint32_t options = 0;
+#ifdef NAN_BOXING
+    options |= SNAPSHOT_NAN_BOXING;
+#endif
+#ifdef COMPRESSED_HEAP_REFS
+    options |= SNAPSHOT_COMPRESSED_HEAP_REFS;
+#endif
+    return options;
+}
+
+// outside the Lox heap, like the grey stack
+typedef struct {
+    uint64_t* offsets;
+    size_t count;
+    size_t capacity;
+} Relocations;
+
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    // pointers into the heap, and to natives, by their offset in the heap
+    Relocations pointers;
+    Relocations natives;
+} Image;
+
+static void addRelocation(Image* image, Relocations* relocations, const void* slot) {
+    assert((const uint8_t*) slot >= image->base && (const uint8_t*) slot < image->base + image->size);
+    if (relocations->count == relocations->capacity) {
+        relocations->capacity = GROW_CAPACITY(relocations->capacity);
+        relocations->offsets = realloc(relocations->offsets, sizeof(uint64_t) * relocations->capacity);
+        assert(relocations->offsets);
+    }
+    relocations->offsets[relocations->count++] = (uint64_t) ((const uint8_t*) slot - image->base);
+}
+
+// slots are read with memcpy, as table entries can be packed
+static void relocatePointer(Image* image, const void* slot) {
+    uint8_t* pointer;
+    memcpy(&pointer, slot, sizeof(pointer));
+    if (!pointer) return;
+    assert(pointer >= image->base && pointer < image->base + image->size);
+    addRelocation(image, &image->pointers, slot);
+}
+
+#ifdef COMPRESSED_HEAP_REFS
+// offsets from the start of the heap, so they never need moving
+#define relocateRef(image, slot) ((void) (image), (void) (slot))
+#else
+#define relocateRef(image, slot) relocatePointer(image, slot)
+#endif
+
+static void relocateValue(Image* image, const void* slot) {
+    Value value;
+    memcpy(&value, slot, sizeof(Value));
+    if (!IS_OBJ(value)) return;
+#ifdef NAN_BOXING
+    // the pointer's in the low bits, so moves by adding to the whole value
+    addRelocation(image, &image->pointers, slot);
+#else
+    relocatePointer(image, (const uint8_t*) slot + offsetof(Value, as.obj));
+#endif
+}
+
+static void relocateEntries(Image* image, Table* table) {
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        // empty or deleted
+        if (table->control[i] & 0x80) continue;
+        const uint8_t* entry = (const uint8_t*) (table->entries + i);
+        relocateRef(image, entry + offsetof(Entry, key));
+        relocateValue(image, entry + offsetof(Entry, value));
+    }
+}
+
+static void relocateTable(Image* image, Table* table) {
+    relocatePointer(image, &table->control);
+    relocatePointer(image, &table->entries);
+    relocateEntries(image, table);
+}
+
+static void relocateObject(Image* image, Obj* object) {
+    relocateRef(image, &object->next);
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* boundMethod = (ObjBoundMethod*) object;
+            relocateValue(image, &boundMethod->receiver);
+            relocateRef(image, &boundMethod->method);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* class = (ObjClass*) object;
+            relocateRef(image, &class->name);
+            relocateTable(image, &class->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            relocateRef(image, &closure->function);
+            relocateRef(image, &closure->upvalues);
+            HEAP_REF(ObjUpvalue)* upvalues = FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues);
+            for (uint32_t i = 0; i < closure->upvalueCount; i++) {
+                relocateRef(image, upvalues + i);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            Chunk* chunk = &function->chunk;
+            relocateRef(image, &function->name);
+            relocatePointer(image, &chunk->code);
+            relocatePointer(image, &chunk->lines);
+            relocatePointer(image, &chunk->inlined);
+            relocatePointer(image, &chunk->constants.values);
+            for (uint32_t i = 0; i < chunk->constants.count; i++) {
+                relocateValue(image, chunk->constants.values + i);
+            }
+            relocatePointer(image, &chunk->words);
+            relocatePointer(image, &chunk->wordOffsets);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            relocateRef(image, &instance->class);
+            relocateTable(image, &instance->fields);
+            break;
+        }
+        case OBJ_NATIVE:
+            addRelocation(image, &image->natives, &((ObjNative*) object)->function);
+            break;
+        case OBJ_STRING:
+            relocateRef(image, &((ObjString*) object)->chars);
+            break;
+        case OBJ_UPVALUE: {
+            // always closed, so pointing at its own value
+            ObjUpvalue* upvalue = (ObjUpvalue*) object;
+            relocatePointer(image, &upvalue->location);
+            relocateValue(image, &upvalue->closed);
+            relocateRef(image, &upvalue->next);
+            break;
+        }
+#ifdef COROUTINES
+        case OBJ_COROUTINE:
+#endif
+#ifdef ISOLATES
+        case OBJ_CHANNEL:
+#endif
+        case OBJ_NONE:
+            assert(!"Unknown object type");
+    }
+}
+
+// everything the heap refers to outside itself is dropped, or copied in
+static void detachFunction(VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+#ifdef NATIVE_CODE
+    freeNativeCode(chunk->native);
+    chunk->native = NULL;
+#endif
+#ifdef TRACING_JIT
+    // recreated when they're next run
+    freeTraceLoops(chunk);
+#endif
+    if (!chunk->mapped) return;
+
+    uint8_t* code = VM_ALLOCATE(uint8_t, chunk->count);
+    memcpy(code, chunk->code, chunk->count);
+    LineRun* lines = VM_ALLOCATE(LineRun, chunk->lineCount);
+    memcpy(lines, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+    uint32_t* words = VM_ALLOCATE(uint32_t, chunk->wordCount);
+    memcpy(words, chunk->words, sizeof(uint32_t) * chunk->wordCount);
+    uint32_t* wordOffsets = VM_ALLOCATE(uint32_t, chunk->wordCount);
+    memcpy(wordOffsets, chunk->wordOffsets, sizeof(uint32_t) * chunk->wordCount);
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->lines = lines;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->words = words;
+    chunk->wordOffsets = wordOffsets;
+    chunk->mapped = false;
+}
+
+static bool writeImage(SnapshotHeader* header, Image* image, FILE* file) {
+    static const uint8_t padding[4096] = {0};
+    if (fwrite(header, sizeof(SnapshotHeader), 1, file) != 1) return false;
+    if (fwrite(image->pointers.offsets, sizeof(uint64_t), image->pointers.count, file) != image->pointers.count) {
+        return false;
+    }
+    if (fwrite(image->natives.offsets, sizeof(uint64_t), image->natives.count, file) != image->natives.count) {
+        return false;
+    }
+    for (long position = ftell(file); position < (long) header->heapOffset; position += sizeof(padding)) {
+        size_t length = header->heapOffset - position < sizeof(padding) ? header->heapOffset - position : sizeof(padding);
+        if (fwrite(padding, 1, length, file) != length) return false;
+    }
+    return fwrite(image->base, 1, header->used, file) == header->used;
+}
+
+bool writeSnapshot(VM* vm, const char* path) {
+    if (vm->frameCount || vm->stack.count) return false;
+    uint8_t id[BUILD_ID_MAX];
+    uint32_t idLength = buildId(id);
+    if (!idLength) return false;
+#ifdef SHARED_CODE
+    // the image couldn't refer to anything outside the VM's heap
+    if (vm->shared) return false;
+#endif
+#ifdef TRACING_JIT
+    if (vm->recorder) abortRecording(vm);
+#endif
+#ifdef COROUTINES
+    // a suspended coroutine's frames point into code which detaching moves, so this has to be checked first
+    collectGarbage(vm, NULL);
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        if (object->type == OBJ_COROUTINE) return false;
+    }
+#endif
+    // nothing outside the heap survives, so functions are detached before the heap's tidied up
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        if (object->type == OBJ_FUNCTION) detachFunction(vm, (ObjFunction*) object);
+    }
+    collectGarbage(vm, NULL);
+#ifdef ISOLATES
+    // a channel's other ends are in other VMs, which the image couldn't reconnect to
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        if (object->type == OBJ_CHANNEL) return false;
+    }
+#endif
+
+    Image image = {.base = vm->freeList->base_, .size = vm->freeList->size_};
+    SnapshotHeader header = {0};
+    memcpy(header.magic, "clxs", 4);
+    header.version = SNAPSHOT_VERSION;
+    header.opcodeCount = OP_INT + 1;
+    header.options = buildOptions();
+    header.base = (uint64_t) (uintptr_t) image.base;
+    header.code = (uint64_t) (uintptr_t) &interpret;
+    header.buildIdLength = idLength;
+    memcpy(header.buildId, id, BUILD_ID_MAX);
+    header.size = image.size;
+    header.used = image.size;
+
+    // the free block reaching the end of the heap (usually most of it) isn't written
+    for (Block* block = vm->freeList->first; block; block = block->next) {
+        if ((uint8_t*) block + block->blockSize == image.base + image.size) {
+            header.used = (uint64_t) ((uint8_t*) block - image.base);
+            header.lastBlockNext = (uint64_t) (uintptr_t) block->next;
+        } else {
+            relocatePointer(&image, &block->next);
+        }
+    }
+    header.firstBlock = (uint64_t) (uintptr_t) vm->freeList->first;
+
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        relocateObject(&image, object);
+    }
+    relocateEntries(&image, &vm->globals);
+    for (uint32_t i = 0; i < vm->strings.capacity; i++) {
+        relocatePointer(&image, &vm->strings.entries[i].string);
+    }
+    header.objects = (uint64_t) (uintptr_t) vm->objects;
+    header.initString = (uint64_t) (uintptr_t) vm->initString;
+    header.globals = vm->globals;
+    header.strings = vm->strings;
+    header.stack = vm->stack;
+    header.bytesAllocated = vm->bytesAllocated;
+    header.nextGC = vm->nextGC;
+    header.registerBytecode = vm->registerBytecode;
+
+    uint64_t pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+    header.relocationCount = image.pointers.count;
+    header.codeRelocationCount = image.natives.count;
+    header.heapOffset = sizeof(SnapshotHeader) + sizeof(uint64_t) * (image.pointers.count + image.natives.count);
+    header.heapOffset = (header.heapOffset + pageSize - 1) / pageSize * pageSize;
+
+    // written alongside and renamed over the old image, so nothing ever maps half a file
+    size_t length = strlen(path) + 32;
+    char* tempPath = malloc(length);
+    assert(tempPath);
+    snprintf(tempPath, length, "%s.%ld.tmp", path, (long) getpid());
+    FILE* file = fopen(tempPath, "wb");
+    bool written = file && writeImage(&header, &image, file);
+    if (file && fclose(file)) written = false;
+    if (written && rename(tempPath, path)) written = false;
+    if (!written) remove(tempPath);
+
+    free(tempPath);
+    free(image.pointers.offsets);
+    free(image.natives.offsets);
+    return written;
+}
+
+static bool validHeader(const SnapshotHeader* header, uint64_t fileSize) {
+    uint64_t pageSize = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t relocations = header->relocationCount + header->codeRelocationCount;
+    uint8_t id[BUILD_ID_MAX];
+    uint32_t idLength = buildId(id);
+    return memcmp(header->magic, "clxs", 4) == 0 && header->version == SNAPSHOT_VERSION
+           && header->opcodeCount == OP_INT + 1 && header->options == buildOptions()
+           && idLength && header->buildIdLength == idLength && memcmp(header->buildId, id, BUILD_ID_MAX) == 0
+           && header->used <= header->size && header->heapOffset % pageSize == 0
+           && relocations <= (header->heapOffset - sizeof(SnapshotHeader)) / sizeof(uint64_t)
+           && header->heapOffset + header->used == fileSize;
+}
+
+// moves each of `count` slots listed from `offset` in the file by `delta`
+static bool relocate(int file, uint64_t offset, uint64_t count, uint8_t* base, uint64_t size, uint64_t delta) {
+    uint64_t offsets[512];
+    while (count) {
+        uint64_t batch = count < 512 ? count : 512;
+        if (pread(file, offsets, sizeof(uint64_t) * batch, (off_t) offset) != (ssize_t) (sizeof(uint64_t) * batch)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < batch; i++) {
+            if (offsets[i] > size - sizeof(uint64_t)) return false;
+            uint64_t slot;
+            memcpy(&slot, base + offsets[i], sizeof(uint64_t));
+            slot += delta;
+            memcpy(base + offsets[i], &slot, sizeof(uint64_t));
+        }
+        offset += sizeof(uint64_t) * batch;
+        count -= batch;
+    }
+    return true;
+}
+
+// the heap region: at its old address if that's free, so nothing needs moving
+static uint8_t* mapHeap(int file, const SnapshotHeader* header) {
+    void* wanted = (void*) (uintptr_t) header->base;
+    uint8_t* base = mmap(wanted, header->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+#ifdef NAN_BOXING
+    if ((uintptr_t) base + header->size > OBJ_POINTER_MASK) {
+        munmap(base, header->size);
+        return NULL;
+    }
+#endif
+    if (header->used && mmap(base, header->used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file,
+                             (off_t) header->heapOffset) == MAP_FAILED) {
+        munmap(base, header->size);
+        return NULL;
+    }
+    return base;
+}
+
+static bool restoreHeap(int file, const SnapshotHeader* header, uint8_t** heap) {
+    uint8_t* base = mapHeap(file, header);
+    if (!base) return false;
+
+    uint64_t delta = (uint64_t) (uintptr_t) base - header->base;
+    uint64_t codeDelta = (uint64_t) (uintptr_t) &interpret - header->code;
+    uint64_t relocations = sizeof(SnapshotHeader);
+    uint64_t codeRelocations = relocations + sizeof(uint64_t) * header->relocationCount;
+    if ((delta && !relocate(file, relocations, header->relocationCount, base, header->used, delta))
+        || (codeDelta && !relocate(file, codeRelocations, header->codeRelocationCount, base, header->used, codeDelta))) {
+        munmap(base, header->size);
+        return false;
+    }
+    *heap = base;
+    return true;
+}
+
+// a pointer from the header, to where it is now
+#define MOVED(type, pointer) ((type*) ((pointer) ? (uintptr_t) (pointer) + delta : 0))
+
+bool restoreSnapshot(FreeList* freeList, VM* vm, const char* path) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) return false;
+    SnapshotHeader header;
+    struct stat info;
+    uint8_t* base = NULL;
+    bool restored = pread(file, &header, sizeof(SnapshotHeader), 0) == sizeof(SnapshotHeader) && !fstat(file, &info)
+                    && validHeader(&header, (uint64_t) info.st_size) && restoreHeap(file, &header, &base);
+    close(file);
+    if (!restored) return false;
+
+    uintptr_t delta = (uintptr_t) base - (uintptr_t) header.base;
+    freeList->first = MOVED(Block, header.firstBlock);
+    freeList->base_ = base;
+    freeList->size_ = header.size;
+    freeList->mapped_ = true;
+#ifdef MARK_BITMAP
+    freeList->marks_ = calloc((header.size + 7) / 8, 1);
+    assert(freeList->marks_);
+#endif
+    if (header.used < header.size) {
+        Block* last = (Block*) (base + header.used);
+        last->next = MOVED(Block, header.lastBlockNext);
+        last->blockSize = header.size - header.used;
+    }
+#ifdef COMPRESSED_HEAP_REFS
+    freeList->heapBase_ = base - (1 << HEAP_REF_SHIFT);
+    heapBase = freeList->heapBase_;
+#endif
+
+    // as initVM() leaves it, apart from everything that's in the heap
+    vm->freeList = freeList;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+#ifdef COROUTINES
+    vm->coroutine = NULL;
+#endif
+    vm->stack = header.stack;
+    vm->stack.values = MOVED(Value, header.stack.values);
+    vm->globals = header.globals;
+    vm->globals.control = MOVED(uint8_t, header.globals.control);
+    vm->globals.entries = MOVED(Entry, header.globals.entries);
+    vm->strings = header.strings;
+    vm->strings.entries = MOVED(InternEntry, header.strings.entries);
+    vm->objects = MOVED(Obj, header.objects);
+    vm->initString = MOVED(ObjString, header.initString);
+    vm->print = printf;
+    vm->greyCount = 0;
+    vm->greyCapacity = 0;
+    vm->greyStack = NULL;
+    vm->bytesAllocated = header.bytesAllocated;
+    vm->nextGC = header.nextGC;
+    vm->registerBytecode = header.registerBytecode;
+#ifdef TRACING_JIT
+    vm->recorder = NULL;
+    vm->codeVersion = 0;
+#endif
+#ifdef BYTECODE_CACHE
+    vm->cacheMappings = NULL;
+#endif
+#ifdef SHARED_CODE
+    vm->shared = NULL;
+#endif
+    return true;
+}
+
+#undef MOVED
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CLOX_SNAPSHOT_H
+#define CLOX_SNAPSHOT_H
+
+#include "buildid.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef HEAP_SNAPSHOT
+
+// an image of a VM between scripts, e.g. once a prelude has defined its classes and tables: its globals, interned
+// strings and every object, as the whole of its heap region byte for byte. Restoring maps the image back in (privately,
+// so pages are only copied once they're written) in place of initMemory() and initVM(), and carries on as if the VM
+// had been there all along.
+//
+// The image maps at the address it was taken from where that's free, which needs no fixups at all; otherwise every
+// pointer into the heap is moved by the difference, from a list of where they all are written with the image, so
+// restoring costs one add per pointer. Natives are moved the same way if the code's been loaded somewhere else, so
+// images can only be restored by the same clox binary (or program embedding it) that took them: the header records the
+// binary's ELF build ID, and a binary linked without one (or that isn't ELF) can't write images.
+//
+// Machine code (from the JIT or --emit-c) and recorded traces are outside the heap, so aren't kept: hot functions and
+// loops are compiled again after restoring. Code used straight from a bytecode cache (see cache.h) is copied in.
+//
+// The file is a SnapshotHeader, the relocations (8 byte offsets into the heap), then the heap from a page boundary.
+
+#define SNAPSHOT_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodeCount;
+    // the build options the heap's layout depends on
+    uint32_t options;
+    // where (and in which build) the image was taken
+    uint64_t base;
+    uint64_t code;
+    uint32_t buildIdLength;
+    uint8_t buildId[BUILD_ID_MAX];
+    // the heap region, of which the first `used` bytes are in the file; the rest is a free block
+    uint64_t size;
+    uint64_t used;
+    uint64_t heapOffset;
+    uint64_t relocationCount;
+    uint64_t codeRelocationCount;
+    // the free list, and the free block at the end (if any)
+    uint64_t firstBlock;
+    uint64_t lastBlockNext;
+    // the VM's state, with pointers as they were when the image was taken
+    uint64_t objects;
+    uint64_t initString;
+    Table globals;
+    InternTable strings;
+    ValueArray stack;
+    uint64_t bytesAllocated;
+    uint64_t nextGC;
+    uint32_t registerBytecode;
+} SnapshotHeader;
+
+// writes an image of the VM to `path`. Only between scripts (with nothing on the stack), as the GC runs first, and not
+// while the VM has any channels (see isolate.h) or coroutines (see object.h); returns false if the image couldn't be
+// written, in which case there's no file left at `path`
+bool writeSnapshot(VM* vm, const char* path);
+
+// restores the image at `path` in place of initMemory() and initVM(), or returns false (having changed nothing) if
+// there's no image there from this build of clox. freeMemory() releases the image with the rest of the heap
+bool restoreSnapshot(FreeList* freeList, VM* vm, const char* path);
+
+#endif
+
+#endif //CLOX_SNAPSHOT_H
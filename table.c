@@ -2,84 +2,185 @@
 #include "table.h"
 #include "object.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// bitmask of the slots in a group, lowest bit = first slot
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*) group);
+    return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte)));
+}
+
+static inline GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+    // both special values have the top bit set, full slots don't
+    return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group));
+}
+#else
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    GroupMask mask = 0;
+    for (uint32_t i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (uint32_t i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchByte(group, CTRL_EMPTY);
+}
+
+// h1 picks a preferred slot, and so the first group to probe; h2 is stored in the control byte to filter candidates
+// without touching the entry
+static inline uint32_t hashSlot(uint32_t hash, uint32_t capacity) {
+    return (hash >> 7) & (capacity - 1);
+}
+
+static inline uint8_t hashTag(uint32_t hash) {
+    return (uint8_t) (hash & 0x7F);
+}
+
+static inline size_t allocationSize(uint32_t capacity) {
+    return (size_t) capacity * (1 + sizeof(Entry));
+}
+
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
+    table->growthLeft = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void freeTable(VM* vm, Table* table) {
-    VM_FREE_ARRAY(Entry, table->entries, table->capacity);
+    VM_FREE_ARRAY(uint8_t, table->control, allocationSize(table->capacity));
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, uint32_t capacity, ObjString* key) {
-    // modulus, taking advantage of the capacity always being a power of 2
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-    // open addressing - entry may not be in the expected location
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (!entry->key) {
-            // not present; return first tombstone found, or first empty slot
-            if (IS_NIL(entry->value)) {
-                return tombstone ? tombstone : entry;
-            } else {
-                if (!tombstone) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+static inline Entry* findEntry(Table* table, ObjString* key) {
+    // small, sparse tables (i.e. most instances & classes) almost always have the key in its preferred slot, which is
+    // as cheap to check as a linear probing hit
+    // keys are compared as stored, without decompressing
+    HEAP_REF(ObjString) keyRef = TO_HEAP_REF(key);
+    uint32_t slot = hashSlot(key->hash, table->capacity);
+    if (table->entries[slot].key == keyRef) return table->entries + slot;
+
+    uint32_t groupMask = table->capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = slot / TABLE_GROUP_WIDTH;
+    uint8_t tag = hashTag(key->hash);
+
+    // triangular probing visits every group exactly once when the group count is a power of 2
+    for (uint32_t step = 1;; step++) {
+        uint8_t* control = table->control + group * TABLE_GROUP_WIDTH;
+        for (GroupMask matches = matchByte(control, tag); matches; matches &= matches - 1) {
+            Entry* entry = table->entries + group * TABLE_GROUP_WIDTH + __builtin_ctz(matches);
+            if (entry->key == keyRef) return entry;
         }
+        // an empty slot means the key would have been inserted in this group (or an earlier one)
+        if (matchEmpty(control)) return NULL;
 
-        index = (index + 1) & (capacity - 1);
+        group = (group + step) & groupMask;
     }
 }
 
-static void adjustCapacity(VM* vm, Compiler* compiler, Table* table, uint32_t newCapacity) {
-    Entry* entries = COMPILER_ALLOCATE(Entry, newCapacity);
+// first empty or deleted slot along the key's probe sequence
+static uint32_t findInsertSlot(uint8_t* controlBytes, uint32_t capacity, uint32_t hash) {
+    uint32_t preferred = hashSlot(hash, capacity);
+    if (controlBytes[preferred] & 0x80) return preferred;
+
+    uint32_t groupMask = capacity / TABLE_GROUP_WIDTH - 1;
+    uint32_t group = preferred / TABLE_GROUP_WIDTH;
+    for (uint32_t step = 1;; step++) {
+        GroupMask available = matchEmptyOrDeleted(controlBytes + group * TABLE_GROUP_WIDTH);
+        if (available) return group * TABLE_GROUP_WIDTH + __builtin_ctz(available);
 
-    for (uint32_t i = 0; i < newCapacity; ++i) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+        group = (group + step) & groupMask;
     }
+}
 
-    table->count = 0;
-    // need to redistribute entries as the indexes depend on the capacity
-    for (uint32_t i = 0; i < table->capacity; ++i) {
-        Entry* entry = &table->entries[i];
-        if (!entry->key) continue;
-
-        Entry* dest = findEntry(entries, newCapacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+static inline uint32_t maxLoad(uint32_t capacity) {
+    return capacity / 8 * TABLE_MAX_LOAD_EIGHTHS;
+}
+
+static void resize(VM* vm, Compiler* compiler, Table* table, uint32_t newCapacity) {
+    uint8_t* control = COMPILER_ALLOCATE(uint8_t, allocationSize(newCapacity));
+    Entry* entries = (Entry*) (control + newCapacity);
+    memset(control, CTRL_EMPTY, newCapacity);
+    // the preferred slot check in findEntry reads keys without looking at the control byte
+    memset(entries, 0, sizeof(Entry) * newCapacity);
+
+    // tombstones aren't copied, which is how they get reclaimed
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (table->control[i] & 0x80) continue;
+
+        Entry* entry = table->entries + i;
+        uint32_t slot = findInsertSlot(control, newCapacity, FROM_HEAP_REF(ObjString, entry->key)->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
     }
 
-    VM_FREE_ARRAY(Entry, table->entries, table->capacity);
+    VM_FREE_ARRAY(uint8_t, table->control, allocationSize(table->capacity));
+    table->control = control;
     table->entries = entries;
     table->capacity = newCapacity;
+    table->growthLeft = maxLoad(newCapacity) - table->count;
+}
+
+static void rehashForInsert(VM* vm, Compiler* compiler, Table* table) {
+    // size for the live entries (not the tombstones) so the table is at most half full afterwards - this grows a full
+    // table, but shrinks one where most of the entries have been deleted
+    uint32_t capacity = TABLE_GROUP_WIDTH;
+    while (maxLoad(capacity) < (table->count + 1) * 2) {
+        capacity *= 2;
+    }
+    resize(vm, compiler, table, capacity);
 }
 
 bool tableSet(VM* vm, Compiler* compiler, Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        uint32_t capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(vm, compiler, table, capacity);
+    if (table->count) {
+        Entry* existing = findEntry(table, key);
+        if (existing) {
+            existing->value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    // tableDelete can't allocate, so shrinking a mostly-deleted table waits for the next insert
+    if (!table->capacity || (table->capacity > TABLE_GROUP_WIDTH && table->count < table->capacity / 16)) {
+        rehashForInsert(vm, compiler, table);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    uint32_t slot = findInsertSlot(table->control, table->capacity, key->hash);
+    // reusing a tombstone never needs a rehash; using up an empty slot might
+    if (table->control[slot] == CTRL_EMPTY && !table->growthLeft) {
+        rehashForInsert(vm, compiler, table);
+        slot = findInsertSlot(table->control, table->capacity, key->hash);
+    }
+
+    if (table->control[slot] == CTRL_EMPTY) table->growthLeft--;
+    table->control[slot] = hashTag(key->hash);
+    table->entries[slot].key = TO_HEAP_REF(key);
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (!table->count) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (!entry->key) return false;
+    Entry* entry = findEntry(table, key);
+    if (!entry) return false;
 
     *value = entry->value;
     return true;
@@ -87,56 +188,42 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
 
 void tableAddAll(VM* vm, Compiler* compiler, Table* from, Table* to) {
     for (uint32_t i = 0; i < from->capacity; ++i) {
-        Entry* entry = &from->entries[i];
-        if (entry->key) {
-            tableSet(vm, compiler, to, entry->key, entry->value);
-        }
+        if (from->control[i] & 0x80) continue;
+
+        Entry* entry = from->entries + i;
+        tableSet(vm, compiler, to, FROM_HEAP_REF(ObjString, entry->key), entry->value);
     }
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (!table->count) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (!entry->key) return false;
+    Entry* entry = findEntry(table, key);
+    if (!entry) return false;
+
+    uint32_t slot = (uint32_t) (entry - table->entries);
+    uint8_t* group = table->control + slot / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+    // probes only continue past a group once it's been completely full, and a full group can never regain an empty
+    // slot - so if this group has one, no probe sequence runs through it and the slot can go straight back to empty
+    if (matchEmpty(group)) {
+        table->control[slot] = CTRL_EMPTY;
+        table->growthLeft++;
+    } else {
+        table->control[slot] = CTRL_DELETED;
+    }
 
-    entry->key = NULL;
-    // flag as tombstone
-    entry->value = BOOL_VAL(true);
+    entry->key = TO_HEAP_REF(NULL);
+    entry->value = NIL_VAL;
+    table->count--;
     return true;
 }
 
-ObjString* tableFindString(Table* table, const char* chars, uint32_t length, uint32_t hash) {
-    if (!table->count) return false;
-
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = table->entries + index;
-        if (!entry->key) {
-            // exclude tombstones
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
-        }
-
-        index = (index + 1) & (table->capacity - 1);
-    }
-}
-
 void markTable(VM* vm, Table* table) {
     for (uint32_t i = 0; i < table->capacity; i++) {
-        Entry* entry = table->entries + i;
-        markObject(vm, (Obj*) entry->key);
-        markValue(vm, entry->value);
-    }
-}
+        if (table->control[i] & 0x80) continue;
 
-void tableRemoveWhite(Table* table) {
-    for (uint32_t i = 0; i < table->capacity; i++) {
         Entry* entry = table->entries + i;
-        if (entry->key && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
-        }
+        markObject(vm, (Obj*) FROM_HEAP_REF(ObjString, entry->key));
+        markValue(vm, entry->value);
     }
 }
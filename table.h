@@ -3,16 +3,34 @@
 
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// SwissTable-style layout: slots are split into groups of 16, each with a parallel array of control bytes which can be
+// scanned for a match in one SSE2 compare
+#define TABLE_GROUP_WIDTH 16
+// max load as a fraction of 8ths i.e. 7/8
+#define TABLE_MAX_LOAD_EIGHTHS 7
+
+#define CTRL_EMPTY   ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+// full slots store the low 7 bits of the key's hash, so the top bit is clear
 
 typedef struct {
-    ObjString* key;
+    HEAP_REF(ObjString) key;
     Value value;
-} Entry;
+}
+#ifdef COMPRESSED_HEAP_REFS
+// 12 rather than 16 bytes; nothing takes the address of the value, and unaligned loads are cheap
+__attribute__((packed))
+#endif
+Entry;
 
 typedef struct {
     uint32_t count;
     uint32_t capacity;
+    // number of empty slots that can be filled before a rehash; deleting into a tombstone doesn't give these back, so
+    // the next rehash is what reclaims tombstones (and shrinks the table if most entries were deleted)
+    uint32_t growthLeft;
+    // `capacity` control bytes followed by `capacity` entries, in a single allocation
+    uint8_t* control;
     Entry* entries;
 } Table;
 
@@ -22,8 +40,6 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(VM* vm, Compiler* compiler, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(VM* vm, Compiler* compiler, Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars, uint32_t length, uint32_t hash);
 void markTable(VM* vm, Table* table);
-void tableRemoveWhite(Table* table);
 
 #endif //CLOX_TABLE_H
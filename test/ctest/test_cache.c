@@ -0,0 +1,150 @@
+#include "test_suite.h"
+#include "vm.c"
+#include "cache.h"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef BYTECODE_CACHE
+#define CACHE_PATH "test_cache.loxc"
+
+static const char* source = "class Counter {\n"
+                            " init(start) { this.count = start; }\n"
+                            " next() { this.count = this.count + 1; return this.count; }\n"
+                            "}\n"
+                            "fun adder(x) {\n fun add(y) { return x + y; }\n return add;\n}\n"
+                            "fun sum(n) {\n var total = 0;\n for (var i = 0; i < n; i = i + 1) total = total + i;\n"
+                            " return total;\n}\n"
+                            "var counter = Counter(10);\n"
+                            "for (var i = 0; i < 100; i = i + 1) counter.next();\n"
+                            "print counter.count;\n"
+                            "print adder(2)(0.5);\n"
+                            "print sum(1000);\n"
+                            "print \"ab\" + \"a much longer string\";\n"
+                            "print nil == false;\n"
+                            "print -7;\n";
+
+static bool writeScript(const char* script) {
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    ObjFunction* function = compile(&vm, script);
+    bool written = function && writeCache(function, script, CACHE_PATH);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return written;
+}
+
+int testLoadedScriptRuns(void) {
+    int err_code = TEST_SUCCEEDED;
+    checkIntsEqual(writeScript(source), true);
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    ObjFunction* script = loadCache(&vm, source, CACHE_PATH);
+    checkIntsEqual(script != NULL, true);
+    if (!script) return TEST_FAILED;
+    checkIntsEqual(script->chunk.mapped, true);
+    checkIntsEqual(script->chunk.capacity, 0);
+    checkPtrsEqual(FROM_HEAP_REF(ObjString, script->name), NULL);
+
+    checkIntsEqual(interpretFunction(&vm, script), INTERPRET_OK);
+    checkIntsEqual(printed, 6);
+    checkStringsEqual(printLog[0], "110");
+    checkStringsEqual(printLog[1], "2.5");
+    checkStringsEqual(printLog[2], "499500");
+    checkStringsEqual(printLog[3], "aba much longer string");
+    checkStringsEqual(printLog[4], "false");
+    checkStringsEqual(printLog[5], "-7");
+
+    // the hot method was rebuilt on the heap
+    Value counter = NIL_VAL;
+    tableGet(&vm.globals, copyString(&vm, NULL, "Counter", 7), &counter);
+    Value next = NIL_VAL;
+    tableGet(&AS_CLASS(counter)->methods, copyString(&vm, NULL, "next", 4), &next);
+    ObjFunction* method = FROM_HEAP_REF(ObjFunction, AS_CLOSURE(next)->function);
+#ifdef SSA_OPTIMISATION
+    checkIntsEqual(method->optimised, true);
+    checkIntsEqual(method->chunk.mapped, false);
+#endif
+    checkStringsEqual(STRING_CHARS(FROM_HEAP_REF(ObjString, method->name)), "next");
+
+    // loaded strings are interned like any others
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "print counter.count + sum(3);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "113");
+
+    freeVM(&vm);
+    checkPtrsEqual(vm.cacheMappings, NULL);
+    freeMemory(&freeList);
+    remove(CACHE_PATH);
+    return err_code;
+}
+
+int testStaleCacheIgnored(void) {
+    int err_code = TEST_SUCCEEDED;
+    checkIntsEqual(writeScript("print 1;\n"), true);
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    checkPtrsEqual(loadCache(&vm, "print 2;\n", CACHE_PATH), NULL);
+    checkPtrsEqual(loadCache(&vm, "print 1;\n\n", CACHE_PATH), NULL);
+    checkIntsEqual(loadCache(&vm, "print 1;\n", CACHE_PATH) != NULL, true);
+
+    // a truncated file
+    char bytes[4096];
+    FILE* file = fopen(CACHE_PATH, "rb");
+    size_t size = fread(bytes, 1, sizeof(bytes), file);
+    fclose(file);
+    file = fopen(CACHE_PATH, "wb");
+    fwrite(bytes, 1, size - 8, file);
+    fclose(file);
+    checkPtrsEqual(loadCache(&vm, "print 1;\n", CACHE_PATH), NULL);
+
+    // written by another build, whose compiler could have folded or emitted the same source differently
+    checkIntsEqual(writeScript("print 1;\n"), true);
+    file = fopen(CACHE_PATH, "r+b");
+    fseek(file, (long) offsetof(CacheHeader, buildId), SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, (long) offsetof(CacheHeader, buildId), SEEK_SET);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    checkPtrsEqual(loadCache(&vm, "print 1;\n", CACHE_PATH), NULL);
+
+    remove(CACHE_PATH);
+    checkPtrsEqual(loadCache(&vm, "print 1;\n", CACHE_PATH), NULL);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef BYTECODE_CACHE
+    return testLoadedScriptRuns() | testStaleCacheIgnored();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,109 @@
+#include "test_suite.h"
+#include "compiler.c"
+
+static ObjFunction* compileScript(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
+    assert(function);
+    // keep reachable
+    push(vm, OBJ_VAL(function));
+    return function;
+}
+
+int testFolding(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    // the whole expression becomes a single constant
+    Chunk* chunk = &compileScript(&vm, "print -2 * 3 + 10 / 4;")->chunk;
+    checkIntsEqual(chunk->code[0], OP_CONSTANT);
+    checkIntsEqual(chunk->constants.count, 1);
+    checkFloatsEqual(AS_NUMBER(chunk->constants.values[chunk->code[1]]), -3.5);
+    checkIntsEqual(chunk->code[2], OP_PRINT);
+
+    chunk = &compileScript(&vm, "print !(1 < 2) == false;")->chunk;
+    checkIntsEqual(chunk->code[0], OP_TRUE);
+    checkIntsEqual(chunk->code[1], OP_PRINT);
+    checkIntsEqual(chunk->constants.count, 0);
+
+    chunk = &compileScript(&vm, "print 1 >= 1.5 == 2 <= 2;")->chunk;
+    checkIntsEqual(chunk->code[0], OP_FALSE);
+
+    chunk = &compileScript(&vm, "print \"con\" + \"cat\" + \"enated\";")->chunk;
+    checkIntsEqual(chunk->code[0], OP_CONSTANT);
+    checkIntsEqual(chunk->constants.count, 1);
+    Value concatenated = chunk->constants.values[0];
+    char chars[16];
+    checkIntsEqual(stringValueLength(concatenated), 12);
+    copyStringValueChars(concatenated, chars);
+    checkIntsEqual(memcmp(chars, "concatenated", 12), 0);
+
+    // int overflow promotes to double, exactly like the VM
+    chunk = &compileScript(&vm, "print 2147483647 + 1;")->chunk;
+    checkIntsEqual(chunk->constants.count, 1);
+    checkIntsEqual(IS_INT(chunk->constants.values[0]), false);
+    checkFloatsEqual(AS_NUMBER(chunk->constants.values[0]), 2147483648.0);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testNotFolded(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    // checks the shape of the stack instructions
+    vm.registerBytecode = false;
+
+    // runtime errors stay runtime errors
+    Chunk* chunk = &compileScript(&vm, "print 1 + \"a\";")->chunk;
+    checkIntsEqual(chunk->code[4], OP_ADD);
+    chunk = &compileScript(&vm, "print -\"a\";")->chunk;
+    checkIntsEqual(chunk->code[2], OP_NEGATE);
+
+    // only constant operands fold, but a constant sub-expression next to a variable still does
+    // scripts end with `PRINT; NIL; RETURN`
+    chunk = &compileScript(&vm, "var a = 1; print a + 2 * 3;")->chunk;
+    checkIntsEqual(chunk->code[chunk->count - 6], OP_CONSTANT);
+    checkIntsEqual(AS_NUMBER(chunk->constants.values[chunk->code[chunk->count - 5]]), 6);
+    checkIntsEqual(chunk->code[chunk->count - 4], OP_ADD);
+
+    chunk = &compileScript(&vm, "var a = 1; print 2 * 3 + a;")->chunk;
+    checkIntsEqual(chunk->code[chunk->count - 4], OP_ADD);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testConstantDeduplication(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    // `a`, 1, 1.0 & "long string" - 1 and 1.0 are only distinct when ints have their own representation
+    Chunk* chunk = &compileScript(&vm, "var a = 1; a = 1.0; a = 1; a = \"long string\"; a = \"long string\"; print a;")->chunk;
+#ifdef NAN_BOXING
+    checkIntsEqual(chunk->constants.count, 4);
+#else
+    checkIntsEqual(chunk->constants.count, 3);
+#endif
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testFolding() | testNotFolded() | testConstantDeduplication();
+}
@@ -0,0 +1,271 @@
+#include "test_suite.h"
+#include "vm.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef COROUTINES
+#define HEAP_SIZE (4 * 1024 * 1024)
+
+static InterpretResult runScript(const char* source) {
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    InterpretResult result = interpret(&vm, source);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return result;
+}
+
+int testGenerators(void) {
+    int err_code = TEST_SUCCEEDED;
+    const char* source = "fun range(n) {\n"
+                         "  for (var i = 0; i < n; i = i + 1) yield(i);\n"
+                         "  return \"done\";\n"
+                         "}\n"
+                         "var r = coroutine(range);\n"
+                         "print resume(r, 2);\n"
+                         "print resume(r, nil);\n"
+                         "print done(r);\n"
+                         "print resume(r, nil);\n"
+                         "print done(r);\n"
+                         // one generator driving another, and handing back what it's resumed with
+                         "fun squares() {\n"
+                         "  var numbers = coroutine(range);\n"
+                         "  var total = 0;\n"
+                         "  for (var i = resume(numbers, 4); !done(numbers); i = resume(numbers, nil))\n"
+                         "    total = total + yield(i * i);\n"
+                         "  return total;\n"
+                         "}\n"
+                         "var s = coroutine(squares);\n"
+                         "var i = resume(s, nil);\n"
+                         "while (!done(s)) { print i; i = resume(s, i); }\n"
+                         "print i;\n"
+                         // returning what the last yield() does, from the coroutine's bottom frame
+                         "fun echo(x) { return yield(x); }\n"
+                         "var e = coroutine(echo);\n"
+                         "print resume(e, \"in\");\n"
+                         "print resume(e, \"out\");\n"
+                         "print done(e);\n";
+    checkIntsEqual(runScript(source), INTERPRET_OK);
+    checkIntsEqual(printed, 13);
+    checkStringsEqual(printLog[0], "0");
+    checkStringsEqual(printLog[1], "1");
+    checkStringsEqual(printLog[2], "false");
+    checkStringsEqual(printLog[3], "done");
+    checkStringsEqual(printLog[4], "true");
+    checkStringsEqual(printLog[5], "0");
+    checkStringsEqual(printLog[6], "1");
+    checkStringsEqual(printLog[7], "4");
+    checkStringsEqual(printLog[8], "9");
+    // the sum of what each yield() returned, i.e. everything before it
+    checkStringsEqual(printLog[9], "14");
+    checkStringsEqual(printLog[10], "in");
+    checkStringsEqual(printLog[11], "out");
+    checkStringsEqual(printLog[12], "true");
+    return err_code;
+}
+
+int testUpvaluesAcrossYields(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    const char* source = "fun counter() {\n"
+                         "  var n = 0;\n"
+                         "  fun bump() { n = n + 1; return n; }\n"
+                         "  var resumed = yield(bump);\n"
+                         "  n = n + resumed;\n"
+                         "  return yield(n);\n"
+                         "}\n"
+                         "var c = coroutine(counter);\n"
+                         "var bump = resume(c, nil);\n"
+                         "bump();\n"
+                         "print bump();\n"
+                         "print resume(c, 100);\n"
+                         "print bump();\n"
+                         "resume(c, nil);\n"
+                         "print bump();\n"
+                         // a closure outliving the coroutine it came from, which is never finished
+                         "fun leak() { var left = \"behind\"; fun get() { return left; } yield(get); }\n"
+                         "var get = resume(coroutine(leak), nil);\n";
+    checkIntsEqual(interpret(&vm, source), INTERPRET_OK);
+    collectGarbage(&vm, NULL);
+    checkIntsEqual(interpret(&vm, "print get();"), INTERPRET_OK);
+    checkIntsEqual(printed, 5);
+    checkStringsEqual(printLog[0], "2");
+    checkStringsEqual(printLog[1], "102");
+    checkStringsEqual(printLog[2], "103");
+    checkStringsEqual(printLog[3], "104");
+    checkStringsEqual(printLog[4], "behind");
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testSuspendedFunctionsGetHot(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    // each coroutine is suspended part way through step() whenever the other calls it, so it can't be rebuilt yet,
+    // however many times it's called: each calls it as often as would make it hot on its own
+    const int calls = HOT_FUNCTION_THRESHOLD;
+    char source[1024];
+    snprintf(source, sizeof(source), "fun step(i) { var doubled = i * 2; yield(doubled); return doubled + 1; }\n"
+                                     "fun steps() {\n"
+                                     "  var total = 0;\n"
+                                     "  for (var i = 0; i < %d; i = i + 1) total = total + step(i);\n"
+                                     "  return total;\n"
+                                     "}\n"
+                                     "var a = coroutine(steps);\n"
+                                     "var b = coroutine(steps);\n"
+                                     "var yielded = 0;\n"
+                                     "var last;\n"
+                                     "while (!done(a)) { yielded = yielded + resume(a, nil); last = resume(b, nil); }\n"
+                                     "print yielded;\n"
+                                     "print last;\n", calls);
+    checkIntsEqual(interpret(&vm, source), INTERPRET_OK);
+    Value step;
+    tableGet(&vm.globals, copyString(&vm, NULL, "step", 4), &step);
+    ObjFunction* function = FROM_HEAP_REF(ObjFunction, AS_CLOSURE(step)->function);
+    checkIntsEqual(function->suspendedFrames, 0);
+    checkIntsEqual(function->optimised, false);
+
+#ifdef SSA_OPTIMISATION
+    // steps() is hot by now too, and inlines step() once it's rebuilt, so c runs step() itself; its call finds nothing
+    // suspended in step(), so mustn't be what tips it over
+    function->hotness = 0;
+#endif
+    checkIntsEqual(interpret(&vm, "var c = coroutine(step);\nvar result = resume(c, 5);\n"), INTERPRET_OK);
+#ifdef SSA_OPTIMISATION
+    function->hotness = HOT_FUNCTION_THRESHOLD;
+    optimiseIfHot(&vm, function);
+    checkIntsEqual(function->optimised, false);
+#endif
+    checkIntsEqual(interpret(&vm, "while (!done(c)) result = resume(c, nil);\nprint result;\n"), INTERPRET_OK);
+#ifdef SSA_OPTIMISATION
+    // until now
+    function->hotness = HOT_FUNCTION_THRESHOLD;
+    optimiseIfHot(&vm, function);
+    checkIntsEqual(function->optimised, true);
+#endif
+    const char* again = "var d = coroutine(steps);\n"
+                        "var result = resume(d, nil);\n"
+                        "while (!done(d)) result = resume(d, nil);\n"
+                        "print result;\n";
+    checkIntsEqual(interpret(&vm, again), INTERPRET_OK);
+    // each yields 2i, and returns the sum of 2i + 1, for i below `calls`
+    char yielded[32], total[32];
+    snprintf(yielded, sizeof(yielded), "%d", calls * (calls - 1) + calls * calls);
+    snprintf(total, sizeof(total), "%d", calls * calls);
+    checkIntsEqual(printed, 4);
+    checkStringsEqual(printLog[0], yielded);
+    checkStringsEqual(printLog[1], total);
+    checkStringsEqual(printLog[2], "11");
+    checkStringsEqual(printLog[3], total);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testErrors(void) {
+    int err_code = TEST_SUCCEEDED;
+    checkIntsEqual(runScript("yield(1);"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(runScript("coroutine(clock);"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(runScript("fun f(a, b) {} coroutine(f);"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(runScript("fun f() {} var c = coroutine(f); resume(c, nil); resume(c, nil);"),
+                   INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(runScript("fun f() { resume(c, nil); } var c = coroutine(f); resume(c, nil);"),
+                   INTERPRET_RUNTIME_ERROR);
+
+    // an error in a coroutine (resumed by another) goes all the way back, and leaves the VM as good as new
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    const char* source = "fun fails(x) { yield(x); return x + \"s\"; }\n"
+                         "fun outer() { var inner = coroutine(fails); yield(resume(inner, 1)); resume(inner, nil); }\n"
+                         "var c = coroutine(outer);\n"
+                         "print resume(c, nil);\n"
+                         "resume(c, nil);\n";
+    checkIntsEqual(interpret(&vm, source), INTERPRET_RUNTIME_ERROR);
+    checkPtrsEqual(vm.coroutine, NULL);
+    checkIntsEqual(vm.frameCount, 0);
+    checkIntsEqual(interpret(&vm, "print done(c);"), INTERPRET_OK);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[0], "1");
+    checkStringsEqual(printLog[1], "true");
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testResumingFromC(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    const char* source = "fun range(n) { for (var i = 0; i < n; i = i + 1) yield(i); return -1; }\n"
+                         "var numbers = coroutine(range);\n"
+                         // the native's called in tail position, so from the bottom frame
+                         "fun next() { return resume(numbers, 3); }\n"
+                         "fun root() { return sqrt(16); }\n";
+    checkIntsEqual(interpret(&vm, source), INTERPRET_OK);
+
+    Value result;
+    checkIntsEqual(callGlobal(&vm, "root", NULL, 0, &result), INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(result), 4);
+    checkIntsEqual(callGlobal(&vm, "next", NULL, 0, &result), INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(result), 0);
+    checkIntsEqual(callGlobal(&vm, "next", NULL, 0, &result), INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(result), 1);
+
+    // and the native itself
+    Value resume, arguments[2] = {NIL_VAL, NIL_VAL};
+    tableGet(&vm.globals, copyString(&vm, NULL, "resume", 6), &resume);
+    tableGet(&vm.globals, copyString(&vm, NULL, "numbers", 7), arguments);
+    checkIntsEqual(callFunction(&vm, resume, arguments, 2, &result), INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(result), 2);
+    checkIntsEqual(callFunction(&vm, resume, arguments, 2, &result), INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(result), -1);
+    checkIntsEqual(vm.stack.count, 0);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef COROUTINES
+    return testGenerators() | testUpvaluesAcrossYields() | testSuspendedFunctionsGetHot() | testErrors()
+           | testResumingFromC();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,114 @@
+#include "test_suite.h"
+#include "vm.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+int testEncoding(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    Chunk chunk;
+    initChunk(&vm, NULL, &chunk);
+    writeValue(&vm, NULL, &chunk.constants, INT_VAL(-5));
+    writeValue(&vm, NULL, &chunk.constants, NUMBER_VAL(1.5));
+
+    uint8_t code[] = {
+            OP_CONSTANT, 0,
+            OP_CONSTANT_LONG, 0, 0, 1,
+            OP_JUMP_IF_FALSE, 0, 2,
+            OP_POP,
+            OP_POP,
+            OP_LOOP, 0, 14,
+            OP_ADD_RK_STORE, 1, 0x81, 2,
+            OP_RETURN,
+    };
+    for (uint32_t i = 0; i < sizeof(code); i++) {
+        writeChunk(&vm, NULL, &chunk, code[i], 1);
+    }
+    encodeChunk(&vm, NULL, &chunk);
+
+    checkIntsEqual(chunk.wordCount, 8);
+    // small ints are immediates
+#ifdef NAN_BOXING
+    checkIntsEqual(WORD_OP(chunk.words[0]), OP_INT);
+    checkIntsEqual(WORD_SIGNED_OPERAND(chunk.words[0]), -5);
+#else
+    checkIntsEqual(WORD_OP(chunk.words[0]), OP_CONSTANT);
+    checkIntsEqual(WORD_OPERAND(chunk.words[0]), 0);
+#endif
+    // wide operands use the narrow opcode
+    checkIntsEqual(WORD_OP(chunk.words[1]), OP_CONSTANT);
+    checkIntsEqual(WORD_OPERAND(chunk.words[1]), 1);
+    // jumps count words, from the end of the jump
+    checkIntsEqual(WORD_OP(chunk.words[2]), OP_JUMP_IF_FALSE);
+    checkIntsEqual(WORD_OPERAND(chunk.words[2]), 2);
+    checkIntsEqual(WORD_OP(chunk.words[5]), OP_LOOP);
+    checkIntsEqual(WORD_OPERAND(chunk.words[5]), 6);
+    checkIntsEqual(WORD_OP(chunk.words[6]), OP_ADD_RK_STORE);
+    checkIntsEqual(WORD_A(chunk.words[6]), 1);
+    checkIntsEqual(WORD_B(chunk.words[6]), 0x81);
+    checkIntsEqual(WORD_C(chunk.words[6]), 2);
+    checkIntsEqual(WORD_OP(chunk.words[7]), OP_RETURN);
+
+    uint32_t offsets[] = {0, 2, 6, 9, 10, 11, 14, 18};
+    for (uint32_t i = 0; i < 8; i++) {
+        checkIntsEqual(chunk.wordOffsets[i], offsets[i]);
+    }
+
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testRunningWords(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    char source[16384];
+    // a closure's function has to be one of the first 256 constants
+    uint32_t length = (uint32_t) snprintf(source, sizeof(source), "fun counter() {\n var n = 0;\n"
+                                          " fun next() { n = n + 1; return n; }\n return next;\n}\n");
+    // enough globals for the long forms of the constant and global instructions
+    for (int i = 0; i < 300; i++) {
+        length += (uint32_t) snprintf(source + length, sizeof(source) - length, "var g%d = %d.5;\n", i, i);
+    }
+    snprintf(source + length, sizeof(source) - length,
+             "print g299;\nprint 8388607 + 1;\nprint -8388608 - 1;\n"
+             "var next = counter();\nnext();\nprint next();\n");
+    checkIntsEqual(interpret(&vm, source), INTERPRET_OK);
+    checkIntsEqual(printed, 4);
+    checkStringsEqual(printLog[0], "299.5");
+    checkStringsEqual(printLog[1], "8388608");
+    checkStringsEqual(printLog[2], "-8388609");
+    checkStringsEqual(printLog[3], "2");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testEncoding() | testRunningWords();
+}
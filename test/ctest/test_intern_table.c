@@ -0,0 +1,124 @@
+#include "test_suite.h"
+#include "intern.c"
+
+int testInternTableRemoveWhite(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    const uint32_t stringCount = 2000;
+    ObjString* strings[2000];
+    for (uint32_t i = 0; i < stringCount; i++) {
+        char chars[16];
+        int length = sprintf(chars, "s%u", i);
+        strings[i] = copyString(&vm, NULL, chars, (uint32_t) length);
+        push(&vm, OBJ_VAL(strings[i]));
+    }
+    uint32_t initialCount = vm.strings.count;
+    uint32_t capacity = vm.strings.capacity;
+
+    // simulate a mark phase which reached the VM's own strings but only every third test string
+    for (uint32_t i = 0; i < vm.strings.capacity; i++) {
+        if (vm.strings.entries[i].string) SET_MARKED(&freeList, &vm.strings.entries[i].string->obj);
+    }
+    for (uint32_t i = 0; i < stringCount; i++) {
+        if (i % 3 == 0) {
+            SET_MARKED(&freeList, &strings[i]->obj);
+        } else {
+            CLEAR_MARKED(&freeList, &strings[i]->obj);
+        }
+    }
+    internTableRemoveWhite(&vm, &vm.strings);
+
+    uint32_t survivors = (stringCount + 2) / 3;
+    checkIntsEqual(vm.strings.count, initialCount - (stringCount - survivors));
+    // compacted in place
+    checkIntsEqual(vm.strings.capacity, capacity);
+
+    for (uint32_t i = 0; i < stringCount; i++) {
+        ObjString* found = internTableFind(&vm.strings, STRING_CHARS(strings[i]), strings[i]->length, strings[i]->hash);
+        checkPtrsEqual(found, i % 3 == 0 ? strings[i] : NULL);
+    }
+
+    // every surviving entry has its hash & length cached, and no empty slot separates it from its home slot
+    uint32_t occupied = 0;
+    for (uint32_t i = 0; i < vm.strings.capacity; i++) {
+        InternEntry* entry = vm.strings.entries + i;
+        if (!entry->string) continue;
+        occupied++;
+        checkIntsEqual(entry->hash, entry->string->hash);
+        checkIntsEqual(entry->length, entry->string->length);
+
+        uint32_t index = entry->hash & (vm.strings.capacity - 1);
+        while (index != i) {
+            if (!vm.strings.entries[index].string) {
+                fprintf(stderr, "\n\033[1;31mEntry %u is unreachable from its home slot\n\033[0m", i);
+                err_code = TEST_FAILED;
+                break;
+            }
+            index = (index + 1) & (vm.strings.capacity - 1);
+        }
+    }
+    checkIntsEqual(occupied, vm.strings.count);
+
+    for (uint32_t i = 0; i < vm.strings.capacity; i++) {
+        if (vm.strings.entries[i].string) CLEAR_MARKED(&freeList, &vm.strings.entries[i].string->obj);
+    }
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testInternTableRemoveWhiteWrapsAround(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    // Z, W & Y share home slot 5 and fill 5-7; V, X & X2 share home slot 7, so wrap around into 0-2. Removing W & V
+    // empties slot 0, which a walk must not start from: X2 would settle in slot 1, then Y's move back to slot 6 would
+    // cut it off from slot 7
+    const char* names[] = {"V", "X", "X2", "Z", "W", "Y"};
+    const uint32_t hashes[] = {7, 7, 7, 5, 5, 5};
+    const uint32_t slots[] = {0, 1, 2, 5, 6, 7};
+    const bool live[] = {false, true, true, true, false, true};
+    InternEntry entries[8];
+    memset(entries, 0, sizeof(entries));
+    InternTable table = {.count = 6, .capacity = 8, .entries = entries};
+    ObjString* strings[6];
+    for (int i = 0; i < 6; i++) {
+        strings[i] = copyString(&vm, NULL, names[i], (uint32_t) strlen(names[i]));
+        push(&vm, OBJ_VAL(strings[i]));
+    }
+    for (int i = 0; i < 6; i++) {
+        entries[slots[i]] = (InternEntry) {.string = strings[i], .hash = hashes[i], .length = strings[i]->length};
+        if (live[i]) {
+            SET_MARKED(&freeList, &strings[i]->obj);
+        } else {
+            CLEAR_MARKED(&freeList, &strings[i]->obj);
+        }
+    }
+    internTableRemoveWhite(&vm, &table);
+
+    checkIntsEqual(table.count, 4);
+    for (int i = 0; i < 6; i++) {
+        ObjString* found = internTableFind(&table, names[i], strings[i]->length, hashes[i]);
+        checkPtrsEqual(found, live[i] ? strings[i] : NULL);
+    }
+
+    for (int i = 0; i < 6; i++) {
+        CLEAR_MARKED(&freeList, &strings[i]->obj);
+    }
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testInternTableRemoveWhite() | testInternTableRemoveWhiteWrapsAround();
+}
\ No newline at end of file
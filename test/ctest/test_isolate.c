@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include "test_suite.h"
+#include "vm.c"
+#include "isolate.h"
+
+static char printLog[64][64];
+static int printed = 0;
+static pthread_mutex_t printLock = PTHREAD_MUTEX_INITIALIZER;
+
+// from isolates as well
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    pthread_mutex_lock(&printLock);
+    assert(printed < 64 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    pthread_mutex_unlock(&printLock);
+    return result;
+}
+
+#ifdef ISOLATES
+#define HEAP_SIZE (4 * 1024 * 1024)
+
+static InterpretResult runScript(const char* source) {
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+    InterpretResult result = interpret(&vm, source);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return result;
+}
+
+int testWorkFansOut(void) {
+    int err_code = TEST_SUCCEEDED;
+    // hot enough in the parent to have been optimised before it's copied
+    const char* source = "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+                         "print fib(20);\n"
+                         "class Job { init(n, scale) { this.n = n; this.scale = scale; } }\n"
+                         "fun worker(channels) {\n"
+                         "  var count = 0;\n"
+                         "  for (var job = receive(channels.jobs); job != nil; job = receive(channels.jobs)) {\n"
+                         "    send(channels.results, fib(job.n) * job.scale);\n"
+                         "    count = count + 1;\n"
+                         "  }\n"
+                         "  return count;\n"
+                         "}\n"
+                         "class Channels {}\n"
+                         "var channels = Channels();\n"
+                         "channels.jobs = channel(2);\n"
+                         "channels.results = channel(8);\n"
+                         "var workers = Channels();\n"
+                         "workers.a = spawn(worker, channels);\n"
+                         "workers.b = spawn(worker, channels);\n"
+                         "workers.c = spawn(worker, channels);\n"
+                         "var total = 0;\n"
+                         "for (var i = 0; i < 24; i = i + 1) {\n"
+                         "  send(channels.jobs, Job(15, 2));\n"
+                         "  var result = poll(channels.results);\n"
+                         "  if (result != nil) total = total + result;\n"
+                         "}\n"
+                         "close(channels.jobs);\n"
+                         "var jobs = receive(workers.a) + receive(workers.b) + receive(workers.c);\n"
+                         "for (var result = poll(channels.results); result != nil; result = poll(channels.results))\n"
+                         "  total = total + result;\n"
+                         "print jobs;\n"
+                         "print total;\n";
+    checkIntsEqual(runScript(source), INTERPRET_OK);
+    checkIntsEqual(printed, 3);
+    checkStringsEqual(printLog[0], "6765");
+    checkStringsEqual(printLog[1], "24");
+    checkStringsEqual(printLog[2], "29280");
+    return err_code;
+}
+
+int testValuesAreCopied(void) {
+    int err_code = TEST_SUCCEEDED;
+    const char* source = "class Node {\n"
+                         "  init(name) { this.name = name; }\n"
+                         "  describe() { return \"node \" + this.name; }\n"
+                         "}\n"
+                         "fun counter() { var n = 0; fun next() { n = n + 1; return n; } return next; }\n"
+                         "var next = counter();\n"
+                         "next();\n"
+                         "fun change(node) {\n"
+                         "  node.name = \"changed in the isolate\";\n"
+                         "  print node.next.next == node;\n"
+                         "  print node.alias == node.next;\n"
+                         "  print node.next.describe();\n"
+                         "  print next();\n"
+                         "  return node;\n"
+                         "}\n"
+                         "var a = Node(\"a\");\n"
+                         "a.next = Node(\"b\");\n"
+                         "a.next.next = a;\n"
+                         "a.alias = a.next;\n"
+                         "var copy = receive(spawn(change, a));\n"
+                         "print a.name;\n"
+                         "print copy.name;\n"
+                         "print copy.next.next == copy;\n"
+                         "print copy == a;\n"
+                         "print next();\n";
+    checkIntsEqual(runScript(source), INTERPRET_OK);
+    checkIntsEqual(printed, 9);
+    // cycles and objects reached twice survive, in both directions
+    checkStringsEqual(printLog[0], "true");
+    checkStringsEqual(printLog[1], "true");
+    checkStringsEqual(printLog[2], "node b");
+    // the closure's variable is copied as it was
+    checkStringsEqual(printLog[3], "2");
+    checkStringsEqual(printLog[4], "a");
+    checkStringsEqual(printLog[5], "changed in the isolate");
+    checkStringsEqual(printLog[6], "true");
+    checkStringsEqual(printLog[7], "false");
+    checkStringsEqual(printLog[8], "2");
+    return err_code;
+}
+
+int testClosedChannels(void) {
+    int err_code = TEST_SUCCEEDED;
+    const char* source = "var c = channel(1);\n"
+                         "print poll(c);\n"
+                         "print send(c, \"a string too long to be stored in the value\");\n"
+                         "close(c);\n"
+                         "print send(c, 2);\n"
+                         "print receive(c);\n"
+                         "print receive(c);\n"
+                         "fun fails(n) { return n + \"x\"; }\n"
+                         "print receive(spawn(fails, 1));\n";
+    checkIntsEqual(runScript(source), INTERPRET_OK);
+    checkIntsEqual(printed, 6);
+    checkStringsEqual(printLog[0], "nil");
+    checkStringsEqual(printLog[1], "true");
+    checkStringsEqual(printLog[2], "false");
+    checkStringsEqual(printLog[3], "a string too long to be stored in the value");
+    checkStringsEqual(printLog[4], "nil");
+    // a failed call closes its result channel without sending anything
+    checkStringsEqual(printLog[5], "nil");
+
+    checkIntsEqual(runScript("channel(0);"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(runScript("send(1, 2);"), INTERPRET_RUNTIME_ERROR);
+    return err_code;
+}
+
+int testTailCallsFromSpawnedFunctions(void) {
+    int err_code = TEST_SUCCEEDED;
+    // the class call in tail position returns straight away, leaving the isolate's VM without any frames
+    checkIntsEqual(runScript("class K {} fun f(x) { return K(); } print receive(spawn(f, 1));"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "K instance");
+    checkIntsEqual(runScript("fun f(x) { return sqrt(x); } print receive(spawn(f, 9));"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "3");
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef ISOLATES
+    return testWorkFansOut() | testValuesAreCopied() | testClosedChannels() | testTailCallsFromSpawnedFunctions();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,138 @@
+#include "test_suite.h"
+#include "vm.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef BASELINE_JIT
+static ObjFunction* globalFunction(VM* vm, const char* name) {
+    Value value = NIL_VAL;
+    tableGet(&vm->globals, copyString(vm, NULL, name, (uint32_t) strlen(name)), &value);
+    assert(IS_CLOSURE(value));
+    return FROM_HEAP_REF(ObjFunction, AS_CLOSURE(value)->function);
+}
+
+int testCompiledCode(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // only called once, so compiled by its loop, and carries on in machine code from the next instruction
+    checkIntsEqual(interpret(&vm, "fun sum(n) {\n var total = 0;\n"
+                                  " for (var i = 0; i < n; i = i + 1) total = total + i;\n return total;\n}\n"
+                                  "print sum(100);\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "sum")->chunk.native != NULL, true);
+    // the fast paths only handle ints: everything else is left to the interpreter, part way through the loop
+    checkIntsEqual(interpret(&vm, "print sum(100000);\n"
+                                  "fun join(a, b) { var s = a; s = s + b; return s; }\n"
+                                  "print join(1, 2);\n"
+                                  "print join(\"a\", \"b\");\n"
+                                  "print join(1.5, 2);\n"
+                                  "print join(2147483647, 1);\n"
+                                  "fun neg(x) { return -x; }\n"
+                                  "print neg(1);\n"
+                                  "print neg(-2147483648);\n"
+                                  "print neg(neg(0.5));\n"
+                                  "fun same(a, b) { return a == b; }\n"
+                                  "print same(1, 1);\n"
+                                  "print same(nil, false);\n"
+                                  "print same(\"ab\", \"ab\");\n"
+                                  "print same(1, 1.0);\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "join")->chunk.native != NULL, true);
+    checkIntsEqual(printed, 13);
+    const char* expected[] = {"4950", "4.99995e+09", "3", "ab", "3.5", "2.14748e+09", "-1", "2.14748e+09", "0.5",
+                              "true", "false", "true", "true"};
+    for (int i = 0; i < 13; i++) {
+        checkStringsEqual(printLog[i], expected[i]);
+    }
+
+    // globals, fields and upvalues
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "var g = 10;\n"
+                                  "class P { init(x) { this.x = x; } }\n"
+                                  "fun counter() {\n var n = 0;\n"
+                                  " fun next() { n = n + g; return n; }\n return next;\n}\n"
+                                  "fun bump(p) { p.x = p.x + 1; return p.x; }\n"
+                                  "var next = counter();\n"
+                                  "var p = P(1);\n"
+                                  "for (var i = 0; i < 5; i = i + 1) {\n next();\n bump(p);\n}\n"
+                                  "print next();\n"
+                                  "print p.x;\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "bump")->chunk.native != NULL, true);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[0], "60");
+    checkStringsEqual(printLog[1], "6");
+
+    // ints have no -0, so a zero product with a negative operand, or negating 0, is left to the interpreter
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun times(a, b) { return a * b; }\n"
+                                  "for (var i = 0; i < 5; i = i + 1) times(i, i);\n"
+                                  "print 1 / times(0, -1);\n"
+                                  "print 1 / times(-1, 0);\n"
+                                  "print times(0, 1);\n"
+                                  "print times(-3, 4);\n"
+                                  "print 1 / neg(0);\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "times")->chunk.native != NULL, true);
+    checkIntsEqual(printed, 5);
+    checkStringsEqual(printLog[0], "-inf");
+    checkStringsEqual(printLog[1], "-inf");
+    checkStringsEqual(printLog[2], "0");
+    checkStringsEqual(printLog[3], "-12");
+    checkStringsEqual(printLog[4], "-inf");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testRuntimeErrors(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // errors still come from the interpreter, at the same instruction
+    checkIntsEqual(interpret(&vm, "fun f(a) {\n print 1;\n var b = a - 1;\n print 2;\n return b;\n}\n"
+                                  "f(1);\nf(2);\nf(3);\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "f")->chunk.native != NULL, true);
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "f(\"a\");\n"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(printed, 1);
+    checkIntsEqual(interpret(&vm, "fun g(x) {\n if (x) return missing;\n return 1;\n}\n"
+                                  "g(false);\ng(false);\ng(false);\n"), INTERPRET_OK);
+    checkIntsEqual(globalFunction(&vm, "g")->chunk.native != NULL, true);
+    checkIntsEqual(interpret(&vm, "g(true);\n"), INTERPRET_RUNTIME_ERROR);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef BASELINE_JIT
+    return testCompiledCode() | testRuntimeErrors();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -21,21 +21,54 @@ int testLineCounter(void) {
     checkIntsEqual(chunk.count, 106);
     checkIntsEqual(chunk.capacity, 128);
 
-    Line* nextLine = chunk.firstLine;
-    assertNotNull(nextLine);
-    checkIntsEqual(nextLine->lineNumber, 10);
-    checkIntsEqual(nextLine->instructions, 5);
-
-    nextLine = nextLine->next;
-    assertNotNull(nextLine);
-    checkIntsEqual(nextLine->lineNumber, 11);
-    checkIntsEqual(nextLine->instructions, 1);
-
-    nextLine = nextLine->next;
-    assertNotNull(nextLine);
-    checkIntsEqual(nextLine->lineNumber, 99);
-    checkIntsEqual(nextLine->instructions, 100);
-    checkPtrsEqual(nextLine->next, NULL);
+    checkIntsEqual(chunk.lineCount, 3);
+    checkIntsEqual(chunk.lines[0].start, 0);
+    checkIntsEqual(chunk.lines[0].line, 10);
+    checkIntsEqual(chunk.lines[1].start, 5);
+    checkIntsEqual(chunk.lines[1].line, 11);
+    checkIntsEqual(chunk.lines[2].start, 6);
+    checkIntsEqual(chunk.lines[2].line, 99);
+
+    checkIntsEqual(getLine(&chunk, 0), 10);
+    checkIntsEqual(getLine(&chunk, 4), 10);
+    checkIntsEqual(getLine(&chunk, 5), 11);
+    checkIntsEqual(getLine(&chunk, 6), 99);
+    checkIntsEqual(getLine(&chunk, 105), 99);
+
+    freeChunk(&vm, &chunk);
+    freeMemory(&freeList);
+
+    return err_code;
+}
+
+int testManyLines(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    VM vm = {.freeList = &freeList};
+    Chunk chunk;
+    initChunk(&vm, NULL, &chunk);
+
+    // a few bytes per line, like generated code; line numbers can repeat out of order e.g. after a multi-line expression
+    const uint32_t lineCount = 50000;
+    for (uint32_t line = 1; line <= lineCount; line++) {
+        for (uint32_t i = 0; i < line % 4 + 1; i++) {
+            writeChunk(&vm, NULL, &chunk, OP_POP, line);
+        }
+    }
+    writeChunk(&vm, NULL, &chunk, OP_RETURN, 1);
+    checkIntsEqual(chunk.lineCount, lineCount + 1);
+
+    uint32_t offset = 0;
+    for (uint32_t line = 1; line <= lineCount; line++) {
+        for (uint32_t i = 0; i < line % 4 + 1; i++) {
+            if (getLine(&chunk, offset++) != line) {
+                fprintf(stderr, "\n\033[1;31mWrong line for offset %u\n\033[0m", offset - 1);
+                err_code = TEST_FAILED;
+            }
+        }
+    }
+    checkIntsEqual(getLine(&chunk, offset), 1);
 
     freeChunk(&vm, &chunk);
     freeMemory(&freeList);
@@ -44,5 +77,5 @@ int testLineCounter(void) {
 }
 
 int main(void) {
-    return testLineCounter();
+    return testLineCounter() | testManyLines();
 }
@@ -123,6 +123,31 @@ int testReallocation() {
     return err_code;
 }
 
+int testHeapRefs(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm = {
+            .freeList = &freeList
+    };
+    initMemory(&freeList, 1024 * 1024);
+
+    checkPtrsEqual(FROM_HEAP_REF(void, TO_HEAP_REF(NULL)), NULL);
+
+    // odd sized allocations must still be referenceable
+    for (int i = 0; i < 16; i++) {
+        void* ptr = reallocate(&vm, NULL, NULL, 0, 1 + i * 3);
+        HEAP_REF(void) ref = TO_HEAP_REF(ptr);
+        checkPtrsEqual(FROM_HEAP_REF(void, ref), ptr);
+#ifdef COMPRESSED_HEAP_REFS
+        checkIntsEqual(ref != 0, true);
+        checkLongsEqual((uintptr_t) ptr % (1 << HEAP_REF_SHIFT), 0);
+#endif
+    }
+
+    freeMemory(&freeList);
+    return err_code;
+}
+
 int main(void) {
-    return testAllocation() | testReallocation();
+    return testAllocation() | testReallocation() | testHeapRefs();
 }
@@ -0,0 +1,48 @@
+#include "test_suite.h"
+#include "object.c"
+
+int testObjectTypeChecks(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    ObjString* name = copyString(&vm, NULL, "Tagged", 6);
+    push(&vm, OBJ_VAL(name));
+    ObjClass* class = newClass(&vm, NULL, name);
+    push(&vm, OBJ_VAL(class));
+    ObjInstance* instance = newInstance(&vm, NULL, class);
+    push(&vm, OBJ_VAL(instance));
+    Value slot = NIL_VAL;
+    ObjUpvalue* upvalue = newUpvalue(&vm, NULL, &slot);
+    push(&vm, OBJ_VAL(upvalue));
+
+    Value values[] = {OBJ_VAL(name), OBJ_VAL(class), OBJ_VAL(instance), OBJ_VAL(upvalue)};
+    ObjType types[] = {OBJ_STRING, OBJ_CLASS, OBJ_INSTANCE, OBJ_UPVALUE};
+    Obj* objects[] = {(Obj*) name, (Obj*) class, (Obj*) instance, (Obj*) upvalue};
+
+    for (int i = 0; i < 4; i++) {
+        checkIntsEqual(IS_OBJ(values[i]), true);
+        checkPtrsEqual(AS_OBJ(values[i]), objects[i]);
+        checkIntsEqual(OBJ_TYPE(values[i]), types[i]);
+        for (int j = 0; j < 4; j++) {
+            checkIntsEqual(isObjType(values[i], types[j]), i == j);
+        }
+    }
+
+    // the type tag must not leak into any other kind of value
+    checkIntsEqual(IS_STRING(NUMBER_VAL(-1.5)), false);
+    checkIntsEqual(IS_STRING(NIL_VAL), false);
+    checkIntsEqual(IS_INSTANCE(BOOL_VAL(true)), false);
+    checkIntsEqual(IS_OBJ(INT_VAL(-1)), false);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testObjectTypeChecks();
+}
@@ -0,0 +1,239 @@
+#include "test_suite.h"
+#include "vm.c"
+#include "optimiser.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+static ObjFunction* firstFunction(VM* vm, const char* source) {
+    ObjFunction* script = compile(vm, source);
+    assert(script);
+    // keep reachable
+    push(vm, OBJ_VAL(script));
+    for (uint32_t i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) return AS_FUNCTION(constant);
+    }
+    assert(!"No function defined");
+    return NULL;
+}
+
+static uint32_t findOp(Chunk* chunk, OpCode op) {
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == op) return offset;
+    }
+    return UINT32_MAX;
+}
+
+static uint32_t countOps(Chunk* chunk, OpCode op) {
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == op) count++;
+    }
+    return count;
+}
+
+static ObjFunction* globalFunction(VM* vm, const char* name) {
+    Value value = NIL_VAL;
+    tableGet(&vm->globals, copyString(vm, NULL, name, (uint32_t) strlen(name)), &value);
+    assert(IS_CLOSURE(value));
+    return FROM_HEAP_REF(ObjFunction, AS_CLOSURE(value)->function);
+}
+
+int testOptimiseFunction(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    // checks the shape of the stack instructions
+    vm.registerBytecode = false;
+
+    // `a * b` is only computed once, before the loop, and the unused subtraction is gone
+    ObjFunction* function = firstFunction(&vm, "fun f(n) {\n var a = 3;\n var b = 4;\n var total = 0;\n"
+                                               " for (var i = 0; i < n; i = i + 1) {\n  var unused = a - b;\n"
+                                               "  total = total + a * b + a * b;\n }\n return total;\n}");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    Chunk* chunk = &function->chunk;
+    checkIntsEqual(countOps(chunk, OP_MULTIPLY), 1);
+    checkIntsEqual(countOps(chunk, OP_SUBTRACT), 0);
+    uint32_t loop = findOp(chunk, OP_LOOP);
+    uint32_t loopStart = loop + 3 - ((chunk->code[loop + 1] << 8) | chunk->code[loop + 2]);
+    checkIntsEqual(findOp(chunk, OP_MULTIPLY) < loopStart, true);
+    // the multiply keeps its line
+    checkIntsEqual(getLine(chunk, findOp(chunk, OP_MULTIPLY)), 7);
+
+    // copies of copies just use the parameter
+    function = firstFunction(&vm, "fun g(x) {\n var y = x;\n var z = y;\n return z;\n}");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    checkIntsEqual(function->chunk.count, 3);
+    checkIntsEqual(function->chunk.code[0], OP_GET_LOCAL);
+    checkIntsEqual(function->chunk.code[1], 1);
+    checkIntsEqual(function->chunk.code[2], OP_RETURN);
+
+    // `x + 1` might fail, so stays put even though it's unused
+    function = firstFunction(&vm, "fun h(x) {\n var y = x + 1;\n return 2;\n}");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    checkIntsEqual(countOps(&function->chunk, OP_ADD), 1);
+
+    // closures aren't modelled
+    function = firstFunction(&vm, "fun outer() {\n var a = 1;\n fun inner() { return a; }\n return inner;\n}");
+    uint32_t count = function->chunk.count;
+    checkIntsEqual(optimiseFunction(&vm, function), false);
+    checkIntsEqual(function->chunk.count, count);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testOptimisedOutput(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+
+    const char* source = "fun f(n, k) {\n var total = 0;\n var i = 0;\n while (i < n) {\n"
+                         "  var scale = k * 2 + 1;\n  if (i > 2) total = total + i * scale; else total = total - 1;\n"
+                         "  i = i + 1;\n }\n return total;\n}\n"
+                         "class A { init(x) { this.x = x; } get() { return this.x * this.x; } }\n"
+                         "var a = A(3);\n"
+                         "for (var j = 0; j < 3; j = j + 1) {\n print f(10, j);\n print a.get();\n}\n"
+                         "print f(4, 0.5);\n";
+    checkIntsEqual(interpret(&vm, source), INTERPRET_OK);
+    checkIntsEqual(printed, 7);
+    const char* expected[] = {"39", "9", "123", "9", "207", "9", "3"};
+    for (int i = 0; i < 7; i++) {
+        checkStringsEqual(printLog[i], expected[i]);
+    }
+
+    // errors still happen, in order
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun g(x) {\n print 1;\n var y = x * 2;\n print 2;\n return y;\n}\n"
+                                  "g(1);\ng(\"a\");"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(printed, 3);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testInlining(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    // checks the shape of the stack instructions
+    vm.registerBytecode = false;
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // both calls are replaced by the callee's code, each behind a guard
+    checkIntsEqual(interpret(&vm, "fun sq(x) {\n return x * x;\n}\n"
+                                  "class P { init(x) { this.x = x; } getX() { return this.x; } }\n"
+                                  "fun f(p, n) {\n return sq(n) + p.getX();\n}\n"), INTERPRET_OK);
+    ObjFunction* function = globalFunction(&vm, "f");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    function->optimised = true;
+    Chunk* chunk = &function->chunk;
+    checkIntsEqual(countOps(chunk, OP_JUMP_IF_CALLEE), 1);
+    checkIntsEqual(countOps(chunk, OP_JUMP_IF_INVOKES), 1);
+    checkIntsEqual(countOps(chunk, OP_MULTIPLY), 1);
+    checkIntsEqual(countOps(chunk, OP_GET_PROPERTY), 1);
+    // the inlined multiply is reported as being in sq(), called from line 6
+    InlinedRun* inlined = findInlinedRun(chunk, findOp(chunk, OP_MULTIPLY));
+    assertNotNull(inlined);
+    checkIntsEqual(inlined->line, 6);
+    checkIntsEqual(getLine(chunk, findOp(chunk, OP_MULTIPLY)), 2);
+    checkIntsEqual(findInlinedRun(chunk, findOp(chunk, OP_ADD)) == NULL, true);
+
+    // the original calls still happen once the guards fail
+    checkIntsEqual(interpret(&vm, "print f(P(1), 3);\n"
+                                  "fun cube(x) { return x * x * x; }\n"
+                                  "sq = cube;\n"
+                                  "print f(P(1), 3);\n"
+                                  "var p = P(1);\n"
+                                  "fun two() { return 2; }\n"
+                                  "p.getX = two;\n"
+                                  "print f(p, 3);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 3);
+    const char* expected[] = {"10", "28", "29"};
+    for (int i = 0; i < 3; i++) {
+        checkStringsEqual(printLog[i], expected[i]);
+    }
+
+    // errors inside inlined code still happen
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun half(x) {\n return x / 2;\n}\n"
+                                  "fun g(x) {\n print half(x);\n}\n"), INTERPRET_OK);
+    function = globalFunction(&vm, "g");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    function->optimised = true;
+    checkIntsEqual(countOps(&function->chunk, OP_JUMP_IF_CALLEE), 1);
+    checkIntsEqual(interpret(&vm, "g(4);\ng(\"a\");\n"), INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(printed, 1);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testTailCalls(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // still a tail call once rebuilt, so runs in constant stack space
+    checkIntsEqual(interpret(&vm, "fun sum(n, total) {\n if (n == 0) return total;\n"
+                                  " return sum(n - 1, total + n);\n}\n"), INTERPRET_OK);
+    ObjFunction* function = globalFunction(&vm, "sum");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    function->optimised = true;
+    checkIntsEqual(countOps(&function->chunk, OP_TAIL_CALL), 1);
+    checkIntsEqual(countOps(&function->chunk, OP_CALL), 0);
+    checkIntsEqual(interpret(&vm, "print sum(10000, 0);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "50005000");
+
+    // inlining a call that's returned keeps both the fallback and the callee's own calls as tail calls
+    checkIntsEqual(interpret(&vm, "fun wrap(n) {\n return sum(n, 0);\n}\n"), INTERPRET_OK);
+    function = globalFunction(&vm, "wrap");
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    function->optimised = true;
+    checkIntsEqual(countOps(&function->chunk, OP_JUMP_IF_CALLEE), 1);
+    checkIntsEqual(countOps(&function->chunk, OP_TAIL_CALL), 2);
+    checkIntsEqual(countOps(&function->chunk, OP_CALL), 0);
+    checkIntsEqual(interpret(&vm, "print wrap(10000);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[1], "50005000");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testOptimiseFunction() | testOptimisedOutput() | testInlining() | testTailCalls();
+}
@@ -0,0 +1,102 @@
+#include "test_suite.h"
+#include "compiler.c"
+
+static ObjFunction* compileScript(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
+    assert(function);
+    // keep reachable
+    push(vm, OBJ_VAL(function));
+    return function;
+}
+
+// the first function defined by the script
+static Chunk* firstFunction(ObjFunction* script) {
+    for (uint32_t i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) return &AS_FUNCTION(constant)->chunk;
+    }
+    assert(!"No function defined");
+    return NULL;
+}
+
+static uint32_t countOps(Chunk* chunk, OpCode op) {
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == op) count++;
+    }
+    return count;
+}
+
+// every jump lands on the start of an instruction which isn't itself an unconditional jump
+static bool jumpsResolved(Chunk* chunk) {
+    bool* starts = calloc(chunk->count + 1, sizeof(bool));
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        starts[offset] = true;
+    }
+
+    bool resolved = true;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (op != OP_JUMP && op != OP_JUMP_IF_FALSE && op != OP_JUMP_IF_TRUE && op != OP_LOOP) continue;
+
+        uint32_t distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        uint32_t target = op == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+        if (target >= chunk->count || !starts[target] || chunk->code[target] == OP_JUMP ||
+            chunk->code[target] == OP_LOOP) {
+            resolved = false;
+        }
+    }
+    free(starts);
+    return resolved;
+}
+
+int testPeephole(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    // checks the shape of the stack instructions
+    vm.registerBytecode = false;
+
+    // NOT; JUMP_IF_FALSE is fused, and the implicit `NIL; RETURN` after the explicit return is unreachable
+    Chunk* chunk = firstFunction(compileScript(&vm, "fun f(n) {\n if (!n) {\n return 1;\n }\n return 2;\n}"));
+    checkIntsEqual(countOps(chunk, OP_NOT), 0);
+    checkIntsEqual(countOps(chunk, OP_JUMP_IF_TRUE), 1);
+    checkIntsEqual(countOps(chunk, OP_NIL), 0);
+    checkIntsEqual(countOps(chunk, OP_RETURN), 2);
+    checkIntsEqual(jumpsResolved(chunk), true);
+    // `CONSTANT 2; RETURN` on line 5
+    checkIntsEqual(chunk->code[chunk->count - 1], OP_RETURN);
+    checkIntsEqual(getLine(chunk, chunk->count - 3), 5);
+    checkIntsEqual(getLine(chunk, 0), 2);
+
+    // the inner `else` jump would land on the outer one
+    chunk = firstFunction(compileScript(&vm, "fun f(a, b) {\n if (a) {\n if (b) print 1; else print 2;\n } else print 3;\n}"));
+    checkIntsEqual(jumpsResolved(chunk), true);
+
+    // assignment statements
+    chunk = firstFunction(compileScript(&vm, "fun f() {\n var a = 1;\n a = 2;\n while (a < 10) a = a + 1;\n}"));
+    checkIntsEqual(countOps(chunk, OP_SET_LOCAL), 0);
+    checkIntsEqual(countOps(chunk, OP_SET_LOCAL_POP), 2);
+    checkIntsEqual(jumpsResolved(chunk), true);
+
+    // the condition of an `if` without an `else` still needs popping on both paths
+    chunk = firstFunction(compileScript(&vm, "fun f(a) {\n if (!a) print 1;\n print 2;\n}"));
+    checkIntsEqual(countOps(chunk, OP_JUMP_IF_TRUE), 1);
+    checkIntsEqual(countOps(chunk, OP_POP), 2);
+    checkIntsEqual(jumpsResolved(chunk), true);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+#ifdef PEEPHOLE_OPTIMISATION
+    return testPeephole();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,161 @@
+#include <pthread.h>
+#include "test_suite.h"
+#include "vm.c"
+#include "pool.h"
+#include "shared.h"
+
+static char printLog[64][64];
+static int printed = 0;
+static int newlines = 0;
+static pthread_mutex_t printLock = PTHREAD_MUTEX_INITIALIZER;
+
+// from every worker at once
+int fakePrintf(const char* format, ...) {
+    pthread_mutex_lock(&printLock);
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) {
+        newlines++;
+        pthread_mutex_unlock(&printLock);
+        return 1;
+    }
+    assert(printed < 64 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    pthread_mutex_unlock(&printLock);
+    return result;
+}
+
+static bool wasPrinted(const char* line) {
+    for (int i = 0; i < printed; i++) {
+        if (strcmp(printLog[i], line) == 0) return true;
+    }
+    return false;
+}
+
+#ifdef WORKER_POOL
+#define HEAP_SIZE (4 * 1024 * 1024)
+
+static const char* prelude = "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+                             "fun join(n) {\n var s = \"\";\n"
+                             " for (var i = 0; i < n; i = i + 1) s = s + \"a longer piece of string \";\n"
+                             " return s;\n}\n"
+                             "fun lengthOf(n) {\n var total = 0;\n"
+                             " for (var i = 0; i < n; i = i + 1) if (join(20) != nil) total = total + 1;\n"
+                             " return total;\n}\n"
+                             // a native, and a class without an initialiser, called in tail position from the bottom
+                             // frame return straight away, leaving no frames to carry on with
+                             "fun root(n) { return sqrt(n); }\n"
+                             "class Empty {}\n"
+                             "fun make() { return Empty(); }\n";
+
+int testJobsRunOnWorkers(void) {
+    int err_code = TEST_SUCCEEDED;
+    PoolOptions options = {.workers = 4, .heapSize = HEAP_SIZE, .prelude = prelude, .print = fakePrintf,
+                           .pinned = true};
+    WorkerPool* pool = newWorkerPool(&options);
+    checkIntsEqual(pool != NULL, true);
+    if (!pool) return TEST_FAILED;
+    printed = 0;
+    newlines = 0;
+
+    PoolResult results[24];
+    for (int i = 0; i < 16; i++) {
+        Value argument = NUMBER_VAL(i);
+        submitCall(pool, "fib", &argument, 1, results + i);
+    }
+    // enough garbage for every worker to collect a few times, all at once
+    for (int i = 16; i < 20; i++) {
+        Value argument = NUMBER_VAL(200);
+        submitCall(pool, "lengthOf", &argument, 1, results + i);
+    }
+    submitScript(pool, "print fib(20);\n", results + 20);
+    submitScript(pool, "print join(2);\n", results + 21);
+    submitCall(pool, "missing", NULL, 0, results + 22);
+    submitScript(pool, "print fib(\"x\" + 1);\n", results + 23);
+    checkIntsEqual(waitForPool(pool), 2);
+
+    double fib[16] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377, 610};
+    for (int i = 0; i < 16; i++) {
+        checkIntsEqual(results[i].status, INTERPRET_OK);
+        checkFloatsEqual(AS_NUMBER(results[i].value), fib[i]);
+    }
+    for (int i = 16; i < 20; i++) {
+        checkIntsEqual(results[i].status, INTERPRET_OK);
+        checkFloatsEqual(AS_NUMBER(results[i].value), 200);
+    }
+    checkIntsEqual(results[20].status, INTERPRET_OK);
+    checkIntsEqual(results[21].status, INTERPRET_OK);
+    checkIntsEqual(results[22].status, INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(results[23].status, INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(printed, 2);
+    // newlines included: none of the output goes around the pool's printer (and its locking)
+    checkIntsEqual(newlines, 2);
+    checkIntsEqual(wasPrinted("6765"), true);
+    checkIntsEqual(wasPrinted("a longer piece of string a longer piece of string "), true);
+
+    // still usable afterwards
+    submitCall(pool, "fib", (Value[]) {NUMBER_VAL(10)}, 1, results);
+    checkIntsEqual(waitForPool(pool), 0);
+    checkFloatsEqual(AS_NUMBER(results[0].value), 55);
+
+    submitCall(pool, "root", (Value[]) {NUMBER_VAL(16)}, 1, results);
+    submitCall(pool, "make", NULL, 0, results + 1);
+    checkIntsEqual(waitForPool(pool), 0);
+    checkIntsEqual(results[0].status, INTERPRET_OK);
+    checkFloatsEqual(AS_NUMBER(results[0].value), 4);
+    checkIntsEqual(results[1].status, INTERPRET_OK);
+    // objects belong to the worker's heap, so come back as nil
+    checkIntsEqual(IS_NIL(results[1].value), true);
+
+    freeWorkerPool(pool);
+    return err_code;
+}
+
+int testFailedPreludeCounted(void) {
+    int err_code = TEST_SUCCEEDED;
+    PoolOptions options = {.workers = 3, .heapSize = HEAP_SIZE, .prelude = "var x = ;", .print = fakePrintf};
+    WorkerPool* pool = newWorkerPool(&options);
+    checkIntsEqual(waitForPool(pool), 3);
+    freeWorkerPool(pool);
+    return err_code;
+}
+
+#ifdef SHARED_CODE
+int testWorkersShareCode(void) {
+    int err_code = TEST_SUCCEEDED;
+    SharedCode* shared = compileSharedCode(prelude, HEAP_SIZE);
+    checkIntsEqual(shared != NULL, true);
+    if (!shared) return TEST_FAILED;
+
+    PoolOptions options = {.workers = 4, .heapSize = HEAP_SIZE, .shared = shared,
+                           .prelude = "fun twice(n) { return fib(n) * 2; }\n", .print = fakePrintf};
+    WorkerPool* pool = newWorkerPool(&options);
+    PoolResult results[8];
+    for (int i = 0; i < 8; i++) {
+        submitCall(pool, i % 2 ? "twice" : "lengthOf", (Value[]) {NUMBER_VAL(i % 2 ? 15 : 100)}, 1, results + i);
+    }
+    checkIntsEqual(waitForPool(pool), 0);
+    for (int i = 0; i < 8; i++) {
+        checkFloatsEqual(AS_NUMBER(results[i].value), i % 2 ? 1220 : 100);
+    }
+
+    freeWorkerPool(pool);
+    freeSharedCode(shared);
+    return err_code;
+}
+#endif
+#endif
+
+int main(void) {
+#ifdef WORKER_POOL
+    int err_code = testJobsRunOnWorkers() | testFailedPreludeCounted();
+#ifdef SHARED_CODE
+    err_code |= testWorkersShareCode();
+#endif
+    return err_code;
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,178 @@
+#include "test_suite.h"
+#include "vm.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+static ObjFunction* firstFunction(VM* vm, const char* source) {
+    ObjFunction* script = compile(vm, source);
+    assert(script);
+    // keep reachable
+    push(vm, OBJ_VAL(script));
+    for (uint32_t i = 0; i < script->chunk.constants.count; i++) {
+        Value constant = script->chunk.constants.values[i];
+        if (IS_FUNCTION(constant)) return AS_FUNCTION(constant);
+    }
+    assert(!"No function defined");
+    return NULL;
+}
+
+static uint32_t findOp(Chunk* chunk, OpCode op) {
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == op) return offset;
+    }
+    return UINT32_MAX;
+}
+
+static uint32_t countOps(Chunk* chunk, OpCode op) {
+    uint32_t count = 0;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == op) count++;
+    }
+    return count;
+}
+
+int testRegisterCode(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.registerBytecode = true;
+
+    // `ADD_RK r1 r2; RETURN`
+    Chunk* chunk = &firstFunction(&vm, "fun f(a, b) { return a + b; }")->chunk;
+    checkIntsEqual(chunk->code[0], OP_ADD_RK);
+    checkIntsEqual(chunk->code[1], 1);
+    checkIntsEqual(chunk->code[2], 2);
+    checkIntsEqual(chunk->code[3], OP_RETURN);
+
+    // assignments of register instructions and operands go straight to the local
+    chunk = &firstFunction(&vm, "fun f(n) {\n var x = 0;\n x = n * 2;\n x = n;\n}")->chunk;
+    uint32_t store = findOp(chunk, OP_MULTIPLY_RK_STORE);
+    checkIntsEqual(store != UINT32_MAX, true);
+    checkIntsEqual(chunk->code[store + 1], 1);
+    checkIntsEqual(AS_INT(chunk->constants.values[chunk->code[store + 2] & ~RK_CONSTANT]), 2);
+    checkIntsEqual(chunk->code[store + 3], 2);
+    checkIntsEqual(getLine(chunk, store), 3);
+    uint32_t move = findOp(chunk, OP_MOVE);
+    checkIntsEqual(move, store + 4);
+    checkIntsEqual(chunk->code[move + 1], 1);
+    checkIntsEqual(chunk->code[move + 2], 2);
+    checkIntsEqual(getLine(chunk, move), 4);
+    checkIntsEqual(countOps(chunk, OP_SET_LOCAL_POP), 0);
+
+    // `!=` is still a negated `==`, and the condition and increment of a loop don't touch the stack
+    chunk = &firstFunction(&vm, "fun f(n) {\n for (var i = 0; i != n; i = i + 1) print i;\n}")->chunk;
+    checkIntsEqual(countOps(chunk, OP_EQUAL_RK), 1);
+    checkIntsEqual(countOps(chunk, OP_ADD_RK_STORE), 1);
+    checkIntsEqual(countOps(chunk, OP_ADD), 0);
+
+    // anything that isn't a local or constant is pushed as before
+    chunk = &firstFunction(&vm, "var g = 1;\nfun f(a, b) { return (a + 1) * b + g; }")->chunk;
+    checkIntsEqual(countOps(chunk, OP_ADD_RK), 1);
+    checkIntsEqual(countOps(chunk, OP_MULTIPLY), 1);
+    checkIntsEqual(countOps(chunk, OP_ADD), 1);
+
+    // and nothing changes in stack mode
+    vm.registerBytecode = false;
+    chunk = &firstFunction(&vm, "fun f(a, b) { a = a + b; }")->chunk;
+    checkIntsEqual(countOps(chunk, OP_ADD), 1);
+    checkIntsEqual(countOps(chunk, OP_ADD_RK_STORE), 0);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testRegisterSemantics(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.registerBytecode = true;
+    vm.print = fakePrintf;
+    printed = 0;
+
+    checkIntsEqual(interpret(&vm, "fun join(a, b) {\n var s = nil;\n s = a + b;\n return s;\n}\n"
+                                  "print join(\"ab\", \"cd\");\n"
+                                  "print join(\"a longer \", \"string\");\n"
+                                  "fun scale(a) { return a * 65536; }\n"
+                                  "print scale(3);\n"
+                                  "print scale(65536) == 65536.0 * 65536;\n"
+                                  "fun compare(a) { var r = a < 1.5; return r; }\n"
+                                  "print compare(1);\n"
+                                  "print compare(2);\n"
+                                  "fun isX(s) { return s == \"x\"; }\n"
+                                  "print isX(\"x\");\n"
+                                  "print isX(1);\n"
+                                  "fun half(a) { var h; h = a / 2; return h; }\n"
+                                  "print half(3);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 9);
+    const char* expected[] = {"abcd", "a longer string", "196608", "true", "true", "false", "true", "false", "1.5"};
+    for (int i = 0; i < 9; i++) {
+        checkStringsEqual(printLog[i], expected[i]);
+    }
+
+    // type errors happen at the same point as the stack instructions
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun f(a) {\n var b;\n print 1;\n b = a - 1;\n print 2;\n}\nf(\"a\");"),
+                   INTERPRET_RUNTIME_ERROR);
+    checkIntsEqual(printed, 1);
+    checkIntsEqual(interpret(&vm, "fun g(a) { return a + nil; }\ng(1);"), INTERPRET_RUNTIME_ERROR);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testOptimisedRegisterCode(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.registerBytecode = true;
+    vm.print = fakePrintf;
+    printed = 0;
+
+    checkIntsEqual(interpret(&vm, "fun sum(n) {\n var total = 0;\n"
+                                  " for (var i = 0; i < n; i = i + 1) total = total + i;\n return total;\n}\n"),
+                   INTERPRET_OK);
+    Value value = NIL_VAL;
+    tableGet(&vm.globals, copyString(&vm, NULL, "sum", 3), &value);
+    assert(IS_CLOSURE(value));
+    ObjFunction* function = FROM_HEAP_REF(ObjFunction, AS_CLOSURE(value)->function);
+    checkIntsEqual(optimiseFunction(&vm, function), true);
+    function->optimised = true;
+    // the rebuilt loop is still register instructions
+    checkIntsEqual(countOps(&function->chunk, OP_LESS_RK), 1);
+    checkIntsEqual(countOps(&function->chunk, OP_ADD), 0);
+    checkIntsEqual(countOps(&function->chunk, OP_LESS), 0);
+    checkIntsEqual(interpret(&vm, "print sum(100);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "4950");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testRegisterCode() | testRegisterSemantics() | testOptimisedRegisterCode();
+}
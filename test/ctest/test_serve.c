@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "test_suite.h"
+#include "vm.c"
+#include "serve.h"
+
+#ifdef FORK_SERVER
+#define OUTPUT_PATH "test_serve.out"
+#define SOCKET_PATH "test_serve.sock"
+
+static const char* prelude = "class Greeter {\n"
+                             " init(greeting) { this.greeting = greeting; }\n"
+                             " greet(name) { return this.greeting + \", \" + name; }\n"
+                             "}\n"
+                             "var greeter = Greeter(\"hello\");\n"
+                             "var jobs = 0;\n";
+
+static void writeFile(const char* path, const char* contents) {
+    FILE* file = fopen(path, "w");
+    fputs(contents, file);
+    fclose(file);
+}
+
+static void readFile(const char* path, char* contents, size_t size) {
+    FILE* file = fopen(path, "r");
+    size_t length = file ? fread(contents, 1, size - 1, file) : 0;
+    contents[length] = '\0';
+    if (file) fclose(file);
+}
+
+static void runScript(VM* vm, const char* path) {
+    char source[256];
+    readFile(path, source, sizeof(source));
+    interpret(vm, source);
+}
+
+static void initWarmVM(FreeList* freeList, VM* vm) {
+    initMemory(freeList, 1024 * 1024);
+    initVM(freeList, vm);
+    interpret(vm, prelude);
+}
+
+int testStdinJobs(void) {
+    int err_code = TEST_SUCCEEDED;
+    writeFile("test_serve_a.lox", "jobs = jobs + 1;\nprint greeter.greet(\"a\");\nprint jobs;\n");
+    writeFile("test_serve_b.lox", "jobs = jobs + 1;\nprint greeter.greet(\"b\");\nprint jobs;\n");
+    writeFile("test_serve.jobs", "test_serve_a.lox\n\ntest_serve_b.lox\ntest_serve_a.lox");
+
+    FreeList freeList;
+    VM vm;
+    initWarmVM(&freeList, &vm);
+
+    fflush(stdout);
+    int in = dup(STDIN_FILENO);
+    int out = dup(STDOUT_FILENO);
+    freopen("test_serve.jobs", "r", stdin);
+    freopen(OUTPUT_PATH, "w", stdout);
+    bool served = serveStdin(&vm, runScript);
+    fflush(stdout);
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    close(in);
+    close(out);
+
+    checkIntsEqual(served, true);
+    char output[16384];
+    readFile(OUTPUT_PATH, output, sizeof(output));
+    // each job starts from the prelude, in order (between anything the compiler's debug output adds)
+    const char* expected[] = {"hello, a\n1\n", "hello, b\n1\n", "hello, a\n1\n"};
+    const char* found = output;
+    for (int i = 0; i < 3 && found; i++) {
+        found = strstr(found, expected[i]);
+        if (found) found += strlen(expected[i]);
+    }
+    checkIntsEqual(found != NULL, true);
+
+    // and none of them reached the server
+    Value jobs = NIL_VAL;
+    tableGet(&vm.globals, copyString(&vm, NULL, "jobs", 4), &jobs);
+    checkFloatsEqual(AS_NUMBER(jobs), 0);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    remove("test_serve_a.lox");
+    remove("test_serve_b.lox");
+    remove("test_serve.jobs");
+    remove(OUTPUT_PATH);
+    return err_code;
+}
+
+static int connectToServer(void) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strcpy(address.sun_path, SOCKET_PATH);
+    // until the server's listening
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (!connect(connection, (struct sockaddr*) &address, sizeof(address))) return connection;
+        close(connection);
+        usleep(10000);
+    }
+    return -1;
+}
+
+int testSocketJobs(void) {
+    int err_code = TEST_SUCCEEDED;
+    writeFile("test_serve_c.lox", "print greeter.greet(\"socket\");\nprint missing;\n");
+
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        FreeList freeList;
+        VM vm;
+        initWarmVM(&freeList, &vm);
+        serveSocket(&vm, SOCKET_PATH, runScript);
+        _exit(1);
+    }
+
+    for (int job = 0; job < 2; job++) {
+        int connection = connectToServer();
+        checkIntsEqual(connection >= 0, true);
+        if (connection < 0) break;
+        checkIntsEqual(write(connection, "test_serve_c.lox\n", 17), 17);
+
+        char output[16384];
+        size_t length = 0;
+        ssize_t count;
+        while ((count = read(connection, output + length, sizeof(output) - 1 - length)) > 0) {
+            length += (size_t) count;
+        }
+        output[length] = '\0';
+        close(connection);
+        checkIntsEqual(strstr(output, "hello, socket\n") != NULL, true);
+        // runtime errors are sent back too
+        checkIntsEqual(strstr(output, "Undefined variable 'missing'.") != NULL, true);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    remove("test_serve_c.lox");
+    remove(SOCKET_PATH);
+    return err_code;
+}
+
+int testSocketPathNotASocket(void) {
+    int err_code = TEST_SUCCEEDED;
+    writeFile(SOCKET_PATH, "not a socket\n");
+
+    FreeList freeList;
+    VM vm;
+    initWarmVM(&freeList, &vm);
+    checkIntsEqual(serveSocket(&vm, SOCKET_PATH, runScript), false);
+    checkIntsEqual(errno, EEXIST);
+    freeVM(&vm);
+    freeMemory(&freeList);
+
+    // left as it was
+    struct stat file;
+    checkIntsEqual(lstat(SOCKET_PATH, &file), 0);
+    checkIntsEqual(S_ISREG(file.st_mode), true);
+    remove(SOCKET_PATH);
+    return err_code;
+}
+
+#ifdef MARK_BITMAP
+int testCollectingDoesntWriteObjects(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    initWarmVM(&freeList, &vm);
+    checkIntsEqual(interpret(&vm, "var greeters = nil;\n"
+                                  "for (var i = 0; i < 1000; i = i + 1) {\n"
+                                  " var next = Greeter(\"hi\");\n next.next = greeters;\n greeters = next;\n"
+                                  "}\n"), INTERPRET_OK);
+    collectGarbage(&vm, NULL);
+
+    // everything before the free block at the end of the heap, as a forked child would share it
+    uint8_t* end = (uint8_t*) freeList.base_ + freeList.size_;
+    uint8_t* used = end;
+    for (Block* block = freeList.first; block; block = block->next) {
+        if ((uint8_t*) block + block->blockSize == end) used = (uint8_t*) block;
+    }
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    uint8_t* start = (uint8_t*) (((uintptr_t) freeList.base_ + pageSize - 1) & ~(uintptr_t) (pageSize - 1));
+    size_t length = (size_t) (used - start) & ~(pageSize - 1);
+    checkIntsEqual(length > 0, true);
+
+    checkIntsEqual(mprotect(start, length, PROT_READ), 0);
+    // with nothing to free, a write would fault
+    collectGarbage(&vm, NULL);
+    checkIntsEqual(mprotect(start, length, PROT_READ | PROT_WRITE), 0);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+#endif
+#endif
+
+int main(void) {
+#ifdef FORK_SERVER
+    int err_code = testStdinJobs() | testSocketJobs() | testSocketPathNotASocket();
+#ifdef MARK_BITMAP
+    err_code |= testCollectingDoesntWriteObjects();
+#endif
+    return err_code;
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -0,0 +1,115 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include "test_suite.h"
+#include "vm.c"
+#include "shared.h"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef SHARED_CODE
+#define HEAP_SIZE (1024 * 1024)
+
+static const char* library = "class Vector {\n"
+                             " init(x, y) { this.x = x; this.y = y; }\n"
+                             " plus(other) { return Vector(this.x + other.x, this.y + other.y); }\n"
+                             "}\n"
+                             "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+                             "fun sum(n) {\n var total = 0;\n for (var i = 0; i < n; i = i + 1) total = total + i;\n"
+                             " return total;\n}\n"
+                             "var greeting = \"hello from the shared library\";\n"
+                             "var loaded = 0;\n";
+
+// writing to the shared heap after this faults
+static int protect(SharedCode* shared, int protection) {
+    uintptr_t pageSize = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) shared->heap.base_ + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t) shared->heap.base_ + shared->heap.size_) & ~(pageSize - 1);
+    return mprotect((void*) start, end - start, protection);
+}
+
+int testVMsShareCode(void) {
+    int err_code = TEST_SUCCEEDED;
+    SharedCode* shared = compileSharedCode(library, HEAP_SIZE);
+    checkIntsEqual(shared != NULL, true);
+    if (!shared) return TEST_FAILED;
+    checkIntsEqual(protect(shared, PROT_READ), 0);
+
+    FreeList freeLists[2];
+    VM vms[2];
+    for (int i = 0; i < 2; i++) {
+        initMemory(freeLists + i, HEAP_SIZE);
+        initSharedVM(freeLists + i, vms + i, shared);
+        vms[i].print = fakePrintf;
+        checkIntsEqual(interpretFunction(vms + i, shared->script), INTERPRET_OK);
+    }
+
+    printed = 0;
+    checkIntsEqual(interpret(vms, "loaded = loaded + 1;\n"
+                                  "var v = Vector(1, 2);\n"
+                                  "for (var i = 0; i < 100; i = i + 1) v = v.plus(Vector(i, 1));\n"
+                                  "print v.x;\n"
+                                  "print fib(15);\n"
+                                  "print sum(1000);\n"
+                                  "print loaded;\n"), INTERPRET_OK);
+    checkIntsEqual(interpret(vms + 1, "print greeting;\n"
+                                      "print greeting == \"hello from the shared \" + \"library\";\n"
+                                      "print loaded;\n"
+                                      "fun local(n) { return fib(n) + 1; }\n"
+                                      "for (var i = 0; i < 50; i = i + 1) local(5);\n"
+                                      "print local(10);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 8);
+    checkStringsEqual(printLog[0], "4951");
+    checkStringsEqual(printLog[1], "610");
+    checkStringsEqual(printLog[2], "499500");
+    checkStringsEqual(printLog[3], "1");
+    checkStringsEqual(printLog[4], "hello from the shared library");
+    // strings made at runtime are the shared ones
+    checkStringsEqual(printLog[5], "true");
+    // globals are the VM's own
+    checkStringsEqual(printLog[6], "0");
+    checkStringsEqual(printLog[7], "56");
+
+    // hot, but left as they were frozen
+    Value fib = NIL_VAL;
+    tableGet(&vms[0].globals, copyString(vms, NULL, "fib", 3), &fib);
+    ObjFunction* function = FROM_HEAP_REF(ObjFunction, AS_CLOSURE(fib)->function);
+    checkIntsEqual(isSharedObject(shared, function), true);
+    checkIntsEqual(function->frozen, true);
+    checkIntsEqual(function->hotness, 0);
+    checkIntsEqual(isSharedObject(shared, AS_CLOSURE(fib)), false);
+
+    for (int i = 0; i < 2; i++) {
+        freeVM(vms + i);
+        freeMemory(freeLists + i);
+    }
+    checkIntsEqual(protect(shared, PROT_READ | PROT_WRITE), 0);
+    freeSharedCode(shared);
+    return err_code;
+}
+
+int testCompileErrorFreesSharedCode(void) {
+    int err_code = TEST_SUCCEEDED;
+    checkPtrsEqual(compileSharedCode("fun broken( {", HEAP_SIZE), NULL);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef SHARED_CODE
+    return testVMsShareCode() | testCompileErrorFreesSharedCode();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
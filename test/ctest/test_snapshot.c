@@ -0,0 +1,162 @@
+#include <sys/mman.h>
+#include "test_suite.h"
+#include "vm.c"
+#include "snapshot.h"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef HEAP_SNAPSHOT
+#define IMAGE_PATH "test_snapshot.image"
+#define HEAP_SIZE (4 * 1024 * 1024)
+
+static const char* prelude = "class Point {\n"
+                             " init(x, y) { this.x = x; this.y = y; }\n"
+                             " sum() { return this.x + this.y; }\n"
+                             "}\n"
+                             "fun counter() {\n var count = 0;\n"
+                             " fun next() { count = count + 1; return count; }\n return next;\n}\n"
+                             "fun sum(n) {\n var total = 0;\n for (var i = 0; i < n; i = i + 1) total = total + i;\n"
+                             " return total;\n}\n"
+                             "var next = counter();\n"
+                             "for (var i = 0; i < 100; i = i + 1) next();\n"
+                             "var origin = Point(1.5, -2);\n"
+                             "var name = \"a string\" + \" too long to be small\";\n"
+                             "var total = sum(100);\n";
+
+// the address the image was taken at
+static void* writeImage(void) {
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    void* base = freeList.base_;
+    bool written = interpret(&vm, prelude) == INTERPRET_OK && writeSnapshot(&vm, IMAGE_PATH);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return written ? base : NULL;
+}
+
+// `moved` from the address the image was taken at, if that's given
+static int checkRestored(void* moved) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    checkIntsEqual(restoreSnapshot(&freeList, &vm, IMAGE_PATH), true);
+    if (moved) checkIntsEqual(freeList.base_ != moved, true);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    checkIntsEqual(interpret(&vm, "print next();\n"
+                                  "print origin.sum();\n"
+                                  "print name;\n"
+                                  "print total + sum(1000);\n"
+                                  "print Point(3, 4).sum();\n"
+                                  "print name == \"a string too long to be small\";\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 6);
+    checkStringsEqual(printLog[0], "101");
+    checkStringsEqual(printLog[1], "-0.5");
+    checkStringsEqual(printLog[2], "a string too long to be small");
+    checkStringsEqual(printLog[3], "504450");
+    checkStringsEqual(printLog[4], "7");
+    // still interned
+    checkStringsEqual(printLog[5], "true");
+
+    // enough garbage to collect a few times
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "var last;\n"
+                                  "for (var i = 0; i < 2000; i = i + 1) last = Point(i, name + \"!\");\n"
+                                  "print last.x;\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "1999");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testRestoredAtSameAddress(void) {
+    int err_code = TEST_SUCCEEDED;
+    checkIntsEqual(writeImage() != NULL, true);
+    err_code |= checkRestored(NULL);
+    remove(IMAGE_PATH);
+    return err_code;
+}
+
+int testRestoredElsewhere(void) {
+    int err_code = TEST_SUCCEEDED;
+    void* base = writeImage();
+    checkIntsEqual(base != NULL, true);
+
+    // whether or not this lands on the old heap, it's not free for the image
+    void* blocker = mmap(base, HEAP_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    checkIntsEqual(blocker != MAP_FAILED, true);
+    err_code |= checkRestored(base);
+    munmap(blocker, HEAP_SIZE);
+    remove(IMAGE_PATH);
+    return err_code;
+}
+
+int testInvalidImageIgnored(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    remove(IMAGE_PATH);
+    checkIntsEqual(restoreSnapshot(&freeList, &vm, IMAGE_PATH), false);
+
+    // a truncated file
+    checkIntsEqual(writeImage() != NULL, true);
+    FILE* file = fopen(IMAGE_PATH, "rb");
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* bytes = malloc(size);
+    size_t read = fread(bytes, 1, size, file);
+    fclose(file);
+    file = fopen(IMAGE_PATH, "wb");
+    fwrite(bytes, 1, read - 8, file);
+    fclose(file);
+    free(bytes);
+    checkIntsEqual(restoreSnapshot(&freeList, &vm, IMAGE_PATH), false);
+
+    // taken by another build, whose natives could be anywhere
+    checkIntsEqual(writeImage() != NULL, true);
+    file = fopen(IMAGE_PATH, "r+b");
+    fseek(file, (long) offsetof(SnapshotHeader, buildId), SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, (long) offsetof(SnapshotHeader, buildId), SEEK_SET);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    checkIntsEqual(restoreSnapshot(&freeList, &vm, IMAGE_PATH), false);
+
+    // not while a script's running
+    initMemory(&freeList, HEAP_SIZE);
+    initVM(&freeList, &vm);
+    push(&vm, NIL_VAL);
+    checkIntsEqual(writeSnapshot(&vm, IMAGE_PATH), false);
+    freeVM(&vm);
+    freeMemory(&freeList);
+
+    remove(IMAGE_PATH);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef HEAP_SNAPSHOT
+    return testRestoredAtSameAddress() | testRestoredElsewhere() | testInvalidImageIgnored();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
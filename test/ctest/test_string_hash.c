@@ -0,0 +1,114 @@
+#include <math.h>
+#include "test_suite.h"
+#include "object.c"
+
+static uint64_t nextRandom(uint64_t* state) {
+    // xorshift64 - only needs to be deterministic and not obviously structured
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int compareHashes(const void* a, const void* b) {
+    uint32_t lhs = *(const uint32_t*) a;
+    uint32_t rhs = *(const uint32_t*) b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+int testAvalanche(void) {
+    int err_code = TEST_SUCCEEDED;
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+
+    // flipping any single input bit should flip about half of the output bits, for every length class the hash handles
+    uint32_t lengths[] = {1, 3, 4, 7, 8, 15, 16, 17, 31, 48, 49, 100};
+    for (uint32_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        uint32_t length = lengths[l];
+        char key[128];
+        uint64_t flips = 0;
+        uint64_t samples = 0;
+
+        for (int trial = 0; trial < 64; trial++) {
+            for (uint32_t i = 0; i < length; i++) {
+                key[i] = (char) nextRandom(&state);
+            }
+            uint32_t original = hashString(key, length);
+
+            for (uint32_t bit = 0; bit < length * 8; bit++) {
+                key[bit / 8] ^= (char) (1 << (bit % 8));
+                flips += __builtin_popcount(original ^ hashString(key, length));
+                key[bit / 8] ^= (char) (1 << (bit % 8));
+                samples++;
+            }
+        }
+
+        double average = (double) flips / (double) samples;
+        if (average < 15.5 || average > 16.5) {
+            fprintf(stderr, "\n\033[1;31mPoor avalanche for length %u: %f bits flipped on average\n\033[0m", length, average);
+            err_code = TEST_FAILED;
+        }
+    }
+
+    return err_code;
+}
+
+int testInternTableCollisions(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 16 * 1024 * 1024);
+    initVM(&freeList, &vm);
+
+    // sequential identifiers are the worst case for weak hashes, and the common case for generated code
+    const uint32_t keyCount = 10000;
+    uint32_t* hashes = malloc(sizeof(uint32_t) * keyCount);
+    assertNotNull(hashes);
+
+    for (uint32_t i = 0; i < keyCount; i++) {
+        char key[16];
+        int length = sprintf(key, "key%u", i);
+        ObjString* string = copyString(&vm, NULL, key, (uint32_t) length);
+        // keep reachable
+        push(&vm, OBJ_VAL(string));
+        hashes[i] = string->hash;
+    }
+
+    // full 32 bit collisions: ~0.01 expected from the birthday bound
+    uint32_t fullCollisions = 0;
+    uint32_t bucketCount = vm.strings.capacity;
+    uint8_t* seen = calloc(bucketCount, 1);
+    assertNotNull(seen);
+    uint32_t occupiedBuckets = 0;
+    for (uint32_t i = 0; i < keyCount; i++) {
+        uint32_t bucket = hashes[i] & (bucketCount - 1);
+        if (!seen[bucket]) occupiedBuckets++;
+        seen[bucket] = 1;
+    }
+
+    qsort(hashes, keyCount, sizeof(uint32_t), compareHashes);
+    for (uint32_t i = 1; i < keyCount; i++) {
+        if (hashes[i] == hashes[i - 1]) fullCollisions++;
+    }
+    checkIntsEqual(fullCollisions > 1, false);
+
+    // compare the number of distinct home buckets against what a uniformly random hash would give
+    double n = keyCount;
+    double m = bucketCount;
+    double expectedOccupied = m * (1.0 - pow(1.0 - 1.0 / m, n));
+    if (occupiedBuckets < expectedOccupied * 0.97) {
+        fprintf(stderr, "\n\033[1;31mToo many bucket collisions: %u occupied, %f expected\n\033[0m", occupiedBuckets,
+                expectedOccupied);
+        err_code = TEST_FAILED;
+    }
+
+    free(seen);
+    free(hashes);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testAvalanche() | testInternTableCollisions();
+}
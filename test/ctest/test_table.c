@@ -0,0 +1,126 @@
+#include "test_suite.h"
+#include "table.c"
+
+#define KEY_COUNT 1000
+
+static ObjString* keys[KEY_COUNT];
+
+static void makeKeys(VM* vm) {
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        char chars[16];
+        int length = sprintf(chars, "field%u", i);
+        keys[i] = copyString(vm, NULL, chars, (uint32_t) length);
+        push(vm, OBJ_VAL(keys[i]));
+    }
+}
+
+int testSetGetDelete(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    initVM(&freeList, &vm);
+    makeKeys(&vm);
+
+    Table table;
+    initTable(&table);
+    Value value = NIL_VAL;
+    checkIntsEqual(tableGet(&table, keys[0], &value), false);
+    checkIntsEqual(tableDelete(&table, keys[0]), false);
+
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        checkIntsEqual(tableSet(&vm, NULL, &table, keys[i], NUMBER_VAL(i)), true);
+    }
+    checkIntsEqual(table.count, KEY_COUNT);
+    checkIntsEqual(table.capacity % TABLE_GROUP_WIDTH, 0);
+
+    // overwriting isn't a new key
+    checkIntsEqual(tableSet(&vm, NULL, &table, keys[7], NUMBER_VAL(-7)), false);
+    checkIntsEqual(table.count, KEY_COUNT);
+
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        checkIntsEqual(tableGet(&table, keys[i], &value), true);
+        checkFloatsEqual(AS_NUMBER(value), i == 7 ? -7.0 : (double) i);
+    }
+
+    for (uint32_t i = 0; i < KEY_COUNT; i += 2) {
+        checkIntsEqual(tableDelete(&table, keys[i]), true);
+    }
+    checkIntsEqual(tableDelete(&table, keys[0]), false);
+    checkIntsEqual(table.count, KEY_COUNT / 2);
+
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        checkIntsEqual(tableGet(&table, keys[i], &value), i % 2 == 1);
+    }
+
+    Table copy;
+    initTable(&copy);
+    tableAddAll(&vm, NULL, &table, &copy);
+    checkIntsEqual(copy.count, KEY_COUNT / 2);
+    for (uint32_t i = 1; i < KEY_COUNT; i += 2) {
+        checkIntsEqual(tableGet(&copy, keys[i], &value), true);
+        checkFloatsEqual(AS_NUMBER(value), i == 7 ? -7.0 : (double) i);
+    }
+
+    freeTable(&vm, &copy);
+    freeTable(&vm, &table);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testTombstonesAndShrinking(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 4 * 1024 * 1024);
+    initVM(&freeList, &vm);
+    makeKeys(&vm);
+
+    Table table;
+    initTable(&table);
+
+    // churning a small number of live keys through many distinct keys must not grow the table without bound
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        tableSet(&vm, NULL, &table, keys[i], NIL_VAL);
+        if (i >= 4) {
+            checkIntsEqual(tableDelete(&table, keys[i - 4]), true);
+        }
+    }
+    checkIntsEqual(table.count, 4);
+    checkIntsEqual(table.capacity, TABLE_GROUP_WIDTH);
+
+    // fill up, delete almost everything, and check the next rehash shrinks back down
+    for (uint32_t i = 0; i < KEY_COUNT; i++) {
+        tableSet(&vm, NULL, &table, keys[i], NIL_VAL);
+    }
+    uint32_t fullCapacity = table.capacity;
+    for (uint32_t i = 0; i < KEY_COUNT - 1; i++) {
+        tableDelete(&table, keys[i]);
+    }
+    checkIntsEqual(table.count, 1);
+
+    uint32_t reinserted = 10;
+    for (uint32_t i = 0; i < reinserted; i++) {
+        tableSet(&vm, NULL, &table, keys[i], NIL_VAL);
+    }
+    checkIntsEqual(table.capacity < fullCapacity, true);
+    checkIntsEqual(table.count, reinserted + 1);
+
+    Value value;
+    checkIntsEqual(tableGet(&table, keys[KEY_COUNT - 1], &value), true);
+    for (uint32_t i = 0; i < reinserted; i++) {
+        checkIntsEqual(tableGet(&table, keys[i], &value), true);
+    }
+
+    freeTable(&vm, &table);
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int main(void) {
+    return testSetGetDelete() | testTombstonesAndShrinking();
+}
@@ -0,0 +1,175 @@
+#include "test_suite.h"
+#include "vm.c"
+
+static char printLog[32][64];
+static int printed = 0;
+
+int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
+    assert(printed < 32 || !"Too many things printed");
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(printLog[printed++], 64, format, args);
+    va_end(args);
+    return result;
+}
+
+#ifdef TRACING_JIT
+static ObjFunction* globalFunction(VM* vm, const char* name) {
+    Value value = NIL_VAL;
+    tableGet(&vm->globals, copyString(vm, NULL, name, (uint32_t) strlen(name)), &value);
+    assert(IS_CLOSURE(value));
+    return FROM_HEAP_REF(ObjFunction, AS_CLOSURE(value)->function);
+}
+
+// a for loop has two back edges, so can have two traces: whichever's recorded first usually does all the work
+static uint64_t iterations(ObjFunction* function) {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < function->chunk.loopCount; i++) {
+        Trace* trace = function->chunk.loops[i].trace;
+        if (trace) count += trace->iterations;
+    }
+    return count;
+}
+
+static uint32_t sideExits(ObjFunction* function) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < function->chunk.loopCount; i++) {
+        Trace* trace = function->chunk.loops[i].trace;
+        for (uint32_t exit = 1; trace && exit < trace->exitCount; exit++) {
+            count += trace->exits[exit].count;
+        }
+    }
+    return count;
+}
+
+static uint8_t maxDepth(ObjFunction* function) {
+    uint8_t depth = 0;
+    for (uint32_t i = 0; i < function->chunk.loopCount; i++) {
+        Trace* trace = function->chunk.loops[i].trace;
+        if (trace && trace->maxDepth > depth) depth = trace->maxDepth;
+    }
+    return depth;
+}
+
+int testTracedLoops(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // ints, doubles (mixed with ints), and a call inlined into the loop
+    checkIntsEqual(interpret(&vm, "fun sum(n) {\n var total = 0;\n var i = 0;\n"
+                                  " while (i < n) { total = total + i; i = i + 1; }\n return total;\n}\n"
+                                  "fun half(x) { return x / 2; }\n"
+                                  "fun halves(n) {\n var total = 0.25;\n"
+                                  " for (var i = 0; i < n; i = i + 1) total = total + half(i) * 1.5;\n"
+                                  " return total;\n}\n"
+                                  "print sum(1000);\n"
+                                  "print halves(1000);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[0], "499500");
+    checkStringsEqual(printLog[1], "374625");
+
+    checkIntsEqual(maxDepth(globalFunction(&vm, "sum")), 0);
+    checkIntsEqual(iterations(globalFunction(&vm, "sum")) > 900, true);
+    checkIntsEqual(maxDepth(globalFunction(&vm, "halves")), 1);
+    checkIntsEqual(iterations(globalFunction(&vm, "halves")) > 900, true);
+
+    // the trace is still good for the next call
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "print sum(10);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "45");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testSideExits(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 1024 * 1024);
+    initVM(&freeList, &vm);
+    vm.print = fakePrintf;
+    printed = 0;
+
+    // int overflow, a branch going the other way, and a global changing type all carry on in the interpreter, from
+    // the middle of the iteration
+    checkIntsEqual(interpret(&vm, "fun grow(n) {\n var x = 1;\n"
+                                  " for (var i = 0; i < n; i = i + 1) x = x * 3;\n return x;\n}\n"
+                                  "fun late(n) {\n var count = 0;\n"
+                                  " for (var i = 0; i < n; i = i + 1) {\n"
+                                  "  if (i == n - 1) print i;\n count = count + 1;\n }\n return count;\n}\n"
+                                  "var step = 1;\n"
+                                  "fun steps(n) {\n var total = 0;\n"
+                                  " for (var i = 0; i < n; i = i + 1) {\n"
+                                  "  if (i == 500) step = 0.5;\n total = total + step;\n }\n return total;\n}\n"
+                                  "print grow(30);\n"
+                                  "print late(100);\n"
+                                  "print steps(1000);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 4);
+    checkStringsEqual(printLog[0], "2.05891e+14");
+    checkStringsEqual(printLog[1], "99");
+    checkStringsEqual(printLog[2], "100");
+    checkStringsEqual(printLog[3], "750");
+
+    // the last time round the loop, and the loop's exit
+    checkIntsEqual(sideExits(globalFunction(&vm, "late")), 2);
+
+    // globals are read and written (and printed) from the trace
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "var calls = 0;\n"
+                                  "fun count(n) {\n"
+                                  " for (var i = 0; i < n; i = i + 1) {\n  calls = calls + 1;\n"
+                                  "  if (calls > n - 3) print calls;\n }\n}\n"
+                                  "count(100);\n"
+                                  "print calls;\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 4);
+    checkStringsEqual(printLog[0], "98");
+    checkStringsEqual(printLog[1], "99");
+    checkStringsEqual(printLog[2], "100");
+    checkStringsEqual(printLog[3], "100");
+
+    // as do results which an int can't hold: -0.0 when counting down to 0
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun products(n) {\n var inverse = 0;\n"
+                                  " for (var i = n; i > -1; i = i - 1) inverse = 1 / (i * -1);\n return inverse;\n}\n"
+                                  "fun negations(n) {\n var inverse = 0;\n"
+                                  " for (var i = n; i > -1; i = i - 1) inverse = 1 / -i;\n return inverse;\n}\n"
+                                  "print products(100);\n"
+                                  "print negations(100);\n"), INTERPRET_OK);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[0], "-inf");
+    checkStringsEqual(printLog[1], "-inf");
+    checkIntsEqual(iterations(globalFunction(&vm, "products")) > 90, true);
+    checkIntsEqual(iterations(globalFunction(&vm, "negations")) > 90, true);
+
+    // runtime errors from the middle of a recording leave the loop to be recorded again
+    printed = 0;
+    checkIntsEqual(interpret(&vm, "fun broken(n) {\n"
+                                  " for (var i = 0; i < n; i = i + 1) if (i == 5) print missing;\n}\n"
+                                  "broken(10);\n"), INTERPRET_RUNTIME_ERROR);
+    checkPtrsEqual(vm.recorder, NULL);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+#endif
+
+int main(void) {
+#ifdef TRACING_JIT
+    return testTracedLoops() | testSideExits();
+#else
+    return TEST_SUCCEEDED;
+#endif
+}
@@ -7,6 +7,8 @@ static char printLog[32][64];
 static int printed = 0;
 
 int fakePrintf(const char* format, ...) {
+    // the newline print statements end each value with, which isn't logged as a line of its own
+    if (strcmp(format, "\n") == 0) return 1;
     assert(printed < 32 || !"Too many things printed");
     va_list args;
     va_start(args, format);
@@ -156,6 +158,61 @@ int testBools(void) {
     return err_code;
 }
 
+int testIntegers(void) {
+#define RUN_TEST(source, expected) do { \
+    int prevPrinted = printed;                                    \
+    INTERPRET("print " source);  \
+    checkIntsEqual(printed, prevPrinted + 1);                                    \
+    checkStringsEqual(printLog[prevPrinted], expected); \
+} while(0)
+
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 64 * 1024);
+    initVM(&freeList, &vm);
+    resetPrintLog();
+    vm.print = fakePrintf;
+
+    // integers print exactly, rather than through %g
+    RUN_TEST("1234567;", "1234567");
+    RUN_TEST("1000 * 1000 - 1;", "999999");
+    RUN_TEST("-2147483647 - 1;", "-2147483648");
+
+    // overflow promotes to doubles
+    RUN_TEST("2147483647 + 1 == 2147483648;", "true");
+    RUN_TEST("-2147483647 - 2 < -2147483648;", "true");
+    RUN_TEST("65536 * 65536 == 4294967296;", "true");
+    RUN_TEST("-(-2147483647 - 1) > 0;", "true");
+
+    // mixing ints & doubles
+    RUN_TEST("7 / 2;", "3.5");
+    RUN_TEST("1 + 0.5;", "1.5");
+    RUN_TEST("1 == 1.0;", "true");
+    RUN_TEST("0.5 + 0.5 == 1;", "true");
+    RUN_TEST("2 < 2.5;", "true");
+
+    // ints have no -0, so those results are doubles, whether folded or not
+    RUN_TEST("1 / -0;", "-inf");
+    RUN_TEST("1 / (0 * -1);", "-inf");
+    INTERPRET("var zero = 0;");
+    RUN_TEST("-zero;", "-0");
+    RUN_TEST("1 / -zero;", "-inf");
+    RUN_TEST("1 / (zero * -3);", "-inf");
+    RUN_TEST("1 / (-3 * zero);", "-inf");
+    RUN_TEST("zero * 3;", "0");
+
+    // whole doubles print the same as ints
+    RUN_TEST("3000000000 - 2000000000;", "1000000000");
+    RUN_TEST("-2147483648;", "-2147483648");
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+#undef RUN_TEST
+}
+
 int testComparisons(void) {
 #define RUN_TEST(source, expected) do { \
     int prevPrinted = printed;                                    \
@@ -231,6 +288,33 @@ int testStrings(void) {
     checkIntsEqual(printed, 3);
     checkStringsEqual(printLog[2], "false");
 
+    // short strings, and concatenations across the small string boundary
+    INTERPRET("print \"ab\" + \"cde\";");
+    checkIntsEqual(printed, 4);
+    checkStringsEqual(printLog[3], "abcde");
+
+    INTERPRET("print \"abc\" + \"def\" == \"abcdef\";");
+    checkIntsEqual(printed, 5);
+    checkStringsEqual(printLog[4], "true");
+
+    INTERPRET("print \"\" + \"a\" + \"\" == \"a\";");
+    checkIntsEqual(printed, 6);
+    checkStringsEqual(printLog[5], "true");
+
+    INTERPRET("print \"abcd\" == \"abce\";");
+    checkIntsEqual(printed, 7);
+    checkStringsEqual(printLog[6], "false");
+
+#ifdef NAN_BOXING
+    INTERPRET("var small = \"sm\" + \"all\";");
+    Value small;
+    key = copyString(&vm, NULL, "small", strlen("small"));
+    checkIntsEqual(tableGet(&vm.globals, key, &small), true);
+    checkIntsEqual(IS_SMALL_STRING(small), true);
+    checkIntsEqual(IS_OBJ(small), false);
+    checkIntsEqual(valuesEqual(small, smallStringToValue("small", 5)), true);
+#endif
+
     freeVM(&vm);
     freeMemory(&freeList);
     return err_code;
@@ -771,8 +855,107 @@ int testInheritance(void) {
     return err_code;
 }
 
+int testTailCalls(void) {
+    int err_code = TEST_SUCCEEDED;
+    FreeList freeList;
+    VM vm;
+    initMemory(&freeList, 256 * 1024);
+    initVM(&freeList, &vm);
+    resetPrintLog();
+    vm.print = fakePrintf;
+
+    // far deeper than FRAMES_MAX
+    const char* countdown =
+            "fun count(n) {\n"
+            "  if (n == 0) return \"done\";\n"
+            "  return count(n - 1);\n"
+            "}\n"
+            "print count(10000);";
+    INTERPRET(countdown);
+    checkIntsEqual(printed, 1);
+    checkStringsEqual(printLog[0], "done");
+
+    const char* methods =
+            "class Parity {\n"
+            "  isEven(n) { if (n == 0) return true; return this.isOdd(n - 1); }\n"
+            "  isOdd(n) { if (n == 0) return false; return this.isEven(n - 1); }\n"
+            "}\n"
+            "class Child < Parity {\n"
+            "  isEven(n) { return super.isEven(n); }\n"
+            "}\n"
+            "print Child().isEven(10001);";
+    INTERPRET(methods);
+    checkIntsEqual(printed, 2);
+    checkStringsEqual(printLog[1], "false");
+
+    // the frame's captured locals are closed before its slots are reused
+    const char* upvalues =
+            "fun identity(f) { return f; }\n"
+            "fun make(n) {\n"
+            "  var x = n;\n"
+            "  fun get() { return x; }\n"
+            "  return identity(get);\n"
+            "}\n"
+            "var get = make(5);\n"
+            "make(6);\n"
+            "print get();";
+    INTERPRET(upvalues);
+    checkIntsEqual(printed, 3);
+    checkStringsEqual(printLog[2], "5");
+
+    // natives and classes
+    const char* others =
+            "fun root(x) { return sqrt(x); }\n"
+            "class Box { init(x) { this.x = x; } }\n"
+            "fun box(x) { return Box(x); }\n"
+            "print root(16);\n"
+            "print box(3).x;";
+    INTERPRET(others);
+    checkIntsEqual(printed, 5);
+    checkStringsEqual(printLog[3], "4");
+    checkStringsEqual(printLog[4], "3");
+
+    checkIntsEqual(interpret(&vm, "fun two(a, b) {} fun one(a) { return two(a); } one(1);"), INTERPRET_RUNTIME_ERROR);
+
+    freeVM(&vm);
+    freeMemory(&freeList);
+    return err_code;
+}
+
+int testVMsOnOneThread(void) {
+    int err_code = TEST_SUCCEEDED;
+
+    FreeList freeListA, freeListB;
+    VM a, b;
+    initMemory(&freeListA, 1024 * 1024);
+    initVM(&freeListA, &a);
+    a.print = fakePrintf;
+    resetPrintLog();
+    checkIntsEqual(interpret(&a, "class Point { init(x) { this.x = x; } }\nvar g = Point(1);\n"), INTERPRET_OK);
+
+    // a second heap, which (with compressed references) mustn't be what the first VM's references are read against
+    initMemory(&freeListB, 1024 * 1024);
+    initVM(&freeListB, &b);
+    b.print = fakePrintf;
+    checkIntsEqual(interpret(&b, "var g = \"b\";\n"), INTERPRET_OK);
+    checkIntsEqual(interpret(&a, "print g.x;\n"), INTERPRET_OK);
+    collectGarbage(&a, NULL);
+    checkIntsEqual(interpret(&b, "print g;\n"), INTERPRET_OK);
+    checkIntsEqual(interpret(&a, "print Point(2).x;\n"), INTERPRET_OK);
+
+    checkIntsEqual(printed, 3);
+    checkStringsEqual(printLog[0], "1");
+    checkStringsEqual(printLog[1], "b");
+    checkStringsEqual(printLog[2], "2");
+    freeVM(&a);
+    freeMemory(&freeListA);
+    freeVM(&b);
+    freeMemory(&freeListB);
+    return err_code;
+}
+
 int main(void) {
     return testGlobals() | testLocals() | testControlFlow() | testVmStack() | testVmArithmetic() | testNil() |
-           testBools() | testComparisons() | testStrings() | testFunctions() | testClosures() | testClasses() |
-           testInheritance();
+           testBools() | testIntegers() | testComparisons() | testStrings() | testFunctions() | testClosures() | testClasses() |
+           testInheritance() | testTailCalls() | testVMsOnOneThread();
 }
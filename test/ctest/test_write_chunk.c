@@ -12,7 +12,8 @@ int testWriteChunk(void) {
 
     checkIntsEqual(chunk.count, 0);
     checkIntsEqual(chunk.capacity, 0);
-    checkPtrsEqual(chunk.firstLine, NULL);
+    checkIntsEqual(chunk.lineCount, 0);
+    checkPtrsEqual(chunk.lines, NULL);
     checkPtrsEqual(chunk.code, NULL);
 
     writeChunk(&vm, NULL, &chunk, OP_RETURN, 0);
@@ -22,10 +23,10 @@ int testWriteChunk(void) {
     assertNotNull(chunk.code);
     checkIntsEqual(chunk.code[0], OP_RETURN);
 
-    assertNotNull(chunk.firstLine);
-    checkIntsEqual(chunk.firstLine[0].lineNumber, 0);
-    checkIntsEqual(chunk.firstLine[0].instructions, 1);
-    checkPtrsEqual(chunk.firstLine[0].next, NULL);
+    assertNotNull(chunk.lines);
+    checkIntsEqual(chunk.lineCount, 1);
+    checkIntsEqual(chunk.lines[0].start, 0);
+    checkIntsEqual(chunk.lines[0].line, 0);
 
     for (int i = 1; i < 9; ++i) {
         writeChunk(&vm, NULL, &chunk, OP_RETURN, i);
@@ -35,13 +36,11 @@ int testWriteChunk(void) {
     checkIntsEqual(chunk.capacity, 16);
     assertNotNull(chunk.code);
 
-    uint32_t length = 0;
-    for (Line* nextLine = chunk.firstLine; nextLine; nextLine = nextLine->next) {
-        checkIntsEqual(nextLine->lineNumber, length);
-        checkIntsEqual(nextLine->instructions, 1);
-        length++;
+    checkIntsEqual(chunk.lineCount, 9);
+    for (uint32_t i = 0; i < chunk.lineCount; i++) {
+        checkIntsEqual(chunk.lines[i].start, i);
+        checkIntsEqual(chunk.lines[i].line, i);
     }
-    checkIntsEqual(length, 9);
 
     freeChunk(&vm, &chunk);
     freeMemory(&freeList);
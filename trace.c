@@ -0,0 +1,1312 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "debug.h"
+#include "x64.h"
+
+#ifdef TRACING_JIT
+
+struct TraceRecorder {
+    ObjFunction* function;
+    TraceLoop* loop;
+    // the loop's frame, as an index into vm->frames
+    uint8_t frame;
+    // the loop's first instruction
+    uint32_t header;
+    // the loop frame's slots when recording started, for the types the trace is entered with
+    uint32_t slotCount;
+    Value* slots;
+    uint32_t codeVersion;
+    TraceStep* steps;
+    uint32_t stepCount;
+    uint32_t stepCapacity;
+};
+
+// the extra words of longer instructions aren't instructions themselves
+static bool isInstruction(Chunk* chunk, uint32_t index) {
+    return index == 0 || chunk->wordOffsets[index] != chunk->wordOffsets[index - 1];
+}
+
+// everything here is outside the Lox heap, so uses the system allocator (like the grey stack)
+void initTraceLoops(Chunk* chunk) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (isInstruction(chunk, i) && WORD_OP(chunk->words[i]) == OP_LOOP) count++;
+    }
+    chunk->loopCount = count;
+    if (!count) return;
+
+    chunk->loops = calloc(count, sizeof(TraceLoop));
+    assert(chunk->loops);
+    count = 0;
+    for (uint32_t i = 0; i < chunk->wordCount; i++) {
+        if (isInstruction(chunk, i) && WORD_OP(chunk->words[i]) == OP_LOOP) chunk->loops[count++].index = i;
+    }
+}
+
+static void freeTrace(Trace* trace) {
+    if (!trace) return;
+    unmapCode(trace->code, trace->size);
+    free(trace->exits);
+    free(trace->steps);
+    free(trace);
+}
+
+void freeTraceLoops(Chunk* chunk) {
+    for (uint32_t i = 0; i < chunk->loopCount; i++) {
+        freeTrace(chunk->loops[i].trace);
+    }
+    free(chunk->loops);
+    chunk->loops = NULL;
+    chunk->loopCount = 0;
+}
+
+TraceLoop* findTraceLoop(Chunk* chunk, uint32_t index) {
+    // dropped from functions restored from a heap snapshot
+    if (!chunk->loops) initTraceLoops(chunk);
+    for (uint32_t i = 0; i < chunk->loopCount; i++) {
+        if (chunk->loops[i].index == index) return chunk->loops + i;
+    }
+    assert(!"Not an OP_LOOP");
+    return NULL;
+}
+
+// the machine code refers to the functions and closures it inlined by address
+static void markSteps(VM* vm, TraceStep* steps, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        markObject(vm, (Obj*) steps[i].function);
+        markValue(vm, steps[i].observed);
+    }
+}
+
+void markTraces(VM* vm, Chunk* chunk) {
+    for (uint32_t i = 0; i < chunk->loopCount; i++) {
+        Trace* trace = chunk->loops[i].trace;
+        if (trace) markSteps(vm, trace->steps, trace->stepCount);
+    }
+}
+
+void markRecording(VM* vm) {
+    markSteps(vm, vm->recorder->steps, vm->recorder->stepCount);
+}
+
+// tries again after another TRACE_THRESHOLD iterations, up to TRACE_MAX_ATTEMPTS times
+static void giveUp(TraceLoop* loop) {
+    loop->hotness = ++loop->attempts < TRACE_MAX_ATTEMPTS ? 0 : INT32_MIN;
+}
+
+void startRecording(VM* vm, CallFrame* frame, TraceLoop* loop) {
+    TraceRecorder* recorder = calloc(1, sizeof(TraceRecorder));
+    assert(recorder);
+    recorder->function = frame->function;
+    recorder->loop = loop;
+    recorder->frame = (uint8_t) (frame - vm->frames);
+    recorder->header = (uint32_t) (frame->ip - frame->function->chunk.words);
+    recorder->slotCount = vm->stack.count - frame->base;
+    recorder->slots = malloc(sizeof(Value) * (recorder->slotCount + 1));
+    assert(recorder->slots);
+    memcpy(recorder->slots, vm->stack.values + frame->base, sizeof(Value) * recorder->slotCount);
+    recorder->codeVersion = vm->codeVersion;
+    vm->recorder = recorder;
+}
+
+static void stopRecording(VM* vm) {
+    free(vm->recorder->steps);
+    free(vm->recorder->slots);
+    free(vm->recorder);
+    vm->recorder = NULL;
+}
+
+void abortRecording(VM* vm) {
+    TraceLoop* loop = vm->recorder->loop;
+    stopRecording(vm);
+    giveUp(loop);
+}
+
+static Value readRegister(VM* vm, CallFrame* frame, uint8_t operand) {
+    return operand & RK_CONSTANT ? frame->function->chunk.constants.values[operand & ~RK_CONSTANT]
+                                 : vm->stack.values[frame->base + operand];
+}
+
+// the trace assumes int arithmetic doesn't overflow, so recording one which does is a waste of time
+static bool numericOperands(OpCode op, Value a, Value b) {
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    if (!IS_INT(a) || !IS_INT(b)) return true;
+
+    int32_t result;
+    switch (op) {
+        case OP_ADD:
+            return !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result);
+        case OP_SUBTRACT:
+            return !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result);
+        case OP_MULTIPLY:
+            return !intMultiplyOverflows(AS_INT(a), AS_INT(b), &result);
+        default:
+            return true;
+    }
+}
+
+// whether the trace compiler handles the instruction about to run, and what it needs to know about it
+static bool recordable(VM* vm, CallFrame* frame, uint32_t word, uint8_t depth, Value* observed) {
+    Value* top = vm->stack.values + vm->stack.count;
+    OpCode op = WORD_OP(word);
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_INT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_MOVE:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_CALLEE:
+        case OP_LOOP:
+        case OP_PRINT:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_EQUAL_RK:
+        case OP_EQUAL_RK_STORE:
+            return true;
+        case OP_GET_GLOBAL:
+            return tableGet(&vm->globals, AS_STRING(frame->function->chunk.constants.values[WORD_OPERAND(word)]),
+                            observed);
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS:
+        case OP_GREATER:
+            return numericOperands(op, top[-2], top[-1]);
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_LESS_RK:
+        case OP_GREATER_RK:
+        case OP_ADD_RK_STORE:
+        case OP_SUBTRACT_RK_STORE:
+        case OP_MULTIPLY_RK_STORE:
+        case OP_DIVIDE_RK_STORE:
+        case OP_LESS_RK_STORE:
+        case OP_GREATER_RK_STORE:
+            return numericOperands(stackOp(op), readRegister(vm, frame, WORD_A(word)),
+                                   readRegister(vm, frame, WORD_B(word)));
+        case OP_NEGATE:
+            return IS_DOUBLE(top[-1]) || (IS_INT(top[-1]) && !intNegateOverflows(AS_INT(top[-1])));
+        case OP_CALL: {
+            Value callee = top[-1 - (int32_t) WORD_A(word)];
+            if (!IS_CLOSURE(callee) || depth == TRACE_MAX_DEPTH || vm->frameCount == FRAMES_MAX) return false;
+            *observed = callee;
+            return FROM_HEAP_REF(ObjFunction, AS_CLOSURE(callee)->function)->arity == WORD_A(word);
+        }
+        case OP_RETURN:
+            // returning from the loop's own frame leaves the loop
+            return depth > 0;
+        default:
+            return false;
+    }
+}
+
+static Trace* compileTrace(VM* vm, TraceRecorder* recorder);
+
+static void finishRecording(VM* vm) {
+    TraceRecorder* recorder = vm->recorder;
+    TraceLoop* loop = recorder->loop;
+    // steps recorded from code the optimiser's since replaced can't be trusted to line up with each other
+    Trace* trace = recorder->codeVersion == vm->codeVersion ? compileTrace(vm, recorder) : NULL;
+    if (trace) recorder->steps = NULL;
+    stopRecording(vm);
+
+    if (trace) {
+        loop->trace = trace;
+#ifdef DEBUG_PRINT_TRACES
+        printTrace(trace);
+#endif
+    } else {
+        giveUp(loop);
+    }
+}
+
+void recordInstruction(VM* vm, CallFrame* frame) {
+    TraceRecorder* recorder = vm->recorder;
+    Chunk* chunk = &frame->function->chunk;
+    uint32_t index = (uint32_t) (frame->ip - chunk->words);
+    int32_t depth = (int32_t) (frame - vm->frames) - recorder->frame;
+    if (depth == 0 && index == recorder->header && recorder->stepCount) {
+        finishRecording(vm);
+        return;
+    }
+
+    Value observed = NIL_VAL;
+    if (depth < 0 || recorder->stepCount == TRACE_MAX_STEPS ||
+        !recordable(vm, frame, *frame->ip, (uint8_t) depth, &observed)) {
+        abortRecording(vm);
+        return;
+    }
+
+    if (recorder->stepCount == recorder->stepCapacity) {
+        recorder->stepCapacity = GROW_CAPACITY(recorder->stepCapacity);
+        recorder->steps = realloc(recorder->steps, sizeof(TraceStep) * recorder->stepCapacity);
+        assert(recorder->steps);
+    }
+    recorder->steps[recorder->stepCount++] = (TraceStep) {
+            .function = frame->function, .index = index, .word = *frame->ip, .depth = (uint8_t) depth,
+            .observed = observed,
+    };
+}
+
+// the kinds of value the trace keeps unboxed; everything but ints, doubles, booleans and nil is a reference to an
+// object (or a small string), which is only ever compared, called or passed around whole
+typedef enum {
+    TYPE_NONE,
+    TYPE_INT,
+    TYPE_DOUBLE,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_OBJECT,
+} TraceType;
+
+static TraceType typeOf(Value value) {
+    if (IS_INT(value)) return TYPE_INT;
+    if (IS_DOUBLE(value)) return TYPE_DOUBLE;
+    if (IS_BOOL(value)) return TYPE_BOOL;
+    if (IS_NIL(value)) return TYPE_NIL;
+    return TYPE_OBJECT;
+}
+
+static bool isNumeric(TraceType type) {
+    return type == TYPE_INT || type == TYPE_DOUBLE;
+}
+
+// a register, or a slot in the machine code's own stack frame: ints (in the low half) and booleans (0 or 1) are kept in
+// general purpose registers, doubles in SSE registers, and objects as the whole value
+typedef struct {
+    bool spilled;
+    uint8_t reg;
+    int32_t offset;
+} Location;
+
+// the machine code's registers: the loop frame's slots in r15, rax, rcx and rdx for scratch, and everything else for
+// values. The caller saved ones are saved around calls to C
+#define SLOTS_REG R15
+static const Register gpRegisters[] = {RBX, RBP, R12, R13, R14, RSI, RDI, R8, R9, R10, R11};
+#define GP_REGISTERS (sizeof(gpRegisters) / sizeof(Register))
+#define CALLEE_SAVED_GP_REGISTERS 5
+#define XMM_FIRST XMM2
+#define XMM_REGISTERS (16 - XMM_FIRST)
+
+// the upper half of every int value
+#define INT_TAG_HIGH ((uint32_t) ((QNAN | TAG_INT) >> 32))
+
+// a value the interpreter needs if it carries on from a side exit
+typedef struct {
+    uint32_t position;
+    TraceType type;
+    Location location;
+} SnapshotEntry;
+
+typedef struct {
+    uint32_t at;
+    uint32_t exit;
+} ExitPatch;
+
+// a call inlined at the current step
+typedef struct {
+    ObjClosure* closure;
+    uint32_t base;
+    // the word after the OP_CALL
+    uint32_t returnIndex;
+} InlinedCall;
+
+// a register operand which might be a constant
+typedef struct {
+    TraceType type;
+    bool isConstant;
+    Value constant;
+    uint32_t position;
+} Operand;
+
+// the trace is compiled twice: the first pass works out the type of each of the loop frame's slots (and which are
+// loaded on entry), the second emits the code for real with the slots in registers
+typedef struct {
+    Assembler as;
+    VM* vm;
+    TraceRecorder* recorder;
+    Trace* trace;
+    bool final;
+    bool failed;
+    // stack positions are slots relative to the loop's frame; those below loopHeight (the loop frame's slots when the
+    // loop starts) are the loop's "homes", which keep their type for the whole trace
+    uint32_t loopHeight;
+    uint32_t positionCount;
+    uint32_t height;
+    uint32_t maxHeight;
+    // per position, the type of the value there now
+    TraceType* types;
+    // per home: the type it always has, whether it's loaded (and checked) on entry as it's read before it's written,
+    // and whether it's been written yet in this iteration
+    TraceType* homeTypes;
+    bool* loaded;
+    bool* written;
+    // per position, where it's kept when it's a double, and when it's anything else; homes only ever have one
+    Location* gpLocations;
+    Location* xmmLocations;
+    uint32_t spillCount;
+    uint32_t gpUsed;
+    uint32_t xmmUsed;
+    uint32_t frameSize;
+    uint8_t depth;
+    InlinedCall calls[TRACE_MAX_DEPTH + 1];
+    // the step being compiled
+    uint32_t step;
+    TraceExit* exits;
+    uint32_t exitCount;
+    uint32_t exitCapacity;
+    // per exit, its first entry
+    uint32_t* snapshots;
+    SnapshotEntry* entries;
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+    ExitPatch* patches;
+    uint32_t patchCount;
+    uint32_t patchCapacity;
+} TraceCompiler;
+
+static TraceStep* currentStep(TraceCompiler* tc) {
+    return tc->recorder->steps + tc->step;
+}
+
+static Value stepConstant(TraceCompiler* tc, uint32_t index) {
+    return currentStep(tc)->function->chunk.constants.values[index];
+}
+
+static uint32_t framePosition(TraceCompiler* tc, uint32_t slot) {
+    return tc->calls[tc->depth].base + slot;
+}
+
+static Location location(TraceCompiler* tc, uint32_t position, TraceType type) {
+    return type == TYPE_DOUBLE ? tc->xmmLocations[position] : tc->gpLocations[position];
+}
+
+// the type of the value at a position, which for a home not yet touched in this iteration is the type it's entered
+// with
+static TraceType readType(TraceCompiler* tc, uint32_t position) {
+    if (position < tc->loopHeight && tc->types[position] == TYPE_NONE) {
+        TraceType type = typeOf(tc->recorder->slots[position]);
+        tc->loaded[position] = true;
+        if (tc->homeTypes[position] == TYPE_NONE) {
+            tc->homeTypes[position] = type;
+        } else if (tc->homeTypes[position] != type) {
+            tc->failed = true;
+        }
+        tc->types[position] = type;
+    }
+    if (tc->types[position] == TYPE_NONE) tc->failed = true;
+    return tc->types[position];
+}
+
+// a home can only hold one type: the next iteration relies on it
+static void setType(TraceCompiler* tc, uint32_t position, TraceType type) {
+    if (position < tc->loopHeight) {
+        if (tc->homeTypes[position] == TYPE_NONE) {
+            tc->homeTypes[position] = type;
+        } else if (tc->homeTypes[position] != type) {
+            tc->failed = true;
+        }
+        tc->written[position] = true;
+    }
+    tc->types[position] = type;
+}
+
+static void emitGet(TraceCompiler* tc, Register dst, Location location) {
+    if (location.spilled) {
+        emitLoad(&tc->as, dst, RSP, location.offset);
+    } else if (location.reg != dst) {
+        emitAlu(&tc->as, ALU_MOV, true, dst, (Register) location.reg);
+    }
+}
+
+static void emitPut(TraceCompiler* tc, Location location, Register src) {
+    if (location.spilled) {
+        emitStore(&tc->as, RSP, location.offset, src);
+    } else {
+        emitAlu(&tc->as, ALU_MOV, true, (Register) location.reg, src);
+    }
+}
+
+static void emitGetXmm(TraceCompiler* tc, XmmRegister dst, Location location) {
+    if (location.spilled) {
+        emitLoadXmm(&tc->as, dst, RSP, location.offset);
+    } else {
+        emitMoveXmm(&tc->as, dst, (XmmRegister) location.reg);
+    }
+}
+
+static void emitPutXmm(TraceCompiler* tc, Location location, XmmRegister src) {
+    if (location.spilled) {
+        emitStoreXmm(&tc->as, RSP, location.offset, src);
+    } else {
+        emitMoveXmm(&tc->as, (XmmRegister) location.reg, src);
+    }
+}
+
+// the unboxed value of a known type, from rax (or xmm0 for doubles), into a position
+static void emitResult(TraceCompiler* tc, uint32_t position, TraceType type) {
+    setType(tc, position, type);
+    if (type == TYPE_DOUBLE) {
+        emitPutXmm(tc, location(tc, position, type), XMM0);
+    } else if (type != TYPE_NIL) {
+        emitPut(tc, location(tc, position, type), RAX);
+    }
+}
+
+static void emitMoveValue(TraceCompiler* tc, uint32_t from, uint32_t to) {
+    TraceType type = readType(tc, from);
+    if (type == TYPE_DOUBLE) {
+        emitGetXmm(tc, XMM0, location(tc, from, type));
+    } else if (type != TYPE_NIL) {
+        emitGet(tc, RAX, location(tc, from, type));
+    }
+    emitResult(tc, to, type);
+}
+
+// the boxed value (in rax) of something the interpreter will need; clobbers rcx
+static void emitBox(TraceCompiler* tc, TraceType type, Location location) {
+    switch (type) {
+        case TYPE_INT:
+        case TYPE_BOOL:
+            // zero extended, so only the tag needs adding
+            if (location.spilled) {
+                emitLoad32(&tc->as, RAX, RSP, location.offset);
+            } else {
+                emitAlu(&tc->as, ALU_MOV, false, RAX, (Register) location.reg);
+            }
+            emitMoveImmediate(&tc->as, RCX, type == TYPE_INT ? QNAN | TAG_INT : FALSE_VAL);
+            emitAlu(&tc->as, ALU_OR, true, RAX, RCX);
+            break;
+        case TYPE_DOUBLE:
+            if (location.spilled) {
+                emitLoad(&tc->as, RAX, RSP, location.offset);
+            } else {
+                emitMoveFromXmm(&tc->as, RAX, (XmmRegister) location.reg);
+            }
+            break;
+        case TYPE_NIL:
+            emitMoveImmediate(&tc->as, RAX, NIL_VAL);
+            break;
+        case TYPE_OBJECT:
+            emitGet(tc, RAX, location);
+            break;
+        case TYPE_NONE:
+            assert(!"Boxing an unknown value");
+    }
+}
+
+// the side exit for the current step, which carries on from just before it
+static uint32_t currentExit(TraceCompiler* tc) {
+    // all of a step's guards come before it changes anything
+    if (tc->exitCount && tc->exits[tc->exitCount - 1].step == tc->step) return tc->exitCount - 1;
+
+    if (tc->exitCount == tc->exitCapacity) {
+        tc->exitCapacity = GROW_CAPACITY(tc->exitCapacity);
+        tc->exits = realloc(tc->exits, sizeof(TraceExit) * tc->exitCapacity);
+        tc->snapshots = realloc(tc->snapshots, sizeof(uint32_t) * (tc->exitCapacity + 1));
+        assert(tc->exits && tc->snapshots);
+    }
+    TraceExit* exit = tc->exits + tc->exitCount;
+    memset(exit, 0, sizeof(TraceExit));
+    exit->step = tc->step;
+    exit->stackCount = tc->height;
+    exit->frameCount = (uint8_t) (tc->depth + 1);
+    uint32_t ip = tc->step == UINT32_MAX ? tc->recorder->header : currentStep(tc)->index;
+    for (int32_t i = tc->depth; i >= 0; i--) {
+        exit->frames[i] = (TraceFrame) {.closure = tc->calls[i].closure, .base = tc->calls[i].base, .ip = ip};
+        ip = tc->calls[i].returnIndex;
+    }
+
+    tc->snapshots[tc->exitCount] = tc->entryCount;
+    for (uint32_t position = 0; position < tc->height; position++) {
+        // homes the iteration hasn't changed yet are still up to date in the frame
+        if (position < tc->loopHeight && !tc->written[position]) continue;
+        if (tc->entryCount == tc->entryCapacity) {
+            tc->entryCapacity = GROW_CAPACITY(tc->entryCapacity);
+            tc->entries = realloc(tc->entries, sizeof(SnapshotEntry) * tc->entryCapacity);
+            assert(tc->entries);
+        }
+        TraceType type = tc->types[position];
+        tc->entries[tc->entryCount++] = (SnapshotEntry) {
+                .position = position, .type = type, .location = location(tc, position, type),
+        };
+    }
+    return tc->exitCount++;
+}
+
+// leaves the trace through a side exit if the condition holds
+static void emitGuard(TraceCompiler* tc, Condition condition) {
+    uint32_t exit = currentExit(tc);
+    uint32_t at = emitJumpIf(&tc->as, condition);
+    if (tc->patchCount == tc->patchCapacity) {
+        tc->patchCapacity = GROW_CAPACITY(tc->patchCapacity);
+        tc->patches = realloc(tc->patches, sizeof(ExitPatch) * tc->patchCapacity);
+        assert(tc->patches);
+    }
+    tc->patches[tc->patchCount++] = (ExitPatch) {.at = at, .exit = exit};
+}
+
+// checks the boxed value in rax is of the type, and unboxes it into the position
+static void emitUnbox(TraceCompiler* tc, uint32_t position, TraceType type) {
+    Assembler* as = &tc->as;
+    switch (type) {
+        case TYPE_INT:
+            emitAlu(as, ALU_MOV, true, RCX, RAX);
+            emitShift(as, SHIFT_RIGHT, RCX, 32);
+            emitAluImmediate(as, IMM_CMP, false, RCX, (int32_t) INT_TAG_HIGH);
+            emitGuard(tc, CC_NOT_EQUAL);
+            break;
+        case TYPE_DOUBLE:
+            emitMoveImmediate(as, RCX, QNAN);
+            emitAlu(as, ALU_MOV, true, RDX, RAX);
+            emitAlu(as, ALU_AND, true, RDX, RCX);
+            emitAlu(as, ALU_CMP, true, RDX, RCX);
+            emitGuard(tc, CC_EQUAL);
+            emitMoveToXmm(as, XMM0, RAX);
+            break;
+        case TYPE_BOOL:
+            // false and true are next to each other
+            emitMoveImmediate(as, RCX, FALSE_VAL);
+            emitAlu(as, ALU_XOR, true, RAX, RCX);
+            emitAluImmediate(as, IMM_CMP, true, RAX, 1);
+            emitGuard(tc, CC_ABOVE);
+            break;
+        case TYPE_NIL:
+            emitMoveImmediate(as, RCX, NIL_VAL);
+            emitAlu(as, ALU_CMP, true, RAX, RCX);
+            emitGuard(tc, CC_NOT_EQUAL);
+            break;
+        case TYPE_OBJECT: {
+            // anything with the sign bit set, or a small string
+            emitAlu(as, ALU_MOV, true, RCX, RAX);
+            emitShift(as, SHIFT_RIGHT, RCX, 48);
+            emitAluImmediate(as, IMM_CMP, false, RCX, (int32_t) ((QNAN | TAG_SMALL_STRING) >> 48));
+            uint32_t smallString = emitJumpIf(as, CC_EQUAL);
+            emitAluImmediate(as, IMM_CMP, false, RCX, (int32_t) ((SIGN_BIT | QNAN) >> 48));
+            emitGuard(tc, CC_BELOW);
+            patchJump(as, smallString, as->count);
+            break;
+        }
+        case TYPE_NONE:
+            assert(!"Unboxing to an unknown type");
+    }
+    emitResult(tc, position, type);
+}
+
+static Operand stackOperand(TraceCompiler* tc, uint32_t distance) {
+    uint32_t position = tc->height - 1 - distance;
+    return (Operand) {.type = readType(tc, position), .position = position};
+}
+
+static Operand registerOperand(TraceCompiler* tc, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        Value value = stepConstant(tc, operand & ~RK_CONSTANT);
+        return (Operand) {.type = typeOf(value), .isConstant = true, .constant = value};
+    }
+    uint32_t position = framePosition(tc, operand);
+    return (Operand) {.type = readType(tc, position), .position = position};
+}
+
+// an int, boolean or object operand
+static void emitOperand(TraceCompiler* tc, Register dst, Operand operand) {
+    if (!operand.isConstant) {
+        emitGet(tc, dst, location(tc, operand.position, operand.type));
+    } else if (operand.type == TYPE_INT) {
+        emitMoveImmediate(&tc->as, dst, (uint32_t) AS_INT(operand.constant));
+    } else if (operand.type == TYPE_BOOL) {
+        emitMoveImmediate(&tc->as, dst, AS_BOOL(operand.constant));
+    } else {
+        emitMoveImmediate(&tc->as, dst, operand.constant);
+    }
+}
+
+// a numeric operand as a double; clobbers rax
+static void emitDoubleOperand(TraceCompiler* tc, XmmRegister dst, Operand operand) {
+    if (operand.type == TYPE_INT) {
+        emitOperand(tc, RAX, operand);
+        emitIntToXmm(&tc->as, dst, RAX);
+    } else if (operand.isConstant) {
+        emitMoveImmediate(&tc->as, RAX, operand.constant);
+        emitMoveToXmm(&tc->as, dst, RAX);
+    } else {
+        emitGetXmm(tc, dst, location(tc, operand.position, TYPE_DOUBLE));
+    }
+}
+
+static void emitConstant(TraceCompiler* tc, uint32_t position, Value value) {
+    TraceType type = typeOf(value);
+    if (type == TYPE_DOUBLE) {
+        emitMoveImmediate(&tc->as, RAX, value);
+        emitMoveToXmm(&tc->as, XMM0, RAX);
+    } else if (type != TYPE_NIL) {
+        emitOperand(tc, RAX, (Operand) {.type = type, .isConstant = true, .constant = value});
+    }
+    emitResult(tc, position, type);
+}
+
+static void emitBool(TraceCompiler* tc, uint32_t position, bool value) {
+    emitMoveImmediate(&tc->as, RAX, value);
+    emitResult(tc, position, TYPE_BOOL);
+}
+
+// a binary operator on operands of the types the recording saw, with the result going to `result`
+static void compileBinary(TraceCompiler* tc, OpCode op, Operand a, Operand b, uint32_t result) {
+    Assembler* as = &tc->as;
+    bool ints = a.type == TYPE_INT && b.type == TYPE_INT;
+    bool numbers = isNumeric(a.type) && isNumeric(b.type);
+    if (op != OP_EQUAL && !numbers) {
+        tc->failed = true;
+        return;
+    }
+
+    if (op == OP_EQUAL && !numbers) {
+        // anything but a number compares bitwise, and different kinds of value are never equal
+        if (a.type != b.type) {
+            emitBool(tc, result, false);
+        } else if (a.type == TYPE_NIL) {
+            emitBool(tc, result, true);
+        } else {
+            emitOperand(tc, RAX, a);
+            emitOperand(tc, RDX, b);
+            emitAlu(as, ALU_CMP, true, RAX, RDX);
+            emitSetCondition(as, CC_EQUAL, RAX);
+            emitResult(tc, result, TYPE_BOOL);
+        }
+        return;
+    }
+
+    if (ints && op != OP_DIVIDE) {
+        emitOperand(tc, RAX, a);
+        emitOperand(tc, RDX, b);
+        switch (op) {
+            case OP_ADD:
+                emitAlu(as, ALU_ADD, false, RAX, RDX);
+                break;
+            case OP_SUBTRACT:
+                emitAlu(as, ALU_SUB, false, RAX, RDX);
+                break;
+            case OP_MULTIPLY:
+                // imul eax, edx
+                emitByte(as, 0x0f);
+                emitByte(as, 0xaf);
+                emitByte(as, 0xc2);
+                break;
+            default:
+                emitAlu(as, ALU_CMP, false, RAX, RDX);
+                emitSetCondition(as, op == OP_LESS ? CC_LESS : op == OP_GREATER ? CC_GREATER : CC_EQUAL, RAX);
+                emitResult(tc, result, TYPE_BOOL);
+                return;
+        }
+        emitGuard(tc, CC_OVERFLOW);
+        if (op == OP_MULTIPLY) {
+            // a zero product might be -0.0, which only the interpreter can tell
+            emitAluImmediate(as, IMM_CMP, false, RAX, 0);
+            emitGuard(tc, CC_EQUAL);
+        }
+        emitResult(tc, result, TYPE_INT);
+        return;
+    }
+
+    emitDoubleOperand(tc, XMM0, a);
+    emitDoubleOperand(tc, XMM1, b);
+    switch (op) {
+        case OP_ADD:
+            emitSse(as, SSE_ADD, XMM0, XMM1);
+            break;
+        case OP_SUBTRACT:
+            emitSse(as, SSE_SUB, XMM0, XMM1);
+            break;
+        case OP_MULTIPLY:
+            emitSse(as, SSE_MUL, XMM0, XMM1);
+            break;
+        case OP_DIVIDE:
+            emitSse(as, SSE_DIV, XMM0, XMM1);
+            break;
+        case OP_LESS:
+        case OP_GREATER:
+            // "above" is false for NaN
+            if (op == OP_LESS) {
+                emitCompareXmm(as, XMM1, XMM0);
+            } else {
+                emitCompareXmm(as, XMM0, XMM1);
+            }
+            emitSetCondition(as, CC_ABOVE, RAX);
+            emitResult(tc, result, TYPE_BOOL);
+            return;
+        default:
+            emitCompareXmm(as, XMM0, XMM1);
+            emitSetCondition(as, CC_EQUAL, RAX);
+            emitSetCondition(as, CC_NO_PARITY, RCX);
+            emitAlu(as, ALU_AND, false, RAX, RCX);
+            emitResult(tc, result, TYPE_BOOL);
+            return;
+    }
+    emitResult(tc, result, TYPE_DOUBLE);
+}
+
+// the caller saved registers holding values, around calls to C
+static void emitSaveRegisters(TraceCompiler* tc, bool save) {
+    int32_t offset = (int32_t) (sizeof(Value) * tc->spillCount);
+    for (uint32_t i = CALLEE_SAVED_GP_REGISTERS; i < tc->gpUsed; i++, offset += (int32_t) sizeof(Value)) {
+        if (save) {
+            emitStore(&tc->as, RSP, offset, gpRegisters[i]);
+        } else {
+            emitLoad(&tc->as, gpRegisters[i], RSP, offset);
+        }
+    }
+    for (uint32_t i = 0; i < tc->xmmUsed; i++, offset += (int32_t) sizeof(Value)) {
+        if (save) {
+            emitStoreXmm(&tc->as, RSP, offset, (XmmRegister) (XMM_FIRST + i));
+        } else {
+            emitLoadXmm(&tc->as, (XmmRegister) (XMM_FIRST + i), RSP, offset);
+        }
+    }
+}
+
+static void emitTestResult(TraceCompiler* tc) {
+    // test al, al
+    emitByte(&tc->as, 0x84);
+    emitByte(&tc->as, 0xc0);
+}
+
+static bool getGlobal(VM* vm, ObjString* name, Value* slot) {
+    return tableGet(&vm->globals, name, slot);
+}
+
+// only sets globals which already exist, so never allocates: leaves undefined globals to the interpreter, to report
+static bool setGlobal(VM* vm, ObjString* name, Value value) {
+    Value existing;
+    if (!tableGet(&vm->globals, name, &existing)) return false;
+    tableSet(vm, NULL, &vm->globals, name, value);
+    return true;
+}
+
+static void printTraced(VM* vm, Value value) {
+    printValue(vm->print, value);
+    vm->print("\n");
+}
+
+// whether the next step is the jump's target rather than the instruction after it
+static bool jumped(TraceCompiler* tc, int32_t distance) {
+    TraceStep* step = currentStep(tc);
+    uint32_t next = tc->step + 1 < tc->recorder->stepCount ? step[1].index : tc->recorder->header;
+    return next == (uint32_t) ((int32_t) step->index + 1 + distance);
+}
+
+static void compileBranch(TraceCompiler* tc, bool whenFalsey, bool taken) {
+    TraceType type = readType(tc, tc->height - 1);
+    bool falsey = type == TYPE_NIL;
+    if (type != TYPE_BOOL) {
+        // the condition's type already decides it
+        if ((falsey == whenFalsey) != taken) tc->failed = true;
+        return;
+    }
+    emitGet(tc, RAX, location(tc, tc->height - 1, type));
+    emitAluImmediate(&tc->as, IMM_CMP, false, RAX, 0);
+    // leave if the condition would go the other way
+    emitGuard(tc, (whenFalsey == taken) ? CC_NOT_EQUAL : CC_EQUAL);
+}
+
+static void compileStep(TraceCompiler* tc) {
+    Assembler* as = &tc->as;
+    TraceStep* step = currentStep(tc);
+    uint32_t word = step->word;
+    OpCode op = WORD_OP(word);
+    switch (op) {
+        case OP_CONSTANT:
+            emitConstant(tc, tc->height++, stepConstant(tc, WORD_OPERAND(word)));
+            break;
+        case OP_INT:
+            emitConstant(tc, tc->height++, INT_VAL(WORD_SIGNED_OPERAND(word)));
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitConstant(tc, tc->height++, op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE));
+            break;
+        case OP_POP:
+            tc->height--;
+            break;
+        case OP_GET_LOCAL:
+            emitMoveValue(tc, framePosition(tc, WORD_OPERAND(word)), tc->height++);
+            break;
+        case OP_SET_LOCAL:
+            emitMoveValue(tc, tc->height - 1, framePosition(tc, WORD_OPERAND(word)));
+            break;
+        case OP_SET_LOCAL_POP:
+            emitMoveValue(tc, tc->height - 1, framePosition(tc, WORD_OPERAND(word)));
+            tc->height--;
+            break;
+        case OP_MOVE: {
+            Operand value = registerOperand(tc, WORD_A(word));
+            if (value.isConstant) {
+                emitConstant(tc, framePosition(tc, WORD_B(word)), value.constant);
+            } else {
+                emitMoveValue(tc, value.position, framePosition(tc, WORD_B(word)));
+            }
+            break;
+        }
+        case OP_GET_GLOBAL: {
+            // tableGet() writes the value into the stack, where it's then checked and unboxed
+            emitSaveRegisters(tc, true);
+            emitMoveImmediate(as, RDI, pointer(tc->vm));
+            emitMoveImmediate(as, RSI, pointer(AS_STRING(stepConstant(tc, WORD_OPERAND(word)))));
+            emitAlu(as, ALU_MOV, true, RDX, SLOTS_REG);
+            emitAluImmediate(as, IMM_ADD, true, RDX, (int32_t) (sizeof(Value) * tc->height));
+            emitCall(as, (uintptr_t) getGlobal);
+            emitTestResult(tc);
+            emitSaveRegisters(tc, false);
+            emitGuard(tc, CC_EQUAL);
+            emitLoad(as, RAX, SLOTS_REG, (int32_t) (sizeof(Value) * tc->height));
+            emitUnbox(tc, tc->height, typeOf(step->observed));
+            tc->height++;
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_PRINT: {
+            emitSaveRegisters(tc, true);
+            TraceType type = readType(tc, tc->height - 1);
+            emitBox(tc, type, location(tc, tc->height - 1, type));
+            emitMoveImmediate(as, RDI, pointer(tc->vm));
+            if (op == OP_PRINT) {
+                emitAlu(as, ALU_MOV, true, RSI, RAX);
+                emitCall(as, (uintptr_t) printTraced);
+                emitSaveRegisters(tc, false);
+                tc->height--;
+            } else {
+                emitAlu(as, ALU_MOV, true, RDX, RAX);
+                emitMoveImmediate(as, RSI, pointer(AS_STRING(stepConstant(tc, WORD_OPERAND(word)))));
+                emitCall(as, (uintptr_t) setGlobal);
+                emitTestResult(tc);
+                emitSaveRegisters(tc, false);
+                emitGuard(tc, CC_EQUAL);
+            }
+            break;
+        }
+        case OP_JUMP:
+        case OP_LOOP:
+            // the trace is a straight line
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            compileBranch(tc, op == OP_JUMP_IF_FALSE, jumped(tc, (int32_t) WORD_OPERAND(word)));
+            break;
+        case OP_JUMP_IF_CALLEE: {
+            bool taken = jumped(tc, (int32_t) (word >> 16));
+            TraceType type = readType(tc, tc->height - 1);
+            if (type == TYPE_OBJECT) {
+                emitGet(tc, RAX, location(tc, tc->height - 1, type));
+                emitMoveImmediate(as, RCX, stepConstant(tc, WORD_A(word)));
+                emitAlu(as, ALU_CMP, true, RAX, RCX);
+                emitGuard(tc, taken ? CC_NOT_EQUAL : CC_EQUAL);
+            } else if (taken) {
+                tc->failed = true;
+            }
+            tc->height--;
+            break;
+        }
+        case OP_NOT: {
+            uint32_t position = tc->height - 1;
+            TraceType type = readType(tc, position);
+            if (type == TYPE_BOOL) {
+                emitGet(tc, RAX, location(tc, position, type));
+                emitMoveImmediate(as, RCX, 1);
+                emitAlu(as, ALU_XOR, false, RAX, RCX);
+                emitResult(tc, position, TYPE_BOOL);
+            } else {
+                emitBool(tc, position, type == TYPE_NIL);
+            }
+            break;
+        }
+        case OP_NEGATE: {
+            uint32_t position = tc->height - 1;
+            TraceType type = readType(tc, position);
+            if (type == TYPE_INT) {
+                emitGet(tc, RAX, location(tc, position, type));
+                // neg eax: overflows on INT32_MIN, and negating 0 gives -0.0
+                emitByte(as, 0xf7);
+                emitByte(as, 0xd8);
+                emitGuard(tc, CC_OVERFLOW);
+                emitGuard(tc, CC_EQUAL);
+                emitResult(tc, position, TYPE_INT);
+            } else if (type == TYPE_DOUBLE) {
+                emitGetXmm(tc, XMM0, location(tc, position, type));
+                emitMoveFromXmm(as, RAX, XMM0);
+                emitMoveImmediate(as, RCX, SIGN_BIT);
+                emitAlu(as, ALU_XOR, true, RAX, RCX);
+                emitMoveToXmm(as, XMM0, RAX);
+                emitResult(tc, position, TYPE_DOUBLE);
+            } else {
+                tc->failed = true;
+            }
+            break;
+        }
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            Operand a = stackOperand(tc, 1);
+            Operand b = stackOperand(tc, 0);
+            compileBinary(tc, op, a, b, tc->height - 2);
+            tc->height--;
+            break;
+        }
+        case OP_EQUAL_RK:
+        case OP_GREATER_RK:
+        case OP_LESS_RK:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_EQUAL_RK_STORE:
+        case OP_GREATER_RK_STORE:
+        case OP_LESS_RK_STORE:
+        case OP_ADD_RK_STORE:
+        case OP_SUBTRACT_RK_STORE:
+        case OP_MULTIPLY_RK_STORE:
+        case OP_DIVIDE_RK_STORE: {
+            Operand a = registerOperand(tc, WORD_A(word));
+            Operand b = registerOperand(tc, WORD_B(word));
+            if (isRegisterStore(op)) {
+                compileBinary(tc, stackOp(op), a, b, framePosition(tc, WORD_C(word)));
+            } else {
+                // the guards leave from before the result's pushed
+                compileBinary(tc, stackOp(op), a, b, tc->height);
+                tc->height++;
+            }
+            break;
+        }
+        case OP_CALL: {
+            // the callee's checked, then its code follows on inline
+            uint32_t callee = tc->height - 1 - WORD_A(word);
+            if (readType(tc, callee) != TYPE_OBJECT) {
+                tc->failed = true;
+                break;
+            }
+            emitGet(tc, RAX, location(tc, callee, TYPE_OBJECT));
+            emitMoveImmediate(as, RCX, step->observed);
+            emitAlu(as, ALU_CMP, true, RAX, RCX);
+            emitGuard(tc, CC_NOT_EQUAL);
+            tc->calls[++tc->depth] = (InlinedCall) {
+                    .closure = AS_CLOSURE(step->observed), .base = callee, .returnIndex = step->index + 1,
+            };
+            if (tc->depth > tc->trace->maxDepth) tc->trace->maxDepth = tc->depth;
+            break;
+        }
+        case OP_RETURN: {
+            uint32_t base = tc->calls[tc->depth].base;
+            emitMoveValue(tc, tc->height - 1, base);
+            tc->height = base + 1;
+            tc->depth--;
+            break;
+        }
+        default:
+            tc->failed = true;
+            break;
+    }
+    if (tc->height > tc->maxHeight) tc->maxHeight = tc->height;
+}
+
+static void emitPrologue(TraceCompiler* tc) {
+    Assembler* as = &tc->as;
+    emitPush(as, RBX);
+    emitPush(as, RBP);
+    emitPush(as, R12);
+    emitPush(as, R13);
+    emitPush(as, R14);
+    emitPush(as, R15);
+    emitAluImmediate(as, IMM_SUB, true, RSP, (int32_t) tc->frameSize);
+    emitAlu(as, ALU_MOV, true, SLOTS_REG, RDI);
+}
+
+// returns the exit in rax
+static void emitEpilogue(TraceCompiler* tc) {
+    Assembler* as = &tc->as;
+    emitAluImmediate(as, IMM_ADD, true, RSP, (int32_t) tc->frameSize);
+    emitPop(as, R15);
+    emitPop(as, R14);
+    emitPop(as, R13);
+    emitPop(as, R12);
+    emitPop(as, RBP);
+    emitPop(as, RBX);
+    emitReturn(as);
+}
+
+// boxes everything the interpreter needs back into the stack
+static void emitWriteBack(TraceCompiler* tc, SnapshotEntry* entries, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        emitBox(tc, entries[i].type, entries[i].location);
+        emitStore(&tc->as, SLOTS_REG, (int32_t) (sizeof(Value) * entries[i].position), RAX);
+    }
+}
+
+static void resetPass(TraceCompiler* tc) {
+    tc->as.count = 0;
+    tc->failed = false;
+    tc->height = tc->loopHeight;
+    tc->maxHeight = tc->loopHeight;
+    tc->depth = 0;
+    tc->exitCount = 0;
+    tc->entryCount = 0;
+    tc->patchCount = 0;
+    tc->trace->maxDepth = 0;
+    for (uint32_t i = 0; i < tc->positionCount; i++) {
+        tc->types[i] = TYPE_NONE;
+    }
+    memset(tc->written, 0, sizeof(bool) * tc->loopHeight);
+}
+
+static bool compilePass(TraceCompiler* tc) {
+    resetPass(tc);
+    emitPrologue(tc);
+
+    // exit 0: leave before running anything if the locals the loop reads aren't the types it was recorded with
+    tc->step = UINT32_MAX;
+    currentExit(tc);
+    for (uint32_t position = 0; position < tc->loopHeight; position++) {
+        if (!tc->final || !tc->loaded[position]) continue;
+        emitLoad(&tc->as, RAX, SLOTS_REG, (int32_t) (sizeof(Value) * position));
+        emitUnbox(tc, position, tc->homeTypes[position]);
+        tc->written[position] = false;
+    }
+
+    uint32_t loopStart = tc->as.count;
+    for (tc->step = 0; tc->step < tc->recorder->stepCount && !tc->failed; tc->step++) {
+        compileStep(tc);
+    }
+    if (tc->failed || tc->height != tc->loopHeight || tc->depth != 0) return false;
+
+    // the back edge keeps the frame up to date with the homes the iteration changed
+    for (uint32_t position = 0; position < tc->loopHeight; position++) {
+        if (!tc->written[position]) continue;
+        SnapshotEntry entry = {
+                .position = position, .type = tc->types[position],
+                .location = location(tc, position, tc->types[position]),
+        };
+        emitWriteBack(tc, &entry, 1);
+    }
+    emitMoveImmediate(&tc->as, RAX, pointer(&tc->trace->iterations));
+    // add qword [rax], 1
+    emitByte(&tc->as, 0x48);
+    emitByte(&tc->as, 0x83);
+    emitByte(&tc->as, 0x00);
+    emitByte(&tc->as, 0x01);
+    patchJump(&tc->as, emitJump(&tc->as), loopStart);
+
+    // side exits, out of line
+    uint32_t* stubs = malloc(sizeof(uint32_t) * tc->exitCount);
+    assert(stubs);
+    uint32_t* returns = malloc(sizeof(uint32_t) * tc->exitCount);
+    assert(returns);
+    tc->snapshots[tc->exitCount] = tc->entryCount;
+    for (uint32_t i = 0; i < tc->exitCount; i++) {
+        stubs[i] = tc->as.count;
+        emitWriteBack(tc, tc->entries + tc->snapshots[i], tc->snapshots[i + 1] - tc->snapshots[i]);
+        emitMoveImmediate(&tc->as, RAX, i);
+        returns[i] = emitJump(&tc->as);
+    }
+    uint32_t epilogue = tc->as.count;
+    emitEpilogue(tc);
+    for (uint32_t i = 0; i < tc->exitCount; i++) {
+        patchJump(&tc->as, returns[i], epilogue);
+    }
+    for (uint32_t i = 0; i < tc->patchCount; i++) {
+        patchJump(&tc->as, tc->patches[i].at, stubs[tc->patches[i].exit]);
+    }
+    free(returns);
+    free(stubs);
+    return true;
+}
+
+// homes get the registers first, then the lowest positions above them; everything else is spilled to the machine
+// code's stack frame
+static void allocateRegisters(TraceCompiler* tc) {
+    for (uint32_t position = 0; position < tc->maxHeight; position++) {
+        bool home = position < tc->loopHeight;
+        TraceType type = home ? tc->homeTypes[position] : TYPE_NONE;
+        if (home && (type == TYPE_NONE || type == TYPE_NIL)) continue;
+
+        Location spill = {.spilled = true, .offset = -1};
+        Location gp = spill;
+        Location xmm = spill;
+        if ((!home || type != TYPE_DOUBLE) && tc->gpUsed < GP_REGISTERS) {
+            gp = (Location) {.reg = (uint8_t) gpRegisters[tc->gpUsed++]};
+        }
+        if ((!home || type == TYPE_DOUBLE) && tc->xmmUsed < XMM_REGISTERS) {
+            xmm = (Location) {.reg = (uint8_t) (XMM_FIRST + tc->xmmUsed++)};
+        }
+        // a spilled position only needs the one slot, whatever it holds
+        if ((gp.spilled && (!home || type != TYPE_DOUBLE)) || (xmm.spilled && (!home || type == TYPE_DOUBLE))) {
+            int32_t offset = (int32_t) (sizeof(Value) * tc->spillCount++);
+            if (gp.spilled) gp.offset = offset;
+            if (xmm.spilled) xmm.offset = offset;
+        }
+        tc->gpLocations[position] = home && type == TYPE_DOUBLE ? xmm : gp;
+        tc->xmmLocations[position] = home && type != TYPE_DOUBLE ? gp : xmm;
+    }
+
+    // six pushes and the return address, then the spills and the save area; calls need the stack 16 byte aligned
+    uint32_t saved = tc->xmmUsed;
+    if (tc->gpUsed > CALLEE_SAVED_GP_REGISTERS) saved += tc->gpUsed - CALLEE_SAVED_GP_REGISTERS;
+    tc->frameSize = (uint32_t) sizeof(Value) * (tc->spillCount + saved);
+    if (tc->frameSize % 16 != 8) tc->frameSize += 8;
+}
+
+static Trace* compileTrace(VM* vm, TraceRecorder* recorder) {
+    TraceCompiler tc = {.vm = vm, .recorder = recorder, .loopHeight = recorder->slotCount};
+    // every step pushes at most one value, and a global is read into the slot above the top
+    tc.positionCount = recorder->slotCount + recorder->stepCount + 2;
+    tc.types = calloc(tc.positionCount, sizeof(TraceType));
+    tc.homeTypes = calloc(tc.loopHeight + 1, sizeof(TraceType));
+    tc.loaded = calloc(tc.loopHeight + 1, sizeof(bool));
+    tc.written = calloc(tc.loopHeight + 1, sizeof(bool));
+    tc.gpLocations = calloc(tc.positionCount, sizeof(Location));
+    tc.xmmLocations = calloc(tc.positionCount, sizeof(Location));
+    tc.trace = calloc(1, sizeof(Trace));
+    assert(tc.types && tc.homeTypes && tc.loaded && tc.written && tc.gpLocations && tc.xmmLocations && tc.trace);
+
+    // the first pass only needs somewhere to put everything
+    for (uint32_t i = 0; i < tc.positionCount; i++) {
+        tc.gpLocations[i] = tc.xmmLocations[i] = (Location) {.spilled = true, .offset = (int32_t) (sizeof(Value) * i)};
+    }
+    bool compiled = compilePass(&tc);
+    if (compiled) {
+        allocateRegisters(&tc);
+        tc.final = true;
+        compiled = compilePass(&tc);
+    }
+
+    Trace* trace = tc.trace;
+    uint8_t* code = NULL;
+    if (compiled) code = mapCode(&tc.as, 0, &trace->size);
+    if (code && protectCode(code, trace->size)) {
+        trace->code = code;
+        // ISO C has no conversion from an object pointer to a function pointer
+        memcpy(&trace->enter, &trace->code, sizeof(trace->enter));
+        trace->steps = recorder->steps;
+        trace->stepCount = recorder->stepCount;
+        trace->exits = tc.exits;
+        trace->exitCount = tc.exitCount;
+        trace->stackNeeded = tc.maxHeight + 1;
+        trace->codeVersion = recorder->codeVersion;
+        tc.exits = NULL;
+    } else {
+        free(trace);
+        trace = NULL;
+    }
+
+    free(tc.exits);
+    free(tc.snapshots);
+    free(tc.entries);
+    free(tc.patches);
+    free(tc.as.code);
+    free(tc.xmmLocations);
+    free(tc.gpLocations);
+    free(tc.written);
+    free(tc.loaded);
+    free(tc.homeTypes);
+    free(tc.types);
+    return trace;
+}
+
+// inlined code is out of date once the optimiser's rebuilt anything, so steps from it can't be printed either
+static bool staleTrace(VM* vm, Trace* trace) {
+    return trace->maxDepth && trace->codeVersion != vm->codeVersion;
+}
+
+static void discardTrace(UNUSED VM* vm, TraceLoop* loop) {
+#ifdef DEBUG_PRINT_TRACES
+    if (!staleTrace(vm, loop->trace)) printTrace(loop->trace);
+#endif
+    freeTrace(loop->trace);
+    loop->trace = NULL;
+    giveUp(loop);
+}
+
+void runTrace(VM* vm, CallFrame* frame, TraceLoop* loop) {
+    Trace* trace = loop->trace;
+    if (staleTrace(vm, trace)) {
+        discardTrace(vm, loop);
+        return;
+    }
+    // the frames of inlined calls are only made when leaving in the middle of one
+    if (vm->frameCount + trace->maxDepth > FRAMES_MAX) return;
+
+    uint32_t taken = trace->enter(vm->stack.values + frame->base);
+    TraceExit* exit = trace->exits + taken;
+    exit->count++;
+    frame->ip = frame->function->chunk.words + exit->frames[0].ip;
+    for (uint32_t i = 1; i < exit->frameCount; i++) {
+        TraceFrame* inlined = exit->frames + i;
+        CallFrame* callee = vm->frames + vm->frameCount++;
+        callee->closure = inlined->closure;
+        callee->function = FROM_HEAP_REF(ObjFunction, inlined->closure->function);
+        callee->ip = callee->function->chunk.words + inlined->ip;
+        callee->base = frame->base + inlined->base;
+    }
+    vm->stack.count = frame->base + exit->stackCount;
+
+    if (++trace->runs < TRACE_CHECK_RUNS) return;
+    bool useful = trace->iterations - trace->checkedIterations >= TRACE_CHECK_RUNS;
+    trace->runs = 0;
+    trace->checkedIterations = trace->iterations;
+    if (!useful) discardTrace(vm, loop);
+}
+
+// kept apart from the program's own output
+static int printError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vfprintf(stderr, format, args);
+    va_end(args);
+    return result;
+}
+
+void printTrace(Trace* trace) {
+    ObjFunction* function = trace->steps[0].function;
+    ObjString* name = FROM_HEAP_REF(ObjString, function->name);
+    printError("== trace in %s, %llu iterations ==\n", name ? STRING_CHARS(name) : "<script>",
+               (unsigned long long) trace->iterations);
+    printError("entry checks failed %u times\n", trace->exits[0].count);
+    uint32_t exit = 1;
+    for (uint32_t i = 0; i < trace->stepCount; i++) {
+        TraceStep* step = trace->steps + i;
+        printError("%*s", 2 * step->depth, "");
+        disassembleInstruction(printError, &step->function->chunk, step->function->chunk.wordOffsets[step->index]);
+        for (; exit < trace->exitCount && trace->exits[exit].step == i; exit++) {
+            printError("%*s  guard failed %u times\n", 2 * step->depth, "", trace->exits[exit].count);
+        }
+    }
+}
+
+void printTraces(VM* vm) {
+    for (Obj* object = vm->objects; object; object = FROM_HEAP_REF(Obj, object->next)) {
+        if (object->type != OBJ_FUNCTION) continue;
+        Chunk* chunk = &((ObjFunction*) object)->chunk;
+        for (uint32_t i = 0; i < chunk->loopCount; i++) {
+            Trace* trace = chunk->loops[i].trace;
+            if (trace && !staleTrace(vm, trace)) printTrace(trace);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef TRACING_JIT
+
+// once a loop's back edge has run TRACE_THRESHOLD times, the interpreter records the instructions of its next iteration
+// as they run, following calls into the functions they run (inlining them). The recording is compiled to machine code
+// for exactly that path and exactly the types it saw: every local it uses is checked and unboxed once on entry (ints
+// and booleans into general purpose registers, doubles into SSE registers), and the loop then runs on the unboxed
+// values, writing back the locals it changed at the end of each iteration. Anything that could turn out differently
+// next time - a branch going the other way, a global or a callee changing type, int overflow - is a guard, which leaves
+// the loop through a side exit: that boxes everything the interpreter needs, rebuilds the frames of any calls inlined
+// at that point, and carries on in run() from the instruction which failed its guard
+
+// calls inlined into a trace, at most
+#define TRACE_MAX_DEPTH 4
+// instructions in a trace, at most: anything longer is probably a nested loop, which gets a trace of its own
+#define TRACE_MAX_STEPS 500
+// recordings which can fail to produce a trace before its loop is left to the interpreter
+#define TRACE_MAX_ATTEMPTS 3
+// runs of a trace between checks that it's still getting round the loop at least once a run on average, rather than
+// leaving through a side exit part way through (i.e. it's not on the usual path any more, or the locals have changed
+// type): if not, the loop is recorded again
+#define TRACE_CHECK_RUNS 64
+
+// an instruction run while recording
+typedef struct {
+    ObjFunction* function;
+    // the word's index in the function's code
+    uint32_t index;
+    uint32_t word;
+    // inlined calls deep
+    uint8_t depth;
+    // what a global held, or the closure which was called
+    Value observed;
+} TraceStep;
+
+// a frame for the interpreter to carry on in, relative to the loop's frame
+typedef struct {
+    // NULL for the loop's own frame
+    ObjClosure* closure;
+    uint32_t base;
+    // the word to carry on from
+    uint32_t ip;
+} TraceFrame;
+
+typedef struct {
+    // the step whose guard failed
+    uint32_t step;
+    // the stack size the interpreter carries on with, relative to the loop's frame
+    uint32_t stackCount;
+    uint8_t frameCount;
+    TraceFrame frames[TRACE_MAX_DEPTH + 1];
+    // times taken
+    uint32_t count;
+} TraceExit;
+
+typedef struct Trace {
+    TraceStep* steps;
+    uint32_t stepCount;
+    // exit 0 is the entry checks
+    TraceExit* exits;
+    uint32_t exitCount;
+    // iterations run all the way through in machine code
+    uint64_t iterations;
+    uint32_t runs;
+    uint64_t checkedIterations;
+    // room needed on the stack, above the loop's frame
+    uint32_t stackNeeded;
+    uint8_t maxDepth;
+    // vm->codeVersion when recorded: inlined code is out of date once the optimiser's rebuilt anything
+    uint32_t codeVersion;
+    uint8_t* code;
+    size_t size;
+    // returns the exit taken
+    uint32_t (*enter)(Value* slots);
+} Trace;
+
+// the state of an OP_LOOP (i.e. loop back edge)
+typedef struct TraceLoop {
+    // the OP_LOOP's index in the code
+    uint32_t index;
+    // times taken, until TRACE_THRESHOLD (INT32_MIN for loops left to the interpreter)
+    int32_t hotness;
+    uint8_t attempts;
+    Trace* trace;
+} TraceLoop;
+
+// (re)builds the chunk's loops from its words
+void initTraceLoops(Chunk* chunk);
+void freeTraceLoops(Chunk* chunk);
+TraceLoop* findTraceLoop(Chunk* chunk, uint32_t index);
+void markTraces(VM* vm, Chunk* chunk);
+
+// starts recording the next iteration of the loop, from its header (where the frame's ip has just been left)
+void startRecording(VM* vm, CallFrame* frame, TraceLoop* loop);
+// called before each instruction while recording, which finishes (compiling the trace) when the loop comes back round
+void recordInstruction(VM* vm, CallFrame* frame);
+void abortRecording(VM* vm);
+void markRecording(VM* vm);
+
+// runs the loop's trace from the top of the frame's loop, leaving the VM (frames included) ready to carry on from
+// whichever side exit it took. Does nothing if the trace's no longer any use
+void runTrace(VM* vm, CallFrame* frame, TraceLoop* loop);
+
+// the recorded instructions, with the side exits from each and how often they've been taken, to stderr
+void printTrace(Trace* trace);
+// every trace the VM's functions still have, i.e. the ones which stayed useful, while their code's still there to print
+void printTraces(VM* vm);
+
+#endif
+
+#endif //CLOX_TRACE_H
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include "value.h"
 #include "object.h"
 
@@ -15,6 +16,11 @@ void writeValue(VM* vm, Compiler* compiler, ValueArray* array, Value value) {
 
     // need to write to array then grow after, otherwise a GC can be triggered while writing temp values to the stack
     if (array->capacity == array->count) {
+        // open upvalues point into the VM's stack, so have to move with it
+        if (array == &vm->stack && vm->openUpvalues) {
+            reserveStack(vm, array->count);
+            return;
+        }
         uint32_t oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(array->capacity);
         array->values = COMPILER_GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
@@ -28,14 +34,32 @@ void freeValueArray(VM* vm, ValueArray* array) {
     array->values = NULL;
 }
 
+// by value rather than representation, so both builds print the same: whole numbers which would fit in an int are
+// printed exactly whether or not they're stored as one, and -0 keeps its sign
+static void printNumber(Printer* print, double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t) number &&
+        !(number == 0 && signbit(number))) {
+        print("%d", (int32_t) number);
+    } else {
+        print("%g", number);
+    }
+}
+
 void printValue(Printer* print, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
         print(AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
         print("nil");
+    } else if (IS_SMALL_STRING(value)) {
+        // sized for the largest length the tag can hold, rather than what's actually used
+        char chars[8];
+        smallStringChars(value, chars);
+        print("%.*s", (int) SMALL_STRING_LENGTH(value), chars);
+    } else if (IS_INT(value)) {
+        print("%d", AS_INT(value));
     } else if (IS_NUMBER(value)) {
-        print("%g", AS_NUMBER(value));
+        printNumber(print, AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
         printObject(print, value);
     }
@@ -48,7 +72,7 @@ void printValue(Printer* print, Value value) {
             print("nil");
             break;
         case VAL_NUMBER:
-            print("%g", AS_NUMBER(value));
+            printNumber(print, AS_NUMBER(value));
             break;
         case VAL_OBJ:
             printObject(print, value);
@@ -59,9 +83,10 @@ void printValue(Printer* print, Value value) {
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
-    // NaN != NaN
-    if (IS_NUMBER(a) && IS_NUMBER(b)) {
-        return AS_NUMBER(a) == AS_NUMBER(b);
+    // NaN != NaN, and an int is equal to the double with the same value; every other kind of value (ints included) has
+    // exactly one representation, so can be compared bitwise
+    if (IS_DOUBLE(a) || IS_DOUBLE(b)) {
+        return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
     } else {
         return a == b;
     }
@@ -14,6 +14,8 @@ typedef struct ObjUpvalue ObjUpvalue;
 typedef struct ObjClass ObjClass;
 typedef struct ObjInstance ObjInstance;
 typedef struct ObjBoundMethod ObjBoundMethod;
+typedef struct ObjChannel ObjChannel;
+typedef struct ObjCoroutine ObjCoroutine;
 
 #ifdef NAN_BOXING
 typedef uint64_t Value;
@@ -28,10 +30,23 @@ typedef uint64_t Value;
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE  3 // 11
 
-#define AS_NUMBER(value) valueToNumber(value)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+// 32 bit integers are stored directly in the lower half of a (positive) QNaN, with this bit set to tell them apart from
+// the other immediates; integer arithmetic which overflows falls back to doubles
+#define TAG_INT ((uint64_t) 1 << 48)
+#define INT_MASK ((uint64_t) 0xffffffff00000000)
+
+// "number" is either representation; use the DOUBLE/INT macros to check for one specifically
+#define AS_NUMBER(value) asNumber(value)
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 #define NUMBER_VAL(number) numberToValue(number)
 
+#define AS_DOUBLE(value) valueToNumber(value)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+
+#define AS_INT(value) ((int32_t) (uint32_t) (value))
+#define IS_INT(value) (((value) & INT_MASK) == (QNAN | TAG_INT))
+#define INT_VAL(integer) ((Value) (QNAN | TAG_INT | (uint32_t) (int32_t) (integer)))
+
 #define IS_NIL(value) ((value) == NIL_VAL)
 #define NIL_VAL ((Value) (uint64_t)(QNAN | TAG_NIL))
 
@@ -42,9 +57,43 @@ typedef uint64_t Value;
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 
-#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+// object values also carry the object's type in the 3 bits above the (47 bit, user space) pointer for the most common
+// types, so e.g. `IS_STRING` is a mask & compare in a register rather than a load from the object header
+#define OBJ_TAG_SHIFT 47
+#define OBJ_TAG_MASK ((uint64_t) 7 << OBJ_TAG_SHIFT)
+#define OBJ_POINTER_MASK (((uint64_t) 1 << OBJ_TAG_SHIFT) - 1)
+
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & OBJ_POINTER_MASK))
 #define IS_OBJ(value) (((value) & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
-#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t) (obj))
+// needs the object's type, so is defined in object.h
+#define OBJ_VAL(obj) objToValue((Obj*) (obj))
+#define OBJ_TAG(value) ((uint32_t) (((value) & OBJ_TAG_MASK) >> OBJ_TAG_SHIFT))
+
+// string values of up to SMALL_STRING_MAX bytes are stored in the value itself, with the length in bits 40-42 and the
+// chars in the bottom 5 bytes (first char lowest); every string value that short is stored this way, so they can still be
+// compared bitwise. Names (of globals, properties, classes etc) are always interned ObjStrings, as they're table keys
+#define TAG_SMALL_STRING ((uint64_t) 2 << 48)
+#define SMALL_STRING_MAX 5
+#define SMALL_STRING_LENGTH_SHIFT 40
+#define IMMEDIATE_TAG_MASK ((uint64_t) 0xffff000000000000)
+
+#define IS_SMALL_STRING(value) (((value) & IMMEDIATE_TAG_MASK) == (QNAN | TAG_SMALL_STRING))
+#define SMALL_STRING_LENGTH(value) ((uint32_t) ((value) >> SMALL_STRING_LENGTH_SHIFT) & 7)
+
+static inline Value smallStringToValue(const char* chars, uint32_t length) {
+    uint64_t packed = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        packed |= (uint64_t) (uint8_t) chars[i] << (i * 8);
+    }
+    return (Value) (QNAN | TAG_SMALL_STRING | ((uint64_t) length << SMALL_STRING_LENGTH_SHIFT) | packed);
+}
+
+// doesn't null terminate
+static inline void smallStringChars(Value value, char* chars) {
+    for (uint32_t i = 0; i < SMALL_STRING_LENGTH(value); i++) {
+        chars[i] = (char) (value >> (i * 8));
+    }
+}
 
 static inline double valueToNumber(Value value) {
     // apparently the redundant memcpy will get optimised away to a basic type pun
@@ -53,6 +102,10 @@ static inline double valueToNumber(Value value) {
     return number;
 }
 
+static inline double asNumber(Value value) {
+    return IS_INT(value) ? (double) AS_INT(value) : valueToNumber(value);
+}
+
 static inline Value numberToValue(double number) {
     Value value;
     memcpy(&value, &number, sizeof(double));
@@ -91,8 +144,29 @@ typedef struct {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value.type) == VAL_OBJ)
 
+// no separate integer representation without NaN boxing - integers are just whole doubles
+#define AS_DOUBLE(value) AS_NUMBER(value)
+#define IS_DOUBLE(value) IS_NUMBER(value)
+#define AS_INT(value) ((int32_t) AS_NUMBER(value))
+#define IS_INT(value) false
+#define INT_VAL(integer) NUMBER_VAL((double) (integer))
+
+// no small strings without NaN boxing either - all strings are ObjStrings
+#define SMALL_STRING_MAX 0
+#define IS_SMALL_STRING(value) false
+
 #endif
 
+// an int can't hold -0.0, so a zero product with a negative operand is left to doubles as if it had overflowed
+static inline bool intMultiplyOverflows(int32_t a, int32_t b, int32_t* result) {
+    return __builtin_mul_overflow(a, b, result) || (*result == 0 && (a < 0 || b < 0));
+}
+
+// likewise negating 0, as well as INT32_MIN which has no positive counterpart
+static inline bool intNegateOverflows(int32_t a) {
+    return a == 0 || a == INT32_MIN;
+}
+
 typedef struct {
     uint32_t capacity;
     uint32_t count;
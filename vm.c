@@ -10,6 +10,11 @@
 #include "debug.h"
 #include "compiler.h"
 #include "object.h"
+#include "optimiser.h"
+#include "jit.h"
+#include "trace.h"
+#include "cache.h"
+#include "isolate.h"
 
 static void resetStack(VM* vm) {
     vm->stack.count = 0;
@@ -17,26 +22,56 @@ static void resetStack(VM* vm) {
     vm->openUpvalues = NULL;
 }
 
-static void runtimeError(VM* vm, const char* format, ...) {
-    fprintf(stderr, "\n\033[1;31m");
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
-
+static void printStackTrace(VM* vm) {
     for (int32_t i = vm->frameCount - 1; i >= 0; i--) {
         CallFrame* frame = vm->frames + i;
-        size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
-        uint32_t line = getLine(&frame->closure->function->chunk, instruction);
+        ObjFunction* function = frame->function;
+        uint32_t instruction = function->chunk.wordOffsets[frame->ip - function->chunk.words - 1];
+        uint32_t line = getLine(&function->chunk, instruction);
+        // the frame the optimiser inlined away
+        InlinedRun* inlined = findInlinedRun(&function->chunk, (uint32_t) instruction);
+        if (inlined) {
+            ObjClosure* callee = AS_CLOSURE(function->chunk.constants.values[inlined->callee]);
+            ObjString* name = FROM_HEAP_REF(ObjString, FROM_HEAP_REF(ObjFunction, callee->function)->name);
+            fprintf(stderr, "\033[1;31m[line %d] in %s()\n\033[0m", line, STRING_CHARS(name));
+            line = inlined->line;
+        }
         fprintf(stderr, "\033[1;31m[line %d] in ", line);
-        if (!frame->closure->function->name) {
+        if (!function->name) {
             fprintf(stderr, "script\n\033[0m");
         } else {
-            fprintf(stderr, "%s()\n\033[0m", frame->closure->function->name->chars);
+            fprintf(stderr, "%s()\n\033[0m", STRING_CHARS(FROM_HEAP_REF(ObjString, function->name)));
         }
     }
+}
+
+#ifdef COROUTINES
+static void closeUpvalues(VM* vm, Value* last);
+static void finishCoroutine(VM* vm, Value result);
+static void defineCoroutineNatives(VM* vm);
+#endif
+
+void runtimeError(VM* vm, const char* format, ...) {
+    fprintf(stderr, "\n\033[1;31m");
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+#ifdef TRACING_JIT
+    if (vm->recorder) abortRecording(vm);
+#endif
 
+    printStackTrace(vm);
+#ifdef COROUTINES
+    // every coroutine the error happened in is finished, back through whatever resumed them to the VM's own stack
+    while (vm->coroutine) {
+        closeUpvalues(vm, vm->stack.values);
+        vm->frameCount = 0;
+        finishCoroutine(vm, NIL_VAL);
+        printStackTrace(vm);
+    }
+#endif
     resetStack(vm);
 }
 
@@ -55,7 +90,7 @@ static bool sqrtNative(VM* vm, Value* out, Value* args) {
     }
 }
 
-static void defineNative(VM* vm, const char* name, NativeFn function, uint8_t arity) {
+void defineNative(VM* vm, const char* name, NativeFn function, uint8_t arity) {
     push(vm, OBJ_VAL(copyString(vm, NULL, name, strlen(name))));
     push(vm, OBJ_VAL(newNative(vm, NULL, function, arity)));
     tableSet(vm, NULL, &vm->globals, AS_STRING(vm->stack.values[0]), vm->stack.values[1]);
@@ -64,11 +99,23 @@ static void defineNative(VM* vm, const char* name, NativeFn function, uint8_t ar
 }
 
 void initVM(FreeList* freeList, VM* vm) {
+#ifdef SHARED_CODE
+    initSharedVM(freeList, vm, NULL);
+}
+
+// before anything's allocated, so the VM's own strings (e.g. "init", and the natives' names) come from the shared code
+void initSharedVM(FreeList* freeList, VM* vm, SharedCode* shared) {
+    vm->shared = shared;
+#endif
     vm->freeList = freeList;
+#ifdef COMPRESSED_HEAP_REFS
+    // left current, as initMemory() leaves it, for whatever's done with the VM before it's run
+    heapBase = freeList->heapBase_;
+#endif
     resetStack(vm);
     vm->objects = NULL;
     initTable(&vm->globals);
-    initTable(&vm->strings);
+    initInternTable(&vm->strings);
     vm->print = printf;
     vm->greyCount = 0;
     vm->greyCapacity = 0;
@@ -76,30 +123,114 @@ void initVM(FreeList* freeList, VM* vm) {
     vm->bytesAllocated = 0;
     vm->nextGC = 1024 * 1024;
     vm->initString = NULL;
+    vm->registerBytecode = REGISTER_BYTECODE;
+#ifdef TRACING_JIT
+    vm->recorder = NULL;
+    vm->codeVersion = 0;
+#endif
+#ifdef BYTECODE_CACHE
+    vm->cacheMappings = NULL;
+#endif
+#ifdef COROUTINES
+    vm->coroutine = NULL;
+#endif
     initValueArray(vm, NULL, &vm->stack);
     vm->initString = copyString(vm, NULL, "init", 4);
 
     defineNative(vm, "clock", clockNative, 0);
     defineNative(vm, "sqrt", sqrtNative, 1);
+#ifdef COROUTINES
+    defineCoroutineNatives(vm);
+#endif
+#ifdef ISOLATES
+    defineIsolateNatives(vm);
+#endif
 }
 
 void freeVM(VM* vm) {
+    ENTER_HEAP(vm);
+#ifdef TRACING_JIT
+    if (vm->recorder) abortRecording(vm);
+#ifdef DEBUG_PRINT_TRACES
+    printTraces(vm);
+#endif
+#endif
     freeTable(vm, &vm->globals);
-    freeTable(vm, &vm->strings);
+    freeInternTable(vm, &vm->strings);
     freeValueArray(vm, &vm->stack);
     vm->initString = NULL;
     freeObjects(vm);
+#ifdef BYTECODE_CACHE
+    freeCacheMappings(vm);
+#endif
     // use system allocator as the custom allocator depends on this
     free(vm->greyStack);
+    LEAVE_HEAP();
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+#ifdef SSA_OPTIMISATION
+// there's no way of moving a running frame over to new code, so functions are only rebuilt when they're not on the stack
+static void optimiseIfHot(VM* vm, ObjFunction* function) {
+    if (function->optimised || function->hotness < HOT_FUNCTION_THRESHOLD) return;
+    for (uint32_t i = 0; i < vm->frameCount; i++) {
+        if (vm->frames[i].function == function) {
+            // recursive, so try again a while later rather than scanning the frames on every call
+            function->hotness = HOT_FUNCTION_THRESHOLD / 2;
+            return;
+        }
+    }
+#ifdef COROUTINES
+    // likewise frames swapped out with a coroutine's stack (or the stack that resumed the running one)
+    if (function->suspendedFrames) {
+        function->hotness = HOT_FUNCTION_THRESHOLD / 2;
+        return;
+    }
+#endif
+
+    function->optimised = true;
+    if (optimiseFunction(vm, function)) {
+#ifdef TRACING_JIT
+        // traces which inlined the old code are out of date
+        vm->codeVersion++;
+#endif
+#ifdef DEBUG_PRINT_CODE
+        disassembleChunk(&function->chunk, function->name ? STRING_CHARS(FROM_HEAP_REF(ObjString, function->name)) : "<script>");
+#endif
+    }
+}
+#endif
+
+#ifdef BASELINE_JIT
+// frames already running the function carry on in the machine code from their next instruction
+static void compileIfHot(VM* vm, ObjFunction* function) {
+    if (!function->chunk.native && function->hotness >= JIT_THRESHOLD) compileNative(vm, function);
+}
+#endif
+
+// native code pushes without checking for space; open upvalues point into the stack, so have to move with it
+void reserveStack(VM* vm, uint32_t count) {
+    if (vm->stack.capacity > count) return;
+    uint32_t capacity = vm->stack.capacity;
+    while (capacity <= count) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    Value* old = vm->stack.values;
+    Value* values = VM_GROW_ARRAY(Value, old, vm->stack.capacity, capacity);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue; upvalue = FROM_HEAP_REF(ObjUpvalue, upvalue->next)) {
+        upvalue->location = values + ((uintptr_t) upvalue->location - (uintptr_t) old) / sizeof(Value);
+    }
+    vm->stack.values = values;
+    vm->stack.capacity = capacity;
+}
+
 static bool call(VM* vm, ObjClosure* closure, uint8_t argumentCount) {
-    if (argumentCount != closure->function->arity) {
-        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argumentCount);
+    ObjFunction* function = FROM_HEAP_REF(ObjFunction, closure->function);
+    if (argumentCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argumentCount);
         return false;
     }
 
@@ -108,9 +239,19 @@ static bool call(VM* vm, ObjClosure* closure, uint8_t argumentCount) {
         return false;
     }
 
+#if defined(SSA_OPTIMISATION) || defined(BASELINE_JIT)
+    if (!IS_FROZEN(function)) function->hotness++;
+#endif
+#ifdef SSA_OPTIMISATION
+    optimiseIfHot(vm, function);
+#endif
+#ifdef BASELINE_JIT
+    compileIfHot(vm, function);
+#endif
     CallFrame* frame = vm->frames + vm->frameCount++;
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->function = function;
+    frame->ip = function->chunk.words;
     frame->base = vm->stack.count - argumentCount - 1;
     return true;
 }
@@ -121,7 +262,7 @@ static bool callValue(VM* vm, Value callee, uint8_t argumentCount) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
                 vm->stack.values[vm->stack.count - argumentCount - 1] = bound->receiver;
-                return call(vm, bound->method, argumentCount);
+                return call(vm, FROM_HEAP_REF(ObjClosure, bound->method), argumentCount);
             }
             case OBJ_CLASS: {
                 ObjClass* class = AS_CLASS(callee);
@@ -168,19 +309,27 @@ static Value peek(VM* vm, uint32_t distance) {
 
 static void concatenate(VM* vm) {
     // keep on stack so GC can reach
-    ObjString* b = AS_STRING(peek(vm, 0));
-    ObjString* a = AS_STRING(peek(vm, 1));
-
-    uint32_t length = a->length + b->length;
-    char* chars = VM_ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Value b = peek(vm, 0);
+    Value a = peek(vm, 1);
 
-    ObjString* result = takeString(vm, NULL, chars, length);
+    uint32_t aLength = stringValueLength(a);
+    uint32_t length = aLength + stringValueLength(b);
+    Value result;
+    if (length <= SMALL_STRING_MAX) {
+        char chars[8];
+        copyStringValueChars(a, chars);
+        copyStringValueChars(b, chars + aLength);
+        result = stringValue(vm, NULL, chars, length);
+    } else {
+        char* chars = VM_ALLOCATE(char, length + 1);
+        copyStringValueChars(a, chars);
+        copyStringValueChars(b, chars + aLength);
+        chars[length] = '\0';
+        result = OBJ_VAL(takeString(vm, NULL, chars, length));
+    }
     pop(vm);
     pop(vm);
-    push(vm, OBJ_VAL(result));
+    push(vm, result);
 }
 
 static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
@@ -189,7 +338,7 @@ static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
 
     while (upvalue && upvalue->location > local) {
         prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        upvalue = FROM_HEAP_REF(ObjUpvalue, upvalue->next);
     }
 
     if (upvalue && upvalue->location == local) {
@@ -197,10 +346,13 @@ static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(vm, NULL, local);
-    createdUpvalue->next = upvalue;
+    createdUpvalue->next = TO_HEAP_REF(upvalue);
+#ifdef COROUTINES
+    createdUpvalue->owner = TO_HEAP_REF(vm->coroutine);
+#endif
 
     if (prevUpvalue) {
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->next = TO_HEAP_REF(createdUpvalue);
     } else {
         vm->openUpvalues = createdUpvalue;
     }
@@ -213,8 +365,177 @@ static void closeUpvalues(VM* vm, Value* last) {
         ObjUpvalue* upvalue = vm->openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm->openUpvalues = upvalue->next;
+#ifdef COROUTINES
+        upvalue->owner = TO_HEAP_REF(NULL);
+#endif
+        vm->openUpvalues = FROM_HEAP_REF(ObjUpvalue, upvalue->next);
+    }
+}
+
+#ifdef COROUTINES
+static void countSuspendedFrames(CallFrame* frames, uint8_t frameCount, int32_t change) {
+    for (uint8_t i = 0; i < frameCount; i++) {
+        if (!IS_FROZEN(frames[i].function)) frames[i].function->suspendedFrames += change;
+    }
+}
+
+// swaps the VM's stack, frames and open upvalues with the ones `coroutine` holds: its own as it's resumed, and its
+// resumer's as it yields or returns
+static void swapStacks(VM* vm, ObjCoroutine* coroutine) {
+    // nothing can be allocated (so nothing can be collected) once they're half swapped
+    if (coroutine->frameCapacity < vm->frameCount) {
+        uint8_t capacity = coroutine->frameCapacity;
+        while (capacity < vm->frameCount) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        coroutine->frames = VM_GROW_ARRAY(CallFrame, coroutine->frames, coroutine->frameCapacity, capacity);
+        coroutine->frameCapacity = capacity;
+    }
+#ifdef TRACING_JIT
+    // the recording follows the frames it started in
+    if (vm->recorder) abortRecording(vm);
+#endif
+
+    CallFrame frames[FRAMES_MAX];
+    uint8_t frameCount = coroutine->frameCount;
+    if (frameCount) memcpy(frames, coroutine->frames, sizeof(CallFrame) * frameCount);
+    if (vm->frameCount) memcpy(coroutine->frames, vm->frames, sizeof(CallFrame) * vm->frameCount);
+    if (frameCount) memcpy(vm->frames, frames, sizeof(CallFrame) * frameCount);
+    countSuspendedFrames(coroutine->frames, vm->frameCount, 1);
+    countSuspendedFrames(vm->frames, frameCount, -1);
+    coroutine->frameCount = vm->frameCount;
+    vm->frameCount = frameCount;
+
+    ValueArray stack = vm->stack;
+    vm->stack = coroutine->stack;
+    coroutine->stack = stack;
+
+    ObjUpvalue* openUpvalues = vm->openUpvalues;
+    vm->openUpvalues = coroutine->openUpvalues;
+    coroutine->openUpvalues = openUpvalues;
+}
+
+// natives have their callee and arguments replaced with their result, so one which switches stacks leaves the new one
+// as it should be afterwards, then pads it with copies of the value on top for callValue() to swap for the result
+static void padNativeResult(VM* vm, Value* out, uint8_t argumentCount) {
+    *out = peek(vm, 0);
+    for (uint8_t i = 0; i < argumentCount; i++) {
+        push(vm, *out);
+    }
+}
+
+// the running coroutine's bottom frame has returned `result` (or failed), so whatever resumed it carries on with that
+static void finishCoroutine(VM* vm, Value result) {
+    ObjCoroutine* coroutine = vm->coroutine;
+    assert(!vm->frameCount && !vm->openUpvalues);
+    swapStacks(vm, coroutine);
+    coroutine->state = COROUTINE_DONE;
+    vm->coroutine = FROM_HEAP_REF(ObjCoroutine, coroutine->resumer);
+    coroutine->resumer = TO_HEAP_REF(NULL);
+    coroutine->closure = TO_HEAP_REF(NULL);
+    // never run again, so its stack can go now rather than when it's collected
+    freeValueArray(vm, &coroutine->stack);
+    VM_FREE_ARRAY(CallFrame, coroutine->frames, coroutine->frameCapacity);
+    coroutine->frames = NULL;
+    coroutine->frameCapacity = 0;
+    push(vm, result);
+}
+
+static bool coroutineNative(VM* vm, Value* out, Value* args) {
+    if (!IS_CLOSURE(*args) || FROM_HEAP_REF(ObjFunction, AS_CLOSURE(*args)->function)->arity > 1) {
+        runtimeError(vm, "Expected a function taking at most one argument.");
+        return false;
+    }
+    *out = OBJ_VAL(newCoroutine(vm, NULL, AS_CLOSURE(*args)));
+    return true;
+}
+
+static bool resumeNative(VM* vm, Value* out, Value* args) {
+    if (!IS_COROUTINE(args[0])) {
+        runtimeError(vm, "Expected a coroutine.");
+        return false;
+    }
+    ObjCoroutine* coroutine = AS_COROUTINE(args[0]);
+    if (coroutine->state == COROUTINE_RUNNING) {
+        runtimeError(vm, "Can't resume a coroutine which is already running.");
+        return false;
+    }
+    if (coroutine->state == COROUTINE_DONE) {
+        runtimeError(vm, "Can't resume a coroutine which has finished.");
+        return false;
+    }
+
+    Value value = args[1];
+    swapStacks(vm, coroutine);
+    coroutine->resumer = TO_HEAP_REF(vm->coroutine);
+    vm->coroutine = coroutine;
+    if (coroutine->state == COROUTINE_NEW) {
+        coroutine->state = COROUTINE_RUNNING;
+        ObjClosure* closure = FROM_HEAP_REF(ObjClosure, coroutine->closure);
+        uint8_t arity = FROM_HEAP_REF(ObjFunction, closure->function)->arity;
+        reserveStack(vm, arity + 1);
+        push(vm, OBJ_VAL(closure));
+        if (arity) push(vm, value);
+        if (!call(vm, closure, arity)) return false;
+    } else {
+        // returned by the yield() it's suspended in
+        coroutine->state = COROUTINE_RUNNING;
+        push(vm, value);
+    }
+    // the call's slots (kept until now so `value` stayed reachable) are filled in with whatever the coroutine yields or
+    // returns, once it has
+    coroutine->stack.count -= 3;
+    padNativeResult(vm, out, 2);
+    return true;
+}
+
+static bool yieldNative(VM* vm, Value* out, Value* args) {
+    ObjCoroutine* coroutine = vm->coroutine;
+    if (!coroutine) {
+        runtimeError(vm, "Can't yield outside a coroutine.");
+        return false;
+    }
+
+    Value value = *args;
+    swapStacks(vm, coroutine);
+    // returned by resume(); the coroutine (and so `value`, in its stack) stays reachable until it's pushed
+    push(vm, value);
+    // the call's slots are filled in with whatever it's resumed with
+    coroutine->stack.count -= 2;
+    coroutine->state = COROUTINE_SUSPENDED;
+    vm->coroutine = FROM_HEAP_REF(ObjCoroutine, coroutine->resumer);
+    coroutine->resumer = TO_HEAP_REF(NULL);
+    padNativeResult(vm, out, 1);
+    return true;
+}
+
+static bool doneNative(VM* vm, Value* out, Value* args) {
+    if (!IS_COROUTINE(*args)) {
+        runtimeError(vm, "Expected a coroutine.");
+        return false;
     }
+    *out = BOOL_VAL(AS_COROUTINE(*args)->state == COROUTINE_DONE);
+    return true;
+}
+
+static void defineCoroutineNatives(VM* vm) {
+    defineNative(vm, "coroutine", coroutineNative, 1);
+    defineNative(vm, "resume", resumeNative, 2);
+    defineNative(vm, "yield", yieldNative, 1);
+    defineNative(vm, "done", doneNative, 1);
+}
+#endif
+
+// the bottom frame has returned, leaving its result on top of the stack: a coroutine's returning finishes it, and
+// whatever resumed it carries on, unless that has no frames left either. False once there's nothing left to run, with
+// the result left in place of the script (or the function callFunction() called) for the caller to pop
+static bool bottomFrameReturned(VM* vm) {
+#ifdef COROUTINES
+    while (!vm->frameCount && vm->coroutine) {
+        finishCoroutine(vm, pop(vm));
+    }
+#endif
+    return vm->frameCount != 0;
 }
 
 static void defineMethod(VM* vm, ObjString* name) {
@@ -228,7 +549,7 @@ static bool bindMethod(VM* vm, ObjClass* class, ObjString* name) {
     Value method;
     if (!tableGet(&class->methods, name, &method)) {
         // TODO this is a bit harsh in a dynamic language - maybe print warning and return nil instead
-        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", STRING_CHARS(name));
         return false;
     }
 
@@ -238,21 +559,16 @@ static bool bindMethod(VM* vm, ObjClass* class, ObjString* name) {
     return true;
 }
 
-uint8_t readByte(CallFrame* frame) {
-    uint8_t result = *frame->ip;
-    ++frame->ip;
-    return result;
-}
-
-static bool isWide(OpCode op) {
-    return op == OP_GET_GLOBAL_LONG || op == OP_SET_GLOBAL_LONG || op == OP_CONSTANT_LONG ||
-           op == OP_DEFINE_GLOBAL_LONG || op == OP_GET_LOCAL_LONG || op == OP_SET_LOCAL_LONG;
+// an operand of a register instruction: either a slot in the current frame, or a constant
+static Value readRegister(VM* vm, CallFrame* frame, uint8_t operand) {
+    if (operand & RK_CONSTANT) return frame->function->chunk.constants.values[operand & ~RK_CONSTANT];
+    return vm->stack.values[frame->base + operand];
 }
 
 static bool invokeFromClass(VM* vm, ObjClass* class, ObjString* name, uint8_t argumentCount) {
     Value method;
     if (!tableGet(&class->methods, name, &method)) {
-        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", STRING_CHARS(name));
         return false;
     }
     return call(vm, AS_CLOSURE(method), argumentCount);
@@ -275,16 +591,34 @@ static bool invoke(VM* vm, ObjString* name, uint8_t argumentCount) {
         return callValue(vm, value, argumentCount);
     }
 
-    return invokeFromClass(vm, instance->class, name, argumentCount);
+    return invokeFromClass(vm, FROM_HEAP_REF(ObjClass, instance->class), name, argumentCount);
+}
+
+// a call in tail position returns whatever the callee does, so the current frame is discarded before making it: the
+// callee and its `argumentCount` arguments move down into the frame's slots, and the call's result ends up exactly
+// where returning from the frame would have put it
+static void discardFrame(VM* vm, CallFrame* frame, uint8_t argumentCount) {
+    closeUpvalues(vm, vm->stack.values + frame->base);
+    uint32_t count = argumentCount + 1;
+    memmove(vm->stack.values + frame->base, vm->stack.values + vm->stack.count - count, sizeof(Value) * count);
+    vm->stack.count = frame->base + count;
+    vm->frameCount--;
 }
 
 static InterpretResult run(VM* vm) {
-    CallFrame* frame = vm->frames + vm->frameCount - 1;
+    CallFrame* frame;
+
+// after anything which can change the running frame: natives (and classes without initialisers) called in tail position
+// from the bottom frame return straight away, leaving it with no frames, as can switching to another coroutine's stack
+#define LOAD_FRAME() do { \
+        if (!vm->frameCount && !bottomFrameReturned(vm)) return INTERPRET_OK; \
+        frame = vm->frames + vm->frameCount - 1; \
+    } while (false)
+
+    LOAD_FRAME();
 
 // TODO (maybe) store the ip in a register - need to ensure the ip is stored/loaded properly when the frame changes
-#define READ_BYTE (readByte(frame))
-#define READ_LONG ((READ_BYTE << 16) | (READ_BYTE << 8) | READ_BYTE)
-#define READ_SHORT ((READ_BYTE << 8) | (READ_BYTE))
+#define READ_WORD (*frame->ip++)
 #define PEEK(distance) peek(vm, distance)
 #define BINARY_OP(valueType, op) do { \
     if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
@@ -295,10 +629,82 @@ static InterpretResult run(VM* vm) {
     double a = AS_NUMBER(PEEK(0));    \
     vm->stack.values[vm->stack.count - 1] = valueType(a op b);\
 } while (false)
-#define READ_CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
+// integer fast path for +, - and *; falls back to doubles if either operand isn't an int or the result overflows
+#define INT_BINARY_OP(checkedOp, op) do { \
+    int32_t result; \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1)) && !checkedOp(AS_INT(PEEK(1)), AS_INT(PEEK(0)), &result)) { \
+        vm->stack.count--; \
+        vm->stack.values[vm->stack.count - 1] = INT_VAL(result); \
+    } else { \
+        BINARY_OP(NUMBER_VAL, op); \
+    } \
+} while (false)
+#define COMPARISON_OP(op) do { \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) { \
+        bool result = AS_INT(PEEK(1)) op AS_INT(PEEK(0)); \
+        vm->stack.count--; \
+        vm->stack.values[vm->stack.count - 1] = BOOL_VAL(result); \
+    } else { \
+        BINARY_OP(BOOL_VAL, op); \
+    } \
+} while (false)
+// register instructions either push their result, or write it straight to a slot
+#define REGISTER_RESULT(value) do { \
+    Value result_ = (value); \
+    if (isRegisterStore(instruction)) { \
+        vm->stack.values[frame->base + WORD_C(word)] = result_; \
+    } else { \
+        push(vm, result_); \
+    } \
+} while (false)
+#define REGISTER_BINARY_OP(valueType, op) do { \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        runtimeError(vm, "Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } \
+    REGISTER_RESULT(valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+} while (false)
+#define REGISTER_INT_BINARY_OP(checkedOp, op) do { \
+    int32_t result; \
+    if (IS_INT(a) && IS_INT(b) && !checkedOp(AS_INT(a), AS_INT(b), &result)) { \
+        REGISTER_RESULT(INT_VAL(result)); \
+    } else { \
+        REGISTER_BINARY_OP(NUMBER_VAL, op); \
+    } \
+} while (false)
+#define REGISTER_COMPARISON_OP(op) do { \
+    if (IS_INT(a) && IS_INT(b)) { \
+        REGISTER_RESULT(BOOL_VAL(AS_INT(a) op AS_INT(b))); \
+    } else { \
+        REGISTER_BINARY_OP(BOOL_VAL, op); \
+    } \
+} while (false)
+#define READ_REGISTER(operand) (readRegister(vm, frame, operand))
+#define FRAME_FUNCTION (frame->function)
+#define FRAME_UPVALUE(slot) \
+    FROM_HEAP_REF(ObjUpvalue, FROM_HEAP_REF(HEAP_REF(ObjUpvalue), frame->closure->upvalues)[slot])
+#define READ_CONSTANT(index) (FRAME_FUNCTION->chunk.constants.values[index])
 #define READ_STRING(index) AS_STRING(READ_CONSTANT(index))
 
-    while (frame->ip < frame->closure->function->chunk.code + frame->closure->function->chunk.count) {
+    while (frame->ip < FRAME_FUNCTION->chunk.words + FRAME_FUNCTION->chunk.wordCount) {
+#ifdef NATIVE_CODE
+        NativeCode* native = FRAME_FUNCTION->chunk.native;
+#ifdef TRACING_JIT
+        // everything's interpreted while a loop's being recorded
+        if (vm->recorder) {
+            recordInstruction(vm, frame);
+            native = NULL;
+        }
+#endif
+        if (native) {
+            uint32_t entry = native->entries[frame->ip - FRAME_FUNCTION->chunk.words];
+            // runs up to the next instruction it can't handle, which is always run here before going back
+            if (entry) {
+                reserveStack(vm, vm->stack.count + native->stackNeeded);
+                runNative(vm, frame, native, entry);
+            }
+        }
+#endif
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
         for (uint32_t i = 0; i < vm->stack.count; i++) {
@@ -307,19 +713,26 @@ static InterpretResult run(VM* vm) {
             printf("]");
         }
         printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (uint32_t) (frame->ip - frame->closure->function->chunk.code));
+        disassembleInstruction(printf, &FRAME_FUNCTION->chunk,
+                               FRAME_FUNCTION->chunk.wordOffsets[frame->ip - FRAME_FUNCTION->chunk.words]);
 #endif
+        uint32_t word = READ_WORD;
         OpCode instruction;
-        switch (instruction = READ_BYTE) {
+        switch (instruction = WORD_OP(word)) {
             case OP_PRINT:
                 printValue(vm->print, pop(vm));
-                printf("\n");
+                vm->print("\n");
                 break;
             case OP_POP:
                 pop(vm);
                 break;
             case OP_ADD: {
-                if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                int32_t result;
+                if (IS_INT(PEEK(0)) && IS_INT(PEEK(1)) &&
+                    !__builtin_add_overflow(AS_INT(PEEK(1)), AS_INT(PEEK(0)), &result)) {
+                    vm->stack.count--;
+                    vm->stack.values[vm->stack.count - 1] = INT_VAL(result);
+                } else if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
                     concatenate(vm);
                 } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
                     double b = AS_NUMBER(pop(vm));
@@ -332,11 +745,11 @@ static InterpretResult run(VM* vm) {
                 break;
             }
             case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
+                INT_BINARY_OP(__builtin_sub_overflow, -);
                 break;
             }
             case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
+                INT_BINARY_OP(intMultiplyOverflows, *);
                 break;
             }
             case OP_DIVIDE: {
@@ -348,38 +761,39 @@ static InterpretResult run(VM* vm) {
                     runtimeError(vm, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                Value operand = pop(vm);
+                if (IS_INT(operand) && !intNegateOverflows(AS_INT(operand))) {
+                    push(vm, INT_VAL(-AS_INT(operand)));
+                } else {
+                    push(vm, NUMBER_VAL(-AS_NUMBER(operand)));
+                }
                 break;
             }
-            case OP_CONSTANT:
-            case OP_CONSTANT_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_CONSTANT: {
+                uint32_t index = WORD_OPERAND(word);
                 push(vm, READ_CONSTANT(index));
                 break;
             }
-            case OP_DEFINE_GLOBAL:
-            case OP_DEFINE_GLOBAL_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_DEFINE_GLOBAL: {
+                uint32_t index = WORD_OPERAND(word);
                 ObjString* name = READ_STRING(index);
                 tableSet(vm, NULL, &vm->globals, name, PEEK(0));
                 pop(vm);
                 break;
             }
-            case OP_GET_GLOBAL:
-            case OP_GET_GLOBAL_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_GET_GLOBAL: {
+                uint32_t index = WORD_OPERAND(word);
                 ObjString* name = READ_STRING(index);
                 Value value;
                 if (!tableGet(&vm->globals, name, &value)) {
-                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+                    runtimeError(vm, "Undefined variable '%s'.", STRING_CHARS(name));
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(vm, value);
                 break;
             }
-            case OP_SET_GLOBAL:
-            case OP_SET_GLOBAL_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_SET_GLOBAL: {
+                uint32_t index = WORD_OPERAND(word);
                 ObjString* name = READ_STRING(index);
                 if (tableSet(vm, NULL, &vm->globals, name, PEEK(0))) {
                     tableDelete(&vm->globals, name);
@@ -388,18 +802,25 @@ static InterpretResult run(VM* vm) {
                 }
                 break;
             }
-            case OP_GET_LOCAL:
-            case OP_GET_LOCAL_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_GET_LOCAL: {
+                uint32_t index = WORD_OPERAND(word);
                 push(vm, vm->stack.values[frame->base + index]);
                 break;
             }
-            case OP_SET_LOCAL:
-            case OP_SET_LOCAL_LONG: {
-                uint32_t index = isWide(instruction) ? READ_LONG : READ_BYTE;
+            case OP_SET_LOCAL: {
+                uint32_t index = WORD_OPERAND(word);
                 vm->stack.values[frame->base + index] = PEEK(0);
                 break;
             }
+            case OP_SET_LOCAL_POP: {
+                uint32_t index = WORD_OPERAND(word);
+                vm->stack.values[frame->base + index] = pop(vm);
+                break;
+            }
+            case OP_INT: {
+                push(vm, INT_VAL(WORD_SIGNED_OPERAND(word)));
+                break;
+            }
             case OP_NIL: {
                 push(vm, NIL_VAL);
                 break;
@@ -422,69 +843,164 @@ static InterpretResult run(VM* vm) {
                 break;
             }
             case OP_GREATER: {
-                BINARY_OP(BOOL_VAL, >);
+                COMPARISON_OP(>);
                 break;
             }
             case OP_LESS: {
-                BINARY_OP(BOOL_VAL, <);
+                COMPARISON_OP(<);
                 break;
             }
             case OP_JUMP: {
-                uint32_t offset = READ_SHORT;
+                uint32_t offset = WORD_OPERAND(word);
                 frame->ip += offset;
                 break;
             }
+            case OP_ADD_RK:
+            case OP_ADD_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                int32_t result;
+                if (IS_INT(a) && IS_INT(b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) {
+                    REGISTER_RESULT(INT_VAL(result));
+                } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+                    push(vm, a);
+                    push(vm, b);
+                    concatenate(vm);
+                    if (isRegisterStore(instruction)) vm->stack.values[frame->base + WORD_C(word)] = pop(vm);
+                } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    REGISTER_RESULT(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                } else {
+                    runtimeError(vm, "Operands must be two numbers or two strings");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_SUBTRACT_RK:
+            case OP_SUBTRACT_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_INT_BINARY_OP(__builtin_sub_overflow, -);
+                break;
+            }
+            case OP_MULTIPLY_RK:
+            case OP_MULTIPLY_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_INT_BINARY_OP(intMultiplyOverflows, *);
+                break;
+            }
+            case OP_DIVIDE_RK:
+            case OP_DIVIDE_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_BINARY_OP(NUMBER_VAL, /);
+                break;
+            }
+            case OP_EQUAL_RK:
+            case OP_EQUAL_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_RESULT(BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_GREATER_RK:
+            case OP_GREATER_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_COMPARISON_OP(>);
+                break;
+            }
+            case OP_LESS_RK:
+            case OP_LESS_RK_STORE: {
+                Value a = READ_REGISTER(WORD_A(word));
+                Value b = READ_REGISTER(WORD_B(word));
+                REGISTER_COMPARISON_OP(<);
+                break;
+            }
+            case OP_MOVE: {
+                Value value = READ_REGISTER(WORD_A(word));
+                vm->stack.values[frame->base + WORD_B(word)] = value;
+                break;
+            }
             case OP_JUMP_IF_FALSE: {
-                uint32_t offset = READ_SHORT;
+                uint32_t offset = WORD_OPERAND(word);
                 if (isFalsey(PEEK(0))) frame->ip += offset;
                 break;
             }
+            case OP_JUMP_IF_TRUE: {
+                uint32_t offset = WORD_OPERAND(word);
+                if (!isFalsey(PEEK(0))) frame->ip += offset;
+                break;
+            }
             case OP_LOOP: {
-                uint32_t offset = READ_SHORT;
+                uint32_t offset = WORD_OPERAND(word);
+#ifdef TRACING_JIT
+                TraceLoop* loop = findTraceLoop(&FRAME_FUNCTION->chunk,
+                                                (uint32_t) (frame->ip - FRAME_FUNCTION->chunk.words) - 1);
+#endif
                 frame->ip -= offset;
+#if defined(SSA_OPTIMISATION) || defined(BASELINE_JIT)
+                // shared with other VMs, so left as it is: not counted, compiled or traced
+                if (IS_FROZEN(FRAME_FUNCTION)) break;
+                FRAME_FUNCTION->hotness++;
+#endif
+#ifdef BASELINE_JIT
+                compileIfHot(vm, FRAME_FUNCTION);
+#endif
+#ifdef TRACING_JIT
+                if (loop->trace && !vm->recorder) {
+                    // carries on from wherever the trace leaves off, which might be inside a call it inlined
+                    reserveStack(vm, frame->base + loop->trace->stackNeeded);
+                    runTrace(vm, frame, loop);
+                    frame = vm->frames + vm->frameCount - 1;
+                } else if (loop->hotness < TRACE_THRESHOLD) {
+                    loop->hotness++;
+                } else if (!vm->recorder) {
+                    startRecording(vm, frame, loop);
+                }
+#endif
                 break;
             }
             case OP_CALL: {
-                uint8_t argumentCount = READ_BYTE;
+                uint8_t argumentCount = WORD_A(word);
                 if (!callValue(vm, PEEK(argumentCount), argumentCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = vm->frames + vm->frameCount - 1;
+                LOAD_FRAME();
                 break;
             }
             case OP_CLASS: {
-                push(vm, OBJ_VAL(newClass(vm, NULL, READ_STRING(READ_BYTE))));
+                push(vm, OBJ_VAL(newClass(vm, NULL, READ_STRING(WORD_OPERAND(word)))));
                 break;
             }
             case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT(READ_BYTE));
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT(WORD_OPERAND(word)));
                 ObjClosure* closure = newClosure(vm, NULL, function);
                 push(vm, OBJ_VAL(closure));
+                HEAP_REF(ObjUpvalue)* upvalues = FROM_HEAP_REF(HEAP_REF(ObjUpvalue), closure->upvalues);
                 for (uint32_t i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE;
-                    uint8_t index = READ_BYTE;
+                    uint32_t upvalue = READ_WORD;
+                    bool isLocal = upvalue & 0xff;
+                    uint8_t index = WORD_A(upvalue);
 
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(vm, vm->stack.values + frame->base + index);
+                        upvalues[i] = TO_HEAP_REF(captureUpvalue(vm, vm->stack.values + frame->base + index));
                     } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                        upvalues[i] = TO_HEAP_REF(FRAME_UPVALUE(index));
                     }
                 }
                 break;
             }
             case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE;
-                push(vm, *frame->closure->upvalues[slot]->location);
+                uint32_t slot = WORD_OPERAND(word);
+                push(vm, *FRAME_UPVALUE(slot)->location);
                 break;
             }
             case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE;
-                *frame->closure->upvalues[slot]->location = PEEK(0);
+                uint32_t slot = WORD_OPERAND(word);
+                *FRAME_UPVALUE(slot)->location = PEEK(0);
                 break;
             }
-            case OP_GET_UPVALUE_LONG:
-            case OP_SET_UPVALUE_LONG:
-                assert(!"Not implemented");
             case OP_CLOSE_UPVALUE: {
                 closeUpvalues(vm, vm->stack.values + vm->stack.count - 1);
                 pop(vm);
@@ -497,7 +1013,7 @@ static InterpretResult run(VM* vm) {
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
-                ObjString* name = READ_STRING(READ_BYTE);
+                ObjString* name = READ_STRING(WORD_OPERAND(word));
 
                 Value value;
                 if (tableGet(&instance->fields, name, &value)) {
@@ -506,7 +1022,7 @@ static InterpretResult run(VM* vm) {
                     break;
                 }
 
-                if (!bindMethod(vm, instance->class, name)) {
+                if (!bindMethod(vm, FROM_HEAP_REF(ObjClass, instance->class), name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
@@ -518,23 +1034,42 @@ static InterpretResult run(VM* vm) {
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
-                tableSet(vm, NULL, &instance->fields, READ_STRING(READ_BYTE), peek(vm, 0));
+                tableSet(vm, NULL, &instance->fields, READ_STRING(WORD_OPERAND(word)), peek(vm, 0));
                 Value value = pop(vm);
                 pop(vm); // instance
                 push(vm, value);
                 break;
             }
             case OP_METHOD: {
-                defineMethod(vm, READ_STRING(READ_BYTE));
+                defineMethod(vm, READ_STRING(WORD_OPERAND(word)));
                 break;
             }
             case OP_INVOKE: {
-                ObjString* method = READ_STRING(READ_BYTE);
-                uint8_t argumentCount = READ_BYTE;
+                ObjString* method = READ_STRING(WORD_A(word));
+                uint8_t argumentCount = WORD_B(word);
                 if (!invoke(vm, method, argumentCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = vm->frames + vm->frameCount - 1;
+                LOAD_FRAME();
+                break;
+            }
+            case OP_JUMP_IF_CALLEE: {
+                Value closure = READ_CONSTANT(WORD_A(word));
+                uint32_t offset = word >> 16;
+                if (valuesEqual(pop(vm), closure)) frame->ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_INVOKES: {
+                ObjString* name = READ_STRING(WORD_A(word));
+                Value closure = READ_CONSTANT(WORD_B(word));
+                uint32_t offset = READ_WORD;
+                Value receiver = pop(vm);
+                // mirrors invoke(): a field shadows a method of the same name
+                Value method;
+                if (IS_INSTANCE(receiver) && !tableGet(&AS_INSTANCE(receiver)->fields, name, &method)) {
+                    ObjClass* class = FROM_HEAP_REF(ObjClass, AS_INSTANCE(receiver)->class);
+                    if (tableGet(&class->methods, name, &method) && valuesEqual(method, closure)) frame->ip += offset;
+                }
                 break;
             }
             case OP_INHERIT: {
@@ -549,7 +1084,7 @@ static InterpretResult run(VM* vm) {
                 break;
             }
             case OP_GET_SUPER: {
-                ObjString* name = READ_STRING(READ_BYTE);
+                ObjString* name = READ_STRING(WORD_OPERAND(word));
                 ObjClass* superclass = AS_CLASS(pop(vm));
 
                 if (!bindMethod(vm, superclass, name)) {
@@ -558,8 +1093,8 @@ static InterpretResult run(VM* vm) {
                 break;
             }
             case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING(READ_BYTE);
-                uint8_t argumentCount = READ_BYTE;
+                ObjString* method = READ_STRING(WORD_A(word));
+                uint8_t argumentCount = WORD_B(word);
                 ObjClass* superclass = AS_CLASS(pop(vm));
                 if (!invokeFromClass(vm, superclass, method, argumentCount)) {
                     return INTERPRET_RUNTIME_ERROR;
@@ -567,42 +1102,121 @@ static InterpretResult run(VM* vm) {
                 frame = vm->frames + vm->frameCount - 1;
                 break;
             }
+            case OP_TAIL_CALL: {
+                uint8_t argumentCount = WORD_A(word);
+                discardFrame(vm, frame, argumentCount);
+                if (!callValue(vm, PEEK(argumentCount), argumentCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            }
+            case OP_TAIL_INVOKE: {
+                ObjString* method = READ_STRING(WORD_A(word));
+                uint8_t argumentCount = WORD_B(word);
+                discardFrame(vm, frame, argumentCount);
+                if (!invoke(vm, method, argumentCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            }
+            case OP_TAIL_SUPER_INVOKE: {
+                ObjString* method = READ_STRING(WORD_A(word));
+                uint8_t argumentCount = WORD_B(word);
+                ObjClass* superclass = AS_CLASS(pop(vm));
+                discardFrame(vm, frame, argumentCount);
+                if (!invokeFromClass(vm, superclass, method, argumentCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = vm->frames + vm->frameCount - 1;
+                break;
+            }
             case OP_RETURN: {
                 Value result = pop(vm);
                 closeUpvalues(vm, vm->stack.values + frame->base);
-                if (--vm->frameCount == 0) {
-                    pop(vm);
-                    return INTERPRET_OK;
-                }
-
+                vm->frameCount--;
                 vm->stack.count = frame->base;
                 push(vm, result);
-                frame = vm->frames + vm->frameCount - 1;
+                LOAD_FRAME();
                 break;
             }
+            // wide operands fit in the instruction word, so these are only in the bytecode
+            case OP_CONSTANT_LONG:
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL_LONG:
+            case OP_SET_LOCAL_POP_LONG:
+            case OP_GET_UPVALUE_LONG:
+            case OP_SET_UPVALUE_LONG:
+                assert(!"_LONG opcode in instruction words");
+                return INTERPRET_RUNTIME_ERROR;
         }
     }
 
     return INTERPRET_OK;
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_LONG
+#undef LOAD_FRAME
+#undef READ_WORD
 #undef PEEK
+#undef FRAME_FUNCTION
+#undef FRAME_UPVALUE
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef COMPARISON_OP
+#undef REGISTER_RESULT
+#undef REGISTER_BINARY_OP
+#undef REGISTER_INT_BINARY_OP
+#undef REGISTER_COMPARISON_OP
+#undef READ_REGISTER
 }
 
 InterpretResult interpret(VM* vm, const char* source) {
     ObjFunction* function = compile(vm, source);
     if (!function) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
+    ENTER_HEAP(vm);
     push(vm, OBJ_VAL(function));
     ObjClosure* closure = newClosure(vm, NULL, function);
     pop(vm);
     push(vm, OBJ_VAL(closure));
     call(vm, closure, 0);
 
-    return run(vm);
+    InterpretResult result = run(vm);
+    if (result == INTERPRET_OK) pop(vm);
+    LEAVE_HEAP();
+    return result;
+}
+
+InterpretResult callGlobal(VM* vm, const char* name, const Value* arguments, uint8_t argumentCount, Value* result) {
+    ENTER_HEAP(vm);
+    Value callee;
+    bool found = tableGet(&vm->globals, copyString(vm, NULL, name, (uint32_t) strlen(name)), &callee);
+    LEAVE_HEAP();
+    if (!found) {
+        runtimeError(vm, "Undefined variable '%s'.", name);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return callFunction(vm, callee, arguments, argumentCount, result);
+}
+
+InterpretResult callFunction(VM* vm, Value callee, const Value* arguments, uint8_t argumentCount, Value* result) {
+    ENTER_HEAP(vm);
+    push(vm, callee);
+    for (uint8_t i = 0; i < argumentCount; i++) {
+        push(vm, arguments[i]);
+    }
+    // natives (and classes without initialisers) have already returned, so there may be nothing to run
+    InterpretResult status = callValue(vm, callee, argumentCount) ? run(vm) : INTERPRET_RUNTIME_ERROR;
+    if (status == INTERPRET_OK) *result = pop(vm);
+    LEAVE_HEAP();
+    return status;
 }
 
 void push(VM* vm, Value value) {
@@ -624,10 +1238,16 @@ void markRoots(VM* vm) {
         markObject(vm, (Obj*) vm->frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue; upvalue = upvalue->next) {
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue; upvalue = FROM_HEAP_REF(ObjUpvalue, upvalue->next)) {
         markObject(vm, (Obj*) upvalue);
     }
 
     markTable(vm, &vm->globals);
     markObject(vm, (Obj*) vm->initString);
+#ifdef COROUTINES
+    markObject(vm, (Obj*) vm->coroutine);
+#endif
+#ifdef TRACING_JIT
+    if (vm->recorder) markRecording(vm);
+#endif
 }
@@ -1,15 +1,27 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "intern.h"
 #include "table.h"
 
 #define FRAMES_MAX 64
 
 typedef struct FreeList FreeList;
+// see trace.h
+typedef struct TraceRecorder TraceRecorder;
+// see cache.h
+typedef struct CacheMapping CacheMapping;
+// see shared.h
+typedef struct SharedCode SharedCode;
+
+// sets `out` and returns true, or reports a runtime error and returns false
+typedef bool (*NativeFn)(VM* vm, Value* out, Value* args);
 
 typedef struct {
     ObjClosure* closure;
-    uint8_t* ip;
+    // the closure's function, so the dispatch loop doesn't need to follow a (possibly compressed) reference every time
+    ObjFunction* function;
+    uint32_t* ip;
     uint32_t base;
 } CallFrame;
 
@@ -19,7 +31,7 @@ struct VM {
     uint8_t frameCount;
     ValueArray stack;
     Table globals;
-    Table strings;
+    InternTable strings;
     ObjUpvalue* openUpvalues;
     Obj* objects;
     Printer* print;
@@ -29,6 +41,26 @@ struct VM {
     size_t bytesAllocated;
     size_t nextGC;
     ObjString* initString;
+    // whether the compiler and optimiser emit the register forms of instructions
+    bool registerBytecode;
+#ifdef TRACING_JIT
+    // the loop being recorded, if any (see trace.h)
+    TraceRecorder* recorder;
+    // bumped whenever the optimiser rebuilds a function
+    uint32_t codeVersion;
+#endif
+#ifdef BYTECODE_CACHE
+    // the caches functions have been loaded from, which are unmapped once they're all freed
+    CacheMapping* cacheMappings;
+#endif
+#ifdef SHARED_CODE
+    // frozen code the VM can run, and whose strings it uses rather than making its own
+    SharedCode* shared;
+#endif
+#ifdef COROUTINES
+    // the coroutine whose stack, frames and open upvalues the VM's are, or NULL for its own (see ObjCoroutine)
+    ObjCoroutine* coroutine;
+#endif
 };
 
 typedef enum {
@@ -38,9 +70,26 @@ typedef enum {
 } InterpretResult;
 
 void initVM(FreeList* freeList, VM* vm);
+#ifdef SHARED_CODE
+// as initVM(), for running `shared`'s code (with interpretFunction()), which has to outlive the VM
+void initSharedVM(FreeList* freeList, VM* vm, SharedCode* shared);
+#endif
 void freeVM(VM* vm);
 InterpretResult interpret(VM* vm, const char* source);
+// runs a script compile() has already returned, before anything else is allocated
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+// calls the global `name` (between scripts) with `argumentCount` arguments, setting `result` to whatever it returns;
+// an object result isn't kept alive, so is only safe until the VM next allocates
+InterpretResult callGlobal(VM* vm, const char* name, const Value* arguments, uint8_t argumentCount, Value* result);
+// as callGlobal(), for a function value (or anything else callable) the VM already has
+InterpretResult callFunction(VM* vm, Value callee, const Value* arguments, uint8_t argumentCount, Value* result);
 void push(VM* vm, Value value);
 Value pop(VM* vm);
+// grows the stack (moving open upvalues with it) so at least `count` values fit without it growing again, e.g. before
+// pushing values that have to stay reachable while they're built
+void reserveStack(VM* vm, uint32_t count);
+// for natives defined outside vm.c; an error leaves the stack reset, so the native has to return false
+void runtimeError(VM* vm, const char* format, ...);
+void defineNative(VM* vm, const char* name, NativeFn function, uint8_t arity);
 
 #endif //CLOX_VM_H
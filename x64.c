@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "x64.h"
+
+#ifdef BASELINE_JIT
+
+void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        assert(as->code);
+    }
+    as->code[as->count++] = byte;
+}
+
+void emit32(Assembler* as, uint32_t value) {
+    for (uint32_t i = 0; i < 4; i++) {
+        emitByte(as, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+void emit64(Assembler* as, uint64_t value) {
+    emit32(as, (uint32_t) value);
+    emit32(as, (uint32_t) (value >> 32));
+}
+
+void emitRex(Assembler* as, bool wide, Register reg, Register base) {
+    uint8_t rex = (uint8_t) (0x40 | (wide ? 8 : 0) | (reg >> 3) << 2 | base >> 3);
+    if (rex != 0x40) emitByte(as, rex);
+}
+
+// rsp and r12 can only be a base with a SIB byte
+void emitMemory(Assembler* as, Register reg, Register base, int32_t disp) {
+    emitByte(as, (uint8_t) (0x80 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    emit32(as, (uint32_t) disp);
+}
+
+void emitLoad(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, true, dst, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, dst, base, disp);
+}
+
+void emitLoad32(Assembler* as, Register dst, Register base, int32_t disp) {
+    emitRex(as, false, dst, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, dst, base, disp);
+}
+
+void emitStore(Assembler* as, Register base, int32_t disp, Register src) {
+    emitRex(as, true, src, base);
+    emitByte(as, 0x89);
+    emitMemory(as, src, base, disp);
+}
+
+void emitStore32(Assembler* as, Register base, int32_t disp, Register src) {
+    emitRex(as, false, src, base);
+    emitByte(as, 0x89);
+    emitMemory(as, src, base, disp);
+}
+
+void emitMoveImmediate(Assembler* as, Register reg, uint64_t value) {
+    emitRex(as, true, RAX, reg);
+    emitByte(as, (uint8_t) (0xb8 + (reg & 7)));
+    emit64(as, value);
+}
+
+void emitAlu(Assembler* as, AluOp op, bool wide, Register dst, Register src) {
+    emitRex(as, wide, src, dst);
+    emitByte(as, op);
+    emitByte(as, (uint8_t) (0xc0 | (src & 7) << 3 | (dst & 7)));
+}
+
+void emitAluImmediate(Assembler* as, ImmediateOp op, bool wide, Register reg, int32_t value) {
+    emitRex(as, wide, RAX, reg);
+    emitByte(as, 0x81);
+    emitByte(as, (uint8_t) (0xc0 | op << 3 | (reg & 7)));
+    emit32(as, (uint32_t) value);
+}
+
+void emitShift(Assembler* as, ImmediateOp op, Register reg, uint8_t bits) {
+    emitRex(as, true, RAX, reg);
+    emitByte(as, 0xc1);
+    emitByte(as, (uint8_t) (0xc0 | op << 3 | (reg & 7)));
+    emitByte(as, bits);
+}
+
+void emitSetCondition(Assembler* as, Condition condition, Register reg) {
+    assert(reg < RSP);
+    emitByte(as, 0x0f);
+    emitByte(as, (uint8_t) (0x90 | condition));
+    emitByte(as, (uint8_t) (0xc0 | reg));
+    emitByte(as, 0x0f);
+    emitByte(as, 0xb6);
+    emitByte(as, (uint8_t) (0xc0 | reg << 3 | reg));
+}
+
+void emitCall(Assembler* as, uint64_t function) {
+    emitMoveImmediate(as, RAX, function);
+    emitByte(as, 0xff);
+    emitByte(as, 0xd0);
+}
+
+void emitPush(Assembler* as, Register reg) {
+    emitRex(as, false, RAX, reg);
+    emitByte(as, (uint8_t) (0x50 + (reg & 7)));
+}
+
+void emitPop(Assembler* as, Register reg) {
+    emitRex(as, false, RAX, reg);
+    emitByte(as, (uint8_t) (0x58 + (reg & 7)));
+}
+
+void emitReturn(Assembler* as) {
+    emitByte(as, 0xc3);
+}
+
+uint32_t emitJump(Assembler* as) {
+    emitByte(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+uint32_t emitJumpIf(Assembler* as, Condition condition) {
+    emitByte(as, 0x0f);
+    emitByte(as, (uint8_t) (0x80 | condition));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+void patchJump(Assembler* as, uint32_t at, uint32_t target) {
+    uint32_t rel = target - (at + 4);
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+// the mandatory prefix goes before any REX prefix
+static void emitSseOp(Assembler* as, uint8_t prefix, bool wide, uint8_t op, uint8_t reg, uint8_t rm) {
+    emitByte(as, prefix);
+    emitRex(as, wide, (Register) reg, (Register) rm);
+    emitByte(as, 0x0f);
+    emitByte(as, op);
+    emitByte(as, (uint8_t) (0xc0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+static void emitSseMemory(Assembler* as, uint8_t op, XmmRegister reg, Register base, int32_t disp) {
+    emitByte(as, 0xf2);
+    emitRex(as, false, (Register) reg, base);
+    emitByte(as, 0x0f);
+    emitByte(as, op);
+    emitMemory(as, (Register) reg, base, disp);
+}
+
+void emitMoveXmm(Assembler* as, XmmRegister dst, XmmRegister src) {
+    // movapd: movsd between registers would merge with the old upper half
+    if (dst != src) emitSseOp(as, 0x66, false, 0x28, dst, src);
+}
+
+void emitMoveToXmm(Assembler* as, XmmRegister dst, Register src) {
+    emitSseOp(as, 0x66, true, 0x6e, dst, src);
+}
+
+void emitMoveFromXmm(Assembler* as, Register dst, XmmRegister src) {
+    emitSseOp(as, 0x66, true, 0x7e, src, dst);
+}
+
+void emitLoadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp) {
+    emitSseMemory(as, 0x10, dst, base, disp);
+}
+
+void emitStoreXmm(Assembler* as, Register base, int32_t disp, XmmRegister src) {
+    emitSseMemory(as, 0x11, src, base, disp);
+}
+
+void emitSse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src) {
+    emitSseOp(as, 0xf2, false, op, dst, src);
+}
+
+void emitCompareXmm(Assembler* as, XmmRegister a, XmmRegister b) {
+    emitSseOp(as, 0x66, false, 0x2e, a, b);
+}
+
+void emitIntToXmm(Assembler* as, XmmRegister dst, Register src) {
+    emitSseOp(as, 0xf2, false, 0x2a, dst, src);
+}
+
+uint8_t* mapCode(Assembler* as, size_t headerSize, size_t* size) {
+    *size = codeOffset(headerSize) + as->count;
+    uint8_t* mapping = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    memcpy(mapping + codeOffset(headerSize), as->code, as->count);
+    return mapping;
+}
+
+bool protectCode(uint8_t* mapping, size_t size) {
+    if (mprotect(mapping, size, PROT_READ | PROT_EXEC) == 0) return true;
+    munmap(mapping, size);
+    return false;
+}
+
+void unmapCode(uint8_t* mapping, size_t size) {
+    munmap(mapping, size);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CLOX_X64_H
+#define CLOX_X64_H
+
+#include "common.h"
+
+#ifdef BASELINE_JIT
+
+// just enough of an x86-64 assembler for the machine code compilers (jit.c and trace.c)
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+typedef enum {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+} XmmRegister;
+
+typedef enum {
+    CC_OVERFLOW = 0x0,
+    CC_BELOW = 0x2,
+    CC_ABOVE_EQUAL = 0x3,
+    CC_EQUAL = 0x4,
+    CC_NOT_EQUAL = 0x5,
+    CC_BELOW_EQUAL = 0x6,
+    CC_ABOVE = 0x7,
+    CC_PARITY = 0xa,
+    CC_NO_PARITY = 0xb,
+    CC_LESS = 0xc,
+    CC_GREATER_EQUAL = 0xd,
+    CC_GREATER = 0xf,
+} Condition;
+
+typedef enum {
+    ALU_ADD = 0x01,
+    ALU_OR = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39,
+    ALU_MOV = 0x89,
+} AluOp;
+
+// the /digit of the 0x81 (op r/m, imm32) and 0xc1 (shift r/m, imm8) groups
+typedef enum {
+    IMM_ADD = 0,
+    IMM_SUB = 5,
+    IMM_CMP = 7,
+    SHIFT_LEFT = 4,
+    SHIFT_RIGHT = 5,
+} ImmediateOp;
+
+// the scalar double (0xf2 0x0f) arithmetic
+typedef enum {
+    SSE_ADD = 0x58,
+    SSE_MUL = 0x59,
+    SSE_SUB = 0x5c,
+    SSE_DIV = 0x5e,
+} SseOp;
+
+// the assembler's buffer is short lived and outside the Lox heap, so it uses the system allocator (like the grey stack)
+typedef struct {
+    uint8_t* code;
+    uint32_t count;
+    uint32_t capacity;
+} Assembler;
+
+void emitByte(Assembler* as, uint8_t byte);
+void emit32(Assembler* as, uint32_t value);
+void emit64(Assembler* as, uint64_t value);
+void emitRex(Assembler* as, bool wide, Register reg, Register base);
+// [base + disp32]
+void emitMemory(Assembler* as, Register reg, Register base, int32_t disp);
+void emitLoad(Assembler* as, Register dst, Register base, int32_t disp);
+void emitLoad32(Assembler* as, Register dst, Register base, int32_t disp);
+void emitStore(Assembler* as, Register base, int32_t disp, Register src);
+void emitStore32(Assembler* as, Register base, int32_t disp, Register src);
+void emitMoveImmediate(Assembler* as, Register reg, uint64_t value);
+void emitAlu(Assembler* as, AluOp op, bool wide, Register dst, Register src);
+void emitAluImmediate(Assembler* as, ImmediateOp op, bool wide, Register reg, int32_t value);
+void emitShift(Assembler* as, ImmediateOp op, Register reg, uint8_t bits);
+// the result is in the low byte of a legacy register, zero extended into the whole register
+void emitSetCondition(Assembler* as, Condition condition, Register reg);
+// clobbers rax
+void emitCall(Assembler* as, uint64_t function);
+void emitPush(Assembler* as, Register reg);
+void emitPop(Assembler* as, Register reg);
+void emitReturn(Assembler* as);
+
+// jumps return the offset of their rel32, to be filled in by patchJump() once the target's known
+uint32_t emitJump(Assembler* as);
+uint32_t emitJumpIf(Assembler* as, Condition condition);
+void patchJump(Assembler* as, uint32_t at, uint32_t target);
+
+// SSE2 scalar doubles
+void emitMoveXmm(Assembler* as, XmmRegister dst, XmmRegister src);
+void emitMoveToXmm(Assembler* as, XmmRegister dst, Register src);
+void emitMoveFromXmm(Assembler* as, Register dst, XmmRegister src);
+void emitLoadXmm(Assembler* as, XmmRegister dst, Register base, int32_t disp);
+void emitStoreXmm(Assembler* as, Register base, int32_t disp, XmmRegister src);
+void emitSse(Assembler* as, SseOp op, XmmRegister dst, XmmRegister src);
+// unordered compare, so NaN sets the parity flag (along with zero and carry)
+void emitCompareXmm(Assembler* as, XmmRegister a, XmmRegister b);
+// from the low 32 bits of the register
+void emitIntToXmm(Assembler* as, XmmRegister dst, Register src);
+
+// a new writable mapping of `headerSize` bytes for the caller, followed by a copy of the code at the next 16 byte
+// boundary (codeOffset()), or NULL if there's no memory to be had
+uint8_t* mapCode(Assembler* as, size_t headerSize, size_t* size);
+// makes the mapping read only and executable, or unmaps it if it can't be
+bool protectCode(uint8_t* mapping, size_t size);
+void unmapCode(uint8_t* mapping, size_t size);
+
+static inline size_t codeOffset(size_t headerSize) {
+    return (headerSize + 15) & ~(size_t) 15;
+}
+
+static inline uint64_t pointer(const void* pointer) {
+    return (uint64_t) (uintptr_t) pointer;
+}
+
+#endif
+
+#endif //CLOX_X64_H